@@ -0,0 +1,20 @@
+#ifndef BENCH_UTIL_H_
+#define BENCH_UTIL_H_
+
+// Helpers shared by kernel_bench, decimate_bench and encode_bench to
+// synthesize their inputs. The generators must stay the same for all of them:
+// the seeds of the recorded runs and baselines depend on it.
+
+#include <stdint.h>
+
+// Linear congruential generator, 24-bit output.
+static inline uint32_t BenchRandom(uint32_t* const seed) {
+  *seed = *seed * 1664525u + 1013904223u;
+  return *seed >> 8;
+}
+
+static inline uint8_t BenchClip(int v) {
+  return (v < 0) ? 0 : (v > 255) ? 255 : v;
+}
+
+#endif  // BENCH_UTIL_H_
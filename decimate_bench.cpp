@@ -0,0 +1,536 @@
+// decimate_bench: bit-exactness cross-check and throughput of the macroblock
+// decimation, VP8Decimate() of the webp.cpp reference encoder against
+// VP8Decimate_snap() of the hw_webp.cpp C model.
+//
+// Both implementations see the same macroblock stream, taken from a picture
+// file or from a seeded synthetic generator. Every VP8ModeScore is diffed
+// field by field, as are the filter statistics and max_edge_ of each segment
+// at the end of the frame.
+//
+// With -DDECIMATE_BENCH_HLS, VP8Decimate() of the hls_test.cpp HLS source is
+// run on the same stream and diffed too. It is a prototype with its own rate
+// model and no non-zero contexts, so its mismatches are reported but don't
+// fail the run.
+//
+// Build (the indented lines continue the command above them):
+//   g++ -O2 -w decimate_bench.cpp decimate_bench_snap.cpp hw_webp.cpp
+//       -o decimate_bench -ljpeg -lpng -lpthread
+// With hls_test.cpp (needs the ap_int.h header of the HLS tools):
+//   g++ -O2 -w -DDECIMATE_BENCH_HLS -I<hls>/include decimate_bench.cpp
+//       decimate_bench_snap.cpp decimate_bench_hls.cpp hw_webp.cpp
+//       -o decimate_bench -ljpeg -lpng -lpthread
+
+#define main WebPReferenceMain   // the reference CLI is not used here
+#include "webp.cpp"
+#undef main
+
+#include "bench_util.h"
+#include "decimate_bench.h"
+
+typedef struct {
+  double decimate_ns, filter_ns;   // time spent in VP8Decimate & co
+  double snap_decimate_ns, snap_filter_ns;
+  double hls_decimate_ns;
+  int num_mbs;                     // macroblocks decimated
+  int max_report;                  // maximum number of mismatches to detail
+  int i4_blocks[16 + 1];           // macroblocks per Intra4 sub-blocks scored
+} BenchStats;
+
+//------------------------------------------------------------------------------
+// Synthetic pictures
+
+// Fills a plane with 32x32 (luma) tiles of flat areas, gradients, noise and
+// hard edges, so that both macroblock types and all the prediction modes
+// show up.
+static void SynthPlane(uint8_t* const dst, int stride, int w, int h,
+                       int tile_size, uint32_t* const seed) {
+  int tx, ty, x, y;
+  for (ty = 0; ty < h; ty += tile_size) {
+    for (tx = 0; tx < w; tx += tile_size) {
+      const int kind = BenchRandom(seed) % 4;
+      const int base = BenchRandom(seed) & 0xff;
+      const int hi = BenchRandom(seed) & 0xff;
+      const int dx = (int)(BenchRandom(seed) % 33) - 16;
+      const int dy = (int)(BenchRandom(seed) % 33) - 16;
+      const int amplitude = 1 + BenchRandom(seed) % 64;
+      const int period = 2 + BenchRandom(seed) % 12;
+      for (y = ty; y < h && y < ty + tile_size; ++y) {
+        for (x = tx; x < w && x < tx + tile_size; ++x) {
+          int v;
+          switch (kind) {
+            case 0: v = base; break;
+            case 1: v = base + ((x - tx) * dx + (y - ty) * dy) / 8; break;
+            case 2:
+              v = base + (int)(BenchRandom(seed) % (2 * amplitude + 1))
+                - amplitude;
+              break;
+            default:
+              v = (((x - tx) + (y - ty) * dx / 8) / period & 1) ? hi : base;
+              break;
+          }
+          dst[y * stride + x] = BenchClip(v);
+        }
+      }
+    }
+  }
+}
+
+static int SynthPicture(WebPPicture* const pic, int width, int height,
+                        uint32_t seed) {
+  const int uv_w = (width + 1) >> 1;
+  const int uv_h = (height + 1) >> 1;
+  pic->use_argb = 0;
+  pic->width = width;
+  pic->height = height;
+  if (!WebPPictureAlloc(pic)) return 0;
+  SynthPlane(pic->y, pic->y_stride, width, height, 32, &seed);
+  SynthPlane(pic->u, pic->uv_stride, uv_w, uv_h, 16, &seed);
+  SynthPlane(pic->v, pic->uv_stride, uv_w, uv_h, 16, &seed);
+  return 1;
+}
+
+//------------------------------------------------------------------------------
+// Reference side
+
+// Same as VP8SetCostLUT() in sw_webp.cpp.
+static void SetCostLUT(VP8EncProba* const proba, BenchCostLUT* const lut) {
+  int ctype, band, ctx;
+  VP8CalculateLevelCosts(proba);
+  memcpy(lut->level_, proba->level_cost_, sizeof(lut->level_));
+  for (ctype = 0; ctype < NUM_TYPES; ++ctype) {
+    for (band = 0; band < NUM_BANDS; ++band) {
+      for (ctx = 0; ctx < NUM_CTX; ++ctx) {
+        const uint8_t p0 = proba->coeffs_[ctype][band][ctx][0];
+        lut->eob_[ctype][band][ctx] = VP8BitCost(0, p0);
+        lut->not_eob_[ctype][band][ctx] = VP8BitCost(1, p0);
+      }
+    }
+  }
+}
+
+static void ExportResult(const VP8EncIterator* const it,
+                         const VP8ModeScore* const rd, BenchResult* const res) {
+  res->D = rd->D;
+  res->SD = rd->SD;
+  res->H = rd->H;
+  res->R = rd->R;
+  res->score = rd->score;
+  memcpy(res->y_dc_levels, rd->y_dc_levels, sizeof(res->y_dc_levels));
+  memcpy(res->y_ac_levels, rd->y_ac_levels, sizeof(res->y_ac_levels));
+  memcpy(res->uv_levels, rd->uv_levels, sizeof(res->uv_levels));
+  res->mode_i16 = rd->mode_i16;
+  memcpy(res->modes_i4, rd->modes_i4, sizeof(res->modes_i4));
+  res->mode_uv = rd->mode_uv;
+  res->nz = rd->nz;
+  memcpy(res->derr, rd->derr, sizeof(res->derr));
+  res->type = it->mb_->type_;
+  res->skip = it->mb_->skip_;
+}
+
+//------------------------------------------------------------------------------
+// Comparison
+
+// Which macroblocks a field is meaningful for. VP8Decimate_snap() doesn't
+// export the scores and the diffusion errors.
+enum { FIELD_ALWAYS, FIELD_I16, FIELD_I4, FIELD_NOT_EXPORTED };
+
+#define BENCH_FIELD(name, when) { #name, offsetof(BenchResult, name), \
+                                  sizeof(((BenchResult*)0)->name), when }
+static const struct {
+  const char* name;
+  size_t offset, size;
+  int when;
+} kFields[] = {
+  BENCH_FIELD(type, FIELD_ALWAYS), BENCH_FIELD(skip, FIELD_ALWAYS),
+  BENCH_FIELD(mode_i16, FIELD_I16), BENCH_FIELD(modes_i4, FIELD_I4),
+  BENCH_FIELD(mode_uv, FIELD_ALWAYS), BENCH_FIELD(nz, FIELD_ALWAYS),
+  BENCH_FIELD(y_dc_levels, FIELD_I16), BENCH_FIELD(y_ac_levels, FIELD_ALWAYS),
+  BENCH_FIELD(uv_levels, FIELD_ALWAYS),
+  BENCH_FIELD(derr, FIELD_NOT_EXPORTED), BENCH_FIELD(D, FIELD_NOT_EXPORTED),
+  BENCH_FIELD(SD, FIELD_NOT_EXPORTED), BENCH_FIELD(H, FIELD_NOT_EXPORTED),
+  BENCH_FIELD(R, FIELD_NOT_EXPORTED), BENCH_FIELD(score, FIELD_NOT_EXPORTED)
+};
+#define NUM_FIELDS ((int)(sizeof(kFields) / sizeof(kFields[0])))
+#undef BENCH_FIELD
+
+// Mismatches of one decimator against the reference.
+typedef struct {
+  const char* name;
+  int num_diff_mbs;                // macroblocks with at least one mismatch
+  int num_reported;
+  int field_diffs[NUM_FIELDS];
+} BenchDiffs;
+
+static void CompareResults(const BenchResult* const ref,
+                           const BenchResult* const res, int x, int y,
+                           int max_report, BenchDiffs* const diffs) {
+  int f, diff = 0;
+  for (f = 0; f < NUM_FIELDS; ++f) {
+    const uint8_t* const a = (const uint8_t*)ref + kFields[f].offset;
+    const uint8_t* const b = (const uint8_t*)res + kFields[f].offset;
+    const int when = kFields[f].when;
+    if (when == FIELD_NOT_EXPORTED) continue;
+    if (when == FIELD_I16 && ref->type != 1) continue;
+    if (when == FIELD_I4 && ref->type != 0) continue;
+    if (memcmp(a, b, kFields[f].size)) {
+      ++diffs->field_diffs[f];
+      if (diffs->num_reported < max_report) {
+        fprintf(stderr, "%s: MB (%d, %d): %s differs\n", diffs->name, x, y,
+                kFields[f].name);
+        ++diffs->num_reported;
+      }
+      diff = 1;
+    }
+  }
+  diffs->num_diff_mbs += diff;
+}
+
+static void PrintDiffs(const BenchDiffs* const diffs, int num_mbs) {
+  int f;
+  printf("%s mismatching macroblocks: %d / %d\n", diffs->name,
+         diffs->num_diff_mbs, num_mbs);
+  for (f = 0; f < NUM_FIELDS; ++f) {
+    if (diffs->field_diffs[f] > 0) {
+      printf("  %-12s %d\n", kFields[f].name, diffs->field_diffs[f]);
+    }
+  }
+}
+
+// Level picked by VP8AdjustFilterStrength() from the stats of a segment.
+static int BestFilterLevel(const double stats[MAX_LF_LEVELS]) {
+  int i, best_level = 0;
+  double best_v = 1.00001 * stats[0];
+  for (i = 1; i < MAX_LF_LEVELS; ++i) {
+    if (stats[i] > best_v) {
+      best_v = stats[i];
+      best_level = i;
+    }
+  }
+  return best_level;
+}
+
+// Returns false if the end-of-frame state of both encoders differs.
+static int CompareFrame(const VP8Encoder* const enc,
+                        const BenchSnap* const snap) {
+  int ok = 1;
+  int s, i;
+  for (s = 0; s < NUM_MB_SEGMENTS; ++s) {
+    if (enc->dqm_[s].max_edge_ != BenchSnapMaxEdge(snap, s)) {
+      fprintf(stderr, "segment %d: max_edge_ %d vs %d\n", s,
+              enc->dqm_[s].max_edge_, BenchSnapMaxEdge(snap, s));
+      ok = 0;
+    }
+  }
+  if (enc->lf_stats_ != NULL) {
+    double lf_stats[NUM_MB_SEGMENTS * MAX_LF_LEVELS];
+    BenchSnapFilterStats(snap, lf_stats);
+    for (s = 0; s < NUM_MB_SEGMENTS; ++s) {
+      const double* const stats = &lf_stats[s * MAX_LF_LEVELS];
+      const int level = BestFilterLevel((*enc->lf_stats_)[s]);
+      const int snap_level = BestFilterLevel(stats);
+      if (level != snap_level) {
+        fprintf(stderr, "segment %d: filter level %d vs %d\n",
+                s, level, snap_level);
+        ok = 0;
+      }
+      // the snap SSIM is in fixed point: only a drift is an error
+      for (i = 0; i < MAX_LF_LEVELS; ++i) {
+        const double a = (*enc->lf_stats_)[s][i];
+        const double b = stats[i];
+        if (fabs(a - b) > 1e-6 * a) {
+          fprintf(stderr, "segment %d: lf_stats[%d] %.6f vs %.6f\n",
+                  s, i, a, b);
+          ok = 0;
+        }
+      }
+    }
+  }
+  return ok;
+}
+
+//------------------------------------------------------------------------------
+
+// One pass over the frame, as in VP8EncTokenLoop() of webp.cpp, with
+// VP8Decimate_snap() and, if 'hls' isn't NULL, VP8Decimate() of hls_test.cpp
+// run on the side. Returns false on a frame-level mismatch or on error.
+static int RunFrame(VP8Encoder* const enc, BenchSnap* const snap,
+                    BenchHls* const hls, BenchStats* const stats,
+                    BenchDiffs* const snap_diffs,
+                    BenchDiffs* const hls_diffs) {
+  VP8EncIterator it;
+  BenchCostLUT costs;
+  const VP8RDLevel rd_opt = enc->rd_opt_level_;
+  int ok;
+
+  VP8IteratorInit(enc, &it);
+  SetLoopParams(enc, enc->config_->quality);
+  ResetTokenStats(enc);
+  VP8InitFilter(&it);
+  VP8TBufferClear(&enc->tokens_);
+  SetCostLUT(&enc->proba_, &costs);
+  if (!BenchSnapBegin(snap, enc->dqm_, sizeof(enc->dqm_), &costs)) {
+    fprintf(stderr, "Error! VP8SegmentInfo or VP8CostLUT layout mismatch.\n");
+    return 0;
+  }
+#ifdef DECIMATE_BENCH_HLS
+  if (hls != NULL && !BenchHlsBegin(hls, enc->dqm_, sizeof(enc->dqm_))) {
+    fprintf(stderr, "Error! hls_test.cpp VP8SegmentInfo layout mismatch.\n");
+    return 0;
+  }
+#endif
+  do {
+    VP8ModeScore info;
+    BenchResult ref_res, snap_res;
+    uint8_t mb_in[384];
+    double start;
+    int j;
+
+    VP8IteratorImport(&it, NULL);
+    for (j = 0; j < 16; ++j) {
+      memcpy(mb_in + j * 16, it.yuv_in_ + Y_OFF_ENC + j * BPS, 16);
+    }
+    for (j = 0; j < 8; ++j) {
+      memcpy(mb_in + 256 + j * 16, it.yuv_in_ + U_OFF_ENC + j * BPS, 8);
+      memcpy(mb_in + 264 + j * 16, it.yuv_in_ + V_OFF_ENC + j * BPS, 8);
+    }
+
+    start = BenchNowNs();
+    VP8Decimate(&it, &info, rd_opt);
+    stats->decimate_ns += BenchNowNs() - start;
+    ok = RecordTokens(&it, &info, &enc->tokens_);
+    if (!ok) {
+      fprintf(stderr, "Error! Out of memory.\n");
+      return 0;
+    }
+    StoreSideInfo(&it);
+    start = BenchNowNs();
+    VP8StoreFilterStats(&it);
+    stats->filter_ns += BenchNowNs() - start;
+    ExportResult(&it, &info, &ref_res);
+
+    ++stats->i4_blocks[BenchSnapDecimate(snap, mb_in, it.x_, it.y_,
+                                         it.mb_->segment_, &snap_res,
+                                         &stats->snap_decimate_ns,
+                                         &stats->snap_filter_ns)];
+    CompareResults(&ref_res, &snap_res, it.x_, it.y_, stats->max_report,
+                   snap_diffs);
+#ifdef DECIMATE_BENCH_HLS
+    if (hls != NULL) {
+      BenchResult hls_res;
+      BenchHlsDecimate(hls, mb_in, it.x_, it.y_, it.mb_->segment_, &hls_res,
+                       &stats->hls_decimate_ns);
+      CompareResults(&ref_res, &hls_res, it.x_, it.y_, stats->max_report,
+                     hls_diffs);
+    }
+#else
+    (void)hls;
+    (void)hls_diffs;
+#endif
+    ++stats->num_mbs;
+
+    VP8IteratorExport(&it);
+    VP8IteratorSaveBoundary(&it);
+  } while (VP8IteratorNext(&it));
+
+  return CompareFrame(enc, snap);
+}
+
+static void PrintTiming(const char* const name, double ns, int num_mbs) {
+  const double ns_per_mb = (num_mbs > 0) ? ns / num_mbs : 0.;
+  printf("%-26s %10.3f %10.0f %10.0f\n", name, ns * 1e-9, ns_per_mb,
+         (ns > 0.) ? 1e9 / ns_per_mb : 0.);
+}
+
+// Intra4 sub-blocks scored by VP8Decimate_snap(), which set the latency of
+// the kernel: 'mb_cycles' plus 'i4_cycles' per sub-block, as given by the
+// synthesis report. With VP8_I4_EARLY_EXIT, the search stops as soon as
+// Intra16 wins. With VP8_SKIP_PREPASS, the pre-pass can skip the Intra4
+// search entirely: those macroblocks are counted with 0 sub-blocks.
+static void PrintLatency(const BenchStats* const stats, int mb_cycles,
+                         int i4_cycles) {
+  int64_t total = 0;
+  int n, max_blocks = 0;
+  if (stats->num_mbs == 0) return;
+  for (n = 0; n <= 16; ++n) {
+    total += (int64_t)n * stats->i4_blocks[n];
+    if (stats->i4_blocks[n] > 0) max_blocks = n;
+  }
+  printf("Intra4 sub-blocks scored: %.2f / 16 per MB, max %d\n",
+         (double)total / stats->num_mbs, max_blocks);
+  printf("  MBs per count:");
+  for (n = 0; n <= 16; ++n) printf(" %d", stats->i4_blocks[n]);
+  printf("\n");
+  if (mb_cycles > 0 || i4_cycles > 0) {
+    printf("kernel latency: %.0f cycles/MB, max %d, fixed schedule %d\n",
+           mb_cycles + (double)i4_cycles * total / stats->num_mbs,
+           mb_cycles + i4_cycles * max_blocks, mb_cycles + i4_cycles * 16);
+  }
+}
+
+static void Help(void) {
+  printf("Usage:\n\n");
+  printf("   decimate_bench [options] [in_file]\n\n");
+  printf("Runs VP8Decimate() of webp.cpp and VP8Decimate_snap() of hw_webp.cpp\n"
+         "on the same macroblocks, diffs their results and times them.\n");
+#ifdef DECIMATE_BENCH_HLS
+  printf("VP8Decimate() of hls_test.cpp is diffed and timed too.\n");
+#endif
+  printf("\n");
+  printf("Options:\n");
+  printf("  -q <float> ............. quality factor (0:small..100:big)\n");
+  printf("  -segments <int> ........ number of segments to use (1..4)\n");
+  printf("  -af .................... collect the filter statistics too\n");
+  printf("  -synth <int>x<int> ..... synthetic picture of the given size "
+         "(default 512x512)\n");
+  printf("  -seed <int> ............ seed of the synthetic picture\n");
+  printf("  -iter <int> ............ number of passes over the picture\n");
+  printf("  -max_report <int> ...... number of mismatches to detail\n");
+  printf("  -noasm ................. plain C kernels for VP8Decimate_snap()\n");
+  printf("  -cycles <int>,<int> .... kernel latency per MB and per Intra4\n"
+         "                           sub-block, for the latency report\n");
+  printf("  -h ..................... this help\n");
+}
+
+int main(int argc, const char* argv[]) {
+  const char* in_file = NULL;
+  int synth_w = 512, synth_h = 512;
+  uint32_t seed = 1;
+  int num_iter = 1;
+  int use_simd = 1;
+  int mb_cycles = 0, i4_cycles = 0;
+  int frame_ok = 1;
+  int return_value = -1;
+  int c, n;
+  const char* dsp_name;
+  char snap_name[64];
+  WebPPicture picture;
+  WebPConfig config;
+  VP8Encoder* enc = NULL;
+  BenchSnap* snap = NULL;
+  BenchHls* hls = NULL;
+  BenchStats stats;
+  BenchDiffs snap_diffs, hls_diffs;
+
+  memset(&stats, 0, sizeof(stats));
+  memset(&snap_diffs, 0, sizeof(snap_diffs));
+  memset(&hls_diffs, 0, sizeof(hls_diffs));
+  snap_diffs.name = "hw_webp.cpp";
+  hls_diffs.name = "hls_test.cpp";
+  stats.max_report = 10;
+  if (!WebPPictureInit(&picture) || !WebPConfigInit(&config)) {
+    fprintf(stderr, "Error! Version mismatch!\n");
+    return -1;
+  }
+  for (c = 1; c < argc; ++c) {
+    int parse_error = 0;
+    if (!strcmp(argv[c], "-h") || !strcmp(argv[c], "-help")) {
+      Help();
+      return 0;
+    } else if (!strcmp(argv[c], "-q") && c < argc - 1) {
+      config.quality = ExUtilGetFloat(argv[++c], &parse_error);
+    } else if (!strcmp(argv[c], "-segments") && c < argc - 1) {
+      config.segments = ExUtilGetInt(argv[++c], 0, &parse_error);
+    } else if (!strcmp(argv[c], "-af")) {
+      config.autofilter = 1;
+    } else if (!strcmp(argv[c], "-synth") && c < argc - 1) {
+      parse_error = (sscanf(argv[++c], "%dx%d", &synth_w, &synth_h) != 2 ||
+                     synth_w <= 0 || synth_h <= 0);
+    } else if (!strcmp(argv[c], "-seed") && c < argc - 1) {
+      seed = (uint32_t)ExUtilGetInt(argv[++c], 0, &parse_error);
+    } else if (!strcmp(argv[c], "-iter") && c < argc - 1) {
+      num_iter = ExUtilGetInt(argv[++c], 0, &parse_error);
+    } else if (!strcmp(argv[c], "-max_report") && c < argc - 1) {
+      stats.max_report = ExUtilGetInt(argv[++c], 0, &parse_error);
+    } else if (!strcmp(argv[c], "-noasm")) {
+      use_simd = 0;
+    } else if (!strcmp(argv[c], "-cycles") && c < argc - 1) {
+      parse_error = (sscanf(argv[++c], "%d,%d", &mb_cycles, &i4_cycles) != 2 ||
+                     mb_cycles < 0 || i4_cycles < 0);
+    } else if (argv[c][0] == '-') {
+      fprintf(stderr, "Error! Unknown option '%s'\n", argv[c]);
+      Help();
+      return -1;
+    } else {
+      in_file = argv[c];
+    }
+    if (parse_error) {
+      Help();
+      return -1;
+    }
+  }
+  if (!WebPValidateConfig(&config)) {
+    fprintf(stderr, "Error! Invalid configuration.\n");
+    return -1;
+  }
+
+  if (in_file != NULL) {
+    if (!ReadPicture(in_file, &picture, 0, NULL)) {
+      fprintf(stderr, "Error! Cannot read input picture file '%s'\n", in_file);
+      goto Error;
+    }
+  } else if (!SynthPicture(&picture, synth_w, synth_h, seed)) {
+    fprintf(stderr, "Error! Cannot allocate the synthetic picture.\n");
+    goto Error;
+  }
+  dsp_name = BenchSnapInitDsp(use_simd);
+
+  enc = InitVP8Encoder(&config, &picture);
+  if (enc == NULL || !VP8EncAnalyze(enc)) {
+    fprintf(stderr, "Error! Encoder setup failed.\n");
+    goto Error;
+  }
+  snap = BenchSnapNew(enc->mb_w_, enc->mb_h_, enc->lf_stats_ != NULL);
+  if (snap == NULL) {
+    fprintf(stderr, "Error! Out of memory.\n");
+    goto Error;
+  }
+#ifdef DECIMATE_BENCH_HLS
+  hls = BenchHlsNew(enc->mb_w_, enc->mb_h_);
+  if (hls == NULL) {
+    fprintf(stderr, "Error! Out of memory.\n");
+    goto Error;
+  }
+#endif
+
+  for (n = 0; n < num_iter; ++n) {
+    frame_ok &= RunFrame(enc, snap, hls, &stats, &snap_diffs, &hls_diffs);
+  }
+
+  printf("picture: %d x %d (%d MB), q=%.1f, segments=%d%s, %d pass(es)\n",
+         picture.width, picture.height, enc->mb_w_ * enc->mb_h_,
+         config.quality, config.segments, config.autofilter ? ", -af" : "",
+         num_iter);
+  printf("%-26s %10s %10s %10s\n", "", "total (s)", "ns/MB", "MB/s");
+  PrintTiming("VP8Decimate", stats.decimate_ns, stats.num_mbs);
+  snprintf(snap_name, sizeof(snap_name), "VP8Decimate_snap (%s)", dsp_name);
+  PrintTiming(snap_name, stats.snap_decimate_ns, stats.num_mbs);
+  if (hls != NULL) {
+    PrintTiming("VP8Decimate (hls_test.cpp)", stats.hls_decimate_ns,
+                stats.num_mbs);
+  }
+  if (enc->lf_stats_ != NULL) {
+    PrintTiming("VP8StoreFilterStats", stats.filter_ns, stats.num_mbs);
+    PrintTiming("VP8StoreFilterStats_snap", stats.snap_filter_ns,
+                stats.num_mbs);
+  }
+  PrintLatency(&stats, mb_cycles, i4_cycles);
+  PrintDiffs(&snap_diffs, stats.num_mbs);
+  if (hls != NULL) PrintDiffs(&hls_diffs, stats.num_mbs);
+  printf("not exported by VP8Decimate_snap:");
+  for (c = 0; c < NUM_FIELDS; ++c) {
+    if (kFields[c].when == FIELD_NOT_EXPORTED) printf(" %s", kFields[c].name);
+  }
+  printf("\n");
+  printf("end of frame state: %s\n", frame_ok ? "identical" : "DIFFERENT");
+  // hls_test.cpp isn't expected to match, see the top of the file
+  return_value = (snap_diffs.num_diff_mbs == 0 && frame_ok) ? 0 : 1;
+
+ Error:
+#ifdef DECIMATE_BENCH_HLS
+  BenchHlsDelete(hls);
+#endif
+  BenchSnapDelete(snap);
+  if (enc != NULL) DeleteVP8Encoder(enc);
+  WebPPictureFree(&picture);
+  return return_value;
+}
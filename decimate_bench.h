@@ -0,0 +1,88 @@
+#ifndef DECIMATE_BENCH_H_
+#define DECIMATE_BENCH_H_
+
+// Glue between the parts of decimate_bench: decimate_bench.cpp is built on
+// top of the webp.cpp reference encoder, decimate_bench_snap.cpp on top of
+// hw_webp.h and decimate_bench_hls.cpp on top of hls_test.cpp. They all define
+// VP8ModeScore, VP8Matrix, DATA... so they can't share a translation unit and
+// only plain types cross this header.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BENCH_NUM_SEGMENTS 4
+#define BENCH_NUM_LF_LEVELS 64
+
+// Output of one macroblock decimation, common to both encoders.
+typedef struct {
+  int64_t D, SD, H, R, score;
+  int16_t y_dc_levels[16];
+  int16_t y_ac_levels[16][16];
+  int16_t uv_levels[4 + 4][16];
+  int mode_i16;
+  uint8_t modes_i4[16];
+  int mode_uv;
+  uint32_t nz;
+  int8_t derr[2][3];
+  int type;    // 1: intra16, 0: intra4
+  int skip;
+} BenchResult;
+
+// Same layout as VP8CostLUT (hw_webp.h).
+typedef struct {
+  uint16_t level_[4][8][3][68];
+  uint16_t eob_[4][8][3];
+  uint16_t not_eob_[4][8][3];
+} BenchCostLUT;
+
+typedef struct BenchSnap BenchSnap;
+
+// Returns NULL in case of memory error.
+BenchSnap* BenchSnapNew(int mb_w, int mb_h, int do_filter_stats);
+void BenchSnapDelete(BenchSnap* const snap);
+
+// Starts a new frame. 'dqm' points to the BENCH_NUM_SEGMENTS VP8SegmentInfo of
+// the encoder (same layout in both), 'dqm_size' is their total size. Returns
+// false on a layout mismatch.
+int BenchSnapBegin(BenchSnap* const snap, const void* const dqm,
+                   size_t dqm_size, const BenchCostLUT* const costs);
+
+// Decimates macroblock (x, y). Macroblocks must come in raster order.
+// 'mb_in' holds the 16x16 luma samples, then 8 rows of 8 U and 8 V samples,
+// all with a stride of 16. The time spent in VP8Decimate_snap() and
+// VP8StoreFilterStats_snap() is added to 'decimate_ns' and 'filter_ns'.
+// Returns the number of Intra4 sub-blocks VP8Decimate_snap() scored, in
+// [0, 16]. 0: the skip pre-pass skipped the Intra16 and Intra4 searches.
+int BenchSnapDecimate(BenchSnap* const snap, const uint8_t mb_in[384],
+                      int x, int y, int segment, BenchResult* const res,
+                      double* const decimate_ns, double* const filter_ns);
+
+// Stores the accumulated filter stats, converted from fixed point, to
+// 'stats'[BENCH_NUM_SEGMENTS][BENCH_NUM_LF_LEVELS].
+void BenchSnapFilterStats(const BenchSnap* const snap, double* const stats);
+int BenchSnapMaxEdge(const BenchSnap* const snap, int segment);
+
+// hls_test.cpp side, only built with -DDECIMATE_BENCH_HLS. Same as above
+// for VP8Decimate() of hls_test.cpp, which has no filter stats.
+typedef struct BenchHls BenchHls;
+
+BenchHls* BenchHlsNew(int mb_w, int mb_h);
+void BenchHlsDelete(BenchHls* const hls);
+int BenchHlsBegin(BenchHls* const hls, const void* const dqm,
+                  size_t dqm_size);
+void BenchHlsDecimate(BenchHls* const hls, const uint8_t mb_in[384],
+                      int x, int y, int segment, BenchResult* const res,
+                      double* const decimate_ns);
+
+// Wrapper of VP8DspInit_snap(): the fastest kernels, or the C ones if
+// 'use_simd' is false. Returns the name of the kernels selected.
+const char* BenchSnapInitDsp(int use_simd);
+
+static inline double BenchNowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#endif  // DECIMATE_BENCH_H_
@@ -0,0 +1,133 @@
+// decimate_bench: hls_test.cpp side.
+// Only built with -DDECIMATE_BENCH_HLS, as hls_test.cpp needs the ap_int.h
+// header of the HLS tools. hls_test.cpp is wrapped in its own namespace since
+// it reuses the names of the webp.cpp and hw_webp.cpp functions.
+// hls_test.cpp has no line memories that outlive a call, so the neighbouring
+// samples are kept here, with the edge values of VP8IteratorImport().
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ap_int.h>
+
+namespace hls {
+#include "hls_test.cpp"
+}  // namespace hls
+
+#include "decimate_bench.h"
+
+struct BenchHls {
+  hls::VP8SegmentInfo dqm[BENCH_NUM_SEGMENTS];
+  int mb_w, mb_h;
+  uint8_t* mem_top_y;               // bottom rows of the previous MB row
+  uint8_t* mem_top_u;
+  uint8_t* mem_top_v;
+  uint8_t left_y[16], left_u[8], left_v[8];
+  uint8_t top_left_y, top_left_u, top_left_v;   // for the next macroblock
+};
+
+BenchHls* BenchHlsNew(int mb_w, int mb_h) {
+  BenchHls* const hls = (BenchHls*)calloc(1, sizeof(*hls));
+  if (hls == NULL) return NULL;
+  hls->mem_top_y = (uint8_t*)malloc((size_t)mb_w * 32);
+  if (hls->mem_top_y == NULL) {
+    free(hls);
+    return NULL;
+  }
+  hls->mem_top_u = hls->mem_top_y + mb_w * 16;
+  hls->mem_top_v = hls->mem_top_u + mb_w * 8;
+  hls->mb_w = mb_w;
+  hls->mb_h = mb_h;
+  return hls;
+}
+
+void BenchHlsDelete(BenchHls* const hls) {
+  if (hls == NULL) return;
+  free(hls->mem_top_y);
+  free(hls);
+}
+
+int BenchHlsBegin(BenchHls* const hls, const void* const dqm,
+                  size_t dqm_size) {
+  if (dqm_size != sizeof(hls->dqm)) return 0;
+  memcpy(hls->dqm, dqm, dqm_size);
+  return 1;
+}
+
+void BenchHlsDecimate(BenchHls* const hls, const uint8_t mb_in[384],
+                      int x, int y, int segment, BenchResult* const res,
+                      double* const decimate_ns) {
+  uint8_t Yin[16 * 16], Yout16[16 * 16], Yout4[16 * 16];
+  uint8_t UVin[8 * 16], UVout[8 * 16];
+  uint8_t top_y[20], top_u[8], top_v[8];
+  uint8_t* const mem_y = hls->mem_top_y + x * 16;
+  uint8_t* const mem_u = hls->mem_top_u + x * 8;
+  uint8_t* const mem_v = hls->mem_top_v + x * 8;
+  const uint8_t* ysrc;
+  hls::VP8ModeScore rd;
+  ap_uint<1> mbtype = 1;
+  int is_skipped = 0;
+  double start;
+  int i;
+
+  if (x == 0) {
+    memset(hls->left_y, 129, 16);
+    memset(hls->left_u, 129, 8);
+    memset(hls->left_v, 129, 8);
+    hls->top_left_y = hls->top_left_u = hls->top_left_v = (y > 0) ? 129 : 127;
+  }
+  if (y == 0) {
+    memset(top_y, 127, 20);
+    memset(top_u, 127, 8);
+    memset(top_v, 127, 8);
+  } else {
+    memcpy(top_y, mem_y, 16);
+    memcpy(top_u, mem_u, 8);
+    memcpy(top_v, mem_v, 8);
+    if (x < hls->mb_w - 1) {
+      memcpy(top_y + 16, mem_y + 16, 4);
+    } else {    // replicate the last valid pixel four times
+      memset(top_y + 16, top_y[15], 4);
+    }
+  }
+  memset(&rd, 0, sizeof(rd));   // not all the fields are set
+  memcpy(Yin, mb_in, 16 * 16);
+  memcpy(UVin, mb_in + 16 * 16, 8 * 16);
+
+  start = BenchNowNs();
+  hls::VP8Decimate(Yin, Yout16, Yout4, &hls->dqm[segment], UVin, UVout,
+                   &is_skipped, hls->left_y, top_y, hls->top_left_y, &mbtype,
+                   hls->left_u, top_u, hls->top_left_u, hls->left_v, top_v,
+                   hls->top_left_v, x, y, &rd);
+  *decimate_ns += BenchNowNs() - start;
+
+  // boundary samples of the next macroblocks, as VP8IteratorSaveBoundary()
+  ysrc = mbtype ? Yout16 : Yout4;
+  for (i = 0; i < 16; ++i) hls->left_y[i] = ysrc[15 + i * 16];
+  for (i = 0; i < 8; ++i) {
+    hls->left_u[i] = UVout[7 + i * 16];
+    hls->left_v[i] = UVout[15 + i * 16];
+  }
+  hls->top_left_y = top_y[15];
+  hls->top_left_u = top_u[7];
+  hls->top_left_v = top_v[7];
+  memcpy(mem_y, ysrc + 15 * 16, 16);
+  memcpy(mem_u, UVout + 7 * 16, 8);
+  memcpy(mem_v, UVout + 7 * 16 + 8, 8);
+
+  res->D = rd.D;
+  res->SD = rd.SD;
+  res->H = rd.H;
+  res->R = rd.R;
+  res->score = rd.score;
+  memcpy(res->y_dc_levels, rd.y_dc_levels, sizeof(res->y_dc_levels));
+  memcpy(res->y_ac_levels, rd.y_ac_levels, sizeof(res->y_ac_levels));
+  memcpy(res->uv_levels, rd.uv_levels, sizeof(res->uv_levels));
+  res->mode_i16 = rd.mode_i16;
+  memcpy(res->modes_i4, rd.modes_i4, sizeof(res->modes_i4));
+  res->mode_uv = rd.mode_uv;
+  res->nz = rd.nz;
+  memcpy(res->derr, rd.derr, sizeof(res->derr));
+  res->type = (int)mbtype;
+  res->skip = is_skipped;
+}
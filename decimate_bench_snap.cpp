@@ -0,0 +1,130 @@
+// decimate_bench: hw_webp.cpp side.
+// Drives VP8Decimate_snap() the same way the raster-order path of
+// VP8EncTokenLoop() in sw_webp.cpp does.
+
+#include <stdlib.h>
+#include <string.h>
+#include "hw_webp.h"
+#include "decimate_bench.h"
+
+struct BenchSnap {
+  DATA data_it;
+  VP8CostLUT costs;
+  int do_filter_stats;
+};
+
+BenchSnap* BenchSnapNew(int mb_w, int mb_h, int do_filter_stats) {
+  BenchSnap* const snap = (BenchSnap*)calloc(1, sizeof(*snap));
+  if (snap == NULL) return NULL;
+  if (!VP8IteratorAllocLines_snap(&snap->data_it, mb_w)) {
+    free(snap);
+    return NULL;
+  }
+  snap->data_it.mb_w = mb_w;
+  snap->data_it.mb_h = mb_h;
+  snap->do_filter_stats = do_filter_stats;
+  return snap;
+}
+
+void BenchSnapDelete(BenchSnap* const snap) {
+  if (snap == NULL) return;
+  VP8IteratorFreeLines_snap(&snap->data_it);
+  free(snap);
+}
+
+int BenchSnapBegin(BenchSnap* const snap, const void* const dqm,
+                   size_t dqm_size, const BenchCostLUT* const costs) {
+  if (dqm_size != sizeof(snap->data_it.dqm) ||
+      sizeof(*costs) != sizeof(snap->costs) ||
+      BENCH_NUM_SEGMENTS != NUM_MB_SEGMENTS ||
+      BENCH_NUM_LF_LEVELS != MAX_LF_LEVELS) {
+    return 0;
+  }
+  memcpy(snap->data_it.dqm, dqm, dqm_size);
+  memcpy(&snap->costs, costs, sizeof(snap->costs));
+  memset(snap->data_it.lf_stats, 0, sizeof(snap->data_it.lf_stats));
+  return 1;
+}
+
+int BenchSnapDecimate(BenchSnap* const snap, const uint8_t mb_in[384],
+                      int x, int y, int segment, BenchResult* const res,
+                      double* const decimate_ns, double* const filter_ns) {
+  DATA* const data_it = &snap->data_it;
+  VP8SegmentInfo* const dqm = &data_it->dqm[segment];
+  VP8ModeScore rd;
+  double start;
+  int i4_blocks;
+
+  if (x == 0) {
+    memset(data_it->left_y, 129, 16);
+    memset(data_it->left_u, 129, 8);
+    memset(data_it->left_v, 129, 8);
+    memset(data_it->left_derr, 0, sizeof(data_it->left_derr));
+    memset(data_it->left_nz, 0, sizeof(data_it->left_nz));
+    memset(data_it->left_modes_i4, 0, sizeof(data_it->left_modes_i4));
+  }
+  memcpy(data_it, mb_in, 384);
+  data_it->x = x;
+  data_it->y = y;
+  data_it->segment = segment;
+  VP8IteratorLoadTop_snap(data_it);
+
+  start = BenchNowNs();
+  i4_blocks = VP8Decimate_snap(data_it->Yin, data_it->Yout16, data_it->Yout4,
+    dqm, data_it->UVin, data_it->UVout, &data_it->is_skipped,
+    data_it->left_y, data_it->top_y, data_it->top_left_y, &data_it->mbtype,
+    data_it->left_u, data_it->top_u, data_it->top_left_u, data_it->left_v,
+    data_it->top_v, data_it->top_left_v, x, y, &rd,
+    data_it->top_derr, data_it->left_derr, data_it->top_nz,
+    data_it->left_nz, data_it->top_modes_i4, data_it->left_modes_i4,
+    &snap->costs);
+  *decimate_ns += BenchNowNs() - start;
+
+  if (snap->do_filter_stats) {
+    start = BenchNowNs();
+    VP8StoreFilterStats_snap(dqm, data_it->lf_stats[segment],
+      data_it->Yin, data_it->Yout16, data_it->Yout4, data_it->UVin,
+      data_it->UVout, data_it->mbtype, data_it->is_skipped);
+    *filter_ns += BenchNowNs() - start;
+  }
+  VP8IteratorStoreBoundary_snap(data_it);
+
+  res->D = rd.D;
+  res->SD = rd.SD;
+  res->H = rd.H;
+  res->R = rd.R;
+  res->score = rd.score;
+  memcpy(res->y_dc_levels, rd.y_dc_levels, sizeof(res->y_dc_levels));
+  memcpy(res->y_ac_levels, rd.y_ac_levels, sizeof(res->y_ac_levels));
+  memcpy(res->uv_levels, rd.uv_levels, sizeof(res->uv_levels));
+  res->mode_i16 = rd.mode_i16;
+  memcpy(res->modes_i4, rd.modes_i4, sizeof(res->modes_i4));
+  res->mode_uv = rd.mode_uv;
+  res->nz = rd.nz;
+  memcpy(res->derr, rd.derr, sizeof(res->derr));
+  res->type = data_it->mbtype;
+  res->skip = data_it->is_skipped;
+  return i4_blocks;
+}
+
+void BenchSnapFilterStats(const BenchSnap* const snap, double* const stats) {
+  int s, i;
+  for (s = 0; s < NUM_MB_SEGMENTS; ++s) {
+    for (i = 0; i < MAX_LF_LEVELS; ++i) {
+      stats[s * MAX_LF_LEVELS + i] =
+          (double)snap->data_it.lf_stats[s][i] / (1 << VP8_SSIM_FIX);
+    }
+  }
+}
+
+int BenchSnapMaxEdge(const BenchSnap* const snap, int segment) {
+  return snap->data_it.dqm[segment].max_edge_;
+}
+
+const char* BenchSnapInitDsp(int use_simd) {
+  static const char* const kDspNames[VP8_SNAP_DSP_NUM] = {
+    "C", "SSE2", "SSE4.1", "AVX2"
+  };
+  return kDspNames[VP8DspInit_snap(use_simd ? VP8_SNAP_DSP_NUM - 1
+                                            : VP8_SNAP_DSP_C)];
+}
@@ -0,0 +1,705 @@
+// encode_bench: end-to-end encoding benchmark on a procedurally generated
+// corpus, WebPEncode() of the webp.cpp reference against the sw_webp.cpp
+// encoder driving the hw_webp.cpp C model.
+//
+// The corpus needs no image files: flat, gradient, noise, text-like,
+// photo-like and alpha-heavy pictures are synthesized from a seed, at sizes
+// from 64x64 up to 7680x4320. Each picture is encoded by both encoders for
+// every quality and method setting, and each run reports its throughput,
+// coded size, PSNR and the peak RSS of the process during the run.
+//
+// '-o' saves the runs to a baseline file, one line per run. '-baseline' loads
+// such a file back and flags the runs that got slower, bigger, worse or more
+// memory hungry than their baseline, as well as those whose bitstream
+// changed.
+//
+// Build (the indented lines continue the command above them):
+//   g++ -O2 -w encode_bench.cpp encode_bench_sw.cpp hw_webp.cpp
+//       -o encode_bench -ljpeg -lpng -lpthread
+// -DWEBP_USE_THREAD enables the '-mt' option of sw_webp.cpp (webp.cpp is
+// always single-threaded here).
+
+#undef WEBP_USE_THREAD   // webp.cpp doesn't build with it
+#define main WebPReferenceMain   // the reference CLI is not used here
+#include "webp.cpp"
+#undef main
+
+#include <sys/resource.h>
+#include "bench_util.h"
+#include "encode_bench.h"
+
+//------------------------------------------------------------------------------
+// webp.cpp encoder
+
+static int BenchWriter(const uint8_t* data, size_t data_size,
+                       const WebPPicture* const picture) {
+  BenchRun* const run = (BenchRun*)picture->custom_ptr;
+  run->coded_size += data_size;
+  run->hash = BenchHash(run->hash, data, data_size);
+  return 1;
+}
+
+int BenchEncodeRef(const BenchPicture* const pic,
+                   const BenchSettings* const settings, BenchRun* const run) {
+  WebPPicture picture;
+  WebPConfig config;
+  WebPAuxStats stats;
+  int ok, n;
+
+  memset(run, 0, sizeof(*run));
+  if (!WebPPictureInit(&picture) || !WebPConfigInit(&config)) return 0;
+  config.quality = settings->quality;
+  config.method = settings->method;
+  if (!WebPValidateConfig(&config)) return 0;
+
+  picture.width = pic->width;
+  picture.height = pic->height;
+  ok = Import(&picture, pic->rgba, pic->stride, 4, 0, pic->has_alpha);
+  picture.writer = BenchWriter;
+  picture.custom_ptr = run;
+  picture.stats = &stats;
+  for (n = 0; ok && n < settings->iterations; ++n) {
+    double start, elapsed;
+    run->coded_size = 0;
+    run->hash = BENCH_HASH_INIT;
+    start = BenchNowNs();
+    ok = WebPEncode(&config, &picture);
+    elapsed = BenchNowNs() - start;
+    if (n == 0 || elapsed < run->encode_ns) run->encode_ns = elapsed;
+  }
+  if (ok) memcpy(run->psnr, stats.PSNR, sizeof(run->psnr));
+  WebPPictureFree(&picture);
+  return ok;
+}
+
+//------------------------------------------------------------------------------
+// Synthetic corpus
+
+typedef enum {
+  CORPUS_FLAT = 0,
+  CORPUS_GRADIENT,
+  CORPUS_NOISE,
+  CORPUS_TEXT,
+  CORPUS_PHOTO,
+  CORPUS_ALPHA,
+  CORPUS_NUM_TYPES
+} CorpusType;
+
+static const char* const kCorpusNames[CORPUS_NUM_TYPES] = {
+  "flat", "gradient", "noise", "text", "photo", "alpha"
+};
+
+static const struct {
+  int width, height;
+} kCorpusSizes[] = {
+  { 64, 64 }, { 256, 256 }, { 1024, 768 }, { 1920, 1080 },
+  { 3840, 2160 }, { 7680, 4320 }
+};
+#define CORPUS_NUM_SIZES (int)(sizeof(kCorpusSizes) / sizeof(kCorpusSizes[0]))
+
+// Hash of a lattice point, in [0, 256).
+static int LatticeValue(int x, int y, uint32_t salt) {
+  uint32_t h = (uint32_t)x * 0x8da6b343u ^ (uint32_t)y * 0xd8163841u ^ salt;
+  h ^= h >> 15;
+  h *= 0x2c1b3c6du;
+  h ^= h >> 12;
+  return (h >> 8) & 0xff;
+}
+
+// Smooth value noise of period 'cell' pixels, in [0, 256).
+static int ValueNoise(int x, int y, int cell, uint32_t salt) {
+  const int cx = x / cell, cy = y / cell;
+  const int fx = ((x % cell) << 8) / cell, fy = ((y % cell) << 8) / cell;
+  // smoothstep weights, in [0, 256]
+  const int wx = (fx * fx * (768 - 2 * fx)) >> 16;
+  const int wy = (fy * fy * (768 - 2 * fy)) >> 16;
+  const int v00 = LatticeValue(cx, cy, salt);
+  const int v10 = LatticeValue(cx + 1, cy, salt);
+  const int v01 = LatticeValue(cx, cy + 1, salt);
+  const int v11 = LatticeValue(cx + 1, cy + 1, salt);
+  const int top = v00 * 256 + (v10 - v00) * wx;
+  const int bottom = v01 * 256 + (v11 - v01) * wx;
+  return (top * 256 + (bottom - top) * wy) >> 16;
+}
+
+static void SetPixel(uint8_t* const p, int r, int g, int b, int a) {
+  p[0] = BenchClip(r);
+  p[1] = BenchClip(g);
+  p[2] = BenchClip(b);
+  p[3] = BenchClip(a);
+}
+
+// A few large areas of uniform color.
+static void SynthFlat(uint8_t* const rgba, int w, int h, uint32_t* const seed) {
+  const int num_rects = 1 + BenchRandom(seed) % 8;
+  int rects[8][7];
+  int n, x, y;
+  for (n = 0; n < num_rects; ++n) {
+    rects[n][0] = BenchRandom(seed) % w;
+    rects[n][1] = BenchRandom(seed) % h;
+    rects[n][2] = rects[n][0] + 1 + BenchRandom(seed) % w;
+    rects[n][3] = rects[n][1] + 1 + BenchRandom(seed) % h;
+    rects[n][4] = BenchRandom(seed) & 0xff;
+    rects[n][5] = BenchRandom(seed) & 0xff;
+    rects[n][6] = BenchRandom(seed) & 0xff;
+  }
+  for (y = 0; y < h; ++y) {
+    for (x = 0; x < w; ++x) {
+      int r = 200, g = 200, b = 200;
+      for (n = 0; n < num_rects; ++n) {
+        if (x >= rects[n][0] && x < rects[n][2] &&
+            y >= rects[n][1] && y < rects[n][3]) {
+          r = rects[n][4];
+          g = rects[n][5];
+          b = rects[n][6];
+        }
+      }
+      SetPixel(rgba + (y * w + x) * 4, r, g, b, 255);
+    }
+  }
+}
+
+// Smooth ramps in different directions on each channel.
+static void SynthGradient(uint8_t* const rgba, int w, int h,
+                          uint32_t* const seed) {
+  const int r0 = BenchRandom(seed) & 0xff, g0 = BenchRandom(seed) & 0xff;
+  const int b0 = BenchRandom(seed) & 0xff;
+  int x, y;
+  for (y = 0; y < h; ++y) {
+    for (x = 0; x < w; ++x) {
+      const int fx = (x * 255) / w, fy = (y * 255) / h;
+      SetPixel(rgba + (y * w + x) * 4, r0 + fx - 128, g0 + fy - 128,
+               b0 + ((fx + fy) >> 1) - 128, 255);
+    }
+  }
+}
+
+// Independent uniform samples, the worst case for prediction and entropy.
+static void SynthNoise(uint8_t* const rgba, int w, int h,
+                       uint32_t* const seed) {
+  int i;
+  for (i = 0; i < w * h; ++i) {
+    const uint32_t v = BenchRandom(seed);
+    SetPixel(rgba + i * 4, v & 0xff, (v >> 8) & 0xff,
+             BenchRandom(seed) & 0xff, 255);
+  }
+}
+
+// Dark 5x7 glyphs on a light background, in lines and paragraphs, like a
+// screenshot of a document.
+static void SynthText(uint8_t* const rgba, int w, int h, uint32_t* const seed) {
+  const int glyph_w = 6 + BenchRandom(seed) % 4;   // cell size, in pixels
+  const int glyph_h = (glyph_w * 3) / 2;
+  const int line_h = glyph_h + glyph_h / 2;
+  const int margin = w / 16;
+  const int ink = BenchRandom(seed) % 64;
+  int x, y;
+  for (y = 0; y < h; ++y) {
+    for (x = 0; x < w; ++x) {
+      SetPixel(rgba + (y * w + x) * 4, 245, 245, 240, 255);
+    }
+  }
+  for (y = margin; y + glyph_h < h - margin; y += line_h) {
+    const int line_end = w - margin - (int)(BenchRandom(seed) % (w / 4 + 1));
+    if (BenchRandom(seed) % 8 == 0) continue;   // paragraph break
+    for (x = margin; x + glyph_w < line_end; x += glyph_w) {
+      const uint64_t bits =
+          BenchRandom(seed) | ((uint64_t)BenchRandom(seed) << 24);
+      int gx, gy;
+      if (BenchRandom(seed) % 6 == 0) continue;   // space
+      for (gy = 0; gy < glyph_h; ++gy) {
+        for (gx = 0; gx < glyph_w - 1; ++gx) {
+          const int bit = (gy * 7 / glyph_h) * 5 + gx * 5 / (glyph_w - 1);
+          if ((bits >> bit) & 1) {
+            SetPixel(rgba + ((y + gy) * w + x + gx) * 4, ink, ink, ink + 16,
+                     255);
+          }
+        }
+      }
+    }
+  }
+}
+
+// Several octaves of smooth noise for the luminance, a slower one for the
+// colors, grain, and a few hard-edged disks as foreground objects.
+static void SynthPhoto(uint8_t* const rgba, int w, int h,
+                       uint32_t* const seed) {
+  const uint32_t salt = BenchRandom(seed);
+  const int base_cell = (w > h ? w : h) / 4 + 8;
+  const int num_disks = 2 + BenchRandom(seed) % 5;
+  int disks[6][6];
+  int n, x, y;
+  for (n = 0; n < num_disks; ++n) {
+    disks[n][0] = BenchRandom(seed) % w;
+    disks[n][1] = BenchRandom(seed) % h;
+    disks[n][2] = 4 + BenchRandom(seed) % (w / 6 + 1);
+    disks[n][3] = BenchRandom(seed) & 0xff;
+    disks[n][4] = BenchRandom(seed) & 0xff;
+    disks[n][5] = BenchRandom(seed) & 0xff;
+  }
+  for (y = 0; y < h; ++y) {
+    for (x = 0; x < w; ++x) {
+      int luma = 0, amplitude = 128, cell = base_cell;
+      int r, g, b;
+      while (cell >= 4) {
+        luma += (ValueNoise(x, y, cell, salt + cell) - 128) * amplitude / 128;
+        amplitude /= 2;
+        cell /= 2;
+      }
+      luma += 128 + (int)(BenchRandom(seed) % 9) - 4;
+      r = luma + (ValueNoise(x, y, base_cell * 2, salt ^ 1) - 128) / 2;
+      g = luma;
+      b = luma + (ValueNoise(x, y, base_cell * 2, salt ^ 2) - 128) / 2;
+      for (n = 0; n < num_disks; ++n) {
+        const int dx = x - disks[n][0], dy = y - disks[n][1];
+        if (dx * dx + dy * dy < disks[n][2] * disks[n][2]) {
+          r = (r + disks[n][3] * 3) / 4;
+          g = (g + disks[n][4] * 3) / 4;
+          b = (b + disks[n][5] * 3) / 4;
+        }
+      }
+      SetPixel(rgba + (y * w + x) * 4, r, g, b, 255);
+    }
+  }
+}
+
+// Photo-like colors under an alpha plane made of fully transparent areas,
+// opaque shapes with soft borders and a translucent ramp.
+static void SynthAlpha(uint8_t* const rgba, int w, int h,
+                       uint32_t* const seed) {
+  const int num_shapes = 1 + BenchRandom(seed) % 4;
+  int shapes[4][4];
+  int n, x, y;
+  SynthPhoto(rgba, w, h, seed);
+  for (n = 0; n < num_shapes; ++n) {
+    shapes[n][0] = BenchRandom(seed) % w;
+    shapes[n][1] = BenchRandom(seed) % h;
+    shapes[n][2] = 4 + BenchRandom(seed) % (w / 3 + 1);   // radius
+    shapes[n][3] = 1 + shapes[n][2] / 8;                  // feather
+  }
+  for (y = 0; y < h; ++y) {
+    for (x = 0; x < w; ++x) {
+      // translucent ramp along the bottom quarter
+      int alpha = (y > (h * 3) / 4) ? ((y - (h * 3) / 4) * 1024) / h : 0;
+      for (n = 0; n < num_shapes; ++n) {
+        const int dx = x - shapes[n][0], dy = y - shapes[n][1];
+        const int d = (int)sqrt((double)(dx * dx + dy * dy));
+        const int a = (shapes[n][2] - d) * 255 / shapes[n][3];
+        if (a > alpha) alpha = a;
+      }
+      rgba[(y * w + x) * 4 + 3] = BenchClip(alpha);
+    }
+  }
+}
+
+// Returns NULL in case of memory error.
+static uint8_t* SynthPicture(CorpusType type, int w, int h, uint32_t seed) {
+  uint8_t* const rgba = (uint8_t*)malloc((size_t)w * h * 4);
+  if (rgba == NULL) return NULL;
+  seed ^= (uint32_t)type * 0x9e3779b9u ^ (uint32_t)(w * 31 + h);
+  switch (type) {
+    case CORPUS_FLAT: SynthFlat(rgba, w, h, &seed); break;
+    case CORPUS_GRADIENT: SynthGradient(rgba, w, h, &seed); break;
+    case CORPUS_NOISE: SynthNoise(rgba, w, h, &seed); break;
+    case CORPUS_TEXT: SynthText(rgba, w, h, &seed); break;
+    case CORPUS_PHOTO: SynthPhoto(rgba, w, h, &seed); break;
+    default: SynthAlpha(rgba, w, h, &seed); break;
+  }
+  return rgba;
+}
+
+//------------------------------------------------------------------------------
+// Peak RSS
+
+// Restarts the peak RSS measurement, if the kernel allows it.
+static void ResetPeakRSS(void) {
+  FILE* const f = fopen("/proc/self/clear_refs", "w");
+  if (f != NULL) {
+    fputs("5", f);
+    fclose(f);
+  }
+}
+
+// Peak RSS in kB since the last ResetPeakRSS(), or since the start of the
+// process if it could not be reset.
+static long ReadPeakRSS(void) {
+  long peak = -1;
+  char line[256];
+  FILE* const f = fopen("/proc/self/status", "r");
+  if (f != NULL) {
+    while (fgets(line, sizeof(line), f) != NULL) {
+      if (sscanf(line, "VmHWM: %ld", &peak) == 1) break;
+    }
+    fclose(f);
+  }
+  if (peak < 0) {
+    struct rusage usage;
+    peak = (getrusage(RUSAGE_SELF, &usage) == 0) ? usage.ru_maxrss : 0;
+  }
+  return peak;
+}
+
+//------------------------------------------------------------------------------
+// Results and baseline
+
+#define BENCH_FILE_TAG "# encode_bench 1"
+
+typedef struct {
+  char encoder[8];
+  char image[16];
+  int width, height;
+  float quality;
+  int method;
+  size_t coded_size;
+  uint32_t hash;
+  float psnr, psnr_alpha;
+  double mb_per_s;
+  long peak_rss;      // kB
+} BenchRecord;
+
+static void WriteRecordHeader(FILE* const out) {
+  fprintf(out, "%s\n", BENCH_FILE_TAG);
+  fprintf(out, "# encoder image width height quality method coded_size hash "
+               "psnr psnr_alpha mb_per_s peak_rss_kb\n");
+}
+
+static void WriteRecord(FILE* const out, const BenchRecord* const r) {
+  fprintf(out, "%s %s %d %d %.1f %d %lu %08x %.3f %.3f %.3f %ld\n",
+          r->encoder, r->image, r->width, r->height, r->quality, r->method,
+          (unsigned long)r->coded_size, r->hash, r->psnr, r->psnr_alpha,
+          r->mb_per_s, r->peak_rss);
+}
+
+// Returns the number of records read from 'file_name', -1 on error.
+// '*records' must be freed by the caller.
+static int ReadBaseline(const char* const file_name,
+                        BenchRecord** const records) {
+  char line[512];
+  int num = 0, max = 0;
+  FILE* const f = fopen(file_name, "r");
+  *records = NULL;
+  if (f == NULL) return -1;
+  if (fgets(line, sizeof(line), f) == NULL ||
+      strncmp(line, BENCH_FILE_TAG, strlen(BENCH_FILE_TAG))) {
+    fclose(f);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    BenchRecord r;
+    unsigned long coded_size;
+    if (line[0] == '#') continue;
+    if (sscanf(line, "%7s %15s %d %d %f %d %lu %x %f %f %lf %ld",
+               r.encoder, r.image, &r.width, &r.height, &r.quality, &r.method,
+               &coded_size, &r.hash, &r.psnr, &r.psnr_alpha, &r.mb_per_s,
+               &r.peak_rss) != 12) {
+      continue;
+    }
+    r.coded_size = coded_size;
+    if (num == max) {
+      BenchRecord* const tmp = (BenchRecord*)realloc(
+          *records, (max * 2 + 16) * sizeof(*tmp));
+      if (tmp == NULL) break;
+      *records = tmp;
+      max = max * 2 + 16;
+    }
+    (*records)[num++] = r;
+  }
+  fclose(f);
+  return num;
+}
+
+static const BenchRecord* FindRecord(const BenchRecord* const records, int num,
+                                     const BenchRecord* const r) {
+  int i;
+  for (i = 0; i < num; ++i) {
+    const BenchRecord* const b = &records[i];
+    if (!strcmp(b->encoder, r->encoder) && !strcmp(b->image, r->image) &&
+        b->width == r->width && b->height == r->height &&
+        b->quality == r->quality && b->method == r->method) {
+      return b;
+    }
+  }
+  return NULL;
+}
+
+#define PSNR_EPSILON 0.01f   // dB
+
+// Returns a short description of how 'r' compares to 'base', and sets
+// '*regression' if it is worse. 'tolerance' is the allowed relative slowdown
+// and peak RSS growth.
+static const char* CompareRecord(const BenchRecord* const r,
+                                 const BenchRecord* const base,
+                                 double tolerance, int* const regression) {
+  const int bigger = (r->coded_size > base->coded_size);
+  const int smaller = (r->coded_size < base->coded_size);
+  const int worse = (r->psnr < base->psnr - PSNR_EPSILON);
+  const int better = (r->psnr > base->psnr + PSNR_EPSILON);
+  *regression = 1;
+  if (r->mb_per_s < base->mb_per_s * (1. - tolerance)) return "SLOWER";
+  if (r->peak_rss > base->peak_rss * (1. + tolerance) + 1024) return "MEMORY";
+  if (bigger && !better) return "BIGGER";
+  if (worse && !smaller) return "WORSE";
+  *regression = 0;
+  return (r->hash != base->hash) ? "changed" : "ok";
+}
+
+//------------------------------------------------------------------------------
+
+// Parses a comma separated list of up to 'max' numbers. Returns their count,
+// 0 on error.
+static int ParseList(const char* v, float* const values, int max) {
+  int num = 0;
+  while (num < max) {
+    char* end;
+    values[num++] = (float)strtod(v, &end);
+    if (end == v) return 0;
+    if (*end == '\0') return num;
+    if (*end != ',') return 0;
+    v = end + 1;
+  }
+  return 0;
+}
+
+#define MAX_SETTINGS 8
+
+static void Help(void) {
+  int i;
+  printf("Usage:\n\n");
+  printf("   encode_bench [options]\n\n");
+  printf("Encodes a synthetic corpus with WebPEncode() of webp.cpp and of\n"
+         "sw_webp.cpp, and reports the throughput, coded size, PSNR and\n"
+         "peak RSS of each run.\n\n");
+  printf("Options:\n");
+  printf("  -type <string> ......... only this kind of picture (repeatable)\n");
+  printf("  -size <int>x<int> ...... only this size (repeatable)\n");
+  printf("  -max_size <int> ........ skip the default sizes wider than this "
+         "(default 1920)\n");
+  printf("  -q <float,...> ......... quality factors (default 50,90)\n");
+  printf("  -m <int,...> ........... compression methods (default 0,4)\n");
+  printf("  -encoder <string> ...... only 'ref' (webp.cpp) or 'sw' "
+         "(sw_webp.cpp)\n");
+  printf("  -iter <int> ............ encodes per run, the fastest is kept\n");
+  printf("  -mt <int> .............. threads of sw_webp.cpp, 0: none\n");
+  printf("  -seed <int> ............ seed of the corpus\n");
+  printf("  -o <file> .............. save the runs as a baseline\n");
+  printf("  -baseline <file> ....... compare the runs to a saved baseline\n");
+  printf("  -tolerance <float> ..... allowed slowdown and peak RSS growth, "
+         "in %% (default 10)\n");
+  printf("  -h ..................... this help\n");
+  printf("\nPicture types:");
+  for (i = 0; i < CORPUS_NUM_TYPES; ++i) printf(" %s", kCorpusNames[i]);
+  printf("\nDefault sizes:");
+  for (i = 0; i < CORPUS_NUM_SIZES; ++i) {
+    printf(" %dx%d", kCorpusSizes[i].width, kCorpusSizes[i].height);
+  }
+  printf("\nMB/s counts the RGB(A) bytes of the source picture.\n");
+}
+
+int main(int argc, const char* argv[]) {
+  int types[CORPUS_NUM_TYPES];
+  int num_types = 0;
+  int sizes[16][2];
+  int num_sizes = 0;
+  int max_size = 1920;
+  float qualities[MAX_SETTINGS] = { 50.f, 90.f };
+  int num_qualities = 2;
+  float methods[MAX_SETTINGS] = { 0.f, 4.f };
+  int num_methods = 2;
+  int use_ref = 1, use_sw = 1;
+  BenchSettings settings;
+  uint32_t seed = 1;
+  const char* out_file = NULL;
+  const char* baseline_file = NULL;
+  double tolerance = 0.10;
+  BenchRecord* baseline = NULL;
+  int num_baseline = 0;
+  int num_runs = 0, num_regressions = 0, num_changed = 0, num_new = 0;
+  int return_value = -1;
+  FILE* out = NULL;
+  int c, t, s, q, m, e;
+
+  memset(types, 0, sizeof(types));
+  memset(&settings, 0, sizeof(settings));
+  settings.iterations = 1;
+  for (c = 1; c < argc; ++c) {
+    int parse_error = 0;
+    if (!strcmp(argv[c], "-h") || !strcmp(argv[c], "-help")) {
+      Help();
+      return 0;
+    } else if (!strcmp(argv[c], "-type") && c < argc - 1) {
+      ++c;
+      for (t = 0; t < CORPUS_NUM_TYPES; ++t) {
+        if (!strcmp(argv[c], kCorpusNames[t])) break;
+      }
+      if (t == CORPUS_NUM_TYPES) {
+        fprintf(stderr, "Error! Unknown picture type '%s'\n", argv[c]);
+        parse_error = 1;
+      } else {
+        num_types += !types[t];
+        types[t] = 1;
+      }
+    } else if (!strcmp(argv[c], "-size") && c < argc - 1) {
+      parse_error = (num_sizes == 16 ||
+                     sscanf(argv[++c], "%dx%d", &sizes[num_sizes][0],
+                            &sizes[num_sizes][1]) != 2 ||
+                     sizes[num_sizes][0] <= 0 || sizes[num_sizes][1] <= 0 ||
+                     sizes[num_sizes][0] > WEBP_MAX_DIMENSION ||
+                     sizes[num_sizes][1] > WEBP_MAX_DIMENSION);
+      ++num_sizes;
+    } else if (!strcmp(argv[c], "-max_size") && c < argc - 1) {
+      max_size = ExUtilGetInt(argv[++c], 0, &parse_error);
+    } else if (!strcmp(argv[c], "-q") && c < argc - 1) {
+      num_qualities = ParseList(argv[++c], qualities, MAX_SETTINGS);
+      parse_error = (num_qualities == 0);
+    } else if (!strcmp(argv[c], "-m") && c < argc - 1) {
+      num_methods = ParseList(argv[++c], methods, MAX_SETTINGS);
+      parse_error = (num_methods == 0);
+    } else if (!strcmp(argv[c], "-encoder") && c < argc - 1) {
+      ++c;
+      use_ref = !strcmp(argv[c], "ref");
+      use_sw = !strcmp(argv[c], "sw");
+      parse_error = !use_ref && !use_sw;
+    } else if (!strcmp(argv[c], "-iter") && c < argc - 1) {
+      settings.iterations = ExUtilGetInt(argv[++c], 0, &parse_error);
+      parse_error |= (settings.iterations <= 0);
+    } else if (!strcmp(argv[c], "-mt") && c < argc - 1) {
+      settings.thread_count = ExUtilGetInt(argv[++c], 0, &parse_error);
+    } else if (!strcmp(argv[c], "-seed") && c < argc - 1) {
+      seed = (uint32_t)ExUtilGetInt(argv[++c], 0, &parse_error);
+    } else if (!strcmp(argv[c], "-o") && c < argc - 1) {
+      out_file = argv[++c];
+    } else if (!strcmp(argv[c], "-baseline") && c < argc - 1) {
+      baseline_file = argv[++c];
+    } else if (!strcmp(argv[c], "-tolerance") && c < argc - 1) {
+      tolerance = ExUtilGetFloat(argv[++c], &parse_error) / 100.;
+    } else {
+      fprintf(stderr, "Error! Unknown option '%s'\n", argv[c]);
+      parse_error = 1;
+    }
+    if (parse_error) {
+      Help();
+      return -1;
+    }
+  }
+  if (num_sizes == 0) {
+    for (s = 0; s < CORPUS_NUM_SIZES; ++s) {
+      if (kCorpusSizes[s].width > max_size) continue;
+      sizes[num_sizes][0] = kCorpusSizes[s].width;
+      sizes[num_sizes][1] = kCorpusSizes[s].height;
+      ++num_sizes;
+    }
+  }
+
+  if (baseline_file != NULL) {
+    num_baseline = ReadBaseline(baseline_file, &baseline);
+    if (num_baseline < 0) {
+      fprintf(stderr, "Error! Cannot read baseline file '%s'\n",
+              baseline_file);
+      goto Error;
+    }
+  }
+  if (out_file != NULL) {
+    out = fopen(out_file, "w");
+    if (out == NULL) {
+      fprintf(stderr, "Error! Cannot open output file '%s'\n", out_file);
+      goto Error;
+    }
+    WriteRecordHeader(out);
+  }
+
+  printf("%-4s %-8s %9s %5s %2s %9s %7s %7s %9s %9s%s\n", "enc", "image",
+         "size", "q", "m", "bytes", "PSNR", "alpha", "MB/s", "peak MB",
+         (baseline != NULL) ? "  vs baseline" : "");
+  for (t = 0; t < CORPUS_NUM_TYPES; ++t) {
+    if (num_types > 0 && !types[t]) continue;
+    for (s = 0; s < num_sizes; ++s) {
+      BenchPicture pic;
+      uint8_t* const rgba =
+          SynthPicture((CorpusType)t, sizes[s][0], sizes[s][1], seed);
+      if (rgba == NULL) {
+        fprintf(stderr, "Error! Cannot allocate the %dx%d picture.\n",
+                sizes[s][0], sizes[s][1]);
+        goto Error;
+      }
+      pic.rgba = rgba;
+      pic.width = sizes[s][0];
+      pic.height = sizes[s][1];
+      pic.stride = pic.width * 4;
+      pic.has_alpha = (t == CORPUS_ALPHA);
+      for (q = 0; q < num_qualities; ++q) {
+        for (m = 0; m < num_methods; ++m) {
+          for (e = 0; e < 2; ++e) {
+            BenchRun run;
+            BenchRecord r;
+            const BenchRecord* base;
+            int ok;
+            if (!(e == 0 ? use_ref : use_sw)) continue;
+            settings.quality = qualities[q];
+            settings.method = (int)methods[m];
+            ResetPeakRSS();
+            ok = (e == 0) ? BenchEncodeRef(&pic, &settings, &run)
+                          : BenchEncodeSw(&pic, &settings, &run);
+            if (!ok) {
+              fprintf(stderr, "Error! %s encoding of %s %dx%d failed.\n",
+                      (e == 0) ? "webp.cpp" : "sw_webp.cpp", kCorpusNames[t],
+                      pic.width, pic.height);
+              free(rgba);
+              goto Error;
+            }
+            memset(&r, 0, sizeof(r));
+            snprintf(r.encoder, sizeof(r.encoder), "%s", e ? "sw" : "ref");
+            snprintf(r.image, sizeof(r.image), "%s", kCorpusNames[t]);
+            r.width = pic.width;
+            r.height = pic.height;
+            r.quality = settings.quality;
+            r.method = settings.method;
+            r.coded_size = run.coded_size;
+            r.hash = run.hash;
+            r.psnr = run.psnr[3];
+            r.psnr_alpha = pic.has_alpha ? run.psnr[4] : 0.f;
+            r.mb_per_s = (double)pic.width * pic.height *
+                         (pic.has_alpha ? 4 : 3) * 1e3 / run.encode_ns;
+            r.peak_rss = ReadPeakRSS();
+            ++num_runs;
+            printf("%-4s %-8s %4dx%-4d %5.1f %2d %9lu %7.2f %7.2f %9.2f "
+                   "%9.1f", r.encoder, r.image, r.width, r.height,
+                   r.quality, r.method, (unsigned long)r.coded_size, r.psnr,
+                   r.psnr_alpha, r.mb_per_s, r.peak_rss / 1024.);
+            if (baseline != NULL) {
+              base = FindRecord(baseline, num_baseline, &r);
+              if (base == NULL) {
+                printf("  new");
+                ++num_new;
+              } else {
+                int regression;
+                const char* const verdict =
+                    CompareRecord(&r, base, tolerance, &regression);
+                printf("  %s %+.1f%% %+ld B %+.2f dB", verdict,
+                       (r.mb_per_s / base->mb_per_s - 1.) * 100.,
+                       (long)r.coded_size - (long)base->coded_size,
+                       r.psnr - base->psnr);
+                num_regressions += regression;
+                num_changed += (r.hash != base->hash);
+              }
+            }
+            printf("\n");
+            fflush(stdout);
+            if (out != NULL) WriteRecord(out, &r);
+          }
+        }
+      }
+      free(rgba);
+    }
+  }
+  if (baseline != NULL) {
+    printf("%d runs: %d regression(s), %d changed bitstream(s), "
+           "%d not in the baseline\n", num_runs, num_regressions,
+           num_changed, num_new);
+  }
+  return_value = (num_regressions > 0) ? 1 : 0;
+
+ Error:
+  if (out != NULL) fclose(out);
+  free(baseline);
+  return return_value;
+}
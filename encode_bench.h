@@ -0,0 +1,58 @@
+#ifndef ENCODE_BENCH_H_
+#define ENCODE_BENCH_H_
+
+// Glue between the two halves of encode_bench: encode_bench.cpp is built on
+// top of the webp.cpp reference encoder, encode_bench_sw.cpp on top of
+// sw_webp.cpp and the hw_webp.cpp C model. Both define the whole WebP API
+// (WebPEncode, WebPPicture...) so they can't share a translation unit and only
+// plain types cross this header.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Source picture, common to both encoders.
+typedef struct {
+  const uint8_t* rgba;      // r, g, b, a
+  int width, height;
+  int stride;               // in bytes
+  int has_alpha;            // if false, the alpha samples are ignored
+} BenchPicture;
+
+typedef struct {
+  float quality;
+  int method;
+  int thread_count;         // sw_webp.cpp: 0 for single-threaded encoding
+  int iterations;           // number of timed encodes
+} BenchSettings;
+
+typedef struct {
+  double encode_ns;         // fastest of the 'iterations' encodes
+  size_t coded_size;
+  uint32_t hash;            // FNV-1a of the bitstream
+  float psnr[5];            // Y/U/V/All/Alpha, as reported in WebPAuxStats
+} BenchRun;
+
+// Import 'pic' (not timed) and encode it 'settings->iterations' times.
+// Return false on error.
+int BenchEncodeRef(const BenchPicture* const pic,
+                   const BenchSettings* const settings, BenchRun* const run);
+int BenchEncodeSw(const BenchPicture* const pic,
+                  const BenchSettings* const settings, BenchRun* const run);
+
+static inline double BenchNowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline uint32_t BenchHash(uint32_t hash, const uint8_t* data,
+                                 size_t size) {
+  size_t i;
+  for (i = 0; i < size; ++i) hash = (hash ^ data[i]) * 16777619u;
+  return hash;
+}
+
+#define BENCH_HASH_INIT 2166136261u
+
+#endif  // ENCODE_BENCH_H_
@@ -0,0 +1,79 @@
+// encode_bench: sw_webp.cpp side.
+// sw_webp.cpp is wrapped in its own namespace since it defines the same WebP
+// API as webp.cpp. The headers it includes are pulled in first, so that they
+// stay in the global namespace, as does the hw_webp.cpp C model it calls.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <assert.h>
+#include <jpeglib.h>
+#include <jerror.h>
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#ifdef WEBP_USE_THREAD
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#include "hw_webp.h"
+
+namespace sw {
+#define main SwMain   // the sw_webp.cpp CLI is not used here
+#include "sw_webp.cpp"
+#undef main
+}  // namespace sw
+
+#include "encode_bench.h"
+
+static int BenchWriter(const uint8_t* data, size_t data_size,
+                       const sw::WebPPicture* const picture) {
+  BenchRun* const run = (BenchRun*)picture->custom_ptr;
+  run->coded_size += data_size;
+  run->hash = BenchHash(run->hash, data, data_size);
+  return 1;
+}
+
+int BenchEncodeSw(const BenchPicture* const pic,
+                  const BenchSettings* const settings, BenchRun* const run) {
+  sw::WebPPicture picture;
+  sw::WebPConfig config;
+  sw::WebPAuxStats stats;
+  int ok, n;
+
+  memset(run, 0, sizeof(*run));
+  if (!sw::WebPPictureInit(&picture) || !sw::WebPConfigInit(&config)) {
+    return 0;
+  }
+  config.quality = settings->quality;
+  config.method = settings->method;
+  if (settings->thread_count > 0) {
+    config.thread_level = 1;
+    config.thread_count = settings->thread_count;
+    sw::WebPSetThreadPoolSize(settings->thread_count);
+  }
+  if (!sw::WebPValidateConfig(&config)) return 0;
+
+  picture.width = pic->width;
+  picture.height = pic->height;
+  ok = sw::Import(&picture, pic->rgba, pic->stride, 4, 0, pic->has_alpha);
+  picture.writer = BenchWriter;
+  picture.custom_ptr = run;
+  picture.stats = &stats;
+  for (n = 0; ok && n < settings->iterations; ++n) {
+    double start, elapsed;
+    run->coded_size = 0;
+    run->hash = BENCH_HASH_INIT;
+    start = BenchNowNs();
+    ok = sw::WebPEncode(&config, &picture);
+    elapsed = BenchNowNs() - start;
+    if (n == 0 || elapsed < run->encode_ns) run->encode_ns = elapsed;
+  }
+  if (ok) memcpy(run->psnr, stats.PSNR, sizeof(run->psnr));
+  sw::WebPPictureFree(&picture);
+  return ok;
+}
@@ -642,6 +642,10 @@ int ReconstructIntra4(int16_t levels[16], const uint8_t y_p[16],
 
 typedef int8_t DError[2 /* u/v */][2 /* top or left */];
 
+#ifndef MAX_MB_W
+#define MAX_MB_W 1024   // widest picture handled, in macroblocks
+#endif
+
 #define C1 7    // fraction of error sent to the 4x4 block below
 #define C2 8    // fraction of error sent to the 4x4 block on the right
 #define DSHIFT 4
@@ -662,7 +666,7 @@ static int QuantizeSingle(int16_t* const v, const VP8Matrix* const mtx) {
   }
 }
 
-static void CorrectDCValues(DError top_derr[1024], DError left_derr, int x,
+static void CorrectDCValues(DError top_derr[MAX_MB_W], DError left_derr, int x,
                             const VP8Matrix* const mtx,
                             int16_t tmp[][16], int8_t derr[2][3]) {
   //         | top[0] | top[1]
@@ -700,7 +704,7 @@ static void CorrectDCValues(DError top_derr[1024], DError left_derr, int x,
 
 int ReconstructUV(int16_t uv_levels[8][16],const uint8_t uv_p[8*16],
 		const uint8_t uv_src[8*16], uint8_t uv_out[8*16], VP8Matrix uv,
-		DError top_derr[1024], DError left_derr, int x, int8_t derr[2][3]) {
+		DError top_derr[MAX_MB_W], DError left_derr, int x, int8_t derr[2][3]) {
 //#pragma HLS PIPELINE
 #pragma HLS ARRAY_PARTITION variable=uv.sharpen_ complete dim=1
 #pragma HLS ARRAY_PARTITION variable=uv.zthresh_ complete dim=1
@@ -1332,6 +1336,66 @@ static int SSE4x4_C(const uint8_t* a, const uint8_t* b) {
   return GetSSE(a, b, 4, 4);
 }
 
+// Intra4 mode pre-screening, as in hw_webp.h: only the VP8_I4_TOPK modes of
+// lowest SATD plus mode cost are reconstructed. 10: exhaustive search.
+#ifndef VP8_I4_TOPK
+#define VP8_I4_TOPK 10
+#endif
+
+#if VP8_I4_TOPK < 10
+static int SATD4x4_C(const uint8_t* src, const uint8_t* pred) {
+#pragma HLS inline
+  int tmp[16];
+  int sum = 0;
+  int i;
+#pragma HLS ARRAY_PARTITION variable=tmp complete dim=1
+  for (i = 0; i < 4; ++i) {
+#pragma HLS unroll
+    const int d0 = src[4 * i + 0] - pred[4 * i + 0];
+    const int d1 = src[4 * i + 1] - pred[4 * i + 1];
+    const int d2 = src[4 * i + 2] - pred[4 * i + 2];
+    const int d3 = src[4 * i + 3] - pred[4 * i + 3];
+    const int a0 = d0 + d2;
+    const int a1 = d1 + d3;
+    const int a2 = d1 - d3;
+    const int a3 = d0 - d2;
+    tmp[0 + i * 4] = a0 + a1;
+    tmp[1 + i * 4] = a3 + a2;
+    tmp[2 + i * 4] = a3 - a2;
+    tmp[3 + i * 4] = a0 - a1;
+  }
+  for (i = 0; i < 4; ++i) {
+#pragma HLS unroll
+    const int a0 = tmp[0 + i] + tmp[8 + i];
+    const int a1 = tmp[4 + i] + tmp[12 + i];
+    const int a2 = tmp[4 + i] - tmp[12 + i];
+    const int a3 = tmp[0 + i] - tmp[8 + i];
+    sum += abs(a0 + a1) + abs(a3 + a2) + abs(a3 - a2) + abs(a0 - a1);
+  }
+  return sum;
+}
+
+// Lists in 'cand' the VP8_I4_TOPK modes of lowest 'cost', best first.
+static void SelectTopK(const score_t cost[NUM_BMODES],
+		uint8_t cand[VP8_I4_TOPK]) {
+#pragma HLS inline
+  int m, n;
+  for (m = 0; m < VP8_I4_TOPK; ++m) {
+#pragma HLS unroll
+    cand[m] = m;   // all overwritten below, but the compiler can't tell
+  }
+  for (m = 0; m < NUM_BMODES; ++m) {
+#pragma HLS unroll
+    int rank = 0;
+    for (n = 0; n < NUM_BMODES; ++n) {
+#pragma HLS unroll
+      rank += (cost[n] < cost[m]) || (cost[n] == cost[m] && n < m);
+    }
+    if (rank < VP8_I4_TOPK) cand[rank] = m;
+  }
+}
+#endif
+
 static void AddScore(VP8ModeScore* const dst, const VP8ModeScore* const src) {
   dst->D  += src->D;
   dst->SD += src->SD;
@@ -1534,6 +1598,7 @@ int PickBestIntra4(VP8SegmentInfo* const dqm, uint8_t Yin[16*16], uint8_t Yout[1
   int i4_ = 0;
 
   do {
+#pragma HLS loop_tripcount min=1 max=16
     const int kNumBlocks = 1;
     VP8ModeScore rd_i4;
     int mode;
@@ -1568,8 +1633,26 @@ int PickBestIntra4(VP8SegmentInfo* const dqm, uint8_t Yin[16*16], uint8_t Yout[1
 
     Intra4Preds_C(tmp_pred, left, top_left, top, top_right);
 
+#if VP8_I4_TOPK < 10
+    score_t pre_score[NUM_BMODES];
+    uint8_t cand[VP8_I4_TOPK];
+    int k;
+#pragma HLS ARRAY_PARTITION variable=pre_score complete dim=1
+#pragma HLS ARRAY_PARTITION variable=cand complete dim=1
+    for (mode = 0; mode < NUM_BMODES; ++mode) {
+#pragma HLS unroll
+      pre_score[mode] = ((score_t)SATD4x4_C(src[i4_], tmp_pred[mode]) << 8)
+                      + mode_costs[mode] * dqm->y1_.q_[1];
+    }
+    SelectTopK(pre_score, cand);
+
+    for (k = 0; k < VP8_I4_TOPK; ++k) {
+      VP8ModeScore rd_tmp;
+      mode = cand[k];
+#else
     for (mode = 0; mode < NUM_BMODES; ++mode) {
       VP8ModeScore rd_tmp;
+#endif
       int16_t tmp_levels[16];
       uint8_t tmp_dst[10][16];
 #pragma HLS ARRAY_PARTITION variable=tmp_dst complete dim=0
@@ -1646,7 +1729,7 @@ static int SSE16x8_C(const uint8_t* a, const uint8_t* b) {
 
 const uint16_t VP8FixedCostsUV[4] = { 302, 984, 439, 642 };
 
-static void StoreDiffusionErrors(DError top_derr[1024], DError left_derr, int x,
+static void StoreDiffusionErrors(DError top_derr[MAX_MB_W], DError left_derr, int x,
                                  const VP8ModeScore* const rd) {
   int ch;
   for (ch = 0; ch <= 1; ++ch) {
@@ -1678,7 +1761,7 @@ void PickBestUV(VP8SegmentInfo* const dqm, uint8_t UVin[8*16], uint8_t UVPred[8]
   uint8_t* dst = UVout;
   VP8ModeScore rd_best;
   uint8_t tmp_p[4][8*16];
-  DError top_derr[1024] = {0}, left_derr = {0};
+  DError top_derr[MAX_MB_W] = {0}, left_derr = {0};
   int mode;
   int i, j, k;
 #pragma HLS ARRAY_PARTITION variable=tmp_dst complete dim=1
@@ -2107,9 +2190,9 @@ void VP8IteratorSaveBoundary(DATA* data_it) {
   int i;
   uint8_t top_y_tmp1[16];
   uint8_t top_y_tmp2[16];
-  uint8_t mem_top_y[1024][16];
-  uint8_t mem_top_u[1024][8];
-  uint8_t mem_top_v[1024][8];
+  uint8_t mem_top_y[MAX_MB_W][16];
+  uint8_t mem_top_u[MAX_MB_W][8];
+  uint8_t mem_top_v[MAX_MB_W][8];
 
   if (data_it->x < data_it->mb_w - 1) {   // left
     for (i = 0; i < 16; ++i) {
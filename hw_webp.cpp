@@ -603,6 +603,429 @@ static void ITransformOne(const uint8_t* ref, const int16_t* in,
   }
 }
 
+//------------------------------------------------------------------------------
+// SIMD variants of the transform / quantization kernels.
+// They are only used by the host build of the C model (VP8DspInit_snap()); the
+// synthesis flow always sees the plain C kernels above.
+
+#if !defined(__SYNTHESIS__) && !defined(WEBP_SNAP_NO_SIMD) && \
+    defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WEBP_SNAP_USE_SIMD
+#endif
+
+#ifdef WEBP_SNAP_USE_SIMD
+#include <immintrin.h>
+
+// Per-function targets, so that the file still builds without -msse4.1/-mavx2
+// and the variant is picked at run-time.
+#define SNAP_SSE2  __attribute__((target("sse2")))
+#define SNAP_SSE41 __attribute__((target("sse4.1")))
+#define SNAP_AVX2  __attribute__((target("avx2")))
+
+// Transposes the 4x4 matrix held in the low 16b lanes of r0..r3.
+// out01 receives columns 0 | 1, out23 columns 2 | 3.
+static SNAP_SSE2 void Transpose4x4_16b(const __m128i r0, const __m128i r1,
+                                       const __m128i r2, const __m128i r3,
+                                       __m128i* const out01,
+                                       __m128i* const out23) {
+  const __m128i t0 = _mm_unpacklo_epi16(r0, r1);  // 00 10 01 11 02 12 03 13
+  const __m128i t1 = _mm_unpacklo_epi16(r2, r3);  // 20 30 21 31 22 32 23 33
+  *out01 = _mm_unpacklo_epi32(t0, t1);            // 00 10 20 30 01 11 21 31
+  *out23 = _mm_unpackhi_epi32(t0, t1);            // 02 12 22 32 03 13 23 33
+}
+
+// Same for a 4x4 matrix of 32b lanes, in place.
+static SNAP_SSE2 void Transpose4x4_32b(__m128i* const r0, __m128i* const r1,
+                                       __m128i* const r2, __m128i* const r3) {
+  const __m128i t0 = _mm_unpacklo_epi32(*r0, *r1);  // 00 10 01 11
+  const __m128i t1 = _mm_unpacklo_epi32(*r2, *r3);  // 20 30 21 31
+  const __m128i t2 = _mm_unpackhi_epi32(*r0, *r1);  // 02 12 03 13
+  const __m128i t3 = _mm_unpackhi_epi32(*r2, *r3);  // 22 32 23 33
+  *r0 = _mm_unpacklo_epi64(t0, t1);
+  *r1 = _mm_unpackhi_epi64(t0, t1);
+  *r2 = _mm_unpacklo_epi64(t2, t3);
+  *r3 = _mm_unpackhi_epi64(t2, t3);
+}
+
+static SNAP_SSE2 __m128i Load4x16b_32b(const int16_t* const src) {
+  const __m128i v = _mm_loadl_epi64((const __m128i*)src);
+  return _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);   // sign-extend
+}
+
+// Packs with the wrap-around of an int -> int16_t store, not saturation.
+static SNAP_SSE2 __m128i PackTrunc_32b(const __m128i a, const __m128i b) {
+  return _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+                         _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+}
+
+static SNAP_SSE2 void FTransform_SSE2(const uint8_t* src, const uint8_t* ref,
+                                      int16_t* out) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i k2217_5352 = _mm_set_epi16(5352, 2217, 5352, 2217,
+                                           5352, 2217, 5352, 2217);
+  const __m128i km5352_2217 = _mm_set_epi16(2217, -5352, 2217, -5352,
+                                            2217, -5352, 2217, -5352);
+  const __m128i k1_1 = _mm_set1_epi16(1);
+  const __m128i k1_m1 = _mm_set_epi16(-1, 1, -1, 1, -1, 1, -1, 1);
+  const __m128i k1lo = _mm_set_epi16(0, 0, 0, 0, 1, 1, 1, 1);
+  const __m128i s = _mm_loadu_si128((const __m128i*)src);
+  const __m128i r = _mm_loadu_si128((const __m128i*)ref);
+  const __m128i d01 = _mm_sub_epi16(_mm_unpacklo_epi8(s, zero),
+                                    _mm_unpacklo_epi8(r, zero));
+  const __m128i d23 = _mm_sub_epi16(_mm_unpackhi_epi8(s, zero),
+                                    _mm_unpackhi_epi8(r, zero));
+  __m128i c01, c23, r01, r23;
+  // First pass, one lane per row.
+  Transpose4x4_16b(d01, _mm_unpackhi_epi64(d01, d01),
+                   d23, _mm_unpackhi_epi64(d23, d23), &c01, &c23);
+  {
+    const __m128i d0 = c01, d1 = _mm_unpackhi_epi64(c01, c01);
+    const __m128i d2 = c23, d3 = _mm_unpackhi_epi64(c23, c23);
+    const __m128i a0 = _mm_add_epi16(d0, d3);
+    const __m128i a1 = _mm_add_epi16(d1, d2);
+    const __m128i a2 = _mm_sub_epi16(d1, d2);
+    const __m128i a3 = _mm_sub_epi16(d0, d3);
+    const __m128i a23 = _mm_unpacklo_epi16(a2, a3);
+    const __m128i t0 = _mm_slli_epi16(_mm_add_epi16(a0, a1), 3);
+    const __m128i t2 = _mm_slli_epi16(_mm_sub_epi16(a0, a1), 3);
+    const __m128i t1 = _mm_srai_epi32(
+        _mm_add_epi32(_mm_madd_epi16(a23, k2217_5352), _mm_set1_epi32(1812)), 9);
+    const __m128i t3 = _mm_srai_epi32(
+        _mm_add_epi32(_mm_madd_epi16(a23, km5352_2217), _mm_set1_epi32(937)), 9);
+    Transpose4x4_16b(t0, _mm_packs_epi32(t1, t1), t2, _mm_packs_epi32(t3, t3),
+                     &r01, &r23);
+  }
+  // Second pass, one lane per column.
+  {
+    const __m128i r0 = r01, r1 = _mm_unpackhi_epi64(r01, r01);
+    const __m128i r2 = r23, r3 = _mm_unpackhi_epi64(r23, r23);
+    const __m128i a0 = _mm_add_epi16(r0, r3);   // 15b
+    const __m128i a1 = _mm_add_epi16(r1, r2);
+    const __m128i a2 = _mm_sub_epi16(r1, r2);
+    const __m128i a3 = _mm_sub_epi16(r0, r3);
+    const __m128i a01 = _mm_unpacklo_epi16(a0, a1);
+    const __m128i a23 = _mm_unpacklo_epi16(a2, a3);
+    const __m128i k7 = _mm_set1_epi32(7);
+    const __m128i o0 = _mm_srai_epi32(
+        _mm_add_epi32(_mm_madd_epi16(a01, k1_1), k7), 4);
+    const __m128i o8 = _mm_srai_epi32(
+        _mm_add_epi32(_mm_madd_epi16(a01, k1_m1), k7), 4);
+    const __m128i o4 = _mm_srai_epi32(
+        _mm_add_epi32(_mm_madd_epi16(a23, k2217_5352),
+                      _mm_set1_epi32(12000)), 16);
+    const __m128i o12 = _mm_srai_epi32(
+        _mm_add_epi32(_mm_madd_epi16(a23, km5352_2217),
+                      _mm_set1_epi32(51000)), 16);
+    // + (a3 != 0) on out[4..7]
+    const __m128i a3_nz = _mm_andnot_si128(_mm_cmpeq_epi16(a3, zero), k1lo);
+    const __m128i o0_8 = _mm_packs_epi32(o0, o8);
+    const __m128i o4_12 = _mm_add_epi16(_mm_packs_epi32(o4, o12), a3_nz);
+    _mm_storeu_si128((__m128i*)&out[0], _mm_unpacklo_epi64(o0_8, o4_12));
+    _mm_storeu_si128((__m128i*)&out[8], _mm_unpackhi_epi64(o0_8, o4_12));
+  }
+}
+
+static SNAP_SSE2 void FTransformWHT_SSE2(const int16_t* in, int16_t* out) {
+  __m128i x0 = Load4x16b_32b(in + 0);
+  __m128i x1 = Load4x16b_32b(in + 4);
+  __m128i x2 = Load4x16b_32b(in + 8);
+  __m128i x3 = Load4x16b_32b(in + 12);
+  Transpose4x4_32b(&x0, &x1, &x2, &x3);
+  {
+    const __m128i a0 = _mm_add_epi32(x0, x2);
+    const __m128i a1 = _mm_add_epi32(x1, x3);
+    const __m128i a2 = _mm_sub_epi32(x1, x3);
+    const __m128i a3 = _mm_sub_epi32(x0, x2);
+    __m128i t0 = _mm_add_epi32(a0, a1);
+    __m128i t1 = _mm_add_epi32(a3, a2);
+    __m128i t2 = _mm_sub_epi32(a3, a2);
+    __m128i t3 = _mm_sub_epi32(a0, a1);
+    Transpose4x4_32b(&t0, &t1, &t2, &t3);
+    {
+      const __m128i b0 = _mm_add_epi32(t0, t2);
+      const __m128i b1 = _mm_add_epi32(t1, t3);
+      const __m128i b2 = _mm_sub_epi32(t1, t3);
+      const __m128i b3 = _mm_sub_epi32(t0, t2);
+      const __m128i o0 = _mm_srai_epi32(_mm_add_epi32(b0, b1), 1);
+      const __m128i o1 = _mm_srai_epi32(_mm_add_epi32(b3, b2), 1);
+      const __m128i o2 = _mm_srai_epi32(_mm_sub_epi32(b3, b2), 1);
+      const __m128i o3 = _mm_srai_epi32(_mm_sub_epi32(b0, b1), 1);
+      _mm_storeu_si128((__m128i*)&out[0], PackTrunc_32b(o0, o1));
+      _mm_storeu_si128((__m128i*)&out[8], PackTrunc_32b(o2, o3));
+    }
+  }
+}
+
+static SNAP_SSE2 void TransformWHT_SSE2(const int16_t* in, int16_t* out) {
+  const __m128i in0 = Load4x16b_32b(in + 0);
+  const __m128i in1 = Load4x16b_32b(in + 4);
+  const __m128i in2 = Load4x16b_32b(in + 8);
+  const __m128i in3 = Load4x16b_32b(in + 12);
+  const __m128i a0 = _mm_add_epi32(in0, in3);
+  const __m128i a1 = _mm_add_epi32(in1, in2);
+  const __m128i a2 = _mm_sub_epi32(in1, in2);
+  const __m128i a3 = _mm_sub_epi32(in0, in3);
+  __m128i t0 = _mm_add_epi32(a0, a1);
+  __m128i t1 = _mm_add_epi32(a3, a2);
+  __m128i t2 = _mm_sub_epi32(a0, a1);
+  __m128i t3 = _mm_sub_epi32(a3, a2);
+  Transpose4x4_32b(&t0, &t1, &t2, &t3);
+  {
+    const __m128i dc = _mm_add_epi32(t0, _mm_set1_epi32(3));  // w/ rounder
+    const __m128i b0 = _mm_add_epi32(dc, t3);
+    const __m128i b1 = _mm_add_epi32(t1, t2);
+    const __m128i b2 = _mm_sub_epi32(t1, t2);
+    const __m128i b3 = _mm_sub_epi32(dc, t3);
+    __m128i o0 = _mm_srai_epi32(_mm_add_epi32(b0, b1), 3);
+    __m128i o1 = _mm_srai_epi32(_mm_add_epi32(b3, b2), 3);
+    __m128i o2 = _mm_srai_epi32(_mm_sub_epi32(b0, b1), 3);
+    __m128i o3 = _mm_srai_epi32(_mm_sub_epi32(b3, b2), 3);
+    Transpose4x4_32b(&o0, &o1, &o2, &o3);
+    _mm_storeu_si128((__m128i*)&out[0], PackTrunc_32b(o0, o1));
+    _mm_storeu_si128((__m128i*)&out[8], PackTrunc_32b(o2, o3));
+  }
+}
+
+// MUL(x, kC1) and MUL(x, kC2) on 16b lanes: kC1 = 20091 + (1 << 16), and
+// 35468 is 65536 - 30068, so both are a mulhi plus the input itself.
+static SNAP_SSE2 __m128i MulC1_SSE2(const __m128i x) {
+  return _mm_add_epi16(x, _mm_mulhi_epi16(x, _mm_set1_epi16(20091)));
+}
+
+static SNAP_SSE2 __m128i MulC2_SSE2(const __m128i x) {
+  return _mm_add_epi16(x, _mm_mulhi_epi16(x, _mm_set1_epi16(-30068)));
+}
+
+static SNAP_SSE2 void ITransformOne_SSE2(const uint8_t* ref, const int16_t* in,
+                                         uint8_t* dst) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i in0 = _mm_loadl_epi64((const __m128i*)&in[0]);
+  const __m128i in1 = _mm_loadl_epi64((const __m128i*)&in[4]);
+  const __m128i in2 = _mm_loadl_epi64((const __m128i*)&in[8]);
+  const __m128i in3 = _mm_loadl_epi64((const __m128i*)&in[12]);
+  __m128i h01, h23, o01, o23;
+  {    // vertical pass
+    const __m128i a = _mm_add_epi16(in0, in2);
+    const __m128i b = _mm_sub_epi16(in0, in2);
+    const __m128i c = _mm_sub_epi16(MulC2_SSE2(in1), MulC1_SSE2(in3));
+    const __m128i d = _mm_add_epi16(MulC1_SSE2(in1), MulC2_SSE2(in3));
+    Transpose4x4_16b(_mm_add_epi16(a, d), _mm_add_epi16(b, c),
+                     _mm_sub_epi16(b, c), _mm_sub_epi16(a, d), &h01, &h23);
+  }
+  {    // horizontal pass
+    const __m128i h1 = _mm_unpackhi_epi64(h01, h01);
+    const __m128i h3 = _mm_unpackhi_epi64(h23, h23);
+    const __m128i dc = _mm_add_epi16(h01, _mm_set1_epi16(4));
+    const __m128i a = _mm_add_epi16(dc, h23);
+    const __m128i b = _mm_sub_epi16(dc, h23);
+    const __m128i c = _mm_sub_epi16(MulC2_SSE2(h1), MulC1_SSE2(h3));
+    const __m128i d = _mm_add_epi16(MulC1_SSE2(h1), MulC2_SSE2(h3));
+    Transpose4x4_16b(_mm_srai_epi16(_mm_add_epi16(a, d), 3),
+                     _mm_srai_epi16(_mm_add_epi16(b, c), 3),
+                     _mm_srai_epi16(_mm_sub_epi16(b, c), 3),
+                     _mm_srai_epi16(_mm_sub_epi16(a, d), 3), &o01, &o23);
+  }
+  {
+    const __m128i r = _mm_loadu_si128((const __m128i*)ref);
+    const __m128i s01 = _mm_add_epi16(_mm_unpacklo_epi8(r, zero), o01);
+    const __m128i s23 = _mm_add_epi16(_mm_unpackhi_epi8(r, zero), o23);
+    _mm_storeu_si128((__m128i*)dst, _mm_packus_epi16(s01, s23));
+  }
+}
+
+// Levels of 8 coefficients in natural order, from their absolute value plus
+// sharpening. 'zthresh' and 'bias' point to the 8 matching 32b entries.
+static SNAP_SSE2 __m128i QuantizeLevels_SSE2(const __m128i coeff,
+                                             const __m128i iq,
+                                             const uint32_t* const bias,
+                                             const uint32_t* const zthresh) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i prod_lo = _mm_mullo_epi16(coeff, iq);
+  const __m128i prod_hi = _mm_mulhi_epu16(coeff, iq);
+  const __m128i b0 = _mm_loadu_si128((const __m128i*)&bias[0]);
+  const __m128i b4 = _mm_loadu_si128((const __m128i*)&bias[4]);
+  const __m128i z0 = _mm_loadu_si128((const __m128i*)&zthresh[0]);
+  const __m128i z4 = _mm_loadu_si128((const __m128i*)&zthresh[4]);
+  const __m128i l0 = _mm_srli_epi32(
+      _mm_add_epi32(_mm_unpacklo_epi16(prod_lo, prod_hi), b0), QFIX);
+  const __m128i l4 = _mm_srli_epi32(
+      _mm_add_epi32(_mm_unpackhi_epi16(prod_lo, prod_hi), b4), QFIX);
+  const __m128i nz0 = _mm_cmpgt_epi32(_mm_unpacklo_epi16(coeff, zero), z0);
+  const __m128i nz4 = _mm_cmpgt_epi32(_mm_unpackhi_epi16(coeff, zero), z4);
+  const __m128i level = _mm_min_epi16(_mm_packs_epi32(l0, l4),
+                                      _mm_set1_epi16(MAX_LEVEL));
+  return _mm_and_si128(level, _mm_packs_epi32(nz0, nz4));
+}
+
+static SNAP_SSE2 int QuantizeBlock_SSE2(int16_t* in, int16_t* out,
+                                        const VP8Matrix* const mtx) {
+  const __m128i in0 = _mm_loadu_si128((const __m128i*)&in[0]);
+  const __m128i in8 = _mm_loadu_si128((const __m128i*)&in[8]);
+  const __m128i sign0 = _mm_srai_epi16(in0, 15);
+  const __m128i sign8 = _mm_srai_epi16(in8, 15);
+  const __m128i coeff0 = _mm_add_epi16(
+      _mm_sub_epi16(_mm_xor_si128(in0, sign0), sign0),
+      _mm_loadu_si128((const __m128i*)&mtx->sharpen_[0]));
+  const __m128i coeff8 = _mm_add_epi16(
+      _mm_sub_epi16(_mm_xor_si128(in8, sign8), sign8),
+      _mm_loadu_si128((const __m128i*)&mtx->sharpen_[8]));
+  const __m128i level0 = QuantizeLevels_SSE2(
+      coeff0, _mm_loadu_si128((const __m128i*)&mtx->iq_[0]),
+      &mtx->bias_[0], &mtx->zthresh_[0]);
+  const __m128i level8 = QuantizeLevels_SSE2(
+      coeff8, _mm_loadu_si128((const __m128i*)&mtx->iq_[8]),
+      &mtx->bias_[8], &mtx->zthresh_[8]);
+  const __m128i slevel0 = _mm_sub_epi16(_mm_xor_si128(level0, sign0), sign0);
+  const __m128i slevel8 = _mm_sub_epi16(_mm_xor_si128(level8, sign8), sign8);
+  int16_t levels[16];
+  int n;
+  _mm_storeu_si128((__m128i*)&in[0], _mm_mullo_epi16(
+      slevel0, _mm_loadu_si128((const __m128i*)&mtx->q_[0])));
+  _mm_storeu_si128((__m128i*)&in[8], _mm_mullo_epi16(
+      slevel8, _mm_loadu_si128((const __m128i*)&mtx->q_[8])));
+  _mm_storeu_si128((__m128i*)&levels[0], slevel0);
+  _mm_storeu_si128((__m128i*)&levels[8], slevel8);
+  for (n = 0; n < 16; ++n) out[n] = levels[kZigzag[n]];
+  return (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_packs_epi16(level0, level8),
+                                           _mm_setzero_si128())) != 0xffff);
+}
+
+// Stores the signed levels 0..7 / 8..15 in zigzag order.
+static SNAP_SSE41 void StoreZigzag_SSE41(const __m128i level0,
+                                         const __m128i level8,
+                                         int16_t* const out) {
+  // out[0..7] = 0 1 4 8 5 2 3 6, out[8..15] = 9 12 13 10 7 11 14 15
+  const __m128i k0_lo = _mm_setr_epi8(0, 1, 2, 3, 8, 9, -1, -1,
+                                      10, 11, 4, 5, 6, 7, 12, 13);
+  const __m128i k0_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 0, 1,
+                                      -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i k8_hi = _mm_setr_epi8(2, 3, 8, 9, 10, 11, 4, 5,
+                                      -1, -1, 6, 7, 12, 13, 14, 15);
+  const __m128i k8_lo = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+                                      14, 15, -1, -1, -1, -1, -1, -1);
+  _mm_storeu_si128((__m128i*)&out[0],
+                   _mm_or_si128(_mm_shuffle_epi8(level0, k0_lo),
+                                _mm_shuffle_epi8(level8, k0_hi)));
+  _mm_storeu_si128((__m128i*)&out[8],
+                   _mm_or_si128(_mm_shuffle_epi8(level8, k8_hi),
+                                _mm_shuffle_epi8(level0, k8_lo)));
+}
+
+static SNAP_SSE41 int QuantizeBlock_SSE41(int16_t* in, int16_t* out,
+                                          const VP8Matrix* const mtx) {
+  const __m128i one = _mm_set1_epi16(1);
+  const __m128i in0 = _mm_loadu_si128((const __m128i*)&in[0]);
+  const __m128i in8 = _mm_loadu_si128((const __m128i*)&in[8]);
+  const __m128i coeff0 = _mm_add_epi16(
+      _mm_abs_epi16(in0), _mm_loadu_si128((const __m128i*)&mtx->sharpen_[0]));
+  const __m128i coeff8 = _mm_add_epi16(
+      _mm_abs_epi16(in8), _mm_loadu_si128((const __m128i*)&mtx->sharpen_[8]));
+  const __m128i level0 = QuantizeLevels_SSE2(
+      coeff0, _mm_loadu_si128((const __m128i*)&mtx->iq_[0]),
+      &mtx->bias_[0], &mtx->zthresh_[0]);
+  const __m128i level8 = QuantizeLevels_SSE2(
+      coeff8, _mm_loadu_si128((const __m128i*)&mtx->iq_[8]),
+      &mtx->bias_[8], &mtx->zthresh_[8]);
+  // 'in | 1' keeps the sign but is never zero: a zero coefficient raised
+  // above zthresh by sharpening quantizes to a positive level.
+  const __m128i slevel0 = _mm_sign_epi16(level0, _mm_or_si128(in0, one));
+  const __m128i slevel8 = _mm_sign_epi16(level8, _mm_or_si128(in8, one));
+  _mm_storeu_si128((__m128i*)&in[0], _mm_mullo_epi16(
+      slevel0, _mm_loadu_si128((const __m128i*)&mtx->q_[0])));
+  _mm_storeu_si128((__m128i*)&in[8], _mm_mullo_epi16(
+      slevel8, _mm_loadu_si128((const __m128i*)&mtx->q_[8])));
+  StoreZigzag_SSE41(slevel0, slevel8, out);
+  return !_mm_testz_si128(_mm_or_si128(level0, level8),
+                          _mm_or_si128(level0, level8));
+}
+
+static SNAP_AVX2 int QuantizeBlock_AVX2(int16_t* in, int16_t* out,
+                                        const VP8Matrix* const mtx) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i v_in = _mm256_loadu_si256((const __m256i*)in);
+  const __m256i coeff = _mm256_add_epi16(
+      _mm256_abs_epi16(v_in), _mm256_loadu_si256((const __m256i*)mtx->sharpen_));
+  const __m256i iq = _mm256_loadu_si256((const __m256i*)mtx->iq_);
+  const __m256i prod_lo = _mm256_mullo_epi16(coeff, iq);
+  const __m256i prod_hi = _mm256_mulhi_epu16(coeff, iq);
+  // The unpacks work per 128b lane: the low half of the block holds
+  // coefficients 0-3 | 8-11, the high half 4-7 | 12-15.
+  const __m256i b0 = _mm256_loadu_si256((const __m256i*)&mtx->bias_[0]);
+  const __m256i b8 = _mm256_loadu_si256((const __m256i*)&mtx->bias_[8]);
+  const __m256i z0 = _mm256_loadu_si256((const __m256i*)&mtx->zthresh_[0]);
+  const __m256i z8 = _mm256_loadu_si256((const __m256i*)&mtx->zthresh_[8]);
+  const __m256i l_lo = _mm256_srli_epi32(_mm256_add_epi32(
+      _mm256_unpacklo_epi16(prod_lo, prod_hi),
+      _mm256_permute2x128_si256(b0, b8, 0x20)), QFIX);
+  const __m256i l_hi = _mm256_srli_epi32(_mm256_add_epi32(
+      _mm256_unpackhi_epi16(prod_lo, prod_hi),
+      _mm256_permute2x128_si256(b0, b8, 0x31)), QFIX);
+  const __m256i nz_lo = _mm256_cmpgt_epi32(
+      _mm256_unpacklo_epi16(coeff, zero),
+      _mm256_permute2x128_si256(z0, z8, 0x20));
+  const __m256i nz_hi = _mm256_cmpgt_epi32(
+      _mm256_unpackhi_epi16(coeff, zero),
+      _mm256_permute2x128_si256(z0, z8, 0x31));
+  const __m256i level = _mm256_and_si256(
+      _mm256_min_epi16(_mm256_packs_epi32(l_lo, l_hi),
+                       _mm256_set1_epi16(MAX_LEVEL)),
+      _mm256_packs_epi32(nz_lo, nz_hi));
+  const __m256i slevel = _mm256_sign_epi16(
+      level, _mm256_or_si256(v_in, _mm256_set1_epi16(1)));
+  _mm256_storeu_si256((__m256i*)in, _mm256_mullo_epi16(
+      slevel, _mm256_loadu_si256((const __m256i*)mtx->q_)));
+  StoreZigzag_SSE41(_mm256_castsi256_si128(slevel),
+                    _mm256_extracti128_si256(slevel, 1), out);
+  return !_mm256_testz_si256(level, level);
+}
+
+typedef void (*VP8FdctFunc)(const uint8_t* src, const uint8_t* ref,
+                            int16_t* out);
+typedef void (*VP8IdctFunc)(const uint8_t* ref, const int16_t* in,
+                            uint8_t* dst);
+typedef void (*VP8WHTFunc)(const int16_t* in, int16_t* out);
+typedef int (*VP8QuantizeBlockFunc)(int16_t* in, int16_t* out,
+                                    const VP8Matrix* const mtx);
+
+typedef struct {
+  VP8FdctFunc ftransform_;
+  VP8WHTFunc ftransform_wht_;
+  VP8QuantizeBlockFunc quantize_block_;
+  VP8WHTFunc transform_wht_;
+  VP8IdctFunc itransform_;
+} VP8DspKernels;
+
+// Indexed by VP8SnapDsp. The wider variants reuse the narrower kernels that
+// have nothing to gain from the extra instructions.
+static const VP8DspKernels kDspKernels[VP8_SNAP_DSP_NUM] = {
+  { FTransform_C, FTransformWHT_C, QuantizeBlock_C,
+    TransformWHT_C, ITransformOne },
+  { FTransform_SSE2, FTransformWHT_SSE2, QuantizeBlock_SSE2,
+    TransformWHT_SSE2, ITransformOne_SSE2 },
+  { FTransform_SSE2, FTransformWHT_SSE2, QuantizeBlock_SSE41,
+    TransformWHT_SSE2, ITransformOne_SSE2 },
+  { FTransform_SSE2, FTransformWHT_SSE2, QuantizeBlock_AVX2,
+    TransformWHT_SSE2, ITransformOne_SSE2 },
+};
+
+static const VP8DspKernels* kDsp = &kDspKernels[VP8_SNAP_DSP_C];
+
+#define VP8FTransform(src, ref, out)   kDsp->ftransform_(src, ref, out)
+#define VP8FTransformWHT(in, out)      kDsp->ftransform_wht_(in, out)
+#define VP8EncQuantizeBlock(in, out, mtx) kDsp->quantize_block_(in, out, mtx)
+#define VP8TransformWHT(in, out)       kDsp->transform_wht_(in, out)
+#define VP8ITransform(ref, in, dst)    kDsp->itransform_(ref, in, dst)
+
+#else   // !WEBP_SNAP_USE_SIMD
+
+#define VP8FTransform(src, ref, out)   FTransform_C(src, ref, out)
+#define VP8FTransformWHT(in, out)      FTransformWHT_C(in, out)
+#define VP8EncQuantizeBlock(in, out, mtx) QuantizeBlock_C(in, out, mtx)
+#define VP8TransformWHT(in, out)       TransformWHT_C(in, out)
+#define VP8ITransform(ref, in, dst)    ITransformOne(ref, in, dst)
+
+#endif  // WEBP_SNAP_USE_SIMD
+
 static int ReconstructIntra16(
 		uint8_t YPred[16*16], uint8_t Ysrc[16*16], uint8_t Yout[16*16],
 		int16_t y_ac_levels[16][16], int16_t y_dc_levels[16], VP8Matrix y1, VP8Matrix y2) {
@@ -658,7 +1081,7 @@ static int ReconstructIntra16(
 
   for (n = 0; n < 16; n++) {
 #pragma HLS unroll
-	  FTransform_C(tmp_src[n], tmp_pred[n], tmp[n]);
+	  VP8FTransform(tmp_src[n], tmp_pred[n], tmp[n]);
   }
 
   for(n = 0; n < 16; n++){
@@ -667,19 +1090,19 @@ static int ReconstructIntra16(
 	  tmp[n][0] = 0;
   }
 
-  FTransformWHT_C(tmp_dc, dc_tmp);
+  VP8FTransformWHT(tmp_dc, dc_tmp);
 
-  nz |= QuantizeBlock_C(dc_tmp, y_dc_levels, &y2) << 24;
+  nz |= VP8EncQuantizeBlock(dc_tmp, y_dc_levels, &y2) << 24;
 
   for (n = 0; n < 16; n++) {
 #pragma HLS unroll
     // Zero-out the first coeff, so that: a) nz is correct below, and
     // b) finding 'last' non-zero coeffs in SetResidualCoeffs() is simplified.
-    nz |= QuantizeBlock_C(tmp[n],y_ac_levels[n], &y1) << n;
+    nz |= VP8EncQuantizeBlock(tmp[n],y_ac_levels[n], &y1) << n;
 
   }
 
-  TransformWHT_C(dc_tmp, tmp_dc);
+  VP8TransformWHT(dc_tmp, tmp_dc);
 
   for(n = 0; n < 16; n++){
 #pragma HLS unroll
@@ -688,7 +1111,7 @@ static int ReconstructIntra16(
 
   for (n = 0; n < 16; n++) {
 #pragma HLS unroll
-	  ITransformOne(tmp_pred[n], tmp[n], tmp_out[n]);
+	  VP8ITransform(tmp_pred[n], tmp[n], tmp_out[n]);
   }
 
   for(n = 0; n < 16; n++){
@@ -743,11 +1166,11 @@ static int ReconstructIntra4(int16_t levels[16], uint8_t y_p[16],
 
   VP8MatrixLoad(&y1_i, &y1);
 
-  FTransform_C(y_src, y_p, tmp);
+  VP8FTransform(y_src, y_p, tmp);
 
-  nz = QuantizeBlock_C(tmp, levels, &y1_i);
+  nz = VP8EncQuantizeBlock(tmp, levels, &y1_i);
 
-  ITransformOne(y_p, tmp, y_out);
+  VP8ITransform(y_p, tmp, y_out);
 
   return nz;
 }
@@ -775,7 +1198,7 @@ static int QuantizeSingle(int16_t* const v, const VP8Matrix* const mtx) {
   }
 }
 
-static void CorrectDCValues(DError top_derr[1024], DError left_derr, int x, int y,
+static void CorrectDCValues(DError top_derr[MAX_MB_W], DError left_derr, int x, int y,
                             const VP8Matrix* const mtx,
                             int16_t tmp[][16], int8_t derr[2][3]) {
   //         | top[0] | top[1]
@@ -824,7 +1247,7 @@ static void CorrectDCValues(DError top_derr[1024], DError left_derr, int x, int
 
 static int ReconstructUV(int16_t uv_levels[8][16], uint8_t uv_p[8*16],
 		uint8_t uv_src[8*16], uint8_t uv_out[8*16], VP8Matrix uv,
-		DError top_derr[1024], DError left_derr, int x, int y, int8_t derr[2][3]) {
+		DError top_derr[MAX_MB_W], DError left_derr, int x, int y, int8_t derr[2][3]) {
 //#pragma HLS ARRAY_PARTITION variable=uv.sharpen_ complete dim=1
 //#pragma HLS ARRAY_PARTITION variable=uv.zthresh_ complete dim=1
 //#pragma HLS ARRAY_PARTITION variable=uv.bias_ complete dim=1
@@ -867,19 +1290,19 @@ static int ReconstructUV(int16_t uv_levels[8][16], uint8_t uv_p[8*16],
 
   for (n = 0; n < 8; n++) {
 #pragma HLS unroll
-	  FTransform_C(tmp_src[n], tmp_p[n], tmp[n]);
+	  VP8FTransform(tmp_src[n], tmp_p[n], tmp[n]);
   }
 
   CorrectDCValues(top_derr, left_derr, x, y, &uv, tmp, derr);
 
   for (n = 0; n < 8; n++) {
 #pragma HLS unroll
-    nz |= QuantizeBlock_C(tmp[n], uv_levels[n], &uv) << n;
+    nz |= VP8EncQuantizeBlock(tmp[n], uv_levels[n], &uv) << n;
   }
 
   for (n = 0; n < 8; n++) {
 #pragma HLS unroll
-	  ITransformOne(tmp_p[n], tmp[n], tmp_out[n]);
+	  VP8ITransform(tmp_p[n], tmp[n], tmp_out[n]);
   }
 
   for(n = 0; n < 8; n++){
@@ -1061,19 +1484,339 @@ static void CopyScore(VP8ModeScore* const dst, const VP8ModeScore* const src) {
   dst->score = src->score;
 }
 
-static int VP8GetCostLuma16(int16_t y_ac_levels[16][16], int16_t y_dc_levels[16]){
+//------------------------------------------------------------------------------
+// Residual costs
+
+// Cost of the sign and extra bits of a level. These don't depend on the
+// token probabilities.
+static const uint16_t VP8LevelFixedCosts[MAX_LEVEL + 1] = {
+     0,  256,  256,  256,  256,  432,  618,  630,
+   731,  640,  640,  828,  901,  948, 1021, 1101,
+  1174, 1221, 1294, 1042, 1085, 1115, 1158, 1202,
+  1245, 1275, 1318, 1337, 1380, 1410, 1453, 1497,
+  1540, 1570, 1613, 1280, 1295, 1317, 1332, 1358,
+  1373, 1395, 1410, 1454, 1469, 1491, 1506, 1532,
+  1547, 1569, 1584, 1601, 1616, 1638, 1653, 1679,
+  1694, 1716, 1731, 1775, 1790, 1812, 1827, 1853,
+  1868, 1890, 1905, 1727, 1733, 1742, 1748, 1759,
+  1765, 1774, 1780, 1800, 1806, 1815, 1821, 1832,
+  1838, 1847, 1853, 1878, 1884, 1893, 1899, 1910,
+  1916, 1925, 1931, 1951, 1957, 1966, 1972, 1983,
+  1989, 1998, 2004, 2027, 2033, 2042, 2048, 2059,
+  2065, 2074, 2080, 2100, 2106, 2115, 2121, 2132,
+  2138, 2147, 2153, 2178, 2184, 2193, 2199, 2210,
+  2216, 2225, 2231, 2251, 2257, 2266, 2272, 2283,
+  2289, 2298, 2304, 2168, 2174, 2183, 2189, 2200,
+  2206, 2215, 2221, 2241, 2247, 2256, 2262, 2273,
+  2279, 2288, 2294, 2319, 2325, 2334, 2340, 2351,
+  2357, 2366, 2372, 2392, 2398, 2407, 2413, 2424,
+  2430, 2439, 2445, 2468, 2474, 2483, 2489, 2500,
+  2506, 2515, 2521, 2541, 2547, 2556, 2562, 2573,
+  2579, 2588, 2594, 2619, 2625, 2634, 2640, 2651,
+  2657, 2666, 2672, 2692, 2698, 2707, 2713, 2724,
+  2730, 2739, 2745, 2540, 2546, 2555, 2561, 2572,
+  2578, 2587, 2593, 2613, 2619, 2628, 2634, 2645,
+  2651, 2660, 2666, 2691, 2697, 2706, 2712, 2723,
+  2729, 2738, 2744, 2764, 2770, 2779, 2785, 2796,
+  2802, 2811, 2817, 2840, 2846, 2855, 2861, 2872,
+  2878, 2887, 2893, 2913, 2919, 2928, 2934, 2945,
+  2951, 2960, 2966, 2991, 2997, 3006, 3012, 3023,
+  3029, 3038, 3044, 3064, 3070, 3079, 3085, 3096,
+  3102, 3111, 3117, 2981, 2987, 2996, 3002, 3013,
+  3019, 3028, 3034, 3054, 3060, 3069, 3075, 3086,
+  3092, 3101, 3107, 3132, 3138, 3147, 3153, 3164,
+  3170, 3179, 3185, 3205, 3211, 3220, 3226, 3237,
+  3243, 3252, 3258, 3281, 3287, 3296, 3302, 3313,
+  3319, 3328, 3334, 3354, 3360, 3369, 3375, 3386,
+  3392, 3401, 3407, 3432, 3438, 3447, 3453, 3464,
+  3470, 3479, 3485, 3505, 3511, 3520, 3526, 3537,
+  3543, 3552, 3558, 2816, 2822, 2831, 2837, 2848,
+  2854, 2863, 2869, 2889, 2895, 2904, 2910, 2921,
+  2927, 2936, 2942, 2967, 2973, 2982, 2988, 2999,
+  3005, 3014, 3020, 3040, 3046, 3055, 3061, 3072,
+  3078, 3087, 3093, 3116, 3122, 3131, 3137, 3148,
+  3154, 3163, 3169, 3189, 3195, 3204, 3210, 3221,
+  3227, 3236, 3242, 3267, 3273, 3282, 3288, 3299,
+  3305, 3314, 3320, 3340, 3346, 3355, 3361, 3372,
+  3378, 3387, 3393, 3257, 3263, 3272, 3278, 3289,
+  3295, 3304, 3310, 3330, 3336, 3345, 3351, 3362,
+  3368, 3377, 3383, 3408, 3414, 3423, 3429, 3440,
+  3446, 3455, 3461, 3481, 3487, 3496, 3502, 3513,
+  3519, 3528, 3534, 3557, 3563, 3572, 3578, 3589,
+  3595, 3604, 3610, 3630, 3636, 3645, 3651, 3662,
+  3668, 3677, 3683, 3708, 3714, 3723, 3729, 3740,
+  3746, 3755, 3761, 3781, 3787, 3796, 3802, 3813,
+  3819, 3828, 3834, 3629, 3635, 3644, 3650, 3661,
+  3667, 3676, 3682, 3702, 3708, 3717, 3723, 3734,
+  3740, 3749, 3755, 3780, 3786, 3795, 3801, 3812,
+  3818, 3827, 3833, 3853, 3859, 3868, 3874, 3885,
+  3891, 3900, 3906, 3929, 3935, 3944, 3950, 3961,
+  3967, 3976, 3982, 4002, 4008, 4017, 4023, 4034,
+  4040, 4049, 4055, 4080, 4086, 4095, 4101, 4112,
+  4118, 4127, 4133, 4153, 4159, 4168, 4174, 4185,
+  4191, 4200, 4206, 4070, 4076, 4085, 4091, 4102,
+  4108, 4117, 4123, 4143, 4149, 4158, 4164, 4175,
+  4181, 4190, 4196, 4221, 4227, 4236, 4242, 4253,
+  4259, 4268, 4274, 4294, 4300, 4309, 4315, 4326,
+  4332, 4341, 4347, 4370, 4376, 4385, 4391, 4402,
+  4408, 4417, 4423, 4443, 4449, 4458, 4464, 4475,
+  4481, 4490, 4496, 4521, 4527, 4536, 4542, 4553,
+  4559, 4568, 4574, 4594, 4600, 4609, 4615, 4626,
+  4632, 4641, 4647, 3515, 3521, 3530, 3536, 3547,
+  3553, 3562, 3568, 3588, 3594, 3603, 3609, 3620,
+  3626, 3635, 3641, 3666, 3672, 3681, 3687, 3698,
+  3704, 3713, 3719, 3739, 3745, 3754, 3760, 3771,
+  3777, 3786, 3792, 3815, 3821, 3830, 3836, 3847,
+  3853, 3862, 3868, 3888, 3894, 3903, 3909, 3920,
+  3926, 3935, 3941, 3966, 3972, 3981, 3987, 3998,
+  4004, 4013, 4019, 4039, 4045, 4054, 4060, 4071,
+  4077, 4086, 4092, 3956, 3962, 3971, 3977, 3988,
+  3994, 4003, 4009, 4029, 4035, 4044, 4050, 4061,
+  4067, 4076, 4082, 4107, 4113, 4122, 4128, 4139,
+  4145, 4154, 4160, 4180, 4186, 4195, 4201, 4212,
+  4218, 4227, 4233, 4256, 4262, 4271, 4277, 4288,
+  4294, 4303, 4309, 4329, 4335, 4344, 4350, 4361,
+  4367, 4376, 4382, 4407, 4413, 4422, 4428, 4439,
+  4445, 4454, 4460, 4480, 4486, 4495, 4501, 4512,
+  4518, 4527, 4533, 4328, 4334, 4343, 4349, 4360,
+  4366, 4375, 4381, 4401, 4407, 4416, 4422, 4433,
+  4439, 4448, 4454, 4479, 4485, 4494, 4500, 4511,
+  4517, 4526, 4532, 4552, 4558, 4567, 4573, 4584,
+  4590, 4599, 4605, 4628, 4634, 4643, 4649, 4660,
+  4666, 4675, 4681, 4701, 4707, 4716, 4722, 4733,
+  4739, 4748, 4754, 4779, 4785, 4794, 4800, 4811,
+  4817, 4826, 4832, 4852, 4858, 4867, 4873, 4884,
+  4890, 4899, 4905, 4769, 4775, 4784, 4790, 4801,
+  4807, 4816, 4822, 4842, 4848, 4857, 4863, 4874,
+  4880, 4889, 4895, 4920, 4926, 4935, 4941, 4952,
+  4958, 4967, 4973, 4993, 4999, 5008, 5014, 5025,
+  5031, 5040, 5046, 5069, 5075, 5084, 5090, 5101,
+  5107, 5116, 5122, 5142, 5148, 5157, 5163, 5174,
+  5180, 5189, 5195, 5220, 5226, 5235, 5241, 5252,
+  5258, 5267, 5273, 5293, 5299, 5308, 5314, 5325,
+  5331, 5340, 5346, 4604, 4610, 4619, 4625, 4636,
+  4642, 4651, 4657, 4677, 4683, 4692, 4698, 4709,
+  4715, 4724, 4730, 4755, 4761, 4770, 4776, 4787,
+  4793, 4802, 4808, 4828, 4834, 4843, 4849, 4860,
+  4866, 4875, 4881, 4904, 4910, 4919, 4925, 4936,
+  4942, 4951, 4957, 4977, 4983, 4992, 4998, 5009,
+  5015, 5024, 5030, 5055, 5061, 5070, 5076, 5087,
+  5093, 5102, 5108, 5128, 5134, 5143, 5149, 5160,
+  5166, 5175, 5181, 5045, 5051, 5060, 5066, 5077,
+  5083, 5092, 5098, 5118, 5124, 5133, 5139, 5150,
+  5156, 5165, 5171, 5196, 5202, 5211, 5217, 5228,
+  5234, 5243, 5249, 5269, 5275, 5284, 5290, 5301,
+  5307, 5316, 5322, 5345, 5351, 5360, 5366, 5377,
+  5383, 5392, 5398, 5418, 5424, 5433, 5439, 5450,
+  5456, 5465, 5471, 5496, 5502, 5511, 5517, 5528,
+  5534, 5543, 5549, 5569, 5575, 5584, 5590, 5601,
+  5607, 5616, 5622, 5417, 5423, 5432, 5438, 5449,
+  5455, 5464, 5470, 5490, 5496, 5505, 5511, 5522,
+  5528, 5537, 5543, 5568, 5574, 5583, 5589, 5600,
+  5606, 5615, 5621, 5641, 5647, 5656, 5662, 5673,
+  5679, 5688, 5694, 5717, 5723, 5732, 5738, 5749,
+  5755, 5764, 5770, 5790, 5796, 5805, 5811, 5822,
+  5828, 5837, 5843, 5868, 5874, 5883, 5889, 5900,
+  5906, 5915, 5921, 5941, 5947, 5956, 5962, 5973,
+  5979, 5988, 5994, 5858, 5864, 5873, 5879, 5890,
+  5896, 5905, 5911, 5931, 5937, 5946, 5952, 5963,
+  5969, 5978, 5984, 6009, 6015, 6024, 6030, 6041,
+  6047, 6056, 6062, 6082, 6088, 6097, 6103, 6114,
+  6120, 6129, 6135, 6158, 6164, 6173, 6179, 6190,
+  6196, 6205, 6211, 6231, 6237, 6246, 6252, 6263,
+  6269, 6278, 6284, 6309, 6315, 6324, 6330, 6341,
+  6347, 6356, 6362, 6382, 6388, 6397, 6403, 6414,
+  6420, 6429, 6435, 3515, 3521, 3530, 3536, 3547,
+  3553, 3562, 3568, 3588, 3594, 3603, 3609, 3620,
+  3626, 3635, 3641, 3666, 3672, 3681, 3687, 3698,
+  3704, 3713, 3719, 3739, 3745, 3754, 3760, 3771,
+  3777, 3786, 3792, 3815, 3821, 3830, 3836, 3847,
+  3853, 3862, 3868, 3888, 3894, 3903, 3909, 3920,
+  3926, 3935, 3941, 3966, 3972, 3981, 3987, 3998,
+  4004, 4013, 4019, 4039, 4045, 4054, 4060, 4071,
+  4077, 4086, 4092, 3956, 3962, 3971, 3977, 3988,
+  3994, 4003, 4009, 4029, 4035, 4044, 4050, 4061,
+  4067, 4076, 4082, 4107, 4113, 4122, 4128, 4139,
+  4145, 4154, 4160, 4180, 4186, 4195, 4201, 4212,
+  4218, 4227, 4233, 4256, 4262, 4271, 4277, 4288,
+  4294, 4303, 4309, 4329, 4335, 4344, 4350, 4361,
+  4367, 4376, 4382, 4407, 4413, 4422, 4428, 4439,
+  4445, 4454, 4460, 4480, 4486, 4495, 4501, 4512,
+  4518, 4527, 4533, 4328, 4334, 4343, 4349, 4360,
+  4366, 4375, 4381, 4401, 4407, 4416, 4422, 4433,
+  4439, 4448, 4454, 4479, 4485, 4494, 4500, 4511,
+  4517, 4526, 4532, 4552, 4558, 4567, 4573, 4584,
+  4590, 4599, 4605, 4628, 4634, 4643, 4649, 4660,
+  4666, 4675, 4681, 4701, 4707, 4716, 4722, 4733,
+  4739, 4748, 4754, 4779, 4785, 4794, 4800, 4811,
+  4817, 4826, 4832, 4852, 4858, 4867, 4873, 4884,
+  4890, 4899, 4905, 4769, 4775, 4784, 4790, 4801,
+  4807, 4816, 4822, 4842, 4848, 4857, 4863, 4874,
+  4880, 4889, 4895, 4920, 4926, 4935, 4941, 4952,
+  4958, 4967, 4973, 4993, 4999, 5008, 5014, 5025,
+  5031, 5040, 5046, 5069, 5075, 5084, 5090, 5101,
+  5107, 5116, 5122, 5142, 5148, 5157, 5163, 5174,
+  5180, 5189, 5195, 5220, 5226, 5235, 5241, 5252,
+  5258, 5267, 5273, 5293, 5299, 5308, 5314, 5325,
+  5331, 5340, 5346, 4604, 4610, 4619, 4625, 4636,
+  4642, 4651, 4657, 4677, 4683, 4692, 4698, 4709,
+  4715, 4724, 4730, 4755, 4761, 4770, 4776, 4787,
+  4793, 4802, 4808, 4828, 4834, 4843, 4849, 4860,
+  4866, 4875, 4881, 4904, 4910, 4919, 4925, 4936,
+  4942, 4951, 4957, 4977, 4983, 4992, 4998, 5009,
+  5015, 5024, 5030, 5055, 5061, 5070, 5076, 5087,
+  5093, 5102, 5108, 5128, 5134, 5143, 5149, 5160,
+  5166, 5175, 5181, 5045, 5051, 5060, 5066, 5077,
+  5083, 5092, 5098, 5118, 5124, 5133, 5139, 5150,
+  5156, 5165, 5171, 5196, 5202, 5211, 5217, 5228,
+  5234, 5243, 5249, 5269, 5275, 5284, 5290, 5301,
+  5307, 5316, 5322, 5345, 5351, 5360, 5366, 5377,
+  5383, 5392, 5398, 5418, 5424, 5433, 5439, 5450,
+  5456, 5465, 5471, 5496, 5502, 5511, 5517, 5528,
+  5534, 5543, 5549, 5569, 5575, 5584, 5590, 5601,
+  5607, 5616, 5622, 5417, 5423, 5432, 5438, 5449,
+  5455, 5464, 5470, 5490, 5496, 5505, 5511, 5522,
+  5528, 5537, 5543, 5568, 5574, 5583, 5589, 5600,
+  5606, 5615, 5621, 5641, 5647, 5656, 5662, 5673,
+  5679, 5688, 5694, 5717, 5723, 5732, 5738, 5749,
+  5755, 5764, 5770, 5790, 5796, 5805, 5811, 5822,
+  5828, 5837, 5843, 5868, 5874, 5883, 5889, 5900,
+  5906, 5915, 5921, 5941, 5947, 5956, 5962, 5973,
+  5979, 5988, 5994, 5858, 5864, 5873, 5879, 5890,
+  5896, 5905, 5911, 5931, 5937, 5946, 5952, 5963,
+  5969, 5978, 5984, 6009, 6015, 6024, 6030, 6041,
+  6047, 6056, 6062, 6082, 6088, 6097, 6103, 6114,
+  6120, 6129, 6135, 6158, 6164, 6173, 6179, 6190,
+  6196, 6205, 6211, 6231, 6237, 6246, 6252, 6263,
+  6269, 6278, 6284, 6309, 6315, 6324, 6330, 6341,
+  6347, 6356, 6362, 6382, 6388, 6397, 6403, 6414,
+  6420, 6429, 6435, 5303, 5309, 5318, 5324, 5335,
+  5341, 5350, 5356, 5376, 5382, 5391, 5397, 5408,
+  5414, 5423, 5429, 5454, 5460, 5469, 5475, 5486,
+  5492, 5501, 5507, 5527, 5533, 5542, 5548, 5559,
+  5565, 5574, 5580, 5603, 5609, 5618, 5624, 5635,
+  5641, 5650, 5656, 5676, 5682, 5691, 5697, 5708,
+  5714, 5723, 5729, 5754, 5760, 5769, 5775, 5786,
+  5792, 5801, 5807, 5827, 5833, 5842, 5848, 5859,
+  5865, 5874, 5880, 5744, 5750, 5759, 5765, 5776,
+  5782, 5791, 5797, 5817, 5823, 5832, 5838, 5849,
+  5855, 5864, 5870, 5895, 5901, 5910, 5916, 5927,
+  5933, 5942, 5948, 5968, 5974, 5983, 5989, 6000,
+  6006, 6015, 6021, 6044, 6050, 6059, 6065, 6076,
+  6082, 6091, 6097, 6117, 6123, 6132, 6138, 6149,
+  6155, 6164, 6170, 6195, 6201, 6210, 6216, 6227,
+  6233, 6242, 6248, 6268, 6274, 6283, 6289, 6300,
+  6306, 6315, 6321, 6116, 6122, 6131, 6137, 6148,
+  6154, 6163, 6169, 6189, 6195, 6204, 6210, 6221,
+  6227, 6236, 6242, 6267, 6273, 6282, 6288, 6299,
+  6305, 6314, 6320, 6340, 6346, 6355, 6361, 6372,
+  6378, 6387, 6393, 6416, 6422, 6431, 6437, 6448,
+  6454, 6463, 6469, 6489, 6495, 6504, 6510, 6521,
+  6527, 6536, 6542, 6567, 6573, 6582, 6588, 6599,
+  6605, 6614, 6620, 6640, 6646, 6655, 6661, 6672,
+  6678, 6687, 6693, 6557, 6563, 6572, 6578, 6589,
+  6595, 6604, 6610, 6630, 6636, 6645, 6651, 6662,
+  6668, 6677, 6683, 6708, 6714, 6723, 6729, 6740,
+  6746, 6755, 6761, 6781, 6787, 6796, 6802, 6813,
+  6819, 6828, 6834, 6857, 6863, 6872, 6878, 6889,
+  6895, 6904, 6910, 6930, 6936, 6945, 6951, 6962,
+  6968, 6977, 6983, 7008, 7014, 7023, 7029, 7040,
+  7046, 7055, 7061, 7081, 7087, 7096, 7102, 7113,
+  7119, 7128, 7134, 6392, 6398, 6407, 6413, 6424,
+  6430, 6439, 6445, 6465, 6471, 6480, 6486, 6497,
+  6503, 6512, 6518, 6543, 6549, 6558, 6564, 6575,
+  6581, 6590, 6596, 6616, 6622, 6631, 6637, 6648,
+  6654, 6663, 6669, 6692, 6698, 6707, 6713, 6724,
+  6730, 6739, 6745, 6765, 6771, 6780, 6786, 6797,
+  6803, 6812, 6818, 6843, 6849, 6858, 6864, 6875,
+  6881, 6890, 6896, 6916, 6922, 6931, 6937, 6948,
+  6954, 6963, 6969, 6833, 6839, 6848, 6854, 6865,
+  6871, 6880, 6886, 6906, 6912, 6921, 6927, 6938,
+  6944, 6953, 6959, 6984, 6990, 6999, 7005, 7016,
+  7022, 7031, 7037, 7057, 7063, 7072, 7078, 7089,
+  7095, 7104, 7110, 7133, 7139, 7148, 7154, 7165,
+  7171, 7180, 7186, 7206, 7212, 7221, 7227, 7238,
+  7244, 7253, 7259, 7284, 7290, 7299, 7305, 7316,
+  7322, 7331, 7337, 7357, 7363, 7372, 7378, 7389,
+  7395, 7404, 7410, 7205, 7211, 7220, 7226, 7237,
+  7243, 7252, 7258, 7278, 7284, 7293, 7299, 7310,
+  7316, 7325, 7331, 7356, 7362, 7371, 7377, 7388,
+  7394, 7403, 7409, 7429, 7435, 7444, 7450, 7461,
+  7467, 7476, 7482, 7505, 7511, 7520, 7526, 7537,
+  7543, 7552, 7558, 7578, 7584, 7593, 7599, 7610,
+  7616, 7625, 7631, 7656, 7662, 7671, 7677, 7688,
+  7694, 7703, 7709, 7729, 7735, 7744, 7750, 7761
+};
+
+static const uint8_t kBands[16 + 1] = {
+  0, 1, 2, 3, 6, 4, 5, 6, 6, 6, 6, 6, 6, 6, 6, 7,
+  0  // sentinel
+};
+
+static int LevelCost(const uint16_t table[MAX_VARIABLE_LEVEL + 1], int level) {
+  return VP8LevelFixedCosts[level]
+       + table[(level > MAX_VARIABLE_LEVEL) ? MAX_VARIABLE_LEVEL : level];
+}
+
+// Same as VP8GetResidualCost(), with a fixed trip count.
+static int GetResidualCost(const VP8CostLUT* const costs, int type, int first,
+		int ctx0, const int16_t levels[16]) {
 #pragma HLS inline off
-	int64_t test_R = 0;
+  int n, last = -1;
+  int ctx = ctx0;
+  int cost;
+
+  for (n = 0; n < 16; ++n) {
+#pragma HLS unroll
+    if (n >= first && levels[n] != 0) last = n;
+  }
+  if (last < 0) {
+    return costs->eob_[type][kBands[first]][ctx0];
+  }
+  // the "not EOB" bit is folded in level_[] only for ctx != 0
+  cost = (ctx0 == 0) ? costs->not_eob_[type][kBands[first]][0] : 0;
+  for (n = 0; n < 16; ++n) {
+#pragma HLS pipeline
+    if (n >= first && n <= last) {
+      const int v = (levels[n] < 0) ? -levels[n] : levels[n];
+      cost += LevelCost(costs->level_[type][kBands[n]][ctx], v);
+      ctx = (v >= 2) ? 2 : v;
+    }
+  }
+  if (last < 15) {   // last coefficient is non-zero, so ctx is 1 or 2 here
+    cost += costs->eob_[type][kBands[last + 1]][ctx];
+  }
+  return cost;
+}
+
+static int VP8GetCostLuma16(int16_t y_ac_levels[16][16], int16_t y_dc_levels[16],
+		const uint8_t top_nz[9], const uint8_t left_nz[9],
+		const VP8CostLUT* const costs){
+#pragma HLS inline off
+	uint8_t tnz[4], lnz[4];
+	int R = 0;
 	int y, x;
-	for (y = 0; y < 16; ++y) {
-//#pragma HLS unroll
-	  for (x = 0; x < 16; ++x) {
+	for (x = 0; x < 4; ++x) {
 #pragma HLS unroll
-	    test_R += y_ac_levels[y][x] * y_ac_levels[y][x];
+	  tnz[x] = top_nz[x];
+	  lnz[x] = left_nz[x];
+	}
+	// DC
+	R += GetResidualCost(costs, 1, 0, top_nz[8] + left_nz[8], y_dc_levels);
+	// AC
+	for (y = 0; y < 4; ++y) {
+	  for (x = 0; x < 4; ++x) {
+	    const int16_t* const levels = y_ac_levels[x + y * 4];
+	    int n, nz = 0;
+	    R += GetResidualCost(costs, 0, 1, tnz[x] + lnz[y], levels);
+	    for (n = 1; n < 16; ++n) {
+#pragma HLS unroll
+	      nz |= (levels[n] != 0);
+	    }
+	    tnz[x] = lnz[y] = nz;
 	  }
-	  test_R += y_dc_levels[y] * y_dc_levels[y];
 	}
-	return test_R << 10;
+	return R;
 }
 
 static void Copy_16x16_int16(int16_t dst[16][16], int16_t src[16][16]){
@@ -1113,7 +1856,9 @@ static void Copy_16_uint8(uint8_t dst[16], uint8_t src[16]){
 
 static void PickBestIntra16(uint8_t Yin[16*16], uint8_t Yout[16*16],
 		VP8ModeScore* rd, VP8SegmentInfo* const dqm, uint8_t left_y[16],
-		uint8_t top_y[20], uint8_t top_left_y, int x, int y) {
+		uint8_t top_y[20], uint8_t top_left_y, int x, int y,
+		const uint8_t top_nz[9], const uint8_t left_nz[9],
+		const VP8CostLUT* const costs) {
 //#pragma HLS ARRAY_PARTITION variable=Yout complete dim=1
 //#pragma HLS ARRAY_PARTITION variable=Yin complete dim=1
 //#pragma HLS ARRAY_PARTITION variable=rd->y_ac_levels complete dim=0
@@ -1180,7 +1925,8 @@ static void PickBestIntra16(uint8_t Yin[16*16], uint8_t Yout[16*16],
 	rd_tmp.D = GetSSE16x16(Yin, Yout_tmp);
 	rd_tmp.SD = tlambda * Disto16x16_C(Yin, Yout_tmp, kWeightY);
 	rd_tmp.H = VP8FixedCostsI16[mode];
-	rd_tmp.R = VP8GetCostLuma16(rd_tmp.y_ac_levels, rd_tmp.y_dc_levels);
+	rd_tmp.R = VP8GetCostLuma16(rd_tmp.y_ac_levels, rd_tmp.y_dc_levels,
+			top_nz, left_nz, costs);
 
     // Since we always examine Intra16 first, we can overwrite *rd directly.
     SetRDScore(lambda, &rd_tmp);
@@ -1206,8 +1952,110 @@ static void PickBestIntra16(uint8_t Yin[16*16], uint8_t Yout[16*16],
 
 #define MAX_COST ((score_t)0x7fffffffffffffLL)
 
-const uint16_t VP8FixedCostsI4[NUM_BMODES] =
-   {   40, 1151, 1723, 1874, 2103, 2019, 1628, 1777, 2226, 2137 };
+// Cost of each 4x4 mode given the modes of the top and left sub-blocks, as
+// coded by PutI4Mode(): VP8FixedCostsI4[top][left][mode].
+const uint16_t VP8FixedCostsI4[NUM_BMODES][NUM_BMODES][NUM_BMODES] = {
+  { {   40, 1151, 1723, 1874, 2103, 2019, 1628, 1777, 2226, 2137 },
+    {  192,  469, 1296, 1308, 1849, 1794, 1781, 1703, 1713, 1522 },
+    {  142,  910,  762, 1684, 1849, 1576, 1460, 1305, 1801, 1657 },
+    {  559,  641, 1370,  421, 1182, 1569, 1612, 1725,  863, 1007 },
+    {  299, 1059, 1256, 1108,  636, 1068, 1581, 1883,  869, 1142 },
+    {  277, 1111,  707, 1362, 1089,  672, 1603, 1541, 1545, 1291 },
+    {  214,  781, 1609, 1303, 1632, 2229,  726, 1560, 1713,  918 },
+    {  152, 1037, 1046, 1759, 1983, 2174, 1358,  742, 1740, 1390 },
+    {  512, 1046, 1420,  753,  752, 1297, 1486, 1613,  460, 1207 },
+    {  424,  827, 1362,  719, 1462, 1202, 1199, 1476, 1199,  538 } },
+  { {  240,  402, 1134, 1491, 1659, 1505, 1517, 1555, 1979, 2099 },
+    {  467,  242,  960, 1232, 1714, 1620, 1834, 1570, 1676, 1391 },
+    {  500,  455,  463, 1507, 1699, 1282, 1564,  982, 2114, 2114 },
+    {  672,  643, 1372,  331, 1589, 1667, 1453, 1938,  996,  876 },
+    {  458,  783, 1037,  911,  738,  968, 1165, 1518,  859, 1033 },
+    {  504,  815,  504, 1139, 1219,  719, 1506, 1085, 1268, 1268 },
+    {  333,  630, 1445, 1239, 1883, 3672,  799, 1548, 1865,  598 },
+    {  399,  644,  746, 1342, 1856, 1350, 1493,  613, 1855, 1015 },
+    {  622,  749, 1205,  608, 1066, 1408, 1290, 1406,  546,  971 },
+    {  500,  753, 1041,  668, 1230, 1617, 1297, 1425, 1383,  523 } },
+  { {  394,  553,  523, 1502, 1536,  981, 1608, 1142, 1666, 2181 },
+    {  655,  430,  375, 1411, 1861, 1220, 1677, 1135, 1978, 1553 },
+    {  690,  640,  245, 1954, 2070, 1194, 1528,  982, 1972, 2232 },
+    {  559,  834,  741,  867, 1131,  980, 1225,  852, 1092,  784 },
+    {  690,  875,  516,  959,  673,  894, 1056, 1190, 1528, 1126 },
+    {  740,  951,  384, 1277, 1177,  492, 1579, 1155, 1846, 1513 },
+    {  323,  775, 1062, 1776, 3062, 1274,  813, 1188, 1372,  655 },
+    {  488,  971,  484, 1767, 1515, 1775, 1115,  503, 1539, 1461 },
+    {  740, 1006,  998,  709,  851, 1230, 1337,  788,  741,  721 },
+    {  522, 1073,  573, 1045, 1346,  887, 1046, 1146, 1203,  697 } },
+  { {  105,  864, 1442, 1009, 1934, 1840, 1519, 1920, 1673, 1579 },
+    {  534,  305, 1193,  683, 1388, 2164, 1802, 1894, 1264, 1170 },
+    {  305,  518,  877, 1108, 1426, 3215, 1425, 1064, 1320, 1242 },
+    {  683,  732, 1927,  257, 1493, 2048, 1858, 1552, 1055,  947 },
+    {  394,  814, 1024,  660,  959, 1556, 1282, 1289,  893, 1047 },
+    {  528,  615,  996,  940, 1201,  635, 1094, 2515,  803, 1358 },
+    {  347,  614, 1609, 1187, 3133, 1345, 1007, 1339, 1017,  667 },
+    {  218,  740,  878, 1605, 3650, 3650, 1345,  758, 1357, 1617 },
+    {  672,  750, 1541,  558, 1257, 1599, 1870, 2135,  402, 1087 },
+    {  592,  684, 1161,  430, 1092, 1497, 1475, 1489, 1095,  822 } },
+  { {  228, 1056, 1059, 1368,  752,  982, 1512, 1518,  987, 1782 },
+    {  494,  514,  818,  942,  965,  892, 1610, 1356, 1048, 1363 },
+    {  512,  648,  591, 1042,  761,  991, 1196, 1454, 1309, 1463 },
+    {  683,  749, 1043,  676,  841, 1396, 1133, 1138,  654,  939 },
+    {  622, 1101, 1126,  994,  361, 1077, 1203, 1318,  877, 1219 },
+    {  631, 1068,  857, 1650,  651,  477, 1650, 1419,  828, 1170 },
+    {  555,  727, 1068, 1335, 3127, 1339,  820, 1331, 1077,  429 },
+    {  504,  879,  624, 1398,  889,  889, 1392,  808,  891, 1406 },
+    {  683, 1602, 1289,  977,  578,  983, 1280, 1708,  406, 1122 },
+    {  399,  865, 1433, 1070, 1072,  764,  968, 1477, 1223,  678 } },
+  { {  333,  760,  935, 1638, 1010,  529, 1646, 1410, 1472, 2219 },
+    {  512,  494,  750, 1160, 1215,  610, 1870, 1868, 1628, 1169 },
+    {  572,  646,  492, 1934, 1208,  603, 1580, 1099, 1398, 1995 },
+    {  786,  789,  942,  581, 1018,  951, 1599, 1207,  731,  768 },
+    {  690, 1015,  672, 1078,  582,  504, 1693, 1438, 1108, 2897 },
+    {  768, 1267,  571, 2005, 1243,  244, 2881, 1380, 1786, 1453 },
+    {  452,  899, 1293,  903, 1311, 3100,  465, 1311, 1319,  813 },
+    {  394,  927,  942, 1103, 1358, 1104,  946,  593, 1363, 1109 },
+    {  559, 1005, 1007, 1016,  658, 1173, 1021, 1164,  623, 1028 },
+    {  564,  796,  632, 1005, 1014,  863, 2316, 1268,  938,  764 } },
+  { {  266,  606, 1098, 1228, 1497, 1243,  948, 1030, 1734, 1461 },
+    {  366,  585,  901, 1060, 1407, 1247,  876, 1134, 1620, 1054 },
+    {  452,  565,  542, 1729, 1479, 1479, 1016,  886, 2938, 1150 },
+    {  555, 1088, 1533,  950, 1354,  895,  834, 1019, 1021,  496 },
+    {  704,  815, 1193,  971,  973,  640, 1217, 2214,  832,  578 },
+    {  672, 1245,  579,  871,  875,  774,  872, 1273, 1027,  949 },
+    {  296, 1134, 2050, 1784, 1636, 3425,  442, 1550, 2076,  722 },
+    {  342,  982, 1259, 1846, 1848, 1848,  622,  568, 1847, 1052 },
+    {  555, 1064, 1304,  828,  746, 1343, 1075, 1329, 1078,  494 },
+    {  288, 1167, 1285, 1174, 1639, 1639,  833, 2254, 1304,  509 } },
+  { {  342,  719,  767, 1866, 1757, 1270, 1246,  550, 1746, 2151 },
+    {  483,  653,  694, 1509, 1459, 1410, 1218,  507, 1914, 1266 },
+    {  488,  757,  447, 2979, 1813, 1268, 1654,  539, 1849, 2109 },
+    {  522, 1097, 1085,  851, 1365, 1111,  851,  901,  961,  605 },
+    {  709,  716,  841,  728,  736,  945,  941,  862, 2845, 1057 },
+    {  512, 1323,  500, 1336, 1083,  681, 1342,  717, 1604, 1350 },
+    {  452, 1155, 1372, 1900, 1501, 3290,  311,  944, 1919,  922 },
+    {  403, 1520,  977, 2132, 1733, 3522, 1076,  276, 3335, 1547 },
+    {  559, 1374, 1101,  615,  673, 2462,  974,  795,  984,  984 },
+    {  547, 1122, 1062,  812, 1410,  951, 1140,  622, 1268,  651 } },
+  { {  165,  982, 1235,  938, 1334, 1366, 1659, 1578,  964, 1612 },
+    {  592,  422,  925,  847, 1139, 1112, 1387, 2036,  861, 1041 },
+    {  403,  837,  732,  770,  941, 1658, 1250,  809, 1407, 1407 },
+    {  896,  874, 1071,  381, 1568, 1722, 1437, 2192,  480, 1035 },
+    {  640, 1098, 1012, 1032,  684, 1382, 1581, 2106,  416,  865 },
+    {  559, 1005,  819,  914,  710,  770, 1418,  920,  838, 1435 },
+    {  415, 1258, 1245,  870, 1278, 3067,  770, 1021, 1287,  522 },
+    {  406,  990,  601, 1009, 1265, 1265, 1267,  759, 1017, 1277 },
+    {  968, 1182, 1329,  788, 1032, 1292, 1705, 1714,  203, 1403 },
+    {  732,  877, 1279,  471,  901, 1161, 1545, 1294,  755,  755 } },
+  { {  111,  931, 1378, 1185, 1933, 1648, 1148, 1714, 1873, 1307 },
+    {  406,  414, 1030, 1023, 1910, 1404, 1313, 1647, 1509,  793 },
+    {  342,  640,  575, 1088, 1241, 1349, 1161, 1350, 1756, 1502 },
+    {  559,  766, 1185,  357, 1682, 1428, 1329, 1897, 1219,  802 },
+    {  473,  909, 1164,  771,  719, 2508, 1427, 1432,  722,  782 },
+    {  342,  892,  785, 1145, 1150,  794, 1296, 1550,  973, 1057 },
+    {  208, 1036, 1326, 1343, 1606, 3395,  815, 1455, 1618,  712 },
+    {  228,  928,  890, 1046, 3499, 1711,  994,  829, 1720, 1318 },
+    {  768,  724, 1058,  636,  991, 1075, 1319, 1324,  616,  825 },
+    {  305, 1167, 1358,  899, 1587, 1587,  987, 1988, 1332,  501 } }
+};
 
 static int GetSSE4x4(const uint8_t* a, const uint8_t* b) {
   int count = 0;
@@ -1223,6 +2071,64 @@ static int GetSSE4x4(const uint8_t* a, const uint8_t* b) {
   return count;
 }
 
+#if VP8_I4_TOPK < 10
+// Sum of the absolute Hadamard coefficients of 'src - pred', a cheap estimate
+// of the cost of the residual.
+static int GetSATD4x4(const uint8_t* src, const uint8_t* pred) {
+#pragma HLS inline
+  int tmp[16];
+  int sum = 0;
+  int i;
+#pragma HLS ARRAY_PARTITION variable=tmp complete dim=1
+  for (i = 0; i < 4; ++i) {
+#pragma HLS unroll
+    const int d0 = src[4 * i + 0] - pred[4 * i + 0];
+    const int d1 = src[4 * i + 1] - pred[4 * i + 1];
+    const int d2 = src[4 * i + 2] - pred[4 * i + 2];
+    const int d3 = src[4 * i + 3] - pred[4 * i + 3];
+    const int a0 = d0 + d2;
+    const int a1 = d1 + d3;
+    const int a2 = d1 - d3;
+    const int a3 = d0 - d2;
+    tmp[0 + i * 4] = a0 + a1;
+    tmp[1 + i * 4] = a3 + a2;
+    tmp[2 + i * 4] = a3 - a2;
+    tmp[3 + i * 4] = a0 - a1;
+  }
+  for (i = 0; i < 4; ++i) {
+#pragma HLS unroll
+    const int a0 = tmp[0 + i] + tmp[8 + i];
+    const int a1 = tmp[4 + i] + tmp[12 + i];
+    const int a2 = tmp[4 + i] - tmp[12 + i];
+    const int a3 = tmp[0 + i] - tmp[8 + i];
+    sum += abs(a0 + a1) + abs(a3 + a2) + abs(a3 - a2) + abs(a0 - a1);
+  }
+  return sum;
+}
+
+// Lists in 'cand' the VP8_I4_TOPK modes of lowest 'cost', best first. Ties go
+// to the lowest mode, as in PickBestMode(). Each mode is ranked on its own so
+// that the comparisons all run in parallel in the kernel.
+static void SelectTopK(const score_t cost[NUM_BMODES],
+		uint8_t cand[VP8_I4_TOPK]) {
+#pragma HLS inline
+  int m, n;
+  for (m = 0; m < VP8_I4_TOPK; ++m) {
+#pragma HLS unroll
+    cand[m] = m;   // all overwritten below, but the compiler can't tell
+  }
+  for (m = 0; m < NUM_BMODES; ++m) {
+#pragma HLS unroll
+    int rank = 0;
+    for (n = 0; n < NUM_BMODES; ++n) {
+#pragma HLS unroll
+      rank += (cost[n] < cost[m]) || (cost[n] == cost[m] && n < m);
+    }
+    if (rank < VP8_I4_TOPK) cand[rank] = m;
+  }
+}
+#endif  // VP8_I4_TOPK < 10
+
 static void AddScore(VP8ModeScore* const dst, const VP8ModeScore* const src) {
   dst->D  += src->D;
   dst->SD += src->SD;
@@ -1394,18 +2300,9 @@ static int VP8IteratorRotateI4(uint8_t y_left[16], uint8_t y_top_left,
   return 1;
 }
 
-static int VP8GetCostLuma4(int16_t tmp_levels[16]){
-	int64_t test_R = 0;
-	int x, y;
-	for (y = 0; y < 4; ++y) {
-#pragma HLS unroll
-	  for (x = 0; x < 4; ++x) {
-#pragma HLS unroll
-		test_R += tmp_levels[y * 4 + x] * tmp_levels[y * 4 + x];
-	  }
-	}
-
-	return test_R << 10;
+static int VP8GetCostLuma4(int16_t tmp_levels[16], int ctx,
+		const VP8CostLUT* const costs){
+	return GetResidualCost(costs, 3, 0, ctx, tmp_levels);
 }
 
 static int PickBestMode(VP8ModeScore rd_tmp[10]){
@@ -1486,8 +2383,15 @@ static int PickBestMode(VP8ModeScore rd_tmp[10]){
 	return best_mode_8;
 }
 
-static void PickBestIntra4(VP8SegmentInfo* const dqm, uint8_t Yin[16*16], uint8_t Yout[16*16],
-		VP8ModeScore* const rd, uint8_t y_left[16], uint8_t y_top_left, uint8_t y_top[20]) {
+// Returns the number of sub-blocks scored. With VP8_I4_EARLY_EXIT, the search
+// stops once rd->score reaches 'max_score', leaving Yout and the remaining
+// modes_i4[] undefined. 'top_modes' and 'left_modes' are the 4x4 modes along
+// the edges of the macroblock, for the mode costs.
+static int PickBestIntra4(VP8SegmentInfo* const dqm, uint8_t Yin[16*16], uint8_t Yout[16*16],
+		VP8ModeScore* const rd, uint8_t y_left[16], uint8_t y_top_left, uint8_t y_top[20],
+		const uint8_t top_nz[9], const uint8_t left_nz[9],
+		const uint8_t top_modes[4], const uint8_t left_modes[4],
+		const VP8CostLUT* const costs, score_t max_score) {
 //#pragma HLS pipeline
 //#pragma HLS ARRAY_PARTITION variable=Yout complete dim=1
 //#pragma HLS ARRAY_PARTITION variable=Yin complete dim=1
@@ -1504,6 +2408,8 @@ static void PickBestIntra4(VP8SegmentInfo* const dqm, uint8_t Yin[16*16], uint8_
   const int tlambda = dqm->tlambda_;
   uint8_t best_blocks[16][16];
   uint8_t left[4], top_left, top[4], top_right[4];
+  uint8_t tnz[4], lnz[4];
+  uint8_t tmodes[4], lmodes[4];
   int i, j, n, i4_;
   uint8_t top_mem[16];
   uint8_t src[16][16];
@@ -1528,6 +2434,10 @@ static void PickBestIntra4(VP8SegmentInfo* const dqm, uint8_t Yin[16*16], uint8_
 	left[i] = y_left[i];
 	top[i] = y_top[i];
 	top_right[i] = y_top[4+i];
+	tnz[i] = top_nz[i];
+	lnz[i] = left_nz[i];
+	tmodes[i] = top_modes[i];
+	lmodes[i] = left_modes[i];
   }
 	
   for(n = 0; n < 16; n++){
@@ -1551,20 +2461,48 @@ static void PickBestIntra4(VP8SegmentInfo* const dqm, uint8_t Yin[16*16], uint8_
   uint8_t tmp_pred[NUM_BMODES][16];    // scratch buffer.
   int16_t tmp_levels[NUM_BMODES][16];
   uint8_t tmp_dst[NUM_BMODES][16];
+#if VP8_I4_TOPK < 10
+  // The pre-screening weighs one bit of mode cost like a residual SATD of
+  // about one quantizer step.
+  const int satd_lambda = dqm->y1_.q_[1];
+  score_t pre_score[NUM_BMODES];
+  uint8_t cand[VP8_I4_TOPK];
+  int k;
+#pragma HLS ARRAY_PARTITION variable=pre_score complete dim=1
+#pragma HLS ARRAY_PARTITION variable=cand complete dim=1
+#endif
 
 #pragma HLS ARRAY_PARTITION variable=rd_tmp complete dim=1
 #pragma HLS ARRAY_PARTITION variable=kWeightY complete dim=1
-#pragma HLS ARRAY_PARTITION variable=VP8FixedCostsI4 complete dim=1
+#pragma HLS ARRAY_PARTITION variable=VP8FixedCostsI4 complete dim=3
 #pragma HLS ARRAY_PARTITION variable=tmp_pred complete dim=0
 #pragma HLS ARRAY_PARTITION variable=tmp_dst complete dim=0
 #pragma HLS ARRAY_PARTITION variable=tmp_levels complete dim=0
 
   for (i4_ = 0; i4_ < 16; i4_++){
+#pragma HLS loop_tripcount min=1 max=16
+
+    const uint16_t* const mode_costs =
+        VP8FixedCostsI4[tmodes[i4_ & 3]][lmodes[i4_ >> 2]];
 
     Intra4Preds_C(tmp_pred, left, top_left, top, top_right);
 
+#if VP8_I4_TOPK < 10
     for (mode = 0; mode < NUM_BMODES; mode++){
 #pragma HLS unroll
+      pre_score[mode] = ((score_t)GetSATD4x4(src[i4_], tmp_pred[mode]) << 8)
+                      + mode_costs[mode] * satd_lambda;
+      rd_tmp[mode].score = MAX_COST;   // never picked unless reconstructed
+    }
+    SelectTopK(pre_score, cand);
+
+    for (k = 0; k < VP8_I4_TOPK; k++){
+#pragma HLS unroll
+      mode = cand[k];
+#else
+    for (mode = 0; mode < NUM_BMODES; mode++){
+#pragma HLS unroll
+#endif
       // Reconstruct
       rd_tmp[mode].nz =
           ReconstructIntra4(tmp_levels[mode], tmp_pred[mode], src[i4_], tmp_dst[mode], dqm->y1_) << i4_;
@@ -1572,8 +2510,9 @@ static void PickBestIntra4(VP8SegmentInfo* const dqm, uint8_t Yin[16*16], uint8_
       // Compute RD-score
       rd_tmp[mode].D = GetSSE4x4(src[i4_], tmp_dst[mode]);
       rd_tmp[mode].SD = tlambda * Disto4x4_C(src[i4_], tmp_dst[mode], kWeightY);
-      rd_tmp[mode].H = VP8FixedCostsI4[mode];
-	  rd_tmp[mode].R = VP8GetCostLuma4(tmp_levels[mode]);
+      rd_tmp[mode].H = mode_costs[mode];
+	  rd_tmp[mode].R = VP8GetCostLuma4(tmp_levels[mode],
+			  tnz[i4_ & 3] + lnz[i4_ >> 2], costs);
 
       SetRDScore_i4(lambda, &rd_tmp[mode]);
     }
@@ -1587,6 +2526,11 @@ static void PickBestIntra4(VP8SegmentInfo* const dqm, uint8_t Yin[16*16], uint8_
     SetRDScore(dqm->lambda_mode_, &rd_i4);
     AddScore(rd, &rd_i4);
     rd->modes_i4[i4_] = best_mode;
+#if VP8_I4_EARLY_EXIT
+    if (rd->score >= max_score) return i4_ + 1;   // Intra16 wins anyway
+#endif
+    tnz[i4_ & 3] = lnz[i4_ >> 2] = (rd_i4.nz ? 1 : 0);
+    tmodes[i4_ & 3] = lmodes[i4_ >> 2] = best_mode;
     VP8IteratorRotateI4(y_left, y_top_left, y_top, i4_, top_mem,
     		best_blocks, left, &top_left, top, top_right);
   }
@@ -1601,7 +2545,8 @@ static void PickBestIntra4(VP8SegmentInfo* const dqm, uint8_t Yin[16*16], uint8_
 		  }
 	  }
   }
-
+  (void)max_score;
+  return 16;
 }
 
 static int GetSSE16x8(const uint8_t* a, const uint8_t* b) {
@@ -1620,7 +2565,7 @@ static int GetSSE16x8(const uint8_t* a, const uint8_t* b) {
 
 const uint16_t VP8FixedCostsUV[4] = { 302, 984, 439, 642 };
 
-static void StoreDiffusionErrors(DError top_derr[1024], DError left_derr, int x,
+static void StoreDiffusionErrors(DError top_derr[MAX_MB_W], DError left_derr, int x,
                                  const VP8ModeScore* const rd) {
   int ch;
   for (ch = 0; ch <= 1; ++ch) {
@@ -1634,18 +2579,33 @@ static void StoreDiffusionErrors(DError top_derr[1024], DError left_derr, int x,
   }
 }
 
-static int64_t VP8GetCostUV(int16_t uv_levels[4 + 4][16]){
+static int64_t VP8GetCostUV(int16_t uv_levels[4 + 4][16],
+		const uint8_t top_nz[9], const uint8_t left_nz[9],
+		const VP8CostLUT* const costs){
 #pragma HLS inline off
-	int64_t test_R = 0;
-	int x, y;
-	for (y = 0; y < 8; ++y) {
-//#pragma HLS unroll
-	  for (x = 0; x < 16; ++x) {
+	uint8_t tnz[4], lnz[4];
+	int R = 0;
+	int ch, x, y;
+	for (x = 0; x < 4; ++x) {
+#pragma HLS unroll
+	  tnz[x] = top_nz[4 + x];
+	  lnz[x] = left_nz[4 + x];
+	}
+	for (ch = 0; ch <= 2; ch += 2) {
+	  for (y = 0; y < 2; ++y) {
+	    for (x = 0; x < 2; ++x) {
+	      const int16_t* const levels = uv_levels[ch * 2 + x + y * 2];
+	      int n, nz = 0;
+	      R += GetResidualCost(costs, 2, 0, tnz[ch + x] + lnz[ch + y], levels);
+	      for (n = 0; n < 16; ++n) {
 #pragma HLS unroll
-	    test_R += uv_levels[y][x] * uv_levels[y][x];
+	        nz |= (levels[n] != 0);
+	      }
+	      tnz[ch + x] = lnz[ch + y] = nz;
+	    }
 	  }
 	}
-	return test_R << 10;
+	return R;
 }
 
 static void CopyUVLevel(int16_t dst[4 + 4][16], int16_t src[4 + 4][16]) {
@@ -1679,9 +2639,10 @@ static void CopyUVout(uint8_t dst[8*16], uint8_t src[8*16]) {
 }
 
 static void PickBestUV(VP8SegmentInfo* const dqm, uint8_t UVin[8*16], uint8_t UVout[8*16],
-		VP8ModeScore* const rd, DError top_derr[1024], DError left_derr, uint8_t left_u[8],
+		VP8ModeScore* const rd, DError top_derr[MAX_MB_W], DError left_derr, uint8_t left_u[8],
 		uint8_t top_u[8], uint8_t top_left_u, uint8_t left_v[8], uint8_t top_v[8],
-		uint8_t top_left_v, int x, int y) {
+		uint8_t top_left_v, int x, int y, const uint8_t top_nz[9],
+		const uint8_t left_nz[9], const VP8CostLUT* const costs) {
 //#pragma HLS pipeline
 //#pragma HLS ARRAY_PARTITION variable=UVout complete dim=1
 //#pragma HLS ARRAY_PARTITION variable=UVin complete dim=1
@@ -1733,7 +2694,7 @@ static void PickBestUV(VP8SegmentInfo* const dqm, uint8_t UVin[8*16], uint8_t UV
     rd_uv.D  = GetSSE16x8(UVin, tmp_dst);
     rd_uv.SD = 0;    // not calling TDisto here: it tends to flatten areas.
     rd_uv.H  = VP8FixedCostsUV[mode];
-	rd_uv.R  = VP8GetCostUV(rd_uv.uv_levels);
+	rd_uv.R  = VP8GetCostUV(rd_uv.uv_levels, top_nz, left_nz, costs);
 
     SetRDScore(lambda, &rd_uv);
 
@@ -1750,11 +2711,106 @@ static void PickBestUV(VP8SegmentInfo* const dqm, uint8_t UVin[8*16], uint8_t UV
   StoreDiffusionErrors(top_derr, left_derr, x, rd);
 }
 
-void VP8Decimate_snap(uint8_t Yin[16*16], uint8_t Yout16[16*16], uint8_t Yout4[16*16],
+#if VP8_SKIP_PREPASS
+// True if all the coefficients of 'in' from 'first' on quantize to zero, the
+// 'coeff > zthresh_' test of QuantizeBlock_C().
+static int IsZeroBlock(const int16_t in[16], const VP8Matrix* const mtx,
+		int first) {
+#pragma HLS inline
+  int zero = 1;
+  int j;
+  for (j = 0; j < 16; ++j) {
+#pragma HLS unroll
+    const uint32_t coeff = ((in[j] < 0) ? -in[j] : in[j]) + mtx->sharpen_[j];
+    if (j >= first && coeff > mtx->zthresh_[j]) zero = 0;
+  }
+  return zero;
+}
+
+// Skip pre-pass: looks for the Intra16 predictions whose residual quantizes to
+// all-zero, using the forward transforms only. Such a mode reconstructs to
+// its prediction, and all of them have the same coefficient cost, so they are
+// scored on their distortion and mode cost alone. Returns true and the best of
+// them in rd->mode_i16 and Yout, or false if there is none.
+static int PickSkipIntra16(uint8_t Yin[16*16], uint8_t Yout[16*16],
+		VP8ModeScore* const rd, VP8SegmentInfo* const dqm, uint8_t left_y[16],
+		uint8_t top_y[20], uint8_t top_left_y, int x, int y) {
+  const int lambda = dqm->lambda_i16_;
+  const int tlambda = dqm->tlambda_;
+  uint8_t YPred[4][16*16];
+  int16_t tmp[16][16], dc_tmp[16], dc_out[16];
+  uint8_t tmp_src[16], tmp_pred[16];
+  int found = 0;
+  int mode, n, i, j;
+
+#pragma HLS ARRAY_PARTITION variable=YPred complete dim=0
+#pragma HLS ARRAY_PARTITION variable=tmp complete dim=0
+#pragma HLS ARRAY_PARTITION variable=dc_tmp complete dim=1
+#pragma HLS ARRAY_PARTITION variable=dc_out complete dim=1
+
+  DCMode_16(YPred[0], left_y, top_y, x, y);
+  TrueMotion_16(YPred[1], left_y, top_y, top_left_y, x, y);
+  VerticalPred_16(YPred[2], top_y);
+  HorizontalPred_16(YPred[3], left_y);
+
+  for (mode = NUM_PRED_MODES - 1; mode >= 0; --mode) {
+    VP8ModeScore rd_tmp;
+    int zero = 1;
+    for (n = 0; n < 16; ++n) {
+#pragma HLS unroll
+      const int off = (n & 3) * 4 + (n >> 2) * 4 * 16;
+      for (j = 0; j < 4; ++j) {
+#pragma HLS unroll
+        for (i = 0; i < 4; ++i) {
+#pragma HLS unroll
+          tmp_src[j * 4 + i] = Yin[off + j * 16 + i];
+          tmp_pred[j * 4 + i] = YPred[mode][off + j * 16 + i];
+        }
+      }
+      VP8FTransform(tmp_src, tmp_pred, tmp[n]);
+      dc_tmp[n] = tmp[n][0];
+      zero &= IsZeroBlock(tmp[n], &dqm->y1_, 1);
+    }
+    VP8FTransformWHT(dc_tmp, dc_out);
+    zero &= IsZeroBlock(dc_out, &dqm->y2_, 0);
+    if (!zero) continue;
+
+    rd_tmp.D = GetSSE16x16(Yin, YPred[mode]);
+    rd_tmp.SD = tlambda * Disto16x16_C(Yin, YPred[mode], kWeightY);
+    rd_tmp.H = VP8FixedCostsI16[mode];
+    rd_tmp.R = 0;
+    rd_tmp.nz = 0;
+    SetRDScore(lambda, &rd_tmp);
+    // same order and tie-break as PickBestIntra16()
+    if (!found || rd_tmp.score <= rd->score) {
+      found = 1;
+      rd->mode_i16 = mode;
+      CopyScore(rd, &rd_tmp);
+    }
+  }
+  if (!found) return 0;
+
+  SetRDScore(dqm->lambda_mode_, rd);
+  Copy_256_uint8(Yout, YPred[rd->mode_i16]);
+  for (n = 0; n < 16; ++n) {
+#pragma HLS unroll
+    rd->y_dc_levels[n] = 0;
+    for (i = 0; i < 16; ++i) {
+#pragma HLS unroll
+      rd->y_ac_levels[n][i] = 0;
+    }
+  }
+  return 1;
+}
+#endif  // VP8_SKIP_PREPASS
+
+int VP8Decimate_snap(uint8_t Yin[16*16], uint8_t Yout16[16*16], uint8_t Yout4[16*16],
 		VP8SegmentInfo* const dqm, uint8_t UVin[8*16], uint8_t UVout[8*16], uint8_t* is_skipped,
 		uint8_t left_y[16], uint8_t top_y[20], uint8_t top_left_y, uint8_t* mbtype, uint8_t left_u[8], 
 		uint8_t top_u[8], uint8_t top_left_u,uint8_t left_v[8], uint8_t top_v[8], uint8_t top_left_v, 
-		int x, int y, VP8ModeScore* const rd, DError top_derr[1024], DError left_derr) {
+		int x, int y, VP8ModeScore* const rd, DError top_derr[MAX_MB_W], DError left_derr,
+		uint8_t top_nz[9], uint8_t left_nz[9], uint8_t top_modes_i4[4],
+		uint8_t left_modes_i4[4], const VP8CostLUT* const costs) {
 //#pragma HLS ARRAY_PARTITION variable=Yin complete dim=1
 //#pragma HLS ARRAY_PARTITION variable=Yout16 complete dim=1
 //#pragma HLS ARRAY_PARTITION variable=Yout4 complete dim=1
@@ -1793,6 +2849,8 @@ void VP8Decimate_snap(uint8_t Yin[16*16], uint8_t Yout16[16*16], uint8_t Yout4[1
   VP8ModeScore rd_i16;
   VP8ModeScore rd_i4;
   VP8ModeScore rd_uv;
+  int i4_blocks;
+  int i;
   
   rd_i4.nz = 0;
   
@@ -1805,13 +2863,28 @@ void VP8Decimate_snap(uint8_t Yin[16*16], uint8_t Yout16[16*16], uint8_t Yout4[1
 
   // We can perform predictions for Luma16x16 and Chroma8x8 already.
   // Luma4x4 predictions needs to be done as-we-go.
+  // Intra16 goes before Intra4: its score bounds the Intra4 search.
 
-  PickBestIntra4(dqm, Yin, Yout4, &rd_i4, left_y, top_left_y, top_y);
-
-  PickBestIntra16(Yin, Yout16, &rd_i16, dqm, left_y, top_y, top_left_y, x, y);
-
+  // Chroma goes first: with VP8_SKIP_PREPASS, an all-zero chroma lets the
+  // skip pre-pass bypass the Intra16 and Intra4 searches.
   PickBestUV(dqm, UVin, UVout, &rd_uv, top_derr, left_derr, left_u, top_u,
-		  top_left_u, left_v, top_v, top_left_v, x,  y);
+		  top_left_u, left_v, top_v, top_left_v, x,  y, top_nz, left_nz, costs);
+
+#if VP8_SKIP_PREPASS
+  if (rd_uv.nz == 0 && PickSkipIntra16(Yin, Yout16, &rd_i16, dqm, left_y,
+		  top_y, top_left_y, x, y)) {
+    rd_i4.score = MAX_COST;
+    i4_blocks = 0;
+  } else
+#endif
+  {
+    PickBestIntra16(Yin, Yout16, &rd_i16, dqm, left_y, top_y, top_left_y, x, y,
+		    top_nz, left_nz, costs);
+
+    i4_blocks = PickBestIntra4(dqm, Yin, Yout4, &rd_i4, left_y, top_left_y,
+		    top_y, top_nz, left_nz, top_modes_i4, left_modes_i4, costs,
+		    rd_i16.score);
+  }
 
   if (rd_i4.score >= rd_i16.score) {
 	*mbtype = 1;
@@ -1822,19 +2895,417 @@ void VP8Decimate_snap(uint8_t Yin[16*16], uint8_t Yout16[16*16], uint8_t Yout4[1
     *mbtype = 0;
     rd->nz = (rd_i4.nz & 0x0000ffff) | (rd_uv.nz & 0x00ff0000);
 	Copy_16x16_int16(rd->y_ac_levels, rd_i4.y_ac_levels);
+	Copy_16_uint8(rd->modes_i4, rd_i4.modes_i4);
   }
 
   CopyUVLevel(rd->uv_levels, rd_uv.uv_levels);
   //CopyUVderr(rd->derr, rd_uv.derr);//can be disable ?? 
-  Copy_16_uint8(rd->modes_i4, rd_i4.modes_i4);
   Copy_16_int16(rd->y_dc_levels, rd_i16.y_dc_levels);
 
   rd->mode_i16 = rd_i16.mode_i16;
   rd->mode_uv = rd_uv.mode_uv;
 
   *is_skipped = (rd->nz == 0);
+
+  // non-zero contexts of the neighbours, see VP8IteratorBytesToNz()
+  for (i = 0; i < 4; ++i) {
+#pragma HLS unroll
+	top_nz[i] = (rd->nz >> (12 + i)) & 1;
+	left_nz[i] = (rd->nz >> (3 + 4 * i)) & 1;
+  }
+  for (i = 0; i < 2; ++i) {
+#pragma HLS unroll
+	top_nz[4 + i] = (rd->nz >> (18 + i)) & 1;
+	top_nz[6 + i] = (rd->nz >> (22 + i)) & 1;
+	left_nz[4 + i] = (rd->nz >> (17 + 2 * i)) & 1;
+	left_nz[6 + i] = (rd->nz >> (21 + 2 * i)) & 1;
+  }
+  if (*mbtype == 1) {   // the DC context only moves through i16 macroblocks
+	top_nz[8] = left_nz[8] = (rd->nz >> 24) & 1;
+  }
+  // 4x4 mode contexts of the neighbours, see VP8SetIntra16Mode()
+  for (i = 0; i < 4; ++i) {
+#pragma HLS unroll
+	top_modes_i4[i] = (*mbtype == 1) ? rd->mode_i16 : rd->modes_i4[12 + i];
+	left_modes_i4[i] = (*mbtype == 1) ? rd->mode_i16 : rd->modes_i4[3 + 4 * i];
+  }
+  return i4_blocks;
+}
+
+//------------------------------------------------------------------------------
+// Trellis quantization of the final decision (RD_OPT_TRELLIS)
+//
+// VP8Trellis_snap() runs once per macroblock, after VP8Decimate_snap(), on the
+// winning luma mode only: the mode search and its kernels are left as they
+// are and the stage can be given its own block (or thread) downstream of the
+// decision. Chroma and the Intra16 DCs keep the levels of the decision, as in
+// libwebp (DO_TRELLIS_UV is off there too). The in-loop trellis of
+// RD_OPT_TRELLIS_ALL is not modeled, so method 6 codes as method 5.
+
+// If a coefficient was quantized to a value Q (using a neutral bias), the
+// levels in [Q-MIN_DELTA, Q+MAX_DELTA] are tested. Negative ones are not.
+#define MIN_DELTA 0   // how much lower level to try
+#define MAX_DELTA 1   // how much higher
+#define NUM_NODES (MIN_DELTA + 1 + MAX_DELTA)
+
+#define BIAS(b)  ((b) << (QFIX - 8))
+
+// Weights of the coefficient errors in the trellis distortion.
+static const uint16_t kWeightTrellis[16] = {
+  30, 27, 19, 11, 27, 24, 17, 10, 19, 17, 12, 8, 11, 10, 8, 6
+};
+
+typedef struct {
+  int8_t prev;     // best previous node
+  int8_t sign;     // sign of coeff_i
+  int16_t level;   // level
+} TrellisNode;
+
+static score_t RDScoreTrellis(int lambda, score_t rate, score_t distortion) {
+  return rate * lambda + RD_DISTO_MULT * distortion;
+}
+
+// Same as TrellisQuantizeBlock() of libwebp, with fixed trip counts: the rate
+// of a level is read from 'costs' with the context left by the level chosen
+// for the previous node, instead of a pointer to the cost row. 'in' is
+// replaced by the dequantized coefficients, as by QuantizeBlock_C(). For
+// i16-AC blocks (type 0), in[0] is left untouched and out[0] is zero.
+static int TrellisQuantizeBlock(int16_t in[16], int16_t out[16], int ctx0,
+		int type, const VP8Matrix* const mtx, int lambda,
+		const VP8CostLUT* const costs) {
+#pragma HLS inline off
+  const int first = (type == 0) ? 1 : 0;
+  const int thresh = mtx->q_[1] * mtx->q_[1] / 4;
+  TrellisNode nodes[16][NUM_NODES];
+  score_t ss_score[NUM_NODES], prev_score[NUM_NODES];
+  uint8_t ss_ctx[NUM_NODES], prev_ctx[NUM_NODES];  // context of the next level
+  int best_path[3] = { -1, -1, -1 };   // best-last/best-level/best-previous
+  score_t best_score;
+  int n, m, p, last, nz = 0;
+#pragma HLS ARRAY_PARTITION variable=nodes complete dim=2
+#pragma HLS ARRAY_PARTITION variable=ss_score complete dim=1
+#pragma HLS ARRAY_PARTITION variable=prev_score complete dim=1
+#pragma HLS ARRAY_PARTITION variable=ss_ctx complete dim=1
+#pragma HLS ARRAY_PARTITION variable=prev_ctx complete dim=1
+
+  // position of the last interesting coefficient: we don't need to go past
+  // the next one without losing much.
+  last = first - 1;
+  for (n = 0; n < 16; ++n) {
+#pragma HLS unroll
+    const int j = kZigzag[n];
+    if (n >= first && in[j] * in[j] > thresh) last = n;
+  }
+  if (last < 15) ++last;
+
+  // 'skip' score. This is the max score one can do.
+  best_score = RDScoreTrellis(lambda, costs->eob_[type][kBands[first]][ctx0], 0);
+
+  // source node
+  for (m = 0; m < NUM_NODES; ++m) {
+#pragma HLS unroll
+    const score_t rate =
+        (ctx0 == 0) ? costs->not_eob_[type][kBands[first]][ctx0] : 0;
+    ss_score[m] = RDScoreTrellis(lambda, rate, 0);
+    ss_ctx[m] = ctx0;
+  }
+
+  // traverse the trellis
+  for (n = 0; n < 16; ++n) {
+#pragma HLS pipeline
+    if (n >= first && n <= last) {
+      const int j = kZigzag[n];
+      const uint32_t Q = mtx->q_[j];
+      const uint32_t iQ = mtx->iq_[j];
+      // the sign of the _original_ coeff is kept, so levels stay positive
+      const int sign = (in[j] < 0);
+      const uint32_t coeff0 = (sign ? -in[j] : in[j]) + mtx->sharpen_[j];
+      int level0 = QUANTDIV(coeff0, iQ, BIAS(0x00));   // neutral bias
+      int thresh_level = QUANTDIV(coeff0, iQ, BIAS(0x80));
+      if (thresh_level > MAX_LEVEL) thresh_level = MAX_LEVEL;
+      if (level0 > MAX_LEVEL) level0 = MAX_LEVEL;
+
+      for (m = 0; m < NUM_NODES; ++m) {
+#pragma HLS unroll
+        prev_score[m] = ss_score[m];
+        prev_ctx[m] = ss_ctx[m];
+      }
+
+      // test all alternate level values around level0
+      for (m = 0; m < NUM_NODES; ++m) {
+#pragma HLS unroll
+        const int level = level0 + m - MIN_DELTA;
+        const int ctx = (level > 2) ? 2 : level;
+        score_t best_cur_score, score;
+        int best_prev;
+
+        ss_ctx[m] = ctx;
+        if (level < 0 || level > thresh_level) {
+          ss_score[m] = MAX_COST;   // dead node
+          continue;
+        }
+        // best non-dead predecessor. Dead ones can't win, their score is
+        // MAX_COST.
+        best_cur_score = prev_score[0] + RDScoreTrellis(lambda,
+            LevelCost(costs->level_[type][kBands[n]][prev_ctx[0]], level), 0);
+        best_prev = 0;
+        for (p = 1; p < NUM_NODES; ++p) {
+#pragma HLS unroll
+          score = prev_score[p] + RDScoreTrellis(lambda,
+              LevelCost(costs->level_[type][kBands[n]][prev_ctx[p]], level), 0);
+          if (score < best_cur_score) {
+            best_cur_score = score;
+            best_prev = p;
+          }
+        }
+        {
+          // distortion = sum of (|coeff_i| - level_i * Q_i)^2, weighted
+          const int new_error = coeff0 - level * Q;
+          const int delta_error =
+              kWeightTrellis[j] * (new_error * new_error - coeff0 * coeff0);
+          best_cur_score += RDScoreTrellis(lambda, 0, delta_error);
+        }
+        nodes[n][m].sign = sign;
+        nodes[n][m].level = level;
+        nodes[n][m].prev = best_prev;
+        ss_score[m] = best_cur_score;
+
+        // best terminal node, and thus best entry in the graph
+        if (level != 0 && best_cur_score < best_score) {
+          const score_t last_pos_cost =
+              (n < 15) ? costs->eob_[type][kBands[n + 1]][ctx] : 0;
+          score = best_cur_score + RDScoreTrellis(lambda, last_pos_cost, 0);
+          if (score < best_score) {
+            best_score = score;
+            best_path[0] = n;           // best eob position
+            best_path[1] = m;           // best node index
+            best_path[2] = best_prev;   // best predecessor
+          }
+        }
+      }
+    }
+  }
+
+  // unwind the best path. The best-prev of the terminal node is not
+  // necessarily the one of the non-terminal node, hence best_path[2].
+  m = best_path[1];
+  for (n = 15; n >= 0; --n) {
+#pragma HLS pipeline
+    const int j = kZigzag[n];
+    if (n < first) {
+      out[n] = 0;
+    } else if (n > best_path[0]) {
+      out[n] = 0;
+      in[j] = 0;
+    } else {
+      const TrellisNode* const node = &nodes[n][m];
+      out[n] = node->sign ? -node->level : node->level;
+      nz |= node->level;
+      in[j] = out[n] * mtx->q_[j];
+      m = (n == best_path[0]) ? best_path[2] : node->prev;
+    }
+  }
+  return (nz != 0);
+}
+
+// Intra16: the AC levels of 'mode' are trellis-quantized in the contexts
+// 'tnz'/'lnz', updated as the blocks go. The DCs are quantized as in
+// ReconstructIntra16().
+static int TrellisIntra16(uint8_t YPred[16*16], uint8_t Ysrc[16*16],
+		uint8_t Yout[16*16], int16_t y_ac_levels[16][16],
+		int16_t y_dc_levels[16], const VP8SegmentInfo* const dqm,
+		uint8_t tnz[4], uint8_t lnz[4], const VP8CostLUT* const costs) {
+  int nz = 0;
+  int n, i, j;
+  int16_t tmp[16][16], dc_tmp[16], tmp_dc[16];
+  uint8_t tmp_src[16][16], tmp_pred[16][16], tmp_out[16][16];
+  const uint16_t VP8Scan[16] = {  // Luma
+    0 +  0 * 16,  4 +  0 * 16, 8 +  0 * 16, 12 +  0 * 16,
+    0 +  4 * 16,  4 +  4 * 16, 8 +  4 * 16, 12 +  4 * 16,
+    0 +  8 * 16,  4 +  8 * 16, 8 +  8 * 16, 12 +  8 * 16,
+    0 + 12 * 16,  4 + 12 * 16, 8 + 12 * 16, 12 + 12 * 16,
+  };
+#pragma HLS ARRAY_PARTITION variable=tmp_src complete dim=0
+#pragma HLS ARRAY_PARTITION variable=tmp_pred complete dim=0
+#pragma HLS ARRAY_PARTITION variable=tmp_out complete dim=0
+#pragma HLS ARRAY_PARTITION variable=tmp complete dim=0
+#pragma HLS ARRAY_PARTITION variable=VP8Scan complete dim=1
+
+  for (n = 0; n < 16; n++) {
+#pragma HLS unroll
+    for (j = 0; j < 4; j++) {
+#pragma HLS unroll
+      for (i = 0; i < 4; i++) {
+#pragma HLS unroll
+        tmp_src[n][j * 4 + i] = Ysrc[VP8Scan[n] + j * 16 + i];
+        tmp_pred[n][j * 4 + i] = YPred[VP8Scan[n] + j * 16 + i];
+      }
+    }
+  }
+  for (n = 0; n < 16; n++) {
+#pragma HLS unroll
+    VP8FTransform(tmp_src[n], tmp_pred[n], tmp[n]);
+    tmp_dc[n] = tmp[n][0];
+  }
+  VP8FTransformWHT(tmp_dc, dc_tmp);
+  nz |= VP8EncQuantizeBlock(dc_tmp, y_dc_levels, &dqm->y2_) << 24;
+
+  // the contexts chain the blocks: no unrolling here
+  for (n = 0; n < 16; n++) {
+    const int x = n & 3, y = n >> 2;
+    const int non_zero = TrellisQuantizeBlock(tmp[n], y_ac_levels[n],
+        tnz[x] + lnz[y], 0, &dqm->y1_, dqm->lambda_trellis_i16_, costs);
+    tnz[x] = lnz[y] = non_zero;
+    nz |= non_zero << n;
+  }
+
+  VP8TransformWHT(dc_tmp, tmp_dc);
+  for (n = 0; n < 16; n++) {
+#pragma HLS unroll
+    tmp[n][0] = tmp_dc[n];
+    VP8ITransform(tmp_pred[n], tmp[n], tmp_out[n]);
+  }
+  for (n = 0; n < 16; n++) {
+#pragma HLS unroll
+    for (j = 0; j < 4; j++) {
+#pragma HLS unroll
+      for (i = 0; i < 4; i++) {
+#pragma HLS unroll
+        Yout[VP8Scan[n] + j * 16 + i] = tmp_out[n][j * 4 + i];
+      }
+    }
+  }
+  return nz;
+}
+
+// Intra4: the sub-blocks are predicted again from their trellis-quantized
+// neighbours, with the modes of the decision.
+static int TrellisIntra4(uint8_t Yin[16*16], uint8_t Yout[16*16],
+		int16_t y_ac_levels[16][16], const uint8_t modes_i4[16],
+		const VP8SegmentInfo* const dqm, uint8_t y_left[16],
+		uint8_t y_top_left, uint8_t y_top[20], uint8_t tnz[4], uint8_t lnz[4],
+		const VP8CostLUT* const costs) {
+  uint8_t blocks[16][16];
+  uint8_t left[4], top_left, top[4], top_right[4];
+  uint8_t top_mem[16];
+  uint8_t src[16][16];
+  uint8_t tmp_pred[NUM_BMODES][16];
+  int16_t tmp[16];
+  int nz = 0;
+  int i, j, n, i4_;
+  const uint16_t VP8Scan[16] = {  // Luma
+    0 +  0 * 16,  4 +  0 * 16, 8 +  0 * 16, 12 +  0 * 16,
+    0 +  4 * 16,  4 +  4 * 16, 8 +  4 * 16, 12 +  4 * 16,
+    0 +  8 * 16,  4 +  8 * 16, 8 +  8 * 16, 12 +  8 * 16,
+    0 + 12 * 16,  4 + 12 * 16, 8 + 12 * 16, 12 + 12 * 16,
+  };
+#pragma HLS ARRAY_PARTITION variable=left complete dim=1
+#pragma HLS ARRAY_PARTITION variable=top complete dim=1
+#pragma HLS ARRAY_PARTITION variable=top_right complete dim=1
+#pragma HLS ARRAY_PARTITION variable=top_mem complete dim=1
+#pragma HLS ARRAY_PARTITION variable=VP8Scan complete dim=1
+#pragma HLS ARRAY_PARTITION variable=src complete dim=0
+#pragma HLS ARRAY_PARTITION variable=blocks complete dim=0
+#pragma HLS ARRAY_PARTITION variable=tmp_pred complete dim=0
+
+  top_left = y_top_left;
+  for (i = 0; i < 4; i++) {
+#pragma HLS unroll
+    left[i] = y_left[i];
+    top[i] = y_top[i];
+    top_right[i] = y_top[4 + i];
+  }
+  for (n = 0; n < 16; n++) {
+#pragma HLS unroll
+    for (j = 0; j < 4; j++) {
+#pragma HLS unroll
+      for (i = 0; i < 4; i++) {
+#pragma HLS unroll
+        src[n][j * 4 + i] = Yin[VP8Scan[n] + j * 16 + i];
+      }
+    }
+  }
+
+  for (i4_ = 0; i4_ < 16; i4_++) {
+    const int x = i4_ & 3, y = i4_ >> 2;
+    int non_zero;
+    Intra4Preds_C(tmp_pred, left, top_left, top, top_right);
+    VP8FTransform(src[i4_], tmp_pred[modes_i4[i4_]], tmp);
+    non_zero = TrellisQuantizeBlock(tmp, y_ac_levels[i4_], tnz[x] + lnz[y],
+        3, &dqm->y1_, dqm->lambda_trellis_i4_, costs);
+    VP8ITransform(tmp_pred[modes_i4[i4_]], tmp, blocks[i4_]);
+    tnz[x] = lnz[y] = non_zero;
+    nz |= non_zero << i4_;
+    VP8IteratorRotateI4(y_left, y_top_left, y_top, i4_, top_mem,
+        blocks, left, &top_left, top, top_right);
+  }
+
+  for (n = 0; n < 16; n++) {
+#pragma HLS unroll
+    for (j = 0; j < 4; j++) {
+#pragma HLS unroll
+      for (i = 0; i < 4; i++) {
+#pragma HLS unroll
+        Yout[VP8Scan[n] + j * 16 + i] = blocks[n][j * 4 + i];
+      }
+    }
+  }
+  return nz;
+}
+
+void VP8Trellis_snap(uint8_t Yin[16*16], uint8_t Yout16[16*16], uint8_t Yout4[16*16],
+		VP8SegmentInfo* const dqm, uint8_t* is_skipped, uint8_t left_y[16],
+		uint8_t top_y[20], uint8_t top_left_y, uint8_t mbtype, int x, int y,
+		VP8ModeScore* const rd, const uint8_t mb_top_nz[4],
+		const uint8_t mb_left_nz[4], uint8_t top_nz[9], uint8_t left_nz[9],
+		const VP8CostLUT* const costs) {
+  uint8_t tnz[4], lnz[4];
+  int nz;
+  int i;
+
+  for (i = 0; i < 4; ++i) {
+#pragma HLS unroll
+    tnz[i] = mb_top_nz[i];
+    lnz[i] = mb_left_nz[i];
+  }
+  if (mbtype == 1) {
+    uint8_t YPred[16*16];
+#pragma HLS ARRAY_PARTITION variable=YPred complete dim=1
+    switch (rd->mode_i16) {
+    case 0:
+      DCMode_16(YPred, left_y, top_y, x, y);
+      break;
+    case 1:
+      TrueMotion_16(YPred, left_y, top_y, top_left_y, x, y);
+      break;
+    case 2:
+      VerticalPred_16(YPred, top_y);
+      break;
+    default:
+      HorizontalPred_16(YPred, left_y);
+      break;
+    }
+    nz = TrellisIntra16(YPred, Yin, Yout16, rd->y_ac_levels, rd->y_dc_levels,
+        dqm, tnz, lnz, costs);
+  } else {
+    nz = TrellisIntra4(Yin, Yout4, rd->y_ac_levels, rd->modes_i4, dqm,
+        left_y, top_left_y, top_y, tnz, lnz, costs);
+  }
+  rd->nz = (rd->nz & 0x00ff0000) | nz;
+  *is_skipped = (rd->nz == 0);
+
+  // the luma contexts left by VP8Decimate_snap() are those of the decision
+  for (i = 0; i < 4; ++i) {
+#pragma HLS unroll
+    top_nz[i] = tnz[i];
+    left_nz[i] = lnz[i];
+  }
 }
 
+#undef MIN_DELTA
+#undef MAX_DELTA
+#undef NUM_NODES
+
 #define VP8_SSIM_KERNEL 3
 
 // hat-shaped filter. Sum of coefficients is equal to 16.
@@ -1848,7 +3319,13 @@ typedef struct {
   uint32_t xxm, xym, yym;  // sum(w_i * x_i * x_i), etc.
 } VP8DistoStats;
 
-static double SSIMCalculation(
+// fden is brought under this bound before the division, so that
+// fnum << VP8_SSIM_FIX can't overflow (fnum <= fden).
+#define SSIM_MAX_DEN (1ULL << (63 - VP8_SSIM_FIX))
+
+// Same as the double version of libwebp, but the final ratio fnum / fden is
+// returned with VP8_SSIM_FIX fractional bits.
+static uint32_t SSIMCalculation(
     const VP8DistoStats* const stats, uint32_t N  /*num samples*/) {
   const uint32_t w2 =  N * N;
   const uint32_t C1 = 20 * w2;
@@ -1864,21 +3341,28 @@ static double SSIMCalculation(
     // we descale by 8 to prevent overflow during the fnum/fden multiply.
     const uint64_t num_S = (2 * (uint64_t)(sxy < 0 ? 0 : sxy) + C2) >> 8;
     const uint64_t den_S = (sxx + syy + C2) >> 8;
-    const uint64_t fnum = (2 * xmym + C1) * num_S;
-    const uint64_t fden = (xmxm + ymym + C1) * den_S;
-    const double r = (double)fnum / fden;
-    return r;
+    uint64_t fnum = (2 * xmym + C1) * num_S;
+    uint64_t fden = (xmxm + ymym + C1) * den_S;   // < 2^59
+    int shift;
+    for (shift = 0; shift < 24; ++shift) {
+#pragma HLS unroll
+      if (fden >= SSIM_MAX_DEN) {
+        fnum >>= 1;
+        fden >>= 1;
+      }
+    }
+    return (uint32_t)((fnum << VP8_SSIM_FIX) / fden);
   }
-  return 1.;   // area is too dark to contribute meaningfully
+  return 1u << VP8_SSIM_FIX;   // area is too dark to contribute meaningfully
 }
 
-static double VP8SSIMFromStatsClipped(const VP8DistoStats* const stats) {
+static uint32_t VP8SSIMFromStatsClipped(const VP8DistoStats* const stats) {
   return SSIMCalculation(stats, stats->w);
 }
 
-static double SSIMGetClipped_C(const uint8_t* src1, int stride1,
-                               const uint8_t* src2, int stride2,
-                               int xo, int yo, int W, int H) {
+static uint32_t SSIMGetClipped_C(const uint8_t* src1, int stride1,
+                                 const uint8_t* src2, int stride2,
+                                 int xo, int yo, int W, int H) {
   VP8DistoStats stats = { 0, 0, 0, 0, 0, 0 };
   const int ymin = (yo - VP8_SSIM_KERNEL < 0) ? 0 : yo - VP8_SSIM_KERNEL;
   const int ymax = (yo + VP8_SSIM_KERNEL > H - 1) ? H - 1
@@ -1906,21 +3390,55 @@ static double SSIMGetClipped_C(const uint8_t* src1, int stride1,
   return VP8SSIMFromStatsClipped(&stats);
 }
 
-static double GetMBSSIM(uint8_t Yin[16*16], uint8_t Yout4[16*16],
-		uint8_t UVin[8*16], uint8_t UVout[8*16]) {
-  int x, y;
-  double sum = 0.;
+#define NUM_SSIM_WINDOWS (10 * 10 + 2 * 6 * 6)
+
+// True if the window of SSIMGetClipped_C() centered on (xo, yo) holds a
+// changed sample. 'rows' has one bit per column, the plane starts at bit
+// 'col_offset'.
+static int WindowChanged(const uint16_t* rows, int xo, int yo, int W, int H,
+                         int col_offset) {
+  const int ymin = (yo - VP8_SSIM_KERNEL < 0) ? 0 : yo - VP8_SSIM_KERNEL;
+  const int ymax = (yo + VP8_SSIM_KERNEL > H - 1) ? H - 1
+                                                  : yo + VP8_SSIM_KERNEL;
+  const int xmin = (xo - VP8_SSIM_KERNEL < 0) ? 0 : xo - VP8_SSIM_KERNEL;
+  const int xmax = (xo + VP8_SSIM_KERNEL > W - 1) ? W - 1
+                                                  : xo + VP8_SSIM_KERNEL;
+  const uint32_t cols = ((1u << (xmax - xmin + 1)) - 1) << (xmin + col_offset);
+  uint32_t any = 0;
+  int y;
+  for (y = ymin; y <= ymax; ++y) any |= rows[y];
+  return (any & cols) != 0;
+}
+
+// Sum of the SSIM of 100 luma and 2 x 36 chroma windows, each in [0, 1] with
+// VP8_SSIM_FIX fractional bits: fits in 32 bits. Only the windows holding a
+// sample flagged in 'changed_y' / 'changed_uv' (U in the low byte, V in the
+// high one) are recomputed, the others are taken from 'ssim'.
+static uint32_t UpdateMBSSIM(const uint8_t Yin[16*16],
+		const uint8_t Yout[16*16], const uint8_t UVin[8*16],
+		const uint8_t UVout[8*16], const uint16_t changed_y[16],
+		const uint16_t changed_uv[8], uint32_t ssim[NUM_SSIM_WINDOWS]) {
+  int x, y, n = 0;
+  uint32_t sum = 0;
 
   // compute SSIM in a 10 x 10 window
   for (y = VP8_SSIM_KERNEL; y < 16 - VP8_SSIM_KERNEL; y++) {
-    for (x = VP8_SSIM_KERNEL; x < 16 - VP8_SSIM_KERNEL; x++) {
-      sum += SSIMGetClipped_C(Yin, 16, Yout4, 16, x, y, 16, 16);
+    for (x = VP8_SSIM_KERNEL; x < 16 - VP8_SSIM_KERNEL; x++, n++) {
+      if (WindowChanged(changed_y, x, y, 16, 16, 0)) {
+        ssim[n] = SSIMGetClipped_C(Yin, 16, Yout, 16, x, y, 16, 16);
+      }
+      sum += ssim[n];
     }
   }
   for (x = 1; x < 7; x++) {
-    for (y = 1; y < 7; y++) {
-      sum += SSIMGetClipped_C(UVin, 16, UVout, 16, x, y, 8, 8);
-      sum += SSIMGetClipped_C(UVin + 8, 16, UVout + 8, 16, x, y, 8, 8);
+    for (y = 1; y < 7; y++, n += 2) {
+      if (WindowChanged(changed_uv, x, y, 8, 8, 0)) {
+        ssim[n] = SSIMGetClipped_C(UVin, 16, UVout, 16, x, y, 8, 8);
+      }
+      if (WindowChanged(changed_uv, x, y, 8, 8, 8)) {
+        ssim[n + 1] = SSIMGetClipped_C(UVin + 8, 16, UVout + 8, 16, x, y, 8, 8);
+      }
+      sum += ssim[n] + ssim[n + 1];
     }
   }
   return sum;
@@ -1947,8 +3465,8 @@ static void DoFilter2_C(uint8_t* p, int step) {
   const int a2 = (tmp3 < -16) ? -16 : (tmp3 > 15) ? 15 : tmp3;
   const int tmp4 = p0 + a2;
   const int tmp5 = q0 - a1;
-  p[-step] = (tmp4 < -128) ? -128 : (tmp4 > 127) ? 127 : tmp4;
-  p[    0] = (tmp5 < -128) ? -128 : (tmp5 > 127) ? 127 : tmp5;
+  p[-step] = (tmp4 < 0) ? 0 : (tmp4 > 255) ? 255 : tmp4;
+  p[    0] = (tmp5 < 0) ? 0 : (tmp5 > 255) ? 255 : tmp5;
 }
 
 static void DoFilter4_C(uint8_t* p, int step) {
@@ -1963,10 +3481,10 @@ static void DoFilter4_C(uint8_t* p, int step) {
   const int tmp5 = p0 + a2;
   const int tmp6 = q0 - a1;
   const int tmp7 = q1 - a3;
-  p[-2*step] = (tmp4 < -128) ? -128 : (tmp4 > 127) ? 127 : tmp4;
-  p[-  step] = (tmp5 < -128) ? -128 : (tmp5 > 127) ? 127 : tmp5;
-  p[      0] = (tmp6 < -128) ? -128 : (tmp6 > 127) ? 127 : tmp6;
-  p[   step] = (tmp7 < -128) ? -128 : (tmp7 > 127) ? 127 : tmp7;
+  p[-2*step] = (tmp4 < 0) ? 0 : (tmp4 > 255) ? 255 : tmp4;
+  p[-  step] = (tmp5 < 0) ? 0 : (tmp5 > 255) ? 255 : tmp5;
+  p[      0] = (tmp6 < 0) ? 0 : (tmp6 > 255) ? 255 : tmp6;
+  p[   step] = (tmp7 < 0) ? 0 : (tmp7 > 255) ? 255 : tmp7;
 }
 
 static int Hev(const uint8_t* p, int step, int thresh) {
@@ -2019,37 +3537,105 @@ static void VFilter8i_C(uint8_t* u, uint8_t* v, int stride,
   FilterLoop24_C(v + 4 * stride, stride, 1, 8, thresh, ithresh, hev_thresh);
 }
 
-static void DoFilter(uint8_t Yout4[16*16], uint8_t UVin[8*16], int level) {
+// Filters the inner edges of the reconstructed macroblock 'Yout' / 'UVout'
+// into 'Y' / 'UV'.
+static void DoFilter(const uint8_t Yout[16*16], const uint8_t UVout[8*16],
+		uint8_t Y[16*16], uint8_t UV[8*16], int level) {
   const int ilevel = (level < 1) ? 1 : level;
   const int limit = 2 * level + ilevel;
-  uint8_t Y[16*16],UV[8*16];
-
+  const int hev_thresh = (level >= 40) ? 2 : (level >= 15) ? 1 : 0;
   uint8_t* const y_dst = Y;
   uint8_t* const u_dst = UV;
   uint8_t* const v_dst = UV + 8;
-
-  // copy current block to yuv_out2_
   int i;
-  for(i = 0; i < 256; i++){
-	  Y[i] = Yout4[i];
+
+  for (i = 0; i < 256; i++) {
+	Y[i] = Yout[i];
   }
-  for(i = 0; i < 128; i++){
-	  UV[i] = UVin[i];
+  for (i = 0; i < 128; i++) {
+	UV[i] = UVout[i];
   }
 
-  const int hev_thresh = (level >= 40) ? 2 : (level >= 15) ? 1 : 0;
   HFilter16i_C(y_dst, 16, limit, ilevel, hev_thresh);
   HFilter8i_C(u_dst, v_dst, 16, limit, ilevel, hev_thresh);
   VFilter16i_C(y_dst, 16, limit, ilevel, hev_thresh);
   VFilter8i_C(u_dst, v_dst, 16, limit, ilevel, hev_thresh);
+}
+
+// True if an inner edge of 'Y' / 'UV' passes NeedsFilter2_C() at 'level'.
+// The thresholds grow with the level, and an edge only sees filtered samples
+// if an earlier one was filtered: when this is false, DoFilter() leaves the
+// macroblock untouched at 'level' and at every lower level.
+static int NeedsInnerFilter(const uint8_t Y[16*16], const uint8_t UV[8*16],
+                            int level) {
+  const int ilevel = (level < 1) ? 1 : level;
+  const int thresh2 = 2 * (2 * level + ilevel) + 1;
+  int i, k;
+  for (k = 4; k < 16; k += 4) {
+    for (i = 0; i < 16; ++i) {
+      if (NeedsFilter2_C(Y + i * 16 + k, 1, thresh2, ilevel) ||
+          NeedsFilter2_C(Y + k * 16 + i, 16, thresh2, ilevel)) {
+        return 1;
+      }
+    }
+  }
+  for (i = 0; i < 8; ++i) {
+    if (NeedsFilter2_C(UV + i * 16 + 4, 1, thresh2, ilevel) ||
+        NeedsFilter2_C(UV + i * 16 + 12, 1, thresh2, ilevel) ||
+        NeedsFilter2_C(UV + 4 * 16 + i, 16, thresh2, ilevel) ||
+        NeedsFilter2_C(UV + 4 * 16 + 8 + i, 16, thresh2, ilevel)) {
+      return 1;
+    }
+  }
+  return 0;
+}
 
+// Flags the samples of 'Y' / 'UV' that differ from 'Yprev' / 'UVprev', one
+// bit per column, and copies them over. Returns false if nothing changed.
+static int DiffBlock(const uint8_t Y[16*16], const uint8_t UV[8*16],
+		uint8_t Yprev[16*16], uint8_t UVprev[8*16],
+		uint16_t changed_y[16], uint16_t changed_uv[8]) {
+  uint16_t any = 0;
+  int x, y;
+  for (y = 0; y < 16; ++y) {
+    uint16_t bits = 0;
+    for (x = 0; x < 16; ++x) {
+#pragma HLS unroll
+      bits |= (uint16_t)(Y[y * 16 + x] != Yprev[y * 16 + x]) << x;
+      Yprev[y * 16 + x] = Y[y * 16 + x];
+    }
+    changed_y[y] = bits;
+    any |= bits;
+  }
+  for (y = 0; y < 8; ++y) {
+    uint16_t bits = 0;
+    for (x = 0; x < 16; ++x) {
+#pragma HLS unroll
+      bits |= (uint16_t)(UV[y * 16 + x] != UVprev[y * 16 + x]) << x;
+      UVprev[y * 16 + x] = UV[y * 16 + x];
+    }
+    changed_uv[y] = bits;
+    any |= bits;
+  }
+  return (any != 0);
 }
 
+// The levels are scored incrementally: each one is compared to the previous
+// one and only the SSIM windows holding a changed sample are recomputed.
+// Macroblocks with no inner edge to filter at the highest level tried skip
+// the filtering altogether. Both give the same stats as a full search.
 void VP8StoreFilterStats_snap(VP8SegmentInfo* const dqm, LFStats_My lf_stats,
 		uint8_t Yin[16*16], uint8_t Yout16[16*16], uint8_t Yout4[16*16],
 		uint8_t UVin[8*16], uint8_t UVout[8*16], uint8_t mbtype, uint8_t skip) {
-  int d;
+  int d, i;
   const int level0 = dqm->fstrength_;
+  const uint8_t* const Yout = (mbtype == 1) ? Yout16 : Yout4;
+  uint8_t Y[16*16], UV[8*16];           // filtered
+  uint8_t Yprev[16*16], UVprev[8*16];   // last scored
+  uint16_t changed_y[16], changed_uv[8];
+  uint32_t ssim[NUM_SSIM_WINDOWS];
+  uint32_t sum, best;
+  int top_level, filtered;
 
   // explore +/-quant range of values around level0
   const int delta_min = -dqm->quant_;
@@ -2066,15 +3652,256 @@ void VP8StoreFilterStats_snap(VP8SegmentInfo* const dqm, LFStats_My lf_stats,
   if (mbtype == 1 && skip) return;
 
   // Always try filter level  zero
-  lf_stats[0] += GetMBSSIM(Yin, Yout4, UVin, UVout);
+  for (i = 0; i < 16; i++) changed_y[i] = 0xffff;
+  for (i = 0; i < 8; i++) changed_uv[i] = 0xffff;
+  for (i = 0; i < 256; i++) Yprev[i] = Yout[i];
+  for (i = 0; i < 128; i++) UVprev[i] = UVout[i];
+  sum = best = UpdateMBSSIM(Yin, Yout, UVin, UVout, changed_y, changed_uv,
+                            ssim);
+  lf_stats[0] += sum;
+
+  top_level = level0 + delta_max;
+  if (top_level >= MAX_LF_LEVELS) top_level = MAX_LF_LEVELS - 1;
+  filtered = NeedsInnerFilter(Yout, UVout, top_level);
 
   for (d = delta_min; d <= delta_max; d += step_size) {
     const int level = level0 + d;
     if (level <= 0 || level >= MAX_LF_LEVELS) {
       continue;
     }
-    DoFilter(Yout4, UVin, level);
-    lf_stats[level] += GetMBSSIM(Yin, Yout4, UVin, UVout);
+    if (filtered) {
+      DoFilter(Yout, UVout, Y, UV, level);
+      if (DiffBlock(Y, UV, Yprev, UVprev, changed_y, changed_uv)) {
+        sum = UpdateMBSSIM(Yin, Y, UVin, UV, changed_y, changed_uv, ssim);
+      }
+    }
+    lf_stats[level] += sum;
+#if VP8_LF_SEARCH_TOL >= 0
+    if ((uint64_t)sum + VP8_LF_SEARCH_TOL < best) break;  // past the peak
+    if (sum > best) best = sum;
+#endif
+  }
+}
+
+#ifndef __SYNTHESIS__
+int VP8IteratorAllocLines_snap(DATA* data_it, int mb_w) {
+  // one allocation for all the lines, sized for this picture only
+  const size_t line_size =
+      (size_t)mb_w * (16 + 8 + 8 + sizeof(DError) + 2 * sizeof(uint16_t));
+  uint8_t* const mem = (uint8_t*)calloc(line_size, 1);
+  if (mem == NULL) return 0;
+  data_it->mem_top_y = (uint8_t(*)[16])mem;
+  data_it->mem_top_u = (uint8_t(*)[8])(mem + mb_w * 16);
+  data_it->mem_top_v = (uint8_t(*)[8])(mem + mb_w * (16 + 8));
+  data_it->top_derr = (DError*)(mem + mb_w * (16 + 8 + 8));
+  data_it->mem_top_nz =
+      (uint16_t*)(mem + mb_w * (16 + 8 + 8 + sizeof(DError)));
+  data_it->mem_top_modes_i4 = data_it->mem_top_nz + mb_w;
+  return 1;
+}
+
+void VP8IteratorFreeLines_snap(DATA* data_it) {
+  free(data_it->mem_top_y);
+  data_it->mem_top_y = NULL;
+  data_it->mem_top_u = NULL;
+  data_it->mem_top_v = NULL;
+  data_it->top_derr = NULL;
+  data_it->mem_top_nz = NULL;
+  data_it->mem_top_modes_i4 = NULL;
+}
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef WEBP_SNAP_USE_SIMD
+static int DspSupported(int dsp) {
+  __builtin_cpu_init();
+  switch (dsp) {
+    case VP8_SNAP_DSP_SSE2: return __builtin_cpu_supports("sse2");
+    case VP8_SNAP_DSP_SSE41: return __builtin_cpu_supports("sse4.1");
+    case VP8_SNAP_DSP_AVX2: return __builtin_cpu_supports("avx2");
+    default: return 1;
+  }
+}
+#endif
+
+int VP8DspInit_snap(int max_dsp) {
+  int dsp = VP8_SNAP_DSP_C;
+#ifdef WEBP_SNAP_USE_SIMD
+  int i;
+  for (i = VP8_SNAP_DSP_SSE2; i <= max_dsp && i < VP8_SNAP_DSP_NUM; ++i) {
+    if (DspSupported(i)) dsp = i;
+  }
+  kDsp = &kDspKernels[dsp];
+#else
+  (void)max_dsp;
+#endif
+  return dsp;
+}
+
+#ifdef WEBP_SNAP_USE_SIMD
+static int SelfTestRandom(uint32_t* const seed, int range) {
+  *seed = *seed * 1103515245u + 12345u;
+  return (int)((*seed >> 8) % (uint32_t)range);
+}
+
+// Same matrix as the encoder's ExpandMatrix() for the quantizers dc_q / ac_q.
+static void SelfTestMatrix(VP8Matrix* const m, int dc_q, int ac_q,
+                           int bias, int sharpen) {
+  static const uint8_t kFreqSharpening[16] = {
+    0,  30, 60, 90, 30, 60, 90, 90, 60, 90, 90, 90, 90, 90, 90, 90
+  };
+  int i;
+  for (i = 0; i < 16; ++i) {
+    const int q = (i == 0) ? dc_q : ac_q;
+    m->q_[i] = q;
+    m->iq_[i] = (1 << QFIX) / q;
+    m->bias_[i] = bias << (QFIX - 8);
+    m->zthresh_[i] = ((1 << QFIX) - 1 - m->bias_[i]) / m->iq_[i];
+    m->sharpen_[i] = sharpen ? (kFreqSharpening[i] * q) >> 11 : 0;
+  }
+}
+
+// Runs one random block through the whole chain of both kernel sets.
+// Returns the name of the first kernel whose output differs, or NULL.
+static const char* SelfTestBlock(const VP8DspKernels* const ref,
+                                 const VP8DspKernels* const dsp,
+                                 uint32_t* const seed) {
+  const int amplitude = 1 + SelfTestRandom(seed, 256);
+  const int full_range = (SelfTestRandom(seed, 4) == 0);
+  uint8_t src[16], pred[16], dst_ref[16], dst[16];
+  int16_t in_ref[16], in[16], out_ref[16], out[16];
+  int16_t wht_ref[16], wht[16];
+  VP8Matrix m;
+  int i, nz_ref, nz;
+
+  SelfTestMatrix(&m, 4 + SelfTestRandom(seed, 154), 4 + SelfTestRandom(seed, 154),
+                 96 + SelfTestRandom(seed, 20), SelfTestRandom(seed, 2));
+  for (i = 0; i < 16; ++i) {
+    const int v = SelfTestRandom(seed, 256);
+    const int p = v + SelfTestRandom(seed, 2 * amplitude + 1) - amplitude;
+    src[i] = v;
+    pred[i] = (p < 0) ? 0 : (p > 255) ? 255 : p;
+  }
+  ref->ftransform_(src, pred, in_ref);
+  dsp->ftransform_(src, pred, in);
+  if (memcmp(in_ref, in, sizeof(in))) return "FTransform";
+
+  nz_ref = ref->quantize_block_(in_ref, out_ref, &m);
+  nz = dsp->quantize_block_(in, out, &m);
+  if (nz_ref != nz || memcmp(out_ref, out, sizeof(out)) ||
+      memcmp(in_ref, in, sizeof(in))) {
+    return "QuantizeBlock";
+  }
+  ref->itransform_(pred, in_ref, dst_ref);
+  dsp->itransform_(pred, in, dst);
+  if (memcmp(dst_ref, dst, sizeof(dst))) return "ITransform";
+
+  // The Walsh-Hadamard kernels and the quantizer are also exact on any input.
+  for (i = 0; i < 16; ++i) {
+    in_ref[i] = full_range ? SelfTestRandom(seed, 65536) - 32768
+                           : SelfTestRandom(seed, 4096) - 2048;
+  }
+  ref->ftransform_wht_(in_ref, wht_ref);
+  dsp->ftransform_wht_(in_ref, wht);
+  if (memcmp(wht_ref, wht, sizeof(wht))) return "FTransformWHT";
+
+  if (full_range) memcpy(wht_ref, in_ref, sizeof(wht_ref));
+  memcpy(wht, wht_ref, sizeof(wht));
+  nz_ref = ref->quantize_block_(wht_ref, out_ref, &m);
+  nz = dsp->quantize_block_(wht, out, &m);
+  if (nz_ref != nz || memcmp(out_ref, out, sizeof(out)) ||
+      memcmp(wht_ref, wht, sizeof(wht))) {
+    return "QuantizeBlock";
+  }
+  if (full_range) memcpy(wht_ref, in_ref, sizeof(wht_ref));
+  ref->transform_wht_(wht_ref, out_ref);
+  dsp->transform_wht_(wht_ref, out);
+  if (memcmp(out_ref, out, sizeof(out))) return "TransformWHT";
+  return NULL;
+}
+#endif
+
+int VP8DspSelfTest_snap(void) {
+  int ok = 1;
+#ifdef WEBP_SNAP_USE_SIMD
+  static const char* const kDspNames[VP8_SNAP_DSP_NUM] = {
+    "C", "SSE2", "SSE4.1", "AVX2"
+  };
+  int dsp;
+  for (dsp = VP8_SNAP_DSP_SSE2; dsp < VP8_SNAP_DSP_NUM; ++dsp) {
+    uint32_t seed = 0x9e3779b9u;
+    int n;
+    if (!DspSupported(dsp)) continue;
+    for (n = 0; n < 200000; ++n) {
+      const char* const kernel =
+          SelfTestBlock(&kDspKernels[VP8_SNAP_DSP_C], &kDspKernels[dsp], &seed);
+      if (kernel != NULL) {
+        fprintf(stderr, "%s %s differs from C (block #%d)\n",
+                kDspNames[dsp], kernel, n);
+        ok = 0;
+        break;
+      }
+    }
+  }
+#endif
+  return ok;
+}
+#endif
+
+static void LoadTopNz(DATA* data_it, int x) {
+  const int nz = (data_it->y > 0) ? data_it->mem_top_nz[x] : 0;
+  int i;
+  for (i = 0; i < 9; ++i) {
+#pragma HLS unroll
+	data_it->top_nz[i] = (nz >> i) & 1;
+  }
+}
+
+static void StoreTopNz(DATA* data_it) {
+  int nz = 0;
+  int i;
+  for (i = 0; i < 9; ++i) {
+#pragma HLS unroll
+	nz |= data_it->top_nz[i] << i;
+  }
+  data_it->mem_top_nz[data_it->x] = nz;
+}
+
+static void ResetLeftNz(DATA* data_it) {
+  int i;
+  for (i = 0; i < 9; ++i) {
+#pragma HLS unroll
+	data_it->left_nz[i] = 0;
+  }
+}
+
+// The 4x4 modes of the bottom row are packed 4 bits each. Outside the picture,
+// the context is B_DC_PRED.
+static void LoadTopModes(DATA* data_it, int x) {
+  const int modes = (data_it->y > 0) ? data_it->mem_top_modes_i4[x] : 0;
+  int i;
+  for (i = 0; i < 4; ++i) {
+#pragma HLS unroll
+	data_it->top_modes_i4[i] = (modes >> (4 * i)) & 15;
+  }
+}
+
+static void StoreTopModes(DATA* data_it) {
+  int modes = 0;
+  int i;
+  for (i = 0; i < 4; ++i) {
+#pragma HLS unroll
+	modes |= data_it->top_modes_i4[i] << (4 * i);
+  }
+  data_it->mem_top_modes_i4[data_it->x] = modes;
+}
+
+static void ResetLeftModes(DATA* data_it) {
+  int i;
+  for (i = 0; i < 4; ++i) {
+#pragma HLS unroll
+	data_it->left_modes_i4[i] = B_DC_PRED;
   }
 }
 
@@ -2113,6 +3940,8 @@ void VP8IteratorSaveBoundary_snap(DATA* data_it) {
 	data_it->top_left_y = 129;
 	data_it->top_left_u = 129;
 	data_it->top_left_v = 129;
+	ResetLeftNz(data_it);
+	ResetLeftModes(data_it);
   }
 
   if (data_it->y < data_it->mb_h - 1) {  // top mem
@@ -2123,6 +3952,8 @@ void VP8IteratorSaveBoundary_snap(DATA* data_it) {
 	  	mem_top_u[data_it->x][i] = uvsrc[7 * 16 + i];
 	  	mem_top_v[data_it->x][i] = uvsrc[7 * 16 + i + 8];
 	}
+	StoreTopNz(data_it);
+	StoreTopModes(data_it);
   }
 
   int tmp = (data_it->x < data_it->mb_w - 1) ? data_it->x + 1 : 0;
@@ -2141,11 +3972,25 @@ void VP8IteratorSaveBoundary_snap(DATA* data_it) {
 	  	data_it->top_u[i] = 127;
 	  	data_it->top_v[i] = 127;
 	}
+	for (i = 0; i < 9; ++i) {
+		data_it->top_nz[i] = 0;
+	}
+	for (i = 0; i < 4; ++i) {
+		data_it->top_modes_i4[i] = B_DC_PRED;
+	}
   }
   else {  // top
+	const int nz = data_it->mem_top_nz[tmp];
+	const int modes = data_it->mem_top_modes_i4[tmp];
 	for (i = 0; i < 16; ++i) {
 		data_it->top_y[i] = top_y_tmp2[i];
 	}
+	for (i = 0; i < 9; ++i) {
+		data_it->top_nz[i] = (nz >> i) & 1;
+	}
+	for (i = 0; i < 4; ++i) {
+		data_it->top_modes_i4[i] = (modes >> (4 * i)) & 15;
+	}
 	for (i = 0; i < 8; ++i) {
 		data_it->top_u[i] = mem_top_u[tmp][i];
 		data_it->top_v[i] = mem_top_v[tmp][i];
@@ -2162,6 +4007,89 @@ void VP8IteratorSaveBoundary_snap(DATA* data_it) {
   }
 }
 
+void VP8IteratorLoadTop_snap(DATA* data_it) {
+  const int x = data_it->x;
+  uint8_t(*mem_top_y)[16] = data_it->mem_top_y;
+  uint8_t(*mem_top_u)[8] = data_it->mem_top_u;
+  uint8_t(*mem_top_v)[8] = data_it->mem_top_v;
+  int i;
+
+  // top-left (before 'top'!): the previous macroblock's top is still loaded
+  if (x == 0) {
+	data_it->top_left_y = (data_it->y > 0) ? 129 : 127;
+	data_it->top_left_u = (data_it->y > 0) ? 129 : 127;
+	data_it->top_left_v = (data_it->y > 0) ? 129 : 127;
+  } else {
+	data_it->top_left_y = data_it->top_y[15];
+	data_it->top_left_u = data_it->top_u[7];
+	data_it->top_left_v = data_it->top_v[7];
+  }
+
+  LoadTopNz(data_it, x);
+  LoadTopModes(data_it, x);
+  if (data_it->y == 0) {
+	for (i = 0; i < 20; ++i) {
+		data_it->top_y[i] = 127;
+	}
+	for (i = 0; i < 8; ++i) {
+		data_it->top_u[i] = 127;
+		data_it->top_v[i] = 127;
+	}
+  } else {
+	for (i = 0; i < 16; ++i) {
+		data_it->top_y[i] = mem_top_y[x][i];
+	}
+	for (i = 0; i < 8; ++i) {
+		data_it->top_u[i] = mem_top_u[x][i];
+		data_it->top_v[i] = mem_top_v[x][i];
+	}
+	for (i = 0; i < 4; ++i) {
+		data_it->top_y[16 + i] = (x == data_it->mb_w - 1) ? data_it->top_y[15]
+		                                                  : mem_top_y[x + 1][i];
+	}
+  }
+}
+
+void VP8IteratorStoreBoundary_snap(DATA* data_it) {
+  const uint8_t* const ysrc = data_it->mbtype ? data_it->Yout16 : data_it->Yout4;
+  const uint8_t* const uvsrc = data_it->UVout;
+  uint8_t(*mem_top_y)[16] = data_it->mem_top_y;
+  uint8_t(*mem_top_u)[8] = data_it->mem_top_u;
+  uint8_t(*mem_top_v)[8] = data_it->mem_top_v;
+  int i;
+
+  if (data_it->x < data_it->mb_w - 1) {   // left
+	for (i = 0; i < 16; ++i) {
+		data_it->left_y[i] = ysrc[15 + i * 16];
+	}
+	for (i = 0; i < 8; ++i) {
+		data_it->left_u[i] = uvsrc[7 + i * 16];
+		data_it->left_v[i] = uvsrc[15 + i * 16];
+	}
+  } else {
+	for (i = 0; i < 16; ++i) {
+		data_it->left_y[i] = 129;
+	}
+	for (i = 0; i < 8; ++i) {
+		data_it->left_u[i] = 129;
+		data_it->left_v[i] = 129;
+	}
+	ResetLeftNz(data_it);
+	ResetLeftModes(data_it);
+  }
+
+  if (data_it->y < data_it->mb_h - 1) {  // top mem
+	for (i = 0; i < 16; ++i) {
+		mem_top_y[data_it->x][i] = ysrc[15 * 16 + i];
+	}
+	for (i = 0; i < 8; ++i) {
+		mem_top_u[data_it->x][i] = uvsrc[7 * 16 + i];
+		mem_top_v[data_it->x][i] = uvsrc[7 * 16 + i + 8];
+	}
+	StoreTopNz(data_it);
+	StoreTopModes(data_it);
+  }
+}
 
 int VP8IteratorNext_snap(DATA* data_it) {
   int i, j;
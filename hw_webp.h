@@ -1,3 +1,6 @@
+#ifndef HW_WEBP_H_
+#define HW_WEBP_H_
+
 #include <stdint.h>
 
 typedef int64_t score_t;     // type used for scores, rate, distortion
@@ -41,22 +44,86 @@ typedef struct {
   score_t i4_penalty_;   // penalty for using Intra4
 } VP8SegmentInfo;
 
-enum { MAX_LF_LEVELS = 64,       // Maximum loop filter level
+enum { NUM_MB_SEGMENTS = 4,      // Number of quantizer / filter segments
+       MAX_LF_LEVELS = 64,       // Maximum loop filter level
        MAX_VARIABLE_LEVEL = 67,  // last (inclusive) level with variable cost
-       MAX_LEVEL = 2047          // max level (note: max codable is 2047 + 67)
+       MAX_LEVEL = 2047,         // max level (note: max codable is 2047 + 67)
+       // Probabilities
+       NUM_TYPES = 4,   // 0: i16-AC,  1: i16-DC,  2:chroma-AC,  3:i4-AC
+       NUM_BANDS = 8,
+       NUM_CTX = 3
      };
 
-typedef double LFStats_My[MAX_LF_LEVELS];
+// Rate model of the mode decision: residual costs indexed by coefficient
+// type, band, context and level clamped to MAX_VARIABLE_LEVEL. The host
+// refreshes it from the token probabilities once per frame, the part of the
+// level cost that doesn't depend on them is a ROM in the kernel.
+typedef struct {
+  uint16_t level_[NUM_TYPES][NUM_BANDS][NUM_CTX][MAX_VARIABLE_LEVEL + 1];
+  uint16_t eob_[NUM_TYPES][NUM_BANDS][NUM_CTX];      // VP8BitCost(0, p[0])
+  uint16_t not_eob_[NUM_TYPES][NUM_BANDS][NUM_CTX];  // VP8BitCost(1, p[0])
+} VP8CostLUT;
+
+// Autofilter stats: per filter level, sum of the SSIM of the filtered
+// macroblocks. Each SSIM is in [0, 1] with VP8_SSIM_FIX fractional bits.
+#define VP8_SSIM_FIX 24
+typedef uint64_t LFStats_My[MAX_LF_LEVELS];
+
+// Early exit of the filter-level search of VP8StoreFilterStats_snap(): the
+// search of a macroblock stops once its SSIM sum falls more than this below
+// the best level tried so far (same fixed point as LFStats_My). The levels
+// past that point miss the contribution of the macroblock, so the stats are
+// only approximate. Negative: exhaustive search, same stats as libwebp.
+#ifndef VP8_LF_SEARCH_TOL
+#define VP8_LF_SEARCH_TOL -1
+#endif
+
+// Intra4 mode pre-screening: for each sub-block, PickBestIntra4() ranks the
+// 10 predictions by the SATD of their residual plus the mode cost and only
+// reconstructs and scores the best VP8_I4_TOPK of them, in [1, 10]. 10:
+// exhaustive search, same decisions as libwebp.
+#ifndef VP8_I4_TOPK
+#define VP8_I4_TOPK 10
+#endif
+#if VP8_I4_TOPK < 1 || VP8_I4_TOPK > 10
+#error "VP8_I4_TOPK must be in [1, 10]"
+#endif
+
+// Early termination of the Intra4 search: the Intra16 score is computed first
+// and PickBestIntra4() stops as soon as the running score of its sub-blocks
+// reaches it, which can't change the decision. The latency of the kernel then
+// depends on the data. 0: all 16 sub-blocks are always scored, for a fixed
+// schedule.
+#ifndef VP8_I4_EARLY_EXIT
+#define VP8_I4_EARLY_EXIT 1
+#endif
+
+// Skip pre-pass: when the chroma quantizes to all-zero, VP8Decimate_snap()
+// first checks the 4 Intra16 predictions against the zthresh_ of the forward
+// transforms. If one of them quantizes to all-zero, the macroblock is coded
+// as a skipped Intra16 one without running the Intra16 and Intra4 searches,
+// which may have found a better coded mode. 0: full search, same decisions as
+// libwebp.
+#ifndef VP8_SKIP_PREPASS
+#define VP8_SKIP_PREPASS 0
+#endif
 
 typedef int8_t DError[2 /* u/v */][2 /* top or left */];
 
+// Widest picture, in macroblocks, handled by the synthesizable kernel. The C
+// model allocates its line memories from mb_w at run time instead.
+#ifndef MAX_MB_W
+#define MAX_MB_W 1024
+#endif
+
 typedef struct DATA {
 		uint8_t Yin[16*16];
 		uint8_t UVin[8*16];
 		uint8_t Yout16[16*16];
 		uint8_t Yout4[16*16];
 		uint8_t UVout[8*16];
-		VP8SegmentInfo dqm;
+		VP8SegmentInfo dqm[NUM_MB_SEGMENTS];   // resident, indexed by 'segment'
+		uint8_t segment;                       // segment of the current macroblock
 		uint8_t left_y[16];
 		uint8_t top_y[20];
 		uint8_t top_left_y;
@@ -73,26 +140,97 @@ typedef struct DATA {
 		int mb_w;
 		int mb_h;
 		int count_down;
-		LFStats_My lf_stats;
+		LFStats_My lf_stats[NUM_MB_SEGMENTS];
 		uint8_t top_y_tmp1[16];
 		uint8_t top_y_tmp2[16];
-		uint8_t mem_top_y[1024][16];
-		uint8_t mem_top_u[1024][8];
-		uint8_t mem_top_v[1024][8];
-		DError top_derr[1024];
+#ifdef __SYNTHESIS__
+		uint8_t mem_top_y[MAX_MB_W][16];
+		uint8_t mem_top_u[MAX_MB_W][8];
+		uint8_t mem_top_v[MAX_MB_W][8];
+		DError top_derr[MAX_MB_W];
+		uint16_t mem_top_nz[MAX_MB_W];
+		uint16_t mem_top_modes_i4[MAX_MB_W];
+#else
+		uint8_t (*mem_top_y)[16];   // line memories, mb_w entries each
+		uint8_t (*mem_top_u)[8];
+		uint8_t (*mem_top_v)[8];
+		DError* top_derr;
+		uint16_t* mem_top_nz;       // packed top_nz[] of the row above
+		uint16_t* mem_top_modes_i4; // packed top_modes_i4[] of the row above
+#endif
 		DError left_derr;
+		uint8_t top_nz[9];          // non-zero contexts, as in VP8EncIterator
+		uint8_t left_nz[9];
+		uint8_t top_modes_i4[4];    // 4x4 mode contexts, as in VP8EncIterator
+		uint8_t left_modes_i4[4];   // preds_[] (the i16 mode for i16 blocks)
 		} DATA;
 
+#ifndef __SYNTHESIS__
+// Allocates the line memories of 'data_it' for a picture 'mb_w' macroblocks
+// wide. Returns false in case of memory error.
+int VP8IteratorAllocLines_snap(DATA* data_it, int mb_w);
+
+void VP8IteratorFreeLines_snap(DATA* data_it);
+
+// Transform/quantization kernel variants, from slowest to fastest.
+typedef enum {
+  VP8_SNAP_DSP_C = 0,
+  VP8_SNAP_DSP_SSE2,
+  VP8_SNAP_DSP_SSE41,
+  VP8_SNAP_DSP_AVX2,
+  VP8_SNAP_DSP_NUM
+} VP8SnapDsp;
+
+// Selects the fastest kernels supported by the CPU, but no faster than
+// 'max_dsp'. Without a call, the plain C kernels are used. Not thread-safe:
+// call it before the first VP8Decimate_snap(). Returns the variant selected.
+int VP8DspInit_snap(int max_dsp);
+
+// Checks every variant supported by the CPU against the C kernels on random
+// blocks and reports mismatches on stderr. Returns false on mismatch.
+int VP8DspSelfTest_snap(void);
+#endif
+
 void VP8IteratorSaveBoundary_snap(DATA* data_it);
 
+// Random-access variant of VP8IteratorSaveBoundary_snap() for schedulers that
+// don't visit the macroblocks in raster order: LoadTop fetches the top context
+// of (x, y) from the line memories, StoreBoundary exports the left context and
+// the bottom samples of the current macroblock.
+void VP8IteratorLoadTop_snap(DATA* data_it);
+
+void VP8IteratorStoreBoundary_snap(DATA* data_it);
+
 int VP8IteratorNext_snap(DATA* data_it);
 
-void VP8Decimate_snap(uint8_t Yin[16*16], uint8_t Yout16[16*16], uint8_t Yout4[16*16],
+// Returns the number of Intra4 sub-blocks scored, in [0, 16], which sets the
+// latency of the kernel. 0: the VP8_SKIP_PREPASS pre-pass coded the
+// macroblock as skipped, without the Intra16 and Intra4 searches.
+int VP8Decimate_snap(uint8_t Yin[16*16], uint8_t Yout16[16*16], uint8_t Yout4[16*16],
 		VP8SegmentInfo* const dqm, uint8_t UVin[8*16], uint8_t UVout[8*16], uint8_t* is_skipped,
 		uint8_t left_y[16], uint8_t top_y[20], uint8_t top_left_y, uint8_t* mbtype, uint8_t left_u[8], 
 		uint8_t top_u[8], uint8_t top_left_u,uint8_t left_v[8], uint8_t top_v[8], uint8_t top_left_v, 
-		int x, int y, VP8ModeScore* const rd, DError top_derr[1024], DError left_derr);
+		int x, int y, VP8ModeScore* const rd, DError top_derr[MAX_MB_W], DError left_derr,
+		uint8_t top_nz[9], uint8_t left_nz[9], uint8_t top_modes_i4[4],
+		uint8_t left_modes_i4[4], const VP8CostLUT* const costs);
 		
+// Trellis quantization of the decision of VP8Decimate_snap() (RD_OPT_TRELLIS):
+// the luma levels of the winning mode are quantized again for the best rate /
+// distortion trade-off, and Yout16 or Yout4, rd->nz and *is_skipped updated.
+// Method 6 (RD_OPT_TRELLIS_ALL) gets the same single pass as method 5: the
+// mode search itself never runs the trellis.
+// 'mb_top_nz' / 'mb_left_nz' are the luma contexts of the macroblock, as they
+// were before VP8Decimate_snap(). Its luma contexts in 'top_nz' / 'left_nz'
+// are replaced by those of the new levels.
+void VP8Trellis_snap(uint8_t Yin[16*16], uint8_t Yout16[16*16], uint8_t Yout4[16*16],
+		VP8SegmentInfo* const dqm, uint8_t* is_skipped, uint8_t left_y[16],
+		uint8_t top_y[20], uint8_t top_left_y, uint8_t mbtype, int x, int y,
+		VP8ModeScore* const rd, const uint8_t mb_top_nz[4],
+		const uint8_t mb_left_nz[4], uint8_t top_nz[9], uint8_t left_nz[9],
+		const VP8CostLUT* const costs);
+
 void VP8StoreFilterStats_snap(VP8SegmentInfo* const dqm, LFStats_My lf_stats,
 		uint8_t Yin[16*16], uint8_t Yout16[16*16], uint8_t Yout4[16*16],
 		uint8_t UVin[8*16], uint8_t UVout[8*16], uint8_t mbtype, uint8_t skip);
+
+#endif  // HW_WEBP_H_
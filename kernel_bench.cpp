@@ -0,0 +1,473 @@
+// kernel_bench: per-kernel microbenchmarks of the DSP building blocks of the
+// encoders, the webp.cpp reference, the hw_webp.cpp C model (with its SIMD
+// variants) and the hls_test.cpp HLS source, side by side.
+//
+// Each kernel variant is timed twice on the same inputs:
+//  - hot: a handful of inputs cycled over, everything stays in L1,
+//  - cold: one input per 4 KB state, spread over a large buffer (64 MB by
+//    default) and visited in a random order, so that most calls miss the
+//    caches. The first pass over the buffer is not timed.
+// The reported MB/s count the samples and coefficients read and written by
+// one call. A variant's inputs are converted to its native layout (BPS stride
+// for webp.cpp, packed blocks for the others) before the clock starts.
+//
+// Build (the indented lines continue the command above them):
+//   g++ -O2 -w kernel_bench.cpp kernel_bench_snap.cpp
+//       -o kernel_bench -ljpeg -lpng -lpthread
+// With the hls_test.cpp variants (needs the ap_int.h header of the HLS tools):
+//   g++ -O2 -w -DKERNEL_BENCH_HLS -I<hls>/include kernel_bench.cpp
+//       kernel_bench_snap.cpp kernel_bench_hls.cpp
+//       -o kernel_bench -ljpeg -lpng -lpthread
+
+#define main WebPReferenceMain   // the reference CLI is not used here
+#include "webp.cpp"
+#undef main
+
+#include "bench_util.h"
+#include "kernel_bench.h"
+
+//------------------------------------------------------------------------------
+// webp.cpp kernels
+
+typedef struct {
+  uint8_t yuv_p[PRED_SIZE_ENC];   // predictions, at the I16DC16... offsets
+  uint8_t src[16 * BPS];
+  uint8_t ref[16 * BPS];
+  uint8_t dst[16 * BPS];
+  uint8_t i4_boundary[5 + 8];     // left[3..0], top-left, top[0..7]
+  uint8_t y_left[1 + 16];         // top-left, left[0..15]
+  uint8_t y_top[16];
+  uint8_t uv_left[32];            // top-left, left for u at 0, v at 16
+  uint8_t uv_top[16];             // top for u at 0, v at 8
+  int16_t coeffs[16];
+  int16_t out[16];
+  VP8Matrix mtx;
+  uint8_t edge[8 * 16];
+  int has_left, has_top;
+  int xo, yo;
+} RefState;
+
+typedef char kRefStateFits[(sizeof(RefState) <= BENCH_STATE_SIZE) ? 1 : -1];
+
+static void RefSetup(const BenchInput* const in, void* const state) {
+  RefState* const s = (RefState*)state;
+  int i;
+  memset(s, 0, sizeof(*s));
+  for (i = 0; i < 16; ++i) {
+    memcpy(s->src + i * BPS, in->src + i * 16, 16);
+    memcpy(s->ref + i * BPS, in->pred + i * 16, 16);
+  }
+  for (i = 0; i < 4; ++i) s->i4_boundary[i] = in->left[3 - i];
+  s->i4_boundary[4] = in->top_left;
+  memcpy(s->i4_boundary + 5, in->top, 8);   // top, top-right
+  s->y_left[0] = in->top_left;
+  memcpy(s->y_left + 1, in->left, 16);
+  memcpy(s->y_top, in->top, 16);
+  s->uv_left[0] = in->top_left_u;
+  memcpy(s->uv_left + 1, in->left_u, 8);
+  s->uv_left[16] = in->top_left_v;
+  memcpy(s->uv_left + 17, in->left_v, 8);
+  memcpy(s->uv_top, in->top_u, 8);
+  memcpy(s->uv_top + 8, in->top_v, 8);
+  memcpy(s->coeffs, in->coeffs, sizeof(s->coeffs));
+  memcpy(&s->mtx, &in->matrix, sizeof(s->mtx));
+  memcpy(s->edge, in->edge, sizeof(s->edge));
+  s->has_left = in->has_left;
+  s->has_top = in->has_top;
+  s->xo = in->xo;
+  s->yo = in->yo;
+}
+
+static uint32_t RefIntra4Preds(const void* const ctx, void* const state) {
+  RefState* const s = (RefState*)state;
+  (void)ctx;
+  Intra4Preds_C(s->yuv_p, s->i4_boundary + 5);
+  return s->yuv_p[I4HU4 + 3 * BPS + 3] + s->yuv_p[I4VR4];
+}
+
+static uint32_t RefIntra16Preds(const void* const ctx, void* const state) {
+  RefState* const s = (RefState*)state;
+  (void)ctx;
+  Intra16Preds_C(s->yuv_p, s->has_left ? s->y_left + 1 : NULL,
+                 s->has_top ? s->y_top : NULL);
+  return s->yuv_p[I16TM16 + 15 * BPS + 15] + s->yuv_p[I16DC16];
+}
+
+static uint32_t RefChromaPreds(const void* const ctx, void* const state) {
+  RefState* const s = (RefState*)state;
+  (void)ctx;
+  IntraChromaPreds_C(s->yuv_p, s->has_left ? s->uv_left + 1 : NULL,
+                     s->has_top ? s->uv_top : NULL);
+  return s->yuv_p[C8TM8 + 7 * BPS + 15] + s->yuv_p[C8DC8];
+}
+
+static uint32_t RefFTransform(const void* const ctx, void* const state) {
+  RefState* const s = (RefState*)state;
+  (void)ctx;
+  FTransform_C(s->src, s->ref, s->out);
+  return s->out[0] + s->out[15];
+}
+
+static uint32_t RefQuantizeBlock(const void* const ctx, void* const state) {
+  RefState* const s = (RefState*)state;
+  int16_t in[16];
+  (void)ctx;
+  memcpy(in, s->coeffs, sizeof(in));   // the kernel overwrites its input
+  return QuantizeBlock_C(in, s->out, &s->mtx) + s->out[0];
+}
+
+static uint32_t RefITransform(const void* const ctx, void* const state) {
+  RefState* const s = (RefState*)state;
+  (void)ctx;
+  ITransformOne(s->ref, s->coeffs, s->dst);
+  return s->dst[0] + s->dst[3 * BPS + 3];
+}
+
+static uint32_t RefDisto16x16(const void* const ctx, void* const state) {
+  const RefState* const s = (const RefState*)state;
+  (void)ctx;
+  return Disto16x16_C(s->src, s->ref, kWeightY);
+}
+
+static uint32_t RefSSE16x16(const void* const ctx, void* const state) {
+  const RefState* const s = (const RefState*)state;
+  (void)ctx;
+  return SSE16x16_C(s->src, s->ref);
+}
+
+static uint32_t RefSSE4x4(const void* const ctx, void* const state) {
+  const RefState* const s = (const RefState*)state;
+  (void)ctx;
+  return SSE4x4_C(s->src, s->ref);
+}
+
+static uint32_t RefDoFilter2(const void* const ctx, void* const state) {
+  RefState* const s = (RefState*)state;
+  int i;
+  (void)ctx;
+  for (i = 0; i < 16; ++i) DoFilter2_C(s->edge + 4 * 16 + i, 16);
+  return s->edge[3 * 16] + s->edge[4 * 16 + 15];
+}
+
+static uint32_t RefDoFilter4(const void* const ctx, void* const state) {
+  RefState* const s = (RefState*)state;
+  int i;
+  (void)ctx;
+  for (i = 0; i < 16; ++i) DoFilter4_C(s->edge + 4 * 16 + i, 16);
+  return s->edge[2 * 16] + s->edge[5 * 16 + 15];
+}
+
+static uint32_t RefSSIMGetClipped(const void* const ctx, void* const state) {
+  const RefState* const s = (const RefState*)state;
+  (void)ctx;
+  return (uint32_t)(65536. * SSIMGetClipped_C(s->src, BPS, s->ref, BPS,
+                                               s->xo, s->yo, 16, 16));
+}
+
+static int AddKernel(BenchKernel* const list, int num, BenchKernelId id,
+                     const char* const variant,
+                     void (*setup)(const BenchInput* const, void* const),
+                     uint32_t (*run)(const void* const, void* const)) {
+  if (num >= BENCH_MAX_KERNELS) return num;
+  list[num].id = id;
+  list[num].variant = variant;
+  list[num].setup = setup;
+  list[num].run = run;
+  list[num].ctx = NULL;
+  return num + 1;
+}
+
+int BenchAddRefKernels(BenchKernel* const list, int num) {
+  static const char kName[] = "webp.cpp";
+  InitTables();   // clip1[] of TrueMotion()
+  num = AddKernel(list, num, BENCH_INTRA4_PREDS, kName, RefSetup,
+                  RefIntra4Preds);
+  num = AddKernel(list, num, BENCH_INTRA16_PREDS, kName, RefSetup,
+                  RefIntra16Preds);
+  num = AddKernel(list, num, BENCH_CHROMA_PREDS, kName, RefSetup,
+                  RefChromaPreds);
+  num = AddKernel(list, num, BENCH_FTRANSFORM, kName, RefSetup, RefFTransform);
+  num = AddKernel(list, num, BENCH_QUANTIZE_BLOCK, kName, RefSetup,
+                  RefQuantizeBlock);
+  num = AddKernel(list, num, BENCH_ITRANSFORM, kName, RefSetup, RefITransform);
+  num = AddKernel(list, num, BENCH_DISTO16X16, kName, RefSetup, RefDisto16x16);
+  num = AddKernel(list, num, BENCH_SSE16X16, kName, RefSetup, RefSSE16x16);
+  num = AddKernel(list, num, BENCH_SSE4X4, kName, RefSetup, RefSSE4x4);
+  num = AddKernel(list, num, BENCH_DO_FILTER2, kName, RefSetup, RefDoFilter2);
+  num = AddKernel(list, num, BENCH_DO_FILTER4, kName, RefSetup, RefDoFilter4);
+  num = AddKernel(list, num, BENCH_SSIM_GET_CLIPPED, kName, RefSetup,
+                  RefSSIMGetClipped);
+  return num;
+}
+
+//------------------------------------------------------------------------------
+// Inputs
+
+static const struct {
+  const char* name;
+  int bytes;   // samples and coefficients read and written by one call
+} kKernelInfo[BENCH_NUM_KERNELS] = {
+  { "Intra4Preds", 13 + 10 * 16 },
+  { "Intra16Preds", 33 + 4 * 256 },
+  { "IntraChromaPreds", 2 * 17 + 8 * 64 },
+  { "FTransform", 16 + 16 + 16 * 2 },
+  { "QuantizeBlock", 16 * 2 + 16 * 2 + 16 * 2 },
+  { "ITransform", 16 + 16 * 2 + 16 },
+  { "Disto16x16", 2 * 256 },
+  { "SSE16x16", 2 * 256 },
+  { "SSE4x4", 2 * 16 },
+  { "DoFilter2", 16 * (4 + 2) },
+  { "DoFilter4", 16 * (4 + 4) },
+  { "SSIMGetClipped", 2 * 7 * 7 },
+};
+
+#define BENCH_NUM_INPUTS 256   // distinct inputs, shared by the cold states
+#define BENCH_HOT_STATES 4
+
+static int BenchNoise(uint32_t* const seed, int amplitude) {
+  return (int)(BenchRandom(seed) % (2 * amplitude + 1)) - amplitude;
+}
+
+// Flat to busy blocks, with a prediction close to the source and mostly
+// available context, as the mode search sees them.
+static void MakeInput(BenchInput* const in, uint32_t* const seed) {
+  const int base = BenchRandom(seed) & 0xff;
+  const int amplitude = 1 + BenchRandom(seed) % 64;
+  const int dx = (int)(BenchRandom(seed) % 9) - 4;
+  const int dy = (int)(BenchRandom(seed) % 9) - 4;
+  const int q = 8 + BenchRandom(seed) % 120;
+  int i;
+  memset(in, 0, sizeof(*in));
+  for (i = 0; i < 256; ++i) {
+    const int v = base + dx * (i & 15) + dy * (i >> 4) +
+                  BenchNoise(seed, amplitude);
+    in->src[i] = BenchClip(v);
+    in->pred[i] = BenchClip(v + BenchNoise(seed, amplitude / 4 + 1));
+  }
+  for (i = 0; i < 16; ++i) {
+    in->left[i] = BenchClip(base + dy * i + BenchNoise(seed, amplitude));
+  }
+  for (i = 0; i < 20; ++i) {
+    in->top[i] = BenchClip(base + dx * i + BenchNoise(seed, amplitude));
+  }
+  in->top_left = BenchClip(base + BenchNoise(seed, amplitude));
+  for (i = 0; i < 8; ++i) {
+    in->left_u[i] = BenchClip(128 + BenchNoise(seed, amplitude / 2));
+    in->top_u[i] = BenchClip(128 + BenchNoise(seed, amplitude / 2));
+    in->left_v[i] = BenchClip(128 + BenchNoise(seed, amplitude / 2));
+    in->top_v[i] = BenchClip(128 + BenchNoise(seed, amplitude / 2));
+  }
+  in->top_left_u = BenchClip(128 + BenchNoise(seed, amplitude / 2));
+  in->top_left_v = BenchClip(128 + BenchNoise(seed, amplitude / 2));
+  in->has_left = (BenchRandom(seed) % 8) != 0;
+  in->has_top = (BenchRandom(seed) % 8) != 0;
+  for (i = 0; i < 16; ++i) {
+    const int range = (amplitude * 32) >> (i >> 2);
+    in->coeffs[i] = (int16_t)BenchNoise(seed, range);
+  }
+  for (i = 0; i < 16; ++i) {
+    BenchMatrix* const m = &in->matrix;
+    m->q_[i] = (i == 0) ? q : q + q / 4;
+    m->iq_[i] = (1 << QFIX) / m->q_[i];
+    m->bias_[i] = BIAS(0x60);
+    m->zthresh_[i] = ((1 << QFIX) - 1 - m->bias_[i]) / m->iq_[i];
+    m->sharpen_[i] = (i == 0) ? 0 : (m->q_[i] * (i & 3)) >> 4;
+  }
+  {
+    // Both sides of the edge close enough for the filters to matter.
+    const int step = BenchNoise(seed, 8);
+    for (i = 0; i < 8 * 16; ++i) {
+      const int side = (i < 4 * 16) ? 0 : step;
+      in->edge[i] = BenchClip(base + side + BenchNoise(seed, 3));
+    }
+  }
+  in->xo = BenchRandom(seed) % 16;
+  in->yo = BenchRandom(seed) % 16;
+}
+
+//------------------------------------------------------------------------------
+// Timing
+
+static volatile uint32_t bench_sink;
+
+// Calls 'k' 'num_calls' times, walking the states in 'order' (NULL: in
+// sequence), and returns the elapsed time in ns.
+static double TimeCalls(const BenchKernel* const k, uint8_t* const states,
+                        int num_states, const int* const order,
+                        int num_calls) {
+  uint32_t sink = 0;
+  const double start = BenchNowNs();
+  int i, n = 0;
+  for (i = 0; i < num_calls; ++i) {
+    const int s = (order != NULL) ? order[n] : n;
+    sink += k->run(k->ctx, states + (size_t)s * BENCH_STATE_SIZE);
+    if (++n == num_states) n = 0;
+  }
+  bench_sink += sink;
+  return BenchNowNs() - start;
+}
+
+static void SetupStates(const BenchKernel* const k, uint8_t* const states,
+                        int num_states, const BenchInput* const inputs) {
+  int i;
+  for (i = 0; i < num_states; ++i) {
+    k->setup(&inputs[i % BENCH_NUM_INPUTS],
+             states + (size_t)i * BENCH_STATE_SIZE);
+  }
+}
+
+// Doubles the number of calls until they take at least 'min_ns'.
+static double TimeHot(const BenchKernel* const k, uint8_t* const states,
+                      const BenchInput* const inputs, double min_ns) {
+  int num_calls = 1024;
+  double ns;
+  SetupStates(k, states, BENCH_HOT_STATES, inputs);
+  TimeCalls(k, states, BENCH_HOT_STATES, NULL, num_calls);   // warm-up
+  while ((ns = TimeCalls(k, states, BENCH_HOT_STATES, NULL, num_calls))
+             < min_ns && num_calls < (1 << 30)) {
+    num_calls *= 2;
+  }
+  return ns / num_calls;
+}
+
+static double TimeCold(const BenchKernel* const k, uint8_t* const states,
+                       int num_states, const int* const order,
+                       const BenchInput* const inputs) {
+  SetupStates(k, states, num_states, inputs);
+  TimeCalls(k, states, num_states, order, num_states);
+  return TimeCalls(k, states, num_states, order, num_states) / num_states;
+}
+
+static double MBPerSecond(int bytes, double ns_per_call) {
+  return (ns_per_call > 0.) ? bytes * 1e3 / ns_per_call : 0.;
+}
+
+static void Help(void) {
+  int i;
+  printf("Usage:\n\n");
+  printf("   kernel_bench [options]\n\n");
+  printf("Times the DSP kernels of webp.cpp, hw_webp.cpp and hls_test.cpp\n"
+         "on the same synthetic inputs, with hot and cold caches.\n\n");
+  printf("Options:\n");
+  printf("  -kernel <string> ....... only time this kernel (repeatable)\n");
+  printf("  -time <int> ............ minimum duration of a hot measurement, "
+         "in ms (default 100)\n");
+  printf("  -cold <int> ............ size of the cold buffer in MB, 0 to skip "
+         "(default 64)\n");
+  printf("  -seed <int> ............ seed of the inputs\n");
+  printf("  -h ..................... this help\n");
+  printf("\nKernels:");
+  for (i = 0; i < BENCH_NUM_KERNELS; ++i) printf(" %s", kKernelInfo[i].name);
+  printf("\n");
+}
+
+int main(int argc, const char* argv[]) {
+  int selected[BENCH_NUM_KERNELS];
+  int num_selected = 0;
+  int time_ms = 100;
+  int cold_mb = 64;
+  uint32_t seed = 1;
+  int return_value = -1;
+  int num_kernels = 0, num_cold_states;
+  int c, i, id;
+  BenchKernel kernels[BENCH_MAX_KERNELS];
+  BenchInput* inputs = NULL;
+  uint8_t* mem = NULL;
+  uint8_t* states;
+  int* order = NULL;
+
+  memset(selected, 0, sizeof(selected));
+  for (c = 1; c < argc; ++c) {
+    int parse_error = 0;
+    if (!strcmp(argv[c], "-h") || !strcmp(argv[c], "-help")) {
+      Help();
+      return 0;
+    } else if (!strcmp(argv[c], "-kernel") && c < argc - 1) {
+      ++c;
+      for (id = 0; id < BENCH_NUM_KERNELS; ++id) {
+        if (!strcmp(argv[c], kKernelInfo[id].name)) break;
+      }
+      if (id == BENCH_NUM_KERNELS) {
+        fprintf(stderr, "Error! Unknown kernel '%s'\n", argv[c]);
+        parse_error = 1;
+      } else {
+        num_selected += !selected[id];
+        selected[id] = 1;
+      }
+    } else if (!strcmp(argv[c], "-time") && c < argc - 1) {
+      time_ms = ExUtilGetInt(argv[++c], 0, &parse_error);
+    } else if (!strcmp(argv[c], "-cold") && c < argc - 1) {
+      cold_mb = ExUtilGetInt(argv[++c], 0, &parse_error);
+    } else if (!strcmp(argv[c], "-seed") && c < argc - 1) {
+      seed = (uint32_t)ExUtilGetInt(argv[++c], 0, &parse_error);
+    } else {
+      fprintf(stderr, "Error! Unknown option '%s'\n", argv[c]);
+      parse_error = 1;
+    }
+    if (parse_error || time_ms < 0 || cold_mb < 0 || cold_mb > 4096) {
+      Help();
+      return -1;
+    }
+  }
+
+  num_kernels = BenchAddRefKernels(kernels, num_kernels);
+  num_kernels = BenchAddSnapKernels(kernels, num_kernels);
+#ifdef KERNEL_BENCH_HLS
+  num_kernels = BenchAddHlsKernels(kernels, num_kernels);
+#endif
+
+  num_cold_states = (int)(((int64_t)cold_mb << 20) / BENCH_STATE_SIZE);
+  if (num_cold_states < BENCH_HOT_STATES) num_cold_states = BENCH_HOT_STATES;
+  inputs = (BenchInput*)malloc(BENCH_NUM_INPUTS * sizeof(*inputs));
+  order = (int*)malloc(num_cold_states * sizeof(*order));
+  mem = (uint8_t*)malloc((size_t)(num_cold_states + 1) * BENCH_STATE_SIZE);
+  if (inputs == NULL || order == NULL || mem == NULL) {
+    fprintf(stderr, "Error! Out of memory.\n");
+    goto Error;
+  }
+  states = (uint8_t*)WEBP_ALIGN(mem);
+  for (i = 0; i < BENCH_NUM_INPUTS; ++i) MakeInput(&inputs[i], &seed);
+  for (i = 0; i < num_cold_states; ++i) order[i] = i;
+  for (i = num_cold_states - 1; i > 0; --i) {   // Fisher-Yates
+    const int j = BenchRandom(&seed) % (i + 1);
+    const int tmp = order[i];
+    order[i] = order[j];
+    order[j] = tmp;
+  }
+
+  printf("hot: %d states, >= %d ms per kernel; cold: %d states (%d MB), "
+         "random order\n", BENCH_HOT_STATES, time_ms,
+         cold_mb ? num_cold_states : 0, cold_mb);
+  printf("%-17s %-18s %5s %9s %9s %9s %9s %7s\n", "kernel", "variant",
+         "bytes", "hot ns", "hot MB/s", "cold ns", "cold MB/s", "speedup");
+  for (id = 0; id < BENCH_NUM_KERNELS; ++id) {
+    double first_ns = 0.;
+    if (num_selected > 0 && !selected[id]) continue;
+    for (i = 0; i < num_kernels; ++i) {
+      const BenchKernel* const k = &kernels[i];
+      const int bytes = kKernelInfo[id].bytes;
+      double hot_ns, cold_ns = 0.;
+      if (k->id != (BenchKernelId)id) continue;
+      hot_ns = TimeHot(k, states, inputs, time_ms * 1e6);
+      if (cold_mb > 0) {
+        cold_ns = TimeCold(k, states, num_cold_states, order, inputs);
+      }
+      if (first_ns == 0.) first_ns = hot_ns;
+      printf("%-17s %-18s %5d %9.2f %9.1f", kKernelInfo[id].name, k->variant,
+             bytes, hot_ns, MBPerSecond(bytes, hot_ns));
+      if (cold_mb > 0) {
+        printf(" %9.2f %9.1f", cold_ns, MBPerSecond(bytes, cold_ns));
+      } else {
+        printf(" %9s %9s", "-", "-");
+      }
+      printf(" %6.2fx\n", (hot_ns > 0.) ? first_ns / hot_ns : 0.);
+    }
+  }
+  return_value = 0;
+
+ Error:
+  free(mem);
+  free(order);
+  free(inputs);
+  return return_value;
+}
@@ -0,0 +1,84 @@
+#ifndef KERNEL_BENCH_H_
+#define KERNEL_BENCH_H_
+
+// Glue between the parts of kernel_bench: kernel_bench.cpp is built on top of
+// the webp.cpp reference encoder, kernel_bench_snap.cpp on top of hw_webp.cpp
+// and kernel_bench_hls.cpp on top of hls_test.cpp. They all define FTransform_C,
+// VP8Matrix... so they can't share a translation unit and only plain types
+// cross this header.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Same layout as VP8Matrix in all three encoders.
+typedef struct {
+  uint16_t q_[16];
+  uint16_t iq_[16];
+  uint32_t bias_[16];
+  uint32_t zthresh_[16];
+  uint16_t sharpen_[16];
+} BenchMatrix;
+
+// Input of one kernel call. Each variant converts it to the layout its kernels
+// expect before the clock starts.
+typedef struct {
+  uint8_t src[16 * 16];     // source samples, stride 16
+  uint8_t pred[16 * 16];    // prediction, close to 'src', stride 16
+  uint8_t left[16];         // luma context
+  uint8_t top[20];          // top[16..19] is the top-right of the 4x4 kernels
+  uint8_t top_left;
+  uint8_t left_u[8], top_u[8], top_left_u;
+  uint8_t left_v[8], top_v[8], top_left_v;
+  int has_left, has_top;    // context availability, i.e. x > 0 and y > 0
+  int16_t coeffs[16];       // transform coefficients
+  BenchMatrix matrix;
+  uint8_t edge[8 * 16];     // p3..q3 across a horizontal edge, 16 wide
+  int xo, yo;               // center of the SSIM window, in [0, 16)
+} BenchInput;
+
+typedef enum {
+  BENCH_INTRA4_PREDS = 0,
+  BENCH_INTRA16_PREDS,
+  BENCH_CHROMA_PREDS,
+  BENCH_FTRANSFORM,
+  BENCH_QUANTIZE_BLOCK,
+  BENCH_ITRANSFORM,
+  BENCH_DISTO16X16,
+  BENCH_SSE16X16,
+  BENCH_SSE4X4,
+  BENCH_DO_FILTER2,         // 16 positions along the edge per call
+  BENCH_DO_FILTER4,
+  BENCH_SSIM_GET_CLIPPED,   // one 7x7 window per call
+  BENCH_NUM_KERNELS
+} BenchKernelId;
+
+// Room for the native input and output of any kernel call.
+#define BENCH_STATE_SIZE 4096
+#define BENCH_MAX_KERNELS 64
+
+// One implementation of a kernel. 'setup' converts 'in' to 'state', 'run'
+// makes one call on it and returns a value depending on the result, so that
+// the call can't be optimized away. 'ctx' is passed to 'run' untouched.
+typedef struct {
+  BenchKernelId id;
+  const char* variant;
+  void (*setup)(const BenchInput* const in, void* const state);
+  uint32_t (*run)(const void* const ctx, void* const state);
+  const void* ctx;
+} BenchKernel;
+
+// Append the kernels of webp.cpp, hw_webp.cpp (with its SIMD variants
+// supported by the CPU) and hls_test.cpp to 'list', which holds 'num' of them
+// out of BENCH_MAX_KERNELS. Return the new count.
+int BenchAddRefKernels(BenchKernel* const list, int num);
+int BenchAddSnapKernels(BenchKernel* const list, int num);
+int BenchAddHlsKernels(BenchKernel* const list, int num);
+
+static inline double BenchNowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#endif  // KERNEL_BENCH_H_
@@ -0,0 +1,177 @@
+// kernel_bench: hls_test.cpp side.
+// Only built with -DKERNEL_BENCH_HLS, as hls_test.cpp needs the ap_int.h
+// header of the HLS tools. hls_test.cpp is wrapped in its own namespace since
+// it reuses the names of the hw_webp.cpp kernels without 'static'.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ap_int.h>
+
+namespace hls {
+#include "hls_test.cpp"
+}  // namespace hls
+
+#include "kernel_bench.h"
+
+typedef struct {
+  uint8_t y_pred[4][16 * 16];
+  uint8_t uv_pred[8][8 * 8];
+  uint8_t pred4[10][16];
+  uint8_t src[16 * 16];
+  uint8_t ref[16 * 16];
+  uint8_t src4[16], ref4[16], dst4[16];   // top-left 4x4 block, packed
+  uint8_t left[16], top[20], top_left;
+  uint8_t left_u[8], top_u[8], top_left_u;
+  uint8_t left_v[8], top_v[8], top_left_v;
+  int16_t coeffs[16];
+  int16_t out[16];
+  hls::VP8Matrix mtx;
+  uint8_t edge[8 * 16];
+  int x, y;
+  int xo, yo;
+} HlsState;
+
+typedef char kHlsStateFits[(sizeof(HlsState) <= BENCH_STATE_SIZE) ? 1 : -1];
+typedef char kHlsMatrix[(sizeof(hls::VP8Matrix) == sizeof(BenchMatrix)) ? 1
+                                                                      : -1];
+
+static void HlsSetup(const BenchInput* const in, void* const state) {
+  HlsState* const s = (HlsState*)state;
+  int i;
+  memset(s, 0, sizeof(*s));
+  memcpy(s->src, in->src, sizeof(s->src));
+  memcpy(s->ref, in->pred, sizeof(s->ref));
+  for (i = 0; i < 4; ++i) {
+    memcpy(s->src4 + i * 4, in->src + i * 16, 4);
+    memcpy(s->ref4 + i * 4, in->pred + i * 16, 4);
+  }
+  memcpy(s->left, in->left, sizeof(s->left));
+  memcpy(s->top, in->top, sizeof(s->top));
+  s->top_left = in->top_left;
+  memcpy(s->left_u, in->left_u, 8);
+  memcpy(s->top_u, in->top_u, 8);
+  s->top_left_u = in->top_left_u;
+  memcpy(s->left_v, in->left_v, 8);
+  memcpy(s->top_v, in->top_v, 8);
+  s->top_left_v = in->top_left_v;
+  memcpy(s->coeffs, in->coeffs, sizeof(s->coeffs));
+  memcpy(&s->mtx, &in->matrix, sizeof(s->mtx));
+  memcpy(s->edge, in->edge, sizeof(s->edge));
+  s->x = in->has_left;
+  s->y = in->has_top;
+  s->xo = in->xo;
+  s->yo = in->yo;
+}
+
+static uint32_t HlsIntra4Preds(const void* const ctx, void* const state) {
+  HlsState* const s = (HlsState*)state;
+  (void)ctx;
+  hls::Intra4Preds_C(s->pred4, s->left, s->top_left, s->top, s->top + 4);
+  return s->pred4[9][15] + s->pred4[5][0];
+}
+
+static uint32_t HlsIntra16Preds(const void* const ctx, void* const state) {
+  HlsState* const s = (HlsState*)state;
+  (void)ctx;
+  hls::Intra16Preds_C(s->y_pred, s->left, s->top, s->top_left, s->x, s->y);
+  return s->y_pred[3][255] + s->y_pred[0][0];
+}
+
+static uint32_t HlsChromaPreds(const void* const ctx, void* const state) {
+  HlsState* const s = (HlsState*)state;
+  (void)ctx;
+  hls::IntraChromaPreds_C(s->uv_pred, s->left_u, s->top_u, s->top_left_u,
+                          s->left_v, s->top_v, s->top_left_v, s->x, s->y);
+  return s->uv_pred[7][63] + s->uv_pred[0][0];
+}
+
+static uint32_t HlsFTransform(const void* const ctx, void* const state) {
+  HlsState* const s = (HlsState*)state;
+  (void)ctx;
+  hls::FTransform_C(s->src4, s->ref4, s->out);
+  return s->out[0] + s->out[15];
+}
+
+static uint32_t HlsQuantizeBlock(const void* const ctx, void* const state) {
+  HlsState* const s = (HlsState*)state;
+  int16_t in[16];
+  (void)ctx;
+  memcpy(in, s->coeffs, sizeof(in));   // the kernel overwrites its input
+  return hls::QuantizeBlock_C(in, s->out, &s->mtx) + s->out[0];
+}
+
+static uint32_t HlsITransform(const void* const ctx, void* const state) {
+  HlsState* const s = (HlsState*)state;
+  (void)ctx;
+  hls::ITransformOne(s->ref4, s->coeffs, s->dst4);
+  return s->dst4[0] + s->dst4[15];
+}
+
+static uint32_t HlsDisto16x16(const void* const ctx, void* const state) {
+  const HlsState* const s = (const HlsState*)state;
+  (void)ctx;
+  return hls::Disto16x16_C(s->src, s->ref, hls::kWeightY);
+}
+
+static uint32_t HlsSSE16x16(const void* const ctx, void* const state) {
+  const HlsState* const s = (const HlsState*)state;
+  (void)ctx;
+  return hls::SSE16x16_C(s->src, s->ref);
+}
+
+static uint32_t HlsSSE4x4(const void* const ctx, void* const state) {
+  const HlsState* const s = (const HlsState*)state;
+  (void)ctx;
+  return hls::SSE4x4_C(s->src4, s->ref4);
+}
+
+static uint32_t HlsDoFilter2(const void* const ctx, void* const state) {
+  HlsState* const s = (HlsState*)state;
+  int i;
+  (void)ctx;
+  for (i = 0; i < 16; ++i) hls::DoFilter2_C(s->edge + 4 * 16 + i, 16);
+  return s->edge[3 * 16] + s->edge[4 * 16 + 15];
+}
+
+static uint32_t HlsDoFilter4(const void* const ctx, void* const state) {
+  HlsState* const s = (HlsState*)state;
+  int i;
+  (void)ctx;
+  for (i = 0; i < 16; ++i) hls::DoFilter4_C(s->edge + 4 * 16 + i, 16);
+  return s->edge[2 * 16] + s->edge[5 * 16 + 15];
+}
+
+static uint32_t HlsSSIMGetClipped(const void* const ctx, void* const state) {
+  const HlsState* const s = (const HlsState*)state;
+  (void)ctx;
+  return (uint32_t)(65536. * hls::SSIMGetClipped_C(s->src, 16, s->ref, 16,
+                                                    s->xo, s->yo, 16, 16));
+}
+
+static int AddKernel(BenchKernel* const list, int num, BenchKernelId id,
+                     uint32_t (*run)(const void* const, void* const)) {
+  if (num >= BENCH_MAX_KERNELS) return num;
+  list[num].id = id;
+  list[num].variant = "hls_test.cpp";
+  list[num].setup = HlsSetup;
+  list[num].run = run;
+  list[num].ctx = NULL;
+  return num + 1;
+}
+
+int BenchAddHlsKernels(BenchKernel* const list, int num) {
+  num = AddKernel(list, num, BENCH_INTRA4_PREDS, HlsIntra4Preds);
+  num = AddKernel(list, num, BENCH_INTRA16_PREDS, HlsIntra16Preds);
+  num = AddKernel(list, num, BENCH_CHROMA_PREDS, HlsChromaPreds);
+  num = AddKernel(list, num, BENCH_FTRANSFORM, HlsFTransform);
+  num = AddKernel(list, num, BENCH_QUANTIZE_BLOCK, HlsQuantizeBlock);
+  num = AddKernel(list, num, BENCH_ITRANSFORM, HlsITransform);
+  num = AddKernel(list, num, BENCH_DISTO16X16, HlsDisto16x16);
+  num = AddKernel(list, num, BENCH_SSE16X16, HlsSSE16x16);
+  num = AddKernel(list, num, BENCH_SSE4X4, HlsSSE4x4);
+  num = AddKernel(list, num, BENCH_DO_FILTER2, HlsDoFilter2);
+  num = AddKernel(list, num, BENCH_DO_FILTER4, HlsDoFilter4);
+  num = AddKernel(list, num, BENCH_SSIM_GET_CLIPPED, HlsSSIMGetClipped);
+  return num;
+}
@@ -0,0 +1,234 @@
+// kernel_bench: hw_webp.cpp side.
+// The kernels are static, so the C model is compiled in this translation unit
+// rather than linked.
+
+#include "hw_webp.cpp"
+#include "kernel_bench.h"
+
+typedef struct {
+  uint8_t y_pred[4][16 * 16];
+  uint8_t uv_pred[4][8 * 16];
+  uint8_t pred4[10][16];
+  uint8_t src[16 * 16];
+  uint8_t ref[16 * 16];
+  uint8_t src4[16], ref4[16], dst4[16];   // top-left 4x4 block, packed
+  uint8_t left[16], top[20], top_left;
+  uint8_t left_u[8], top_u[8], top_left_u;
+  uint8_t left_v[8], top_v[8], top_left_v;
+  int16_t coeffs[16];
+  int16_t out[16];
+  VP8Matrix mtx;
+  uint8_t edge[8 * 16];
+  int x, y;
+  int xo, yo;
+} SnapState;
+
+typedef char kSnapStateFits[(sizeof(SnapState) <= BENCH_STATE_SIZE) ? 1 : -1];
+typedef char kSnapMatrix[(sizeof(VP8Matrix) == sizeof(BenchMatrix)) ? 1 : -1];
+
+static void SnapSetup(const BenchInput* const in, void* const state) {
+  SnapState* const s = (SnapState*)state;
+  int i;
+  memset(s, 0, sizeof(*s));
+  memcpy(s->src, in->src, sizeof(s->src));
+  memcpy(s->ref, in->pred, sizeof(s->ref));
+  for (i = 0; i < 4; ++i) {
+    memcpy(s->src4 + i * 4, in->src + i * 16, 4);
+    memcpy(s->ref4 + i * 4, in->pred + i * 16, 4);
+  }
+  memcpy(s->left, in->left, sizeof(s->left));
+  memcpy(s->top, in->top, sizeof(s->top));
+  s->top_left = in->top_left;
+  memcpy(s->left_u, in->left_u, 8);
+  memcpy(s->top_u, in->top_u, 8);
+  s->top_left_u = in->top_left_u;
+  memcpy(s->left_v, in->left_v, 8);
+  memcpy(s->top_v, in->top_v, 8);
+  s->top_left_v = in->top_left_v;
+  memcpy(s->coeffs, in->coeffs, sizeof(s->coeffs));
+  memcpy(&s->mtx, &in->matrix, sizeof(s->mtx));
+  memcpy(s->edge, in->edge, sizeof(s->edge));
+  s->x = in->has_left;
+  s->y = in->has_top;
+  s->xo = in->xo;
+  s->yo = in->yo;
+}
+
+static uint32_t SnapIntra4Preds(const void* const ctx, void* const state) {
+  SnapState* const s = (SnapState*)state;
+  (void)ctx;
+  Intra4Preds_C(s->pred4, s->left, s->top_left, s->top, s->top + 4);
+  return s->pred4[9][15] + s->pred4[5][0];
+}
+
+static uint32_t SnapIntra16Preds(const void* const ctx, void* const state) {
+  SnapState* const s = (SnapState*)state;
+  (void)ctx;
+  DCMode_16(s->y_pred[0], s->left, s->top, s->x, s->y);
+  VerticalPred_16(s->y_pred[2], s->top);
+  HorizontalPred_16(s->y_pred[3], s->left);
+  TrueMotion_16(s->y_pred[1], s->left, s->top, s->top_left, s->x, s->y);
+  return s->y_pred[1][255] + s->y_pred[0][0];
+}
+
+static uint32_t SnapChromaPreds(const void* const ctx, void* const state) {
+  SnapState* const s = (SnapState*)state;
+  (void)ctx;
+  IntraChromaPreds_C(s->uv_pred, s->left_u, s->top_u, s->top_left_u,
+                     s->left_v, s->top_v, s->top_left_v, s->x, s->y);
+  return s->uv_pred[1][127] + s->uv_pred[0][0];
+}
+
+static uint32_t SnapFTransform(const void* const ctx, void* const state) {
+  SnapState* const s = (SnapState*)state;
+  (void)ctx;
+  FTransform_C(s->src4, s->ref4, s->out);
+  return s->out[0] + s->out[15];
+}
+
+static uint32_t SnapQuantizeBlock(const void* const ctx, void* const state) {
+  SnapState* const s = (SnapState*)state;
+  int16_t in[16];
+  (void)ctx;
+  memcpy(in, s->coeffs, sizeof(in));   // the kernel overwrites its input
+  return QuantizeBlock_C(in, s->out, &s->mtx) + s->out[0];
+}
+
+static uint32_t SnapITransform(const void* const ctx, void* const state) {
+  SnapState* const s = (SnapState*)state;
+  (void)ctx;
+  ITransformOne(s->ref4, s->coeffs, s->dst4);
+  return s->dst4[0] + s->dst4[15];
+}
+
+static uint32_t SnapDisto16x16(const void* const ctx, void* const state) {
+  const SnapState* const s = (const SnapState*)state;
+  (void)ctx;
+  return Disto16x16_C(s->src, s->ref, kWeightY);
+}
+
+static uint32_t SnapSSE16x16(const void* const ctx, void* const state) {
+  const SnapState* const s = (const SnapState*)state;
+  (void)ctx;
+  return GetSSE16x16(s->src, s->ref);
+}
+
+static uint32_t SnapSSE4x4(const void* const ctx, void* const state) {
+  const SnapState* const s = (const SnapState*)state;
+  (void)ctx;
+  return GetSSE4x4(s->src4, s->ref4);
+}
+
+static uint32_t SnapDoFilter2(const void* const ctx, void* const state) {
+  SnapState* const s = (SnapState*)state;
+  int i;
+  (void)ctx;
+  for (i = 0; i < 16; ++i) DoFilter2_C(s->edge + 4 * 16 + i, 16);
+  return s->edge[3 * 16] + s->edge[4 * 16 + 15];
+}
+
+static uint32_t SnapDoFilter4(const void* const ctx, void* const state) {
+  SnapState* const s = (SnapState*)state;
+  int i;
+  (void)ctx;
+  for (i = 0; i < 16; ++i) DoFilter4_C(s->edge + 4 * 16 + i, 16);
+  return s->edge[2 * 16] + s->edge[5 * 16 + 15];
+}
+
+static uint32_t SnapSSIMGetClipped(const void* const ctx, void* const state) {
+  const SnapState* const s = (const SnapState*)state;
+  (void)ctx;
+  return SSIMGetClipped_C(s->src, 16, s->ref, 16, s->xo, s->yo, 16, 16);
+}
+
+#ifdef WEBP_SNAP_USE_SIMD
+// Variants going through the kDspKernels[] entry given as 'ctx'.
+
+static uint32_t SnapFTransformDsp(const void* const ctx, void* const state) {
+  const VP8DspKernels* const dsp = (const VP8DspKernels*)ctx;
+  SnapState* const s = (SnapState*)state;
+  dsp->ftransform_(s->src4, s->ref4, s->out);
+  return s->out[0] + s->out[15];
+}
+
+static uint32_t SnapQuantizeBlockDsp(const void* const ctx,
+                                     void* const state) {
+  const VP8DspKernels* const dsp = (const VP8DspKernels*)ctx;
+  SnapState* const s = (SnapState*)state;
+  int16_t in[16];
+  memcpy(in, s->coeffs, sizeof(in));
+  return dsp->quantize_block_(in, s->out, &s->mtx) + s->out[0];
+}
+
+static uint32_t SnapITransformDsp(const void* const ctx, void* const state) {
+  const VP8DspKernels* const dsp = (const VP8DspKernels*)ctx;
+  SnapState* const s = (SnapState*)state;
+  dsp->itransform_(s->ref4, s->coeffs, s->dst4);
+  return s->dst4[0] + s->dst4[15];
+}
+#endif  // WEBP_SNAP_USE_SIMD
+
+static int AddKernel(BenchKernel* const list, int num, BenchKernelId id,
+                     const char* const variant,
+                     uint32_t (*run)(const void* const, void* const),
+                     const void* const ctx) {
+  if (num >= BENCH_MAX_KERNELS) return num;
+  list[num].id = id;
+  list[num].variant = variant;
+  list[num].setup = SnapSetup;
+  list[num].run = run;
+  list[num].ctx = ctx;
+  return num + 1;
+}
+
+int BenchAddSnapKernels(BenchKernel* const list, int num) {
+  static const char kName[] = "hw_webp.cpp";
+  num = AddKernel(list, num, BENCH_INTRA4_PREDS, kName, SnapIntra4Preds, NULL);
+  num = AddKernel(list, num, BENCH_INTRA16_PREDS, kName, SnapIntra16Preds,
+                  NULL);
+  num = AddKernel(list, num, BENCH_CHROMA_PREDS, kName, SnapChromaPreds, NULL);
+  num = AddKernel(list, num, BENCH_FTRANSFORM, kName, SnapFTransform, NULL);
+  num = AddKernel(list, num, BENCH_QUANTIZE_BLOCK, kName, SnapQuantizeBlock,
+                  NULL);
+  num = AddKernel(list, num, BENCH_ITRANSFORM, kName, SnapITransform, NULL);
+  num = AddKernel(list, num, BENCH_DISTO16X16, kName, SnapDisto16x16, NULL);
+  num = AddKernel(list, num, BENCH_SSE16X16, kName, SnapSSE16x16, NULL);
+  num = AddKernel(list, num, BENCH_SSE4X4, kName, SnapSSE4x4, NULL);
+  num = AddKernel(list, num, BENCH_DO_FILTER2, kName, SnapDoFilter2, NULL);
+  num = AddKernel(list, num, BENCH_DO_FILTER4, kName, SnapDoFilter4, NULL);
+  num = AddKernel(list, num, BENCH_SSIM_GET_CLIPPED, kName, SnapSSIMGetClipped,
+                  NULL);
+#ifdef WEBP_SNAP_USE_SIMD
+  {
+    static const char* const kDspNames[VP8_SNAP_DSP_NUM] = {
+      "hw_webp.cpp C", "hw_webp.cpp SSE2", "hw_webp.cpp SSE4.1",
+      "hw_webp.cpp AVX2"
+    };
+    int dsp, prev;
+    // Only the kernels that differ from those of the previous levels.
+    for (dsp = VP8_SNAP_DSP_SSE2; dsp < VP8_SNAP_DSP_NUM; ++dsp) {
+      const VP8DspKernels* const k = &kDspKernels[dsp];
+      int new_fdct = 1, new_quant = 1, new_idct = 1;
+      if (!DspSupported(dsp)) continue;
+      for (prev = VP8_SNAP_DSP_C; prev < dsp; ++prev) {
+        new_fdct &= (kDspKernels[prev].ftransform_ != k->ftransform_);
+        new_quant &= (kDspKernels[prev].quantize_block_ != k->quantize_block_);
+        new_idct &= (kDspKernels[prev].itransform_ != k->itransform_);
+      }
+      if (new_fdct) {
+        num = AddKernel(list, num, BENCH_FTRANSFORM, kDspNames[dsp],
+                        SnapFTransformDsp, k);
+      }
+      if (new_quant) {
+        num = AddKernel(list, num, BENCH_QUANTIZE_BLOCK, kDspNames[dsp],
+                        SnapQuantizeBlockDsp, k);
+      }
+      if (new_idct) {
+        num = AddKernel(list, num, BENCH_ITRANSFORM, kDspNames[dsp],
+                        SnapITransformDsp, k);
+      }
+    }
+  }
+#endif
+  return num;
+}
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
 #include <assert.h>
 //#include <cstring>
 #include <jpeglib.h>
@@ -10,6 +12,10 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <math.h>
+#ifdef WEBP_USE_THREAD
+#include <pthread.h>
+#include <unistd.h>
+#endif
 #include "hw_webp.h"
 
 
@@ -115,6 +121,8 @@ struct WebPPicture {
   ////////////////////
   void* memory_;          // row chunk of memory for yuva planes
   void* memory_argb_;     // and for argb too.
+  double import_wall_;    // wall and cpu time of the last RGB import,
+  double import_cpu_;     // reported as WEBP_STAGE_IMPORT
   void* pad7[2];          // padding for later use
 };
 
@@ -181,10 +189,30 @@ struct WebPConfig {
 
   int use_delta_palette;  // reserved for future lossless feature
   int use_sharp_yuv;      // if needed, use sharp (and slow) RGB->YUV conversion
+  int thread_count;       // number of worker threads used when thread_level
+                          // is set (0 = one per online core).
+  const char* trace_file; // if not NULL, file receiving the per-macroblock
+                          // decision trace (debug).
 
-  uint32_t pad[2];        // padding for later use
+  uint32_t pad[1];        // padding for later use
 };
 
+// Encoding stages timed in WebPAuxStats.
+typedef enum WebPEncStage {
+  WEBP_STAGE_IMPORT = 0,      // RGB -> YUV or ARGB conversion of the input
+  WEBP_STAGE_ANALYZE,         // VP8EncAnalyze()
+  WEBP_STAGE_STAT_LOOP,       // StatLoop(), only without token buffer
+  WEBP_STAGE_TOKEN_LOOP,      // main coding loop, without StatLoop / emission
+  WEBP_STAGE_DECIMATE,        // token loop: VP8Decimate_snap()
+  WEBP_STAGE_TRELLIS,         // token loop: VP8Trellis_snap(), method >= 5
+  WEBP_STAGE_RECORD_TOKENS,   // token loop: RecordTokens()
+  WEBP_STAGE_FILTER_STATS,    // token loop: VP8StoreFilterStats_snap()
+  WEBP_STAGE_EMIT_TOKENS,     // VP8EmitTokens() of all the partitions
+  WEBP_STAGE_ALPHA,           // alpha plane compression
+  WEBP_STAGE_WRITE,           // VP8EncWrite()
+  WEBP_STAGE_LAST
+} WebPEncStage;
+
 struct WebPAuxStats {
   int coded_size;         // final size
 
@@ -212,6 +240,15 @@ struct WebPAuxStats {
   int lossless_hdr_size;       // lossless header (transform, huffman etc) size
   int lossless_data_size;      // lossless image data size
 
+  // time spent in each WebPEncStage, in seconds. The cpu time is the one of
+  // the whole process over the same span, so it also counts whatever runs
+  // concurrently (alpha worker, other encodes). The token loop sub-stages,
+  // decimate to filter_stats, are summed over the macroblocks on all threads
+  // and have no cpu time.
+  double stage_wall[WEBP_STAGE_LAST];
+  double stage_cpu[WEBP_STAGE_LAST];
+  long peak_memory;       // peak resident size of the process, in kB
+
   uint32_t pad[2];        // padding for later use
 };
 
@@ -300,6 +337,7 @@ int WebPValidateConfig(const WebPConfig* config) {
   if (config->image_hint >= WEBP_HINT_LAST) return 0;
   if (config->emulate_jpeg_size < 0 || config->emulate_jpeg_size > 1) return 0;
   if (config->thread_level < 0 || config->thread_level > 1) return 0;
+  if (config->thread_count < 0) return 0;
   if (config->low_memory < 0 || config->low_memory > 1) return 0;
   if (config->exact < 0 || config->exact > 1) return 0;
   if (config->use_delta_palette < 0 || config->use_delta_palette > 1) {
@@ -340,6 +378,8 @@ int WebPConfigInitInternal(WebPConfig* config,
   config->image_hint = WEBP_HINT_DEFAULT;
   config->emulate_jpeg_size = 0;
   config->thread_level = 0;
+  config->thread_count = 0;
+  config->trace_file = NULL;
   config->low_memory = 0;
   config->near_lossless = 100;
   config->use_delta_palette = 0;
@@ -436,6 +476,8 @@ static void HelpLong(void) {
   printf("  -nostrong .............. use simple filter instead of strong\n");
   printf("  -sharp_yuv ............. use sharper (and slower) RGB->YUV "
                                      "conversion\n");
+  printf("  -partitions <int> ...... log2 of the number of token partitions "
+         "(0..3), default=0\n");
   printf("  -partition_limit <int> . limit quality to fit the 512k limit on\n");
   printf("                           "
          "the first partition (0=no degradation ... 100=full)\n");
@@ -443,7 +485,15 @@ static void HelpLong(void) {
   printf("  -crop <x> <y> <w> <h> .. crop picture with the given rectangle\n");
   printf("  -resize <w> <h> ........ resize picture (after any cropping)\n");
   printf("  -mt .................... use multi-threading if available\n");
+  printf("  -threads <int> ......... number of threads for -mt "
+         "(0=one per core)\n");
   printf("  -low_memory ............ reduce memory usage (slower encoding)\n");
+  printf("  -batch <file> .......... encode the 'input output' pairs listed "
+         "in <file>,\n");
+  printf("                           one per line ('-' reads the list from "
+         "stdin)\n");
+  printf("  -jobs <int> ............ pictures encoded at once with -batch "
+         "(0=one per core)\n");
   printf("  -map <int> ............. print map of extra info\n");
   printf("  -print_psnr ............ prints averaged PSNR distortion\n");
   printf("  -print_ssim ............ prints averaged SSIM distortion\n");
@@ -481,13 +531,16 @@ static void HelpLong(void) {
 #ifndef WEBP_DLL
   printf("  -noasm ................. disable all assembly optimizations\n");
 #endif
+  printf("  -selftest .............. check the SIMD kernels against C and exit\n");
   printf("  -v ..................... verbose, e.g. print encoding/decoding "
          "times\n");
+  printf("                           and the stage times as a JSON line\n");
   printf("  -progress .............. report encoding progress\n");
   printf("\n");
   printf("Experimental Options:\n");
   printf("  -jpeg_like ............. roughly match expected JPEG size\n");
   printf("  -af .................... auto-adjust filter strength\n");
+  printf("  -trace <file> .......... write the per-macroblock decision trace\n");
   printf("  -pre <int> ............. pre-processing filter\n");
   printf("\n");
 }
@@ -545,6 +598,47 @@ static  double StopwatchReadAndReset(Stopwatch* watch) {
   return delta_sec + delta_usec / 1000000.0;
 }
 
+//------------------------------------------------------------------------------
+// Stage timing
+
+static double WallTime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double CpuTime(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct {
+  double wall, cpu;
+} StageTimer;
+
+static void StageTimerStart(StageTimer* const timer) {
+  timer->wall = WallTime();
+  timer->cpu = CpuTime();
+}
+
+// Adds the time elapsed since StageTimerStart() to 'wall' and 'cpu'.
+static void StageTimerAdd(const StageTimer* const timer,
+                          double* const wall, double* const cpu) {
+  *wall += WallTime() - timer->wall;
+  *cpu += CpuTime() - timer->cpu;
+}
+
+// Accounts the time elapsed since StageTimerStart() to 'stage' of the stats
+// of 'pic', if any.
+static void StageTimerStop(const StageTimer* const timer,
+                           const WebPPicture* const pic, WebPEncStage stage) {
+  WebPAuxStats* const stats = pic->stats;
+  if (stats != NULL) {
+    StageTimerAdd(timer, &stats->stage_wall[stage], &stats->stage_cpu[stage]);
+  }
+}
+
 typedef struct MetadataPayload {
   uint8_t* bytes;
   size_t size;
@@ -1061,6 +1155,16 @@ void* WebPSafeMalloc(uint64_t nmemb, size_t size) {
   return ptr;
 }
 
+void* WebPSafeCalloc(uint64_t nmemb, size_t size) {
+  void* ptr;
+  Increment(&num_calloc_calls);
+  if (!CheckSizeArgumentsOverflow(nmemb, size)) return NULL;
+  assert(nmemb * size > 0);
+  ptr = calloc((size_t)nmemb, size);
+  AddMem(ptr, (size_t)(nmemb * size));
+  return ptr;
+}
+
 int WebPPictureAllocYUVA(WebPPicture* const picture, int width, int height) {
   const WebPEncCSP uv_csp =
       (WebPEncCSP)((int)picture->colorspace & WEBP_CSP_UV_MASK);
@@ -1127,6 +1231,23 @@ int WebPPictureAllocYUVA(WebPPicture* const picture, int width, int height) {
 
 static const int kAlphaFix = 19;
 
+// Calls 'init' once per process, even when several encodes get there at
+// the same time (e.g. in -batch mode).
+#ifdef WEBP_USE_THREAD
+#define WEBP_INIT_ONCE(init) do {                        \
+  static pthread_once_t init_once = PTHREAD_ONCE_INIT;   \
+  pthread_once(&init_once, (init));                      \
+} while (0)
+#else
+#define WEBP_INIT_ONCE(init) do {                        \
+  static int init_done = 0;                              \
+  if (!init_done) {                                      \
+    (init)();                                            \
+    init_done = 1;                                       \
+  }                                                      \
+} while (0)
+#endif
+
 #define kGamma 0.80      // for now we use a different gamma value than kGammaF
 #define kGammaFix 12     // fixed-point precision for linear values
 #define kGammaScale ((1 << kGammaFix) - 1)
@@ -1137,7 +1258,6 @@ static const int kAlphaFix = 19;
 
 static int kLinearToGammaTab[kGammaTabSize + 1];
 static uint16_t kGammaToLinearTab[256];
-static volatile int kGammaTablesOk = 0;
 
 #define SFIX 2                // fixed-point precision of RGB and Y/W
 #define MAX_Y_T ((256 << SFIX) - 1)
@@ -1145,62 +1265,63 @@ static volatile int kGammaTablesOk = 0;
 static uint32_t kLinearToGammaTabS[kGammaTabSize + 2];
 #define GAMMA_TO_LINEAR_BITS 14
 static uint32_t kGammaToLinearTabS[MAX_Y_T + 1];   // size scales with Y_FIX
-static volatile int kGammaTablesSOk = 0;
 
-static void InitGammaTablesS(void) {
+static void DoInitGammaTablesS(void) {
+  int v;
+  const double norm = 1. / MAX_Y_T;
+  const double scale = 1. / kGammaTabSize;
+  const double a = 0.09929682680944;
+  const double thresh = 0.018053968510807;
+  const double final_scale = 1 << GAMMA_TO_LINEAR_BITS;
   assert(2 * GAMMA_TO_LINEAR_BITS < 32);  // we use uint32_t intermediate values
-  if (!kGammaTablesSOk) {
-    int v;
-    const double norm = 1. / MAX_Y_T;
-    const double scale = 1. / kGammaTabSize;
-    const double a = 0.09929682680944;
-    const double thresh = 0.018053968510807;
-    const double final_scale = 1 << GAMMA_TO_LINEAR_BITS;
-    for (v = 0; v <= MAX_Y_T; ++v) {
-      const double g = norm * v;
-      double value;
-      if (g <= thresh * 4.5) {
-        value = g / 4.5;
-      } else {
-        const double a_rec = 1. / (1. + a);
-        value = pow(a_rec * (g + a), kGammaF);
-      }
-      kGammaToLinearTabS[v] = (uint32_t)(value * final_scale + .5);
+  for (v = 0; v <= MAX_Y_T; ++v) {
+    const double g = norm * v;
+    double value;
+    if (g <= thresh * 4.5) {
+      value = g / 4.5;
+    } else {
+      const double a_rec = 1. / (1. + a);
+      value = pow(a_rec * (g + a), kGammaF);
     }
-    for (v = 0; v <= kGammaTabSize; ++v) {
-      const double g = scale * v;
-      double value;
-      if (g <= thresh) {
-        value = 4.5 * g;
-      } else {
-        value = (1. + a) * pow(g, 1. / kGammaF) - a;
-      }
-      // we already incorporate the 1/2 rounding constant here
-      kLinearToGammaTabS[v] =
-          (uint32_t)(MAX_Y_T * value) + (1 << GAMMA_TO_LINEAR_BITS >> 1);
+    kGammaToLinearTabS[v] = (uint32_t)(value * final_scale + .5);
+  }
+  for (v = 0; v <= kGammaTabSize; ++v) {
+    const double g = scale * v;
+    double value;
+    if (g <= thresh) {
+      value = 4.5 * g;
+    } else {
+      value = (1. + a) * pow(g, 1. / kGammaF) - a;
     }
-    // to prevent small rounding errors to cause read-overflow:
-    kLinearToGammaTabS[kGammaTabSize + 1] = kLinearToGammaTabS[kGammaTabSize];
-    kGammaTablesSOk = 1;
+    // we already incorporate the 1/2 rounding constant here
+    kLinearToGammaTabS[v] =
+        (uint32_t)(MAX_Y_T * value) + (1 << GAMMA_TO_LINEAR_BITS >> 1);
   }
+  // to prevent small rounding errors to cause read-overflow:
+  kLinearToGammaTabS[kGammaTabSize + 1] = kLinearToGammaTabS[kGammaTabSize];
 }
 
-static void InitGammaTables(void) {
-  if (!kGammaTablesOk) {
-    int v;
-    const double scale = (double)(1 << kGammaTabFix) / kGammaScale;
-    const double norm = 1. / 255.;
-    for (v = 0; v <= 255; ++v) {
-      kGammaToLinearTab[v] =
-          (uint16_t)(pow(norm * v, kGamma) * kGammaScale + .5);
-    }
-    for (v = 0; v <= kGammaTabSize; ++v) {
-      kLinearToGammaTab[v] = (int)(255. * pow(scale * v, 1. / kGamma) + .5);
-    }
-    kGammaTablesOk = 1;
+static void InitGammaTablesS(void) {
+  WEBP_INIT_ONCE(DoInitGammaTablesS);
+}
+
+static void DoInitGammaTables(void) {
+  int v;
+  const double scale = (double)(1 << kGammaTabFix) / kGammaScale;
+  const double norm = 1. / 255.;
+  for (v = 0; v <= 255; ++v) {
+    kGammaToLinearTab[v] =
+        (uint16_t)(pow(norm * v, kGamma) * kGammaScale + .5);
+  }
+  for (v = 0; v <= kGammaTabSize; ++v) {
+    kLinearToGammaTab[v] = (int)(255. * pow(scale * v, 1. / kGamma) + .5);
   }
 }
 
+static void InitGammaTables(void) {
+  WEBP_INIT_ONCE(DoInitGammaTables);
+}
+
 #define SAFE_ALLOC(W, H, T) ((T*)WebPSafeMalloc((W) * (H), sizeof(T)))
 
 typedef int16_t fixed_t;      // signed type with extra SFIX precision for UV
@@ -2220,9 +2341,9 @@ static void PackRGB_C(const uint8_t* r, const uint8_t* g, const uint8_t* b,
   }
 }
 
-static int Import(WebPPicture* const picture,
-                  const uint8_t* rgb, int rgb_stride,
-                  int step, int swap_rb, int import_alpha) {
+static int ImportPlanes(WebPPicture* const picture,
+                        const uint8_t* rgb, int rgb_stride,
+                        int step, int swap_rb, int import_alpha) {
   int y;
   // swap_rb -> b,g,r,a , !swap_rb -> r,g,b,a
   const uint8_t* r_ptr = rgb + (swap_rb ? 2 : 0);
@@ -2280,6 +2401,19 @@ static int Import(WebPPicture* const picture,
   return 1;
 }
 
+// Both the conversion to YUV and the packing to ARGB are timed.
+static int Import(WebPPicture* const picture,
+                  const uint8_t* rgb, int rgb_stride,
+                  int step, int swap_rb, int import_alpha) {
+  StageTimer timer;
+  int ok;
+  StageTimerStart(&timer);
+  ok = ImportPlanes(picture, rgb, rgb_stride, step, swap_rb, import_alpha);
+  picture->import_wall_ = picture->import_cpu_ = 0.;
+  StageTimerAdd(&timer, &picture->import_wall_, &picture->import_cpu_);
+  return ok;
+}
+
 int WebPPictureImportRGB(WebPPicture* picture,
                          const uint8_t* rgb, int rgb_stride) {
   return (picture != NULL && rgb != NULL)
@@ -2728,6 +2862,37 @@ static void PrintFullLosslessInfo(const WebPAuxStats* const stats,
   }
 }
 
+static const char* const kStageNames[WEBP_STAGE_LAST] = {
+  "import", "analyze", "stat_loop", "token_loop", "decimate", "trellis",
+  "record_tokens", "filter_stats", "emit_tokens", "alpha", "write"
+};
+
+// Prints the stage times of 'stats' as a one-line JSON object, for -v.
+static void PrintStageTimes(const WebPAuxStats* const stats,
+                            const char* const file_name) {
+  char line[2048];
+  int len = 0, i;
+  const char* c;
+  len += snprintf(line + len, sizeof(line) - len, "{\"file\":\"");
+  for (c = file_name; *c != '\0' && len < (int)sizeof(line) - 1024; ++c) {
+    if (*c == '"' || *c == '\\') line[len++] = '\\';
+    line[len++] = ((unsigned char)*c < 0x20) ? '?' : *c;
+  }
+  len += snprintf(line + len, sizeof(line) - len, "\",\"stages\":{");
+  for (i = 0; i < WEBP_STAGE_LAST; ++i) {
+    const int has_cpu =
+        (i < WEBP_STAGE_DECIMATE || i > WEBP_STAGE_FILTER_STATS);
+    len += snprintf(line + len, sizeof(line) - len,
+                    "%s\"%s\":{\"wall\":%.6f,\"cpu\":",
+                    (i > 0) ? "," : "", kStageNames[i], stats->stage_wall[i]);
+    len += has_cpu ? snprintf(line + len, sizeof(line) - len, "%.6f}",
+                              stats->stage_cpu[i])
+                   : snprintf(line + len, sizeof(line) - len, "null}");
+  }
+  snprintf(line + len, sizeof(line) - len, "},\"peak_memory_kb\":%ld}\n",
+           stats->peak_memory);
+  fputs(line, stderr);
+}
 
 static void PrintExtraInfoLossy(const WebPPicture* const pic, int short_output,
                                 int full_details,
@@ -2837,6 +3002,19 @@ struct VP8Tokens {
   VP8Tokens* next_;        // pointer to next page
 };
 
+// Token pages of the VP8TBuffers of an encoder. Most of them are carved out
+// of one slab, sized before the token loop from the expected number of
+// tokens. If that falls short, the extra pages are allocated one by one.
+// Pages return to the free list when a buffer is cleared and are only
+// released by VP8TokenArenaClear(), so they are recycled across passes and,
+// through a WebPEncoder, across pictures.
+typedef struct {
+  VP8Tokens* free_pages_;
+  uint8_t* slab_;           // 'num_slab_pages_' contiguous pages
+  int num_slab_pages_;
+  int page_size_;           // number of tokens per page
+} VP8TokenArena;
+
 typedef struct {
 #if !defined(DISABLE_TOKEN_BUFFER)
   VP8Tokens* pages_;        // first page
@@ -2844,19 +3022,26 @@ typedef struct {
   uint16_t* tokens_;        // set to (*last_page_)->tokens_
   int left_;                // how many free tokens left before the page is full
   int page_size_;           // number of tokens per page
+  VP8TokenArena* arena_;    // if not NULL, provides and recycles the pages
 #endif
   int error_;         // true in case of malloc error
 } VP8TBuffer;
 
+// Memory a WebPEncoder keeps from one picture to the next: the VP8Encoder
+// allocation and the token pages. Pictures of equal or smaller size don't
+// need new ones.
+struct WebPEncoder {
+  uint8_t* mem;             // VP8Encoder allocation, or NULL
+  uint64_t mem_size;
+  VP8TokenArena tokens;
+};
+typedef struct WebPEncoder WebPEncoder;
+
 enum { MB_FEATURE_TREE_PROBS = 3,
-       NUM_MB_SEGMENTS = 4,
        NUM_REF_LF_DELTAS = 4,
        NUM_MODE_LF_DELTAS = 4,    // I4x4, ZERO, *, SPLIT
        MAX_NUM_PARTITIONS = 8,
        // Probabilities
-       NUM_TYPES = 4,   // 0: i16-AC,  1: i16-DC,  2:chroma-AC,  3:i4-AC
-       NUM_BANDS = 8,
-       NUM_CTX = 3,
        NUM_PROBAS = 11
      };
 
@@ -2903,7 +3088,8 @@ typedef enum {   // Rate-distortion optimization levels
   RD_OPT_NONE        = 0,  // no rd-opt
   RD_OPT_BASIC       = 1,  // basic scoring (no trellis)
   RD_OPT_TRELLIS     = 2,  // perform trellis-quant on the final decision only
-  RD_OPT_TRELLIS_ALL = 3   // trellis-quant for every scoring (much slower)
+  RD_OPT_TRELLIS_ALL = 3   // method 6: no trellis in the mode search here, so
+                           // the same as RD_OPT_TRELLIS
 } VP8RDLevel;
 
 typedef struct {
@@ -2937,7 +3123,9 @@ struct VP8Encoder {
   // per-partition boolean decoders.
   VP8BitWriter bw_;                         // part0
   VP8BitWriter parts_[MAX_NUM_PARTITIONS];  // token partitions
-  VP8TBuffer tokens_;                       // token buffer
+  VP8TBuffer tokens_[MAX_NUM_PARTITIONS];   // token buffers, per partition
+  VP8TokenArena* token_arena_;  // pages of tokens_[], own or a WebPEncoder's
+  VP8TokenArena own_token_arena_;
 
   int percent_;                             // for progress
 
@@ -3162,9 +3350,6 @@ static void MapConfigToTools(VP8Encoder* const enc) {
 #if !defined(DISABLE_TOKEN_BUFFER)
     enc->use_tokens_ = (enc->rd_opt_level_ >= RD_OPT_BASIC);  // need rd stats
 #endif
-    if (enc->use_tokens_) {
-      enc->num_parts_ = 1;   // doesn't work with multi-partition
-    }
   }
 }
 
@@ -3173,18 +3358,15 @@ static void MapConfigToTools(VP8Encoder* const enc) {
 
 static uint8_t clip1[255 + 510 + 1];    // clips [-255,510] to [0,255]
 
-// We declare this variable 'volatile' to prevent instruction reordering
-// and make sure it's set to true _last_ (so as to be thread-safe)
-static volatile int tables_ok = 0;
+static void DoInitTables(void) {
+  int i;
+  for (i = -255; i <= 255 + 255; ++i) {
+    clip1[255 + i] = clip_8b(i);
+  }
+}
 
 static void InitTables(void) {
-  if (!tables_ok) {
-    int i;
-    for (i = -255; i <= 255 + 255; ++i) {
-      clip1[255 + i] = clip_8b(i);
-    }
-    tables_ok = 1;
-  }
+  WEBP_INIT_ONCE(DoInitTables);
 }
 
 // Paragraph 13.5
@@ -3426,6 +3608,152 @@ typedef struct {
   void (*End)(WebPWorker* const worker);
 } WebPWorkerInterface;
 
+//------------------------------------------------------------------------------
+// Thread pool
+//
+// Workers don't own a thread: Launch() hands them to a process-wide pool of
+// parked threads, so short jobs don't pay for a thread creation each time.
+// The pool keeps up to WebPSetThreadPoolSize() threads parked (one per online
+// core by default). A Launch() finding no parked thread starts a new one
+// rather than queuing: the hooks may wait on each other (see the wavefront
+// scheduler) and must all run concurrently. Threads above the pool size
+// exit once their job is done.
+
+#ifdef WEBP_USE_THREAD
+
+typedef struct {
+  pthread_mutex_t mutex_;
+  pthread_cond_t  condition_;
+} WebPWorkerImpl;
+
+typedef struct WebPPoolThread {
+  pthread_cond_t condition_;
+  WebPWorker* job_;                // job to run, NULL when parked
+  struct WebPPoolThread* next_;    // next parked thread
+} WebPPoolThread;
+
+static struct {
+  pthread_mutex_t mutex_;
+  int size_;                       // threads kept parked. < 0: not set yet.
+  int num_threads_;                // running or parked
+  WebPPoolThread* parked_;
+} g_pool = { PTHREAD_MUTEX_INITIALIZER, -1, 0, NULL };
+
+static void Execute(WebPWorker* const worker);
+
+// Must be called with g_pool.mutex_ held.
+static int PoolSize(void) {
+  if (g_pool.size_ < 0) {
+    const long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    g_pool.size_ = (num_cores > 0) ? (int)num_cores : 1;
+  }
+  return g_pool.size_;
+}
+
+// Marks the job of 'worker' as done and wakes up Sync(). 'worker' may be
+// released as soon as the lock is dropped.
+static void FinishJob(WebPWorker* const worker) {
+  WebPWorkerImpl* const impl = (WebPWorkerImpl*)worker->impl_;
+  pthread_mutex_lock(&impl->mutex_);
+  worker->status_ = OK;
+  pthread_cond_signal(&impl->condition_);
+  pthread_mutex_unlock(&impl->mutex_);
+}
+
+static void* PoolThreadLoop(void* ptr) {
+  WebPPoolThread* const self = (WebPPoolThread*)ptr;
+  pthread_mutex_lock(&g_pool.mutex_);
+  while (1) {
+    WebPWorker* const worker = self->job_;
+    pthread_mutex_unlock(&g_pool.mutex_);
+    Execute(worker);
+    FinishJob(worker);
+    pthread_mutex_lock(&g_pool.mutex_);
+    self->job_ = NULL;
+    if (g_pool.num_threads_ > PoolSize()) break;   // surplus thread
+    self->next_ = g_pool.parked_;
+    g_pool.parked_ = self;
+    while (self->job_ == NULL) {
+      pthread_cond_wait(&self->condition_, &g_pool.mutex_);
+    }
+  }
+  --g_pool.num_threads_;
+  pthread_mutex_unlock(&g_pool.mutex_);
+  pthread_cond_destroy(&self->condition_);
+  WebPSafeFree(self);
+  return NULL;
+}
+
+// Runs the job of 'worker' on a parked thread, or else on a new one. Unless
+// 'grow' is set, the pool doesn't grow past its size for it. Returns false
+// if no thread could be found.
+static int PoolSubmit(WebPWorker* const worker, int grow) {
+  WebPPoolThread* thread;
+  int ok = 0;
+  pthread_mutex_lock(&g_pool.mutex_);
+  thread = g_pool.parked_;
+  if (thread != NULL) {
+    g_pool.parked_ = thread->next_;
+    thread->job_ = worker;
+    pthread_cond_signal(&thread->condition_);
+    ok = 1;
+  } else if (grow || g_pool.num_threads_ < PoolSize()) {
+    thread = (WebPPoolThread*)WebPSafeCalloc(1, sizeof(*thread));
+    if (thread != NULL && !pthread_cond_init(&thread->condition_, NULL)) {
+      pthread_attr_t attr;
+      pthread_t id;
+      thread->job_ = worker;
+      pthread_attr_init(&attr);
+      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+      ok = !pthread_create(&id, &attr, PoolThreadLoop, thread);
+      pthread_attr_destroy(&attr);
+      if (ok) {
+        ++g_pool.num_threads_;
+      } else {
+        pthread_cond_destroy(&thread->condition_);
+      }
+    }
+    if (!ok) WebPSafeFree(thread);
+  }
+  pthread_mutex_unlock(&g_pool.mutex_);
+  return ok;
+}
+
+// main thread state control
+static void ChangeState(WebPWorker* const worker, WebPWorkerStatus new_status) {
+  // No-op when attempting to change state on a worker that wasn't Reset().
+  // Checking status_ without acquiring the lock first would result in a data
+  // race.
+  WebPWorkerImpl* const impl = (WebPWorkerImpl*)worker->impl_;
+  if (impl == NULL) return;
+
+  pthread_mutex_lock(&impl->mutex_);
+  if (worker->status_ >= OK) {
+    // wait for the current job to finish
+    while (worker->status_ != OK) {
+      pthread_cond_wait(&impl->condition_, &impl->mutex_);
+    }
+    if (new_status != OK) worker->status_ = new_status;
+  }
+  pthread_mutex_unlock(&impl->mutex_);
+}
+
+#endif  // WEBP_USE_THREAD
+
+// Sets the number of threads kept parked by the pool, 0 for one per online
+// core. Threads above the new size exit once they are done.
+void WebPSetThreadPoolSize(int size) {
+#ifdef WEBP_USE_THREAD
+  const long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (size <= 0) size = (num_cores > 0) ? (int)num_cores : 1;
+  pthread_mutex_lock(&g_pool.mutex_);
+  g_pool.size_ = size;
+  pthread_mutex_unlock(&g_pool.mutex_);
+#else
+  (void)size;
+#endif
+}
+
 static void Init(WebPWorker* const worker) {
   memset(worker, 0, sizeof(*worker));
   worker->status_ = NOT_OK;
@@ -3455,23 +3783,13 @@ static int Reset(WebPWorker* const worker) {
     }
     if (pthread_cond_init(&impl->condition_, NULL)) {
       pthread_mutex_destroy(&impl->mutex_);
-      goto Error;
-    }
-    pthread_mutex_lock(&impl->mutex_);
-    ok = !pthread_create(&impl->thread_, NULL, ThreadLoop, worker);
-    if (ok) worker->status_ = OK;
-    pthread_mutex_unlock(&impl->mutex_);
-    if (!ok) {
-      pthread_mutex_destroy(&impl->mutex_);
-      pthread_cond_destroy(&impl->condition_);
  Error:
       WebPSafeFree(impl);
       worker->impl_ = NULL;
       return 0;
     }
-#else
-    worker->status_ = OK;
 #endif
+    worker->status_ = OK;
   } else if (worker->status_ > OK) {
     ok = Sync(worker);
   }
@@ -3487,7 +3805,13 @@ static void Execute(WebPWorker* const worker) {
 
 static void Launch(WebPWorker* const worker) {
 #ifdef WEBP_USE_THREAD
+  if (worker->impl_ == NULL) return;
   ChangeState(worker, WORK);
+  if (!PoolSubmit(worker, 1)) {
+    // out of threads: run it here rather than dropping it
+    Execute(worker);
+    FinishJob(worker);
+  }
 #else
   Execute(worker);
 #endif
@@ -3498,17 +3822,14 @@ static void End(WebPWorker* const worker) {
   if (worker->impl_ != NULL) {
     WebPWorkerImpl* const impl = (WebPWorkerImpl*)worker->impl_;
     ChangeState(worker, NOT_OK);
-    pthread_join(impl->thread_, NULL);
     pthread_mutex_destroy(&impl->mutex_);
     pthread_cond_destroy(&impl->condition_);
     WebPSafeFree(impl);
     worker->impl_ = NULL;
   }
-#else
+#endif
   worker->status_ = NOT_OK;
   assert(worker->impl_ == NULL);
-#endif
-  assert(worker->status_ == NOT_OK);
 }
 
 static WebPWorkerInterface g_worker_interface = {
@@ -3519,6 +3840,120 @@ const WebPWorkerInterface* WebPGetWorkerInterface(void) {
   return &g_worker_interface;
 }
 
+//------------------------------------------------------------------------------
+// Parallel for
+
+#define PARALLEL_FOR_MAX_THREADS 64
+
+// Called with the index of the iteration. Returns false in case of error.
+typedef int (*WebPParallelForHook)(void* data, int index);
+
+typedef struct {
+  WebPParallelForHook hook;
+  void* data;
+  int count;
+  int next;           // next iteration to hand out
+  int ok;
+#ifdef WEBP_USE_THREAD
+  pthread_mutex_t mutex;
+#endif
+} ParallelFor;
+
+// Runs iterations until there are none left or one failed. The threads
+// taking part pick the next free iteration, so a thread stuck on a slow one
+// doesn't hold back the others.
+static int ParallelForLoop(void* arg1, void* arg2) {
+  ParallelFor* const pf = (ParallelFor*)arg1;
+  (void)arg2;
+  while (1) {
+    int index;
+#ifdef WEBP_USE_THREAD
+    pthread_mutex_lock(&pf->mutex);
+#endif
+    index = pf->ok ? pf->next++ : pf->count;
+#ifdef WEBP_USE_THREAD
+    pthread_mutex_unlock(&pf->mutex);
+#endif
+    if (index >= pf->count) break;
+    if (!pf->hook(pf->data, index)) {
+#ifdef WEBP_USE_THREAD
+      pthread_mutex_lock(&pf->mutex);
+#endif
+      pf->ok = 0;
+#ifdef WEBP_USE_THREAD
+      pthread_mutex_unlock(&pf->mutex);
+#endif
+    }
+  }
+  return 1;
+}
+
+// Calls hook(data, i) for i in [0, count), using the calling thread and up
+// to 'num_threads' - 1 threads of the pool, fewer if the pool is busy. The
+// iterations must be independent: they may run in any order. Returns false
+// if one of them failed, the remaining ones are then skipped.
+int WebPParallelFor(int count, int num_threads, WebPParallelForHook hook,
+                    void* data) {
+  ParallelFor pf;
+  pf.hook = hook;
+  pf.data = data;
+  pf.count = count;
+  pf.next = 0;
+  pf.ok = 1;
+#ifdef WEBP_USE_THREAD
+  if (pthread_mutex_init(&pf.mutex, NULL)) return 0;
+  if (num_threads > count) num_threads = count;
+  if (num_threads > PARALLEL_FOR_MAX_THREADS) {
+    num_threads = PARALLEL_FOR_MAX_THREADS;
+  }
+  {
+    const WebPWorkerInterface* const worker_interface =
+        WebPGetWorkerInterface();
+    WebPWorker helpers[PARALLEL_FOR_MAX_THREADS - 1];
+    int num_helpers, i;
+    for (num_helpers = 0; num_helpers < num_threads - 1; ++num_helpers) {
+      WebPWorker* const worker = &helpers[num_helpers];
+      worker_interface->Init(worker);
+      if (!worker_interface->Reset(worker)) break;
+      worker->hook = ParallelForLoop;
+      worker->data1 = &pf;
+      // helpers are optional: don't grow the pool past its size for them
+      worker->status_ = WORK;
+      if (!PoolSubmit(worker, 0)) {
+        worker->status_ = OK;
+        worker_interface->End(worker);
+        break;
+      }
+    }
+    ParallelForLoop(&pf, NULL);
+    for (i = 0; i < num_helpers; ++i) {
+      worker_interface->Sync(&helpers[i]);
+      worker_interface->End(&helpers[i]);
+    }
+  }
+  pthread_mutex_destroy(&pf.mutex);
+#else
+  (void)num_threads;
+  ParallelForLoop(&pf, NULL);
+#endif
+  return pf.ok;
+}
+
+// Number of threads to use for 'enc': 1 unless multi-threading is on, in
+// which case config->thread_count, or one per online core if it's 0.
+static int GetNumThreads(const VP8Encoder* const enc) {
+#ifdef WEBP_USE_THREAD
+  if (enc->thread_level_ > 0) {
+    int num_threads = enc->config_->thread_count;
+    if (num_threads == 0) num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    return (num_threads > 1) ? num_threads : 1;
+  }
+#else
+  (void)enc;
+#endif
+  return 1;
+}
+
 typedef enum {     // Filter types.
   WEBP_FILTER_NONE = 0,
   WEBP_FILTER_HORIZONTAL,
@@ -3816,6 +4251,7 @@ int VP8BitWriterInit(VP8BitWriter* const bw, size_t expected_size) {
 }
 
 static void InitFilterTrial(FilterTrial* const score) {
+  memset(score, 0, sizeof(*score));
   score->score = (size_t)~0U;
   VP8BitWriterInit(&score->bw, 0);
 }
@@ -4121,16 +4557,6 @@ typedef struct {
                                      // backward references.
 } VP8LEncoder;
 
-void* WebPSafeCalloc(uint64_t nmemb, size_t size) {
-  void* ptr;
-  Increment(&num_calloc_calls);
-  if (!CheckSizeArgumentsOverflow(nmemb, size)) return NULL;
-  assert(nmemb * size > 0);
-  ptr = calloc((size_t)nmemb, size);
-  AddMem(ptr, (size_t)(nmemb * size));
-  return ptr;
-}
-
 static VP8LEncoder* VP8LEncoderNew(const WebPConfig* const config,
                                    const WebPPicture* const picture) {
   VP8LEncoder* const enc = (VP8LEncoder*)WebPSafeCalloc(1ULL, sizeof(*enc));
@@ -7352,6 +7778,7 @@ static int BackwardReferencesHashChainFollowChosenPath(
   int cc_init = 0;
   VP8LColorCache hashers;
 
+  memset(&hashers, 0, sizeof(hashers));   // only used with use_color_cache
   if (use_color_cache) {
     cc_init = VP8LColorCacheInit(&hashers, cache_bits);
     if (!cc_init) goto Error;
@@ -8746,8 +9173,6 @@ typedef void (*VP8LPredictorAddSubFunc)(const uint32_t* in,
                                         const uint32_t* upper, int num_pixels,
                                         uint32_t* out);
 
-VP8LPredictorAddSubFunc VP8LPredictorsSub[16];
-
 static void PredictorSub0_C(const uint32_t* in, const uint32_t* upper,
                             int num_pixels, uint32_t* out) {
   int i;
@@ -8906,26 +9331,20 @@ GENERATE_PREDICTOR_SUB(Predictor11, PredictorSub11_C)
 GENERATE_PREDICTOR_SUB(Predictor12, PredictorSub12_C)
 GENERATE_PREDICTOR_SUB(Predictor13, PredictorSub13_C)
 
+// The predictor tables are constant: the lossless encoder may run on several
+// threads at once (e.g. the alpha filter trials).
+static const VP8LPredictorAddSubFunc VP8LPredictorsSub[16] = {
+  PredictorSub0_C, PredictorSub1_C, PredictorSub2_C, PredictorSub3_C,
+  PredictorSub4_C, PredictorSub5_C, PredictorSub6_C, PredictorSub7_C,
+  PredictorSub8_C, PredictorSub9_C, PredictorSub10_C, PredictorSub11_C,
+  PredictorSub12_C, PredictorSub13_C,
+  PredictorSub0_C, PredictorSub0_C   // <- padding security sentinels
+};
+
 static void PredictBatch(int mode, int x_start, int y,
                                      int num_pixels, const uint32_t* current,
                                      const uint32_t* upper, uint32_t* out) {
 
-	VP8LPredictorsSub[0] = PredictorSub0_C;
-	VP8LPredictorsSub[1] = PredictorSub1_C;
-	VP8LPredictorsSub[2] = PredictorSub2_C;
-	VP8LPredictorsSub[3] = PredictorSub3_C;
-	VP8LPredictorsSub[4] = PredictorSub4_C;
-	VP8LPredictorsSub[5] = PredictorSub5_C;
-	VP8LPredictorsSub[6] = PredictorSub6_C;
-	VP8LPredictorsSub[7] = PredictorSub7_C;
-	VP8LPredictorsSub[8] = PredictorSub8_C;
-	VP8LPredictorsSub[9] = PredictorSub9_C;
-	VP8LPredictorsSub[10] = PredictorSub10_C;
-	VP8LPredictorsSub[11] = PredictorSub11_C;
-	VP8LPredictorsSub[12] = PredictorSub12_C;
-	VP8LPredictorsSub[13] = PredictorSub13_C;
-	VP8LPredictorsSub[14] = PredictorSub0_C;  // <- padding security sentinels
-	VP8LPredictorsSub[15] = PredictorSub0_C;
 
   if (x_start == 0) {
     if (y == 0) {
@@ -8950,27 +9369,6 @@ static void PredictBatch(int mode, int x_start, int y,
 
 typedef uint32_t (*VP8LPredictorFunc)(uint32_t left, const uint32_t* const top);
 
-VP8LPredictorFunc VP8LPredictors[16];
-
-#define COPY_PREDICTOR_ARRAY(IN, OUT) do {                \
-  (OUT)[0] = IN##0_C;                                     \
-  (OUT)[1] = IN##1_C;                                     \
-  (OUT)[2] = IN##2_C;                                     \
-  (OUT)[3] = IN##3_C;                                     \
-  (OUT)[4] = IN##4_C;                                     \
-  (OUT)[5] = IN##5_C;                                     \
-  (OUT)[6] = IN##6_C;                                     \
-  (OUT)[7] = IN##7_C;                                     \
-  (OUT)[8] = IN##8_C;                                     \
-  (OUT)[9] = IN##9_C;                                     \
-  (OUT)[10] = IN##10_C;                                   \
-  (OUT)[11] = IN##11_C;                                   \
-  (OUT)[12] = IN##12_C;                                   \
-  (OUT)[13] = IN##13_C;                                   \
-  (OUT)[14] = IN##0_C; /* <- padding security sentinels*/ \
-  (OUT)[15] = IN##0_C;                                    \
-} while (0);
-
 static uint32_t Predictor0_C(uint32_t left, const uint32_t* const top) {
   (void)top;
   (void)left;
@@ -9031,6 +9429,14 @@ static uint32_t Predictor13_C(uint32_t left, const uint32_t* const top) {
   return pred;
 }
 
+static const VP8LPredictorFunc VP8LPredictors[16] = {
+  Predictor0_C, Predictor1_C, Predictor2_C, Predictor3_C,
+  Predictor4_C, Predictor5_C, Predictor6_C, Predictor7_C,
+  Predictor8_C, Predictor9_C, Predictor10_C, Predictor11_C,
+  Predictor12_C, Predictor13_C,
+  Predictor0_C, Predictor0_C   // <- padding security sentinels
+};
+
 // Quantize the difference between the actual component value and its prediction
 // to a multiple of quantization, working modulo 256, taking care not to cross
 // a boundary (inclusive upper limit).
@@ -9124,8 +9530,6 @@ static void GetResidual(
     int x_start, int x_end, int y, int max_quantization, int exact,
     int used_subtract_green, uint32_t* const out) {
 
-	  COPY_PREDICTOR_ARRAY(Predictor, VP8LPredictors)
-
   if (exact) {
     PredictBatch(mode, x_start, y, x_end - x_start, current_row, upper_row,
                  out);
@@ -11402,41 +11806,90 @@ static uint8_t* VP8BitWriterBuf(const VP8BitWriter* const bw) {
   return bw->buf_;
 }
 
+// The filter candidates of ApplyFiltersAndEncode(), each compressed into its
+// own trial. Job 'j' of the num_jobs runs trials j, j + num_jobs... with
+// scratch plane 'j'.
+typedef struct {
+  const uint8_t* alpha;
+  int width, height;
+  int method, reduce_levels, effort_level;
+  int num_trials, num_jobs;
+  int filters[WEBP_FILTER_LAST];
+  uint8_t* filtered_alpha;      // num_jobs scratch planes, or NULL
+  FilterTrial trials[WEBP_FILTER_LAST];
+} FilterTrials;
+
+static int FilterTrialJob(void* data, int job) {
+  FilterTrials* const ft = (FilterTrials*)data;
+  const size_t data_size = (size_t)ft->width * ft->height;
+  uint8_t* const tmp_alpha = (ft->filtered_alpha != NULL)
+                           ? ft->filtered_alpha + job * data_size : NULL;
+  int i;
+  for (i = job; i < ft->num_trials; i += ft->num_jobs) {
+    if (!EncodeAlphaInternal(ft->alpha, ft->width, ft->height, ft->method,
+                             ft->filters[i], ft->reduce_levels,
+                             ft->effort_level, tmp_alpha, &ft->trials[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// The candidate filters are independent trials: they are compressed in
+// parallel, one scratch plane per thread, and the smallest one is kept.
+// Ties go to the lowest filter, as when they were tried one after the other.
 static int ApplyFiltersAndEncode(const uint8_t* alpha, int width, int height,
                                  size_t data_size, int method, int filter,
                                  int reduce_levels, int effort_level,
+                                 int num_threads,
                                  uint8_t** const output,
                                  size_t* const output_size,
                                  WebPAuxStats* const stats) {
   int ok = 1;
+  int i;
+  FilterTrials ft;
   FilterTrial best;
   uint32_t try_map =
       GetFilterMap(alpha, width, height, filter, effort_level);
+  const int use_filters = (try_map != FILTER_TRY_NONE);
   InitFilterTrial(&best);
 
-  if (try_map != FILTER_TRY_NONE) {
-    uint8_t* filtered_alpha =  (uint8_t*)WebPSafeMalloc(1ULL, data_size);
-    if (filtered_alpha == NULL) return 0;
-
-    for (filter = WEBP_FILTER_NONE; ok && try_map; ++filter, try_map >>= 1) {
-      if (try_map & 1) {
-        FilterTrial trial;
-        ok = EncodeAlphaInternal(alpha, width, height, method, filter,
-                                 reduce_levels, effort_level, filtered_alpha,
-                                 &trial);
-        if (ok && trial.score < best.score) {
-          VP8BitWriterWipeOut(&best.bw);
-          best = trial;
-        } else {
-          VP8BitWriterWipeOut(&trial.bw);
-        }
-      }
+  ft.alpha = alpha;
+  ft.width = width;
+  ft.height = height;
+  ft.method = method;
+  ft.reduce_levels = reduce_levels;
+  ft.effort_level = effort_level;
+  ft.num_trials = 0;
+  ft.filtered_alpha = NULL;
+  if (use_filters) {
+    for (filter = WEBP_FILTER_NONE; try_map; ++filter, try_map >>= 1) {
+      if (try_map & 1) ft.filters[ft.num_trials++] = filter;
     }
-    WebPSafeFree(filtered_alpha);
   } else {
-    ok = EncodeAlphaInternal(alpha, width, height, method, WEBP_FILTER_NONE,
-                             reduce_levels, effort_level, NULL, &best);
+    ft.filters[ft.num_trials++] = WEBP_FILTER_NONE;
+  }
+  ft.num_jobs = (num_threads < ft.num_trials) ? num_threads : ft.num_trials;
+  if (ft.num_jobs < 1) ft.num_jobs = 1;
+  if (use_filters) {
+    ft.filtered_alpha =
+        (uint8_t*)WebPSafeMalloc((uint64_t)ft.num_jobs, data_size);
+    if (ft.filtered_alpha == NULL) return 0;
+  }
+  // a failing trial can return before touching its writer
+  for (i = 0; i < ft.num_trials; ++i) InitFilterTrial(&ft.trials[i]);
+
+  ok = WebPParallelFor(ft.num_jobs, num_threads, FilterTrialJob, &ft);
+  for (i = 0; i < ft.num_trials; ++i) {
+    FilterTrial* const trial = &ft.trials[i];
+    if (ok && trial->score < best.score) {
+      VP8BitWriterWipeOut(&best.bw);
+      best = *trial;
+    } else {
+      VP8BitWriterWipeOut(&trial->bw);
+    }
   }
+  WebPSafeFree(ft.filtered_alpha);
   if (ok) {
 #if !defined(WEBP_DISABLE_STATS)
     if (stats != NULL) {
@@ -11514,8 +11967,9 @@ static int EncodeAlpha(VP8Encoder* const enc,
 
   if (ok) {
     ok = ApplyFiltersAndEncode(quant_alpha, width, height, data_size, method,
-                               filter, reduce_levels, effort_level, output,
-                               output_size, pic->stats);
+                               filter, reduce_levels, effort_level,
+                               GetNumThreads(enc), output, output_size,
+                               pic->stats);
 #if !defined(WEBP_DISABLE_STATS)
     if (pic->stats != NULL) {  // need stats?
       pic->stats->coded_size += (int)(*output_size);
@@ -11538,10 +11992,13 @@ static int CompressAlphaJob(void* arg1, void* dummy) {
       (config->alpha_filtering == 0) ? WEBP_FILTER_NONE :
       (config->alpha_filtering == 1) ? WEBP_FILTER_FAST :
                                        WEBP_FILTER_BEST;
-  if (!EncodeAlpha(enc, config->alpha_quality, config->alpha_compression,
-                   filter, effort_level, &alpha_data, &alpha_size)) {
-    return 0;
-  }
+  StageTimer timer;
+  int ok;
+  StageTimerStart(&timer);
+  ok = EncodeAlpha(enc, config->alpha_quality, config->alpha_compression,
+                   filter, effort_level, &alpha_data, &alpha_size);
+  StageTimerStop(&timer, enc->pic_, WEBP_STAGE_ALPHA);
+  if (!ok) return 0;
   if (alpha_size != (uint32_t)alpha_size) {  // Sanity check.
     WebPSafeFree(alpha_data);
     return 0;
@@ -11573,11 +12030,15 @@ void VP8TBufferInit(VP8TBuffer* const b, int page_size) {
   b->last_page_ = &b->pages_;
   b->left_ = 0;
   b->page_size_ = (page_size < MIN_PAGE_SIZE) ? MIN_PAGE_SIZE : page_size;
+  b->arena_ = NULL;
   b->error_ = 0;
 }
 
+// 'reuse', if not NULL, provides the memory and gets it back in
+// DeleteVP8Encoder().
 static VP8Encoder* InitVP8Encoder(const WebPConfig* const config,
-                                  WebPPicture* const picture) {
+                                  WebPPicture* const picture,
+                                  WebPEncoder* const reuse) {
   VP8Encoder* enc;
   const int use_filter =
       (config->filter_strength > 0) || (config->autofilter > 0);
@@ -11633,10 +12094,23 @@ static VP8Encoder* InitVP8Encoder(const WebPConfig* const config,
          mb_w * mb_h * 384 * sizeof(uint8_t));
   printf("===================================\n");
 #endif
-  mem = (uint8_t*)WebPSafeMalloc(size, sizeof(*mem));
-  if (mem == NULL) {
-    WebPEncodingSetError(picture, VP8_ENC_ERROR_OUT_OF_MEMORY);
-    return NULL;
+  if (reuse != NULL && reuse->mem_size >= size) {
+    mem = reuse->mem;
+  } else {
+    if (reuse != NULL) {
+      WebPSafeFree(reuse->mem);
+      reuse->mem = NULL;
+      reuse->mem_size = 0;
+    }
+    mem = (uint8_t*)WebPSafeMalloc(size, sizeof(*mem));
+    if (mem == NULL) {
+      WebPEncodingSetError(picture, VP8_ENC_ERROR_OUT_OF_MEMORY);
+      return NULL;
+    }
+    if (reuse != NULL) {
+      reuse->mem = mem;
+      reuse->mem_size = size;
+    }
   }
   enc = (VP8Encoder*)mem;
   mem = (uint8_t*)WEBP_ALIGN(mem + sizeof(*enc));
@@ -11676,12 +12150,8 @@ static VP8Encoder* InitVP8Encoder(const WebPConfig* const config,
   ResetBoundaryPredictions(enc);
   VP8EncInitAlpha(enc);
 
-  // lower quality means smaller output -> we modulate a little the page
-  // size based on quality. This is just a crude 1rst-order prediction.
-  {
-    const float scale = 1.f + config->quality * 5.f / 100.f;  // in [1,6]
-    VP8TBufferInit(&enc->tokens_, (int)(mb_w * mb_h * 4 * scale));
-  }
+  // the token buffers are set up by the token loop, once the arena is sized
+  enc->token_arena_ = (reuse != NULL) ? &reuse->tokens : &enc->own_token_arena_;
   return enc;
 }
 
@@ -11736,7 +12206,6 @@ typedef struct {
 
 // struct used to collect job result
 typedef struct {
-  WebPWorker worker;
   int alphas[MAX_ALPHA + 1];
   int alpha, uv_alpha;
   VP8EncIterator it;
@@ -12684,9 +13153,8 @@ int VP8IteratorProgress(const VP8EncIterator* const it, int delta) {
 }
 
 // main work call
-static int DoSegmentsJob(void* arg1, void* arg2) {
-  SegmentJob* const job = (SegmentJob*)arg1;
-  VP8EncIterator* const it = (VP8EncIterator*)arg2;
+static int DoSegmentsJob(SegmentJob* const job) {
+  VP8EncIterator* const it = &job->it;
   int ok = 1;
   if (!VP8IteratorIsDone(it)) {
     uint8_t tmp[32 + WEBP_ALIGN_CST];
@@ -12742,17 +13210,13 @@ void VP8IteratorInit(VP8Encoder* const enc, VP8EncIterator* const it) {
 // initialize the job struct with some TODOs
 static void InitSegmentJob(VP8Encoder* const enc, SegmentJob* const job,
                            int start_row, int end_row) {
-  WebPGetWorkerInterface()->Init(&job->worker);
-  job->worker.data1 = job;
-  job->worker.data2 = &job->it;
-  job->worker.hook = DoSegmentsJob;
   VP8IteratorInit(enc, &job->it);
   VP8IteratorSetRow(&job->it, start_row);
   VP8IteratorSetCountDown(&job->it, (end_row - start_row) * enc->mb_w_);
   memset(job->alphas, 0, sizeof(job->alphas));
   job->alpha = 0;
   job->uv_alpha = 0;
-  // only one of both jobs can record the progress, since we don't
+  // only one of the jobs can record the progress, since we don't
   // expect the user's hook to be multi-thread safe
   job->delta_progress = (start_row == 0) ? 20 : 0;
 }
@@ -12940,7 +13404,18 @@ static void ResetAllMBInfo(VP8Encoder* const enc) {
   WebPReportProgress(enc->pic_, enc->percent_ + 20, &enc->percent_);
 }
 
+#define ANALYZE_MIN_BAND_ROWS 2   // minimal rows for a band to be worth it
+#define ANALYZE_MAX_BANDS 64
+
+static int AnalyzeBand(void* data, int index) {
+  return DoSegmentsJob((SegmentJob*)data + index);
+}
+
 // main entry point
+// The picture is cut into row bands analyzed in parallel, each with its own
+// histogram. Macroblocks are analyzed from the source samples only and the
+// histograms are integer sums, so the result doesn't depend on the number
+// of bands.
 int VP8EncAnalyze(VP8Encoder* const enc) {
   int ok = 1;
   const int do_segments =
@@ -12949,48 +13424,32 @@ int VP8EncAnalyze(VP8Encoder* const enc) {
       (enc->method_ <= 1);  // for method 0 - 1, we need preds_[] to be filled.
   if (do_segments) {
     const int last_row = enc->mb_h_;
-    // We give a little more than a half work to the main thread.
-    const int split_row = (9 * last_row + 15) >> 4;
     const int total_mb = last_row * enc->mb_w_;
-#ifdef WEBP_USE_THREAD
-    const int kMinSplitRow = 2;  // minimal rows needed for mt to be worth it
-    const int do_mt = (enc->thread_level_ > 0) && (split_row >= kMinSplitRow);
-#else
-    const int do_mt = 0;
-#endif
-    const WebPWorkerInterface* const worker_interface =
-        WebPGetWorkerInterface();
-    SegmentJob main_job;
-    if (do_mt) {
-      SegmentJob side_job;
-      // Note the use of '&' instead of '&&' because we must call the functions
-      // no matter what.
-      InitSegmentJob(enc, &main_job, 0, split_row);
-      InitSegmentJob(enc, &side_job, split_row, last_row);
-      // we don't need to call Reset() on main_job.worker, since we're calling
-      // WebPWorkerExecute() on it
-      ok &= worker_interface->Reset(&side_job.worker);
-      // launch the two jobs in parallel
-      if (ok) {
-        worker_interface->Launch(&side_job.worker);
-        worker_interface->Execute(&main_job.worker);
-        ok &= worker_interface->Sync(&side_job.worker);
-        ok &= worker_interface->Sync(&main_job.worker);
-      }
-      worker_interface->End(&side_job.worker);
-      if (ok) MergeJobs(&side_job, &main_job);  // merge results together
-    } else {
-      // Even for single-thread case, we use the generic Worker tools.
-      InitSegmentJob(enc, &main_job, 0, last_row);
-      worker_interface->Execute(&main_job.worker);
-      ok &= worker_interface->Sync(&main_job.worker);
-    }
-    worker_interface->End(&main_job.worker);
+    const int num_threads = GetNumThreads(enc);
+    int num_bands = last_row / ANALYZE_MIN_BAND_ROWS;
+    SegmentJob* jobs;
+    int n;
+    if (num_bands > num_threads) num_bands = num_threads;
+    if (num_bands > ANALYZE_MAX_BANDS) num_bands = ANALYZE_MAX_BANDS;
+    if (num_bands < 1) num_bands = 1;
+    jobs = (SegmentJob*)WebPSafeMalloc(num_bands, sizeof(*jobs));
+    if (jobs == NULL) {
+      return WebPEncodingSetError(enc->pic_, VP8_ENC_ERROR_OUT_OF_MEMORY);
+    }
+    for (n = 0; n < num_bands; ++n) {
+      InitSegmentJob(enc, &jobs[n], n * last_row / num_bands,
+                     (n + 1) * last_row / num_bands);
+    }
+    ok = WebPParallelFor(num_bands, num_threads, AnalyzeBand, jobs);
     if (ok) {
-      enc->alpha_ = main_job.alpha / total_mb;
-      enc->uv_alpha_ = main_job.uv_alpha / total_mb;
-      AssignSegments(enc, main_job.alphas);
+      for (n = 1; n < num_bands; ++n) {
+        MergeJobs(&jobs[n], &jobs[0]);  // merge results together
+      }
+      enc->alpha_ = jobs[0].alpha / total_mb;
+      enc->uv_alpha_ = jobs[0].uv_alpha / total_mb;
+      AssignSegments(enc, jobs[0].alphas);
     }
+    WebPSafeFree(jobs);
   } else {   // Use only one default segment.
     ResetAllMBInfo(enc);
   }
@@ -13041,6 +13500,8 @@ static int PreLoopInitialize(VP8Encoder* const enc) {
   return ok;
 }
 
+
+
 typedef struct {  // struct for organizing convergence in either size or PSNR
   int is_first;
   float dq;
@@ -13604,6 +14065,22 @@ void VP8CalculateLevelCosts(VP8EncProba* const proba) {
   proba->dirty_ = 0;
 }
 
+// Exports the current level costs to the rate model of VP8Decimate_snap().
+static void VP8SetCostLUT(VP8EncProba* const proba, VP8CostLUT* const lut) {
+  int ctype, band, ctx;
+  VP8CalculateLevelCosts(proba);
+  memcpy(lut->level_, proba->level_cost_, sizeof(lut->level_));
+  for (ctype = 0; ctype < NUM_TYPES; ++ctype) {
+    for (band = 0; band < NUM_BANDS; ++band) {
+      for (ctx = 0; ctx < NUM_CTX; ++ctx) {
+        const uint8_t p0 = proba->coeffs_[ctype][band][ctx][0];
+        lut->eob_[ctype][band][ctx] = VP8BitCost(0, p0);
+        lut->not_eob_[ctype][band][ctx] = VP8BitCost(1, p0);
+      }
+    }
+  }
+}
+
 static void ResetStats(VP8Encoder* const enc) {
   VP8EncProba* const proba = &enc->proba_;
   VP8CalculateLevelCosts(proba);
@@ -14183,6 +14660,17 @@ static void Copy16x8_C(const uint8_t* src, uint8_t* dst) {
   Copy(src, dst, 16, 8);
 }
 
+// Cost of the 4x4 modes of sub-block it->i4_, given the modes of its top and
+// left neighbours: 'modes' inside the macroblock, preds_[] across its edges.
+static const uint16_t* GetCostModeI4(VP8EncIterator* const it,
+                                     const uint8_t modes[16]) {
+  const int preds_w = it->enc_->preds_w_;
+  const int x = (it->i4_ & 3), y = it->i4_ >> 2;
+  const int left = (x == 0) ? it->preds_[y * preds_w - 1] : modes[it->i4_ - 1];
+  const int top = (y == 0) ? it->preds_[-preds_w + x] : modes[it->i4_ - 4];
+  return VP8FixedCostsI4[top][left];
+}
+
 static int PickBestIntra4(VP8EncIterator* const it, VP8ModeScore* const rd) {
   const VP8Encoder* const enc = it->enc_;
   const VP8SegmentInfo* const dqm = &enc->dqm_[it->mb_->segment_];
@@ -14207,8 +14695,7 @@ static int PickBestIntra4(VP8EncIterator* const it, VP8ModeScore* const rd) {
     int mode;
     int best_mode = -1;
     const uint8_t* const src = src0 + VP8Scan[it->i4_];
-    //const uint16_t* const mode_costs = GetCostModeI4(it, rd->modes_i4);
-    const uint16_t* const mode_costs = VP8FixedCostsI4[0][0];
+    const uint16_t* const mode_costs = GetCostModeI4(it, rd->modes_i4);
     uint8_t* best_block = best_blocks + VP8Scan[it->i4_];
     uint8_t* tmp_dst = it->yuv_p_ + I4TMP;    // scratch buffer.
 
@@ -15275,7 +15762,6 @@ static void StoreSideInfo(const VP8EncIterator* const it) {
   WebPPicture* const pic = enc->pic_;
 
   if (pic->stats != NULL) {
-    StoreSSE(it);
     enc->block_count_[0] += (mb->type_ == 0);
     enc->block_count_[1] += (mb->type_ == 1);
     enc->block_count_[2] += (mb->skip_ != 0);
@@ -15972,10 +16458,14 @@ static int PostLoopFinalize(VP8EncIterator* const it, int ok) {
 
 int VP8EncLoop(VP8Encoder* const enc) {
   VP8EncIterator it;
+  StageTimer timer;
   int ok = PreLoopInitialize(enc);
   if (!ok) return 0;
 
+  StageTimerStart(&timer);
   StatLoop(enc);  // stats-collection loop
+  StageTimerStop(&timer, enc->pic_, WEBP_STAGE_STAT_LOOP);
+  StageTimerStart(&timer);
 
   VP8IteratorInit(enc, &it);
   VP8InitFilter(&it);
@@ -15992,39 +16482,126 @@ int VP8EncLoop(VP8Encoder* const enc) {
     } else {   // reset predictors after a skip
       ResetAfterSkip(&it);
     }
+    if (enc->pic_->stats != NULL) StoreSSE(&it);
     StoreSideInfo(&it);
     VP8StoreFilterStats(&it);
     VP8IteratorExport(&it);
     ok = VP8IteratorProgress(&it, 20);
     VP8IteratorSaveBoundary(&it);
   } while (ok && VP8IteratorNext(&it));
+  StageTimerStop(&timer, enc->pic_, WEBP_STAGE_TOKEN_LOOP);
 
   return PostLoopFinalize(&it, ok);
 }
 
-void VP8TBufferClear(VP8TBuffer* const b) {
-  if (b != NULL) {
-    VP8Tokens* p = b->pages_;
-    while (p != NULL) {
-      VP8Tokens* const next = p->next_;
-      WebPSafeFree(p);
-      p = next;
-    }
-    VP8TBufferInit(b, b->page_size_);
-  }
-}
-
 typedef uint16_t token_t;  // bit #15: bit value
                            // bit #14: flags for constant proba or idx
                            // bits #0..13: slot or constant proba
 
 #define TOKEN_DATA(p) ((const token_t*)&(p)[1])
 
-static int TBufferNewPage(VP8TBuffer* const b) {
-  VP8Tokens* page = NULL;
-  if (!b->error_) {
-    const size_t size = sizeof(*page) + b->page_size_ * sizeof(token_t);
-    page = (VP8Tokens*)WebPSafeMalloc(1ULL, size);
+static size_t TokenPageBytes(int page_size) {
+  return sizeof(VP8Tokens) + page_size * sizeof(token_t);
+}
+
+static int IsSlabPage(const VP8TokenArena* const arena,
+                      const VP8Tokens* const page) {
+  const uint8_t* const p = (const uint8_t*)page;
+  return (arena->slab_ != NULL && p >= arena->slab_ &&
+          p < arena->slab_ +
+              arena->num_slab_pages_ * TokenPageBytes(arena->page_size_));
+}
+
+// Frees the pages of the free list that aren't part of the slab, and the
+// slab itself with 'free_slab'. The slab pages are dropped from the list in
+// both cases.
+static void TokenArenaRelease(VP8TokenArena* const arena, int free_slab) {
+  VP8Tokens** p = &arena->free_pages_;
+  while (*p != NULL) {
+    VP8Tokens* const page = *p;
+    if (IsSlabPage(arena, page)) {
+      *p = page->next_;
+    } else if (free_slab) {
+      *p = page->next_;
+      WebPSafeFree(page);
+    } else {
+      p = &page->next_;
+    }
+  }
+  WebPSafeFree(arena->slab_);
+  arena->slab_ = NULL;
+  arena->num_slab_pages_ = 0;
+}
+
+// All the pages must be back in the free list.
+static void VP8TokenArenaClear(VP8TokenArena* const arena) {
+  TokenArenaRelease(arena, 1);
+  memset(arena, 0, sizeof(*arena));
+}
+
+// Makes sure the slab holds enough pages of at least 'page_size' tokens for
+// 'num_parts' buffers of 'num_tokens' tokens each. The buffers must be empty.
+// Returns false if the slab couldn't grow: the pages are then allocated
+// one at a time.
+static int VP8TokenArenaReserve(VP8TokenArena* const arena, int page_size,
+                                int num_parts, uint64_t num_tokens) {
+  uint64_t num_pages;
+  size_t page_bytes;
+  int i;
+  if (page_size < MIN_PAGE_SIZE) page_size = MIN_PAGE_SIZE;
+  page_size = (page_size + 3) & ~3;   // keeps the pages pointer-aligned
+  if (arena->page_size_ < page_size) {   // pages are too small, start over
+    VP8TokenArenaClear(arena);
+    arena->page_size_ = page_size;
+  }
+  num_pages = (num_tokens + arena->page_size_ - 1) / arena->page_size_;
+  num_pages *= num_parts;
+  if (num_pages <= (uint64_t)arena->num_slab_pages_) return 1;
+
+  TokenArenaRelease(arena, 0);   // the slab must grow: replace it
+  page_bytes = TokenPageBytes(arena->page_size_);
+  arena->slab_ = (uint8_t*)WebPSafeMalloc(num_pages, page_bytes);
+  if (arena->slab_ == NULL) return 0;
+  arena->num_slab_pages_ = (int)num_pages;
+  // first pages first, so that the buffers are laid out in order
+  for (i = arena->num_slab_pages_ - 1; i >= 0; --i) {
+    VP8Tokens* const page = (VP8Tokens*)(arena->slab_ + i * page_bytes);
+    page->next_ = arena->free_pages_;
+    arena->free_pages_ = page;
+  }
+  return 1;
+}
+
+void VP8TBufferClear(VP8TBuffer* const b) {
+  if (b != NULL) {
+    VP8TokenArena* const arena = b->arena_;
+    if (arena == NULL) {
+      VP8Tokens* p = b->pages_;
+      while (p != NULL) {
+        VP8Tokens* const next = p->next_;
+        WebPSafeFree(p);
+        p = next;
+      }
+    } else if (b->pages_ != NULL) {   // hand all the pages back at once
+      *b->last_page_ = arena->free_pages_;
+      arena->free_pages_ = b->pages_;
+    }
+    VP8TBufferInit(b, b->page_size_);
+    b->arena_ = arena;
+  }
+}
+
+// Pages are only added by the thread recording the tokens, which takes them
+// from the arena first.
+static int TBufferNewPage(VP8TBuffer* const b) {
+  VP8Tokens* page = NULL;
+  if (!b->error_) {
+    if (b->arena_ != NULL && b->arena_->free_pages_ != NULL) {
+      page = b->arena_->free_pages_;
+      b->arena_->free_pages_ = page->next_;
+    } else {
+      page = (VP8Tokens*)WebPSafeMalloc(1ULL, TokenPageBytes(b->page_size_));
+    }
   }
   if (page == NULL) {
     b->error_ = 1;
@@ -16195,9 +16772,12 @@ static int RecordTokens(VP8EncIterator* const it, const VP8ModeScore* const rd,
   return !tokens->error_;
 }
 
+// With 'final_pass', the pages are released as they are coded, unless they
+// belong to an arena: VP8TBufferClear() then hands them back.
 int VP8EmitTokens(VP8TBuffer* const b, VP8BitWriter* const bw,
                   const uint8_t* const probas, int final_pass) {
   const VP8Tokens* p = b->pages_;
+  const int free_pages = final_pass && (b->arena_ == NULL);
   assert(!b->error_);
   while (p != NULL) {
     const VP8Tokens* const next = p->next_;
@@ -16213,13 +16793,591 @@ int VP8EmitTokens(VP8TBuffer* const b, VP8BitWriter* const bw,
         VP8PutBit(bw, bit, probas[token & 0x3fffu]);
       }
     }
-    if (final_pass) WebPSafeFree((void*)p);
+    if (free_pages) WebPSafeFree((void*)p);
     p = next;
   }
-  if (final_pass) b->pages_ = NULL;
+  if (free_pages) b->pages_ = NULL;
+  return 1;
+}
+
+// Codes the tokens of partition 'index', once the final probas are known.
+// Partitions have their own token buffer and bit writer, so they can be
+// coded in parallel.
+static int EmitPartitionTokens(void* data, int index) {
+  VP8Encoder* const enc = (VP8Encoder*)data;
+  return VP8EmitTokens(&enc->tokens_[index], &enc->parts_[index],
+                       (const uint8_t*)enc->proba_.coeffs_, 1);
+}
+
+//------------------------------------------------------------------------------
+// Decision trace
+//
+// Optional record of the output of VP8Decimate_snap(), for diffing runs
+// against a golden trace (-trace). Little-endian, one header then one record
+// per macroblock in raster order:
+//   header: "VP8T", version (1 byte), mb_w (2 bytes), mb_h (2 bytes)
+//   record: flags (1 byte, bit 0: intra16, bit 1: skipped), mode_uv (1 byte),
+//           mode_i16 (1 byte) or the 16 modes_i4 (8 bytes, two per byte, low
+//           nibble first), nz (4 bytes), then for each block whose nz bit is
+//           set, in bit order (y-ac 0..15, uv 16..23, y-dc 24): the number
+//           of levels up to the last non-zero one (1 byte) and these levels
+//           (2 bytes each, in zigzag order).
+// Records are gathered in a buffer that is written by a worker, in the
+// background when threads are enabled.
+
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_SIZE (1 << 20)
+#define TRACE_MAX_RECORD_SIZE (1 + 1 + 8 + 4 + 25 * (1 + 16 * 2))
+
+typedef struct {
+  FILE* file;
+  uint8_t* buffers[2];   // one being filled, the other one being written
+  int cur;               // buffer being filled
+  size_t size;           // bytes used in buffers[cur]
+  const uint8_t* out;    // data and size of the pending write
+  size_t out_size;
+  int use_thread;
+  int launched;          // true if the worker has to be synced
+  WebPWorker worker;
+} DecisionTrace;
+
+static int TraceWriteJob(void* arg1, void* arg2) {
+  DecisionTrace* const trace = (DecisionTrace*)arg1;
+  (void)arg2;
+  return (fwrite(trace->out, trace->out_size, 1, trace->file) == 1);
+}
+
+// Hands the current buffer over to the worker. Returns false on write error.
+static int TraceFlush(DecisionTrace* const trace) {
+  const WebPWorkerInterface* const worker_interface = WebPGetWorkerInterface();
+  int ok = 1;
+  if (trace->launched) {
+    ok = worker_interface->Sync(&trace->worker);
+    trace->launched = 0;
+  }
+  if (trace->size == 0) return ok;
+  trace->out = trace->buffers[trace->cur];
+  trace->out_size = trace->size;
+  if (trace->use_thread) {
+    worker_interface->Launch(&trace->worker);
+  } else {
+    worker_interface->Execute(&trace->worker);
+  }
+  trace->launched = 1;
+  trace->cur ^= 1;
+  trace->size = 0;
+  return ok;
+}
+
+static int TraceInit(DecisionTrace* const trace, const char* const file_name,
+                     const VP8Encoder* const enc) {
+  const WebPWorkerInterface* const worker_interface = WebPGetWorkerInterface();
+  uint8_t* header;
+  memset(trace, 0, sizeof(*trace));
+  trace->file = fopen(file_name, "wb");
+  trace->buffers[0] =
+      (uint8_t*)WebPSafeMalloc(2ULL * TRACE_BUFFER_SIZE, sizeof(uint8_t));
+  if (trace->file == NULL || trace->buffers[0] == NULL) {
+    if (trace->file != NULL) fclose(trace->file);
+    WebPSafeFree(trace->buffers[0]);
+    trace->file = NULL;
+    return 0;
+  }
+  trace->buffers[1] = trace->buffers[0] + TRACE_BUFFER_SIZE;
+  worker_interface->Init(&trace->worker);
+  trace->worker.hook = TraceWriteJob;
+  trace->worker.data1 = trace;
+  trace->worker.data2 = NULL;
+  trace->use_thread =
+      (enc->thread_level_ > 0) && worker_interface->Reset(&trace->worker);
+
+  header = trace->buffers[0];
+  memcpy(header, "VP8T", 4);
+  header[4] = TRACE_VERSION;
+  header[5] = enc->mb_w_ & 0xff;
+  header[6] = enc->mb_w_ >> 8;
+  header[7] = enc->mb_h_ & 0xff;
+  header[8] = enc->mb_h_ >> 8;
+  trace->size = 9;
+  return 1;
+}
+
+static uint8_t* TracePutLevels(uint8_t* dst, const int16_t levels[16]) {
+  int last = 15, n;
+  while (last >= 0 && levels[last] == 0) --last;
+  *dst++ = last + 1;
+  for (n = 0; n <= last; ++n) {
+    *dst++ = levels[n] & 0xff;
+    *dst++ = (levels[n] >> 8) & 0xff;
+  }
+  return dst;
+}
+
+// Returns false on write error.
+static int TraceAdd(DecisionTrace* const trace,
+                    const VP8ModeScore* const info, int is_i16, int skip) {
+  uint8_t* dst;
+  int n;
+  if (trace->size + TRACE_MAX_RECORD_SIZE > TRACE_BUFFER_SIZE &&
+      !TraceFlush(trace)) {
+    return 0;
+  }
+  dst = trace->buffers[trace->cur] + trace->size;
+  *dst++ = (is_i16 ? 1 : 0) | (skip ? 2 : 0);
+  *dst++ = info->mode_uv;
+  if (is_i16) {
+    *dst++ = info->mode_i16;
+  } else {
+    for (n = 0; n < 16; n += 2) {
+      *dst++ = info->modes_i4[n] | (info->modes_i4[n + 1] << 4);
+    }
+  }
+  for (n = 0; n < 4; ++n) *dst++ = (info->nz >> (8 * n)) & 0xff;
+  for (n = 0; n < 16; ++n) {
+    if (info->nz & (1u << n)) dst = TracePutLevels(dst, info->y_ac_levels[n]);
+  }
+  for (n = 0; n < 8; ++n) {
+    if (info->nz & (1u << (16 + n))) {
+      dst = TracePutLevels(dst, info->uv_levels[n]);
+    }
+  }
+  if (info->nz & (1u << 24)) dst = TracePutLevels(dst, info->y_dc_levels);
+  trace->size = dst - trace->buffers[trace->cur];
   return 1;
 }
 
+// Flushes and closes the trace. Returns false on write error.
+static int TraceEnd(DecisionTrace* const trace) {
+  int ok;
+  if (trace->file == NULL) return 1;
+  ok = TraceFlush(trace);
+  ok &= TraceFlush(trace);    // waits for the last write
+  WebPGetWorkerInterface()->End(&trace->worker);
+  ok &= (fclose(trace->file) == 0);
+  WebPSafeFree(trace->buffers[0]);
+  memset(trace, 0, sizeof(*trace));
+  return ok;
+}
+
+//------------------------------------------------------------------------------
+// Wavefront scheduling of VP8Decimate_snap()
+//
+// Macroblock (x, y) only sees (x - 1, y) through the left context and
+// (x - 1 .. x + 1, y - 1) through the mem_top_* / top_derr line memories.
+// Rows are dealt round-robin to the workers and a row may decimate column x
+// as soon as the row above has completed column x + 1. Token recording stays
+// in raster order on the calling thread, so the bitstream is identical to the
+// one of a single-threaded run.
+// The quantizer sets of all segments are resident in every DATA and picked
+// per macroblock from the segment map. max_edge_ and the filter stats are
+// accumulated per job and segment, and folded back in WavefrontEnd().
+// The source samples are not staged for the whole frame: each row is imported
+// into the input ring by the job that decimates it, right before it starts, so
+// the import of row y + 1 overlaps the decimation of row y.
+// With RD_OPT_TRELLIS and up, each decision goes through VP8Trellis_snap()
+// before the job moves on, as the next macroblocks are predicted from its
+// reconstruction.
+// With stats, the decimation, trellis and filter stats times and the squared
+// errors of the reconstruction are summed per job too.
+
+#define WAVEFRONT_MAX_JOBS 64
+
+typedef struct {
+  double times[3];      // decimation, filter stats and trellis times
+  uint64_t sse[3];      // Y/U/V squared errors, as StoreSSE() sums them
+  uint64_t sse_count;   // pixel count for sse[]
+} WavefrontAcc;
+
+typedef struct {
+  WebPWorker worker;
+  DATA data_it;       // left context and quantizer copies of the current row
+  int first_row;      // rows first_row, first_row + num_jobs, ... are ours
+  WavefrontAcc acc;   // only with stats
+} WavefrontJob;
+
+typedef struct {
+  const WebPPicture* pic; // source samples
+  uint8_t* mem_in;        // input ring, 'num_rows' rows in macroblock order
+  const VP8MBInfo* mb_info;  // segment map
+  VP8CostLUT* costs;      // rate model, fixed for the whole pass
+  DATA* lines;            // owner of the shared mem_top_* / top_derr lines
+  int do_filter_stats;    // true if autofilter stats must be collected
+  int do_trellis;         // true if the decisions must go through the trellis
+  int mb_w, mb_h;
+  int num_jobs;           // number of decimation workers. 0 = run inline.
+  int num_rows;           // depth of the input/result rings, in mb rows
+  VP8ModeScore* info;     // decimation results
+  uint8_t* mbtype;
+  uint8_t* is_skipped;
+  int* done;              // number of decimated macroblocks, per row
+  int consumed;           // number of rows released by the token loop
+  WavefrontJob* jobs;
+  WebPAuxStats* stats;    // if not NULL, receives the decimation times
+  WavefrontAcc acc;       // stats of the inline rows, then of all of them
+#ifdef WEBP_USE_THREAD
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+#endif
+} Wavefront;
+
+static int WavefrontNumJobs(const VP8Encoder* const enc) {
+#ifdef WEBP_USE_THREAD
+  if (enc->thread_level_ > 0 && enc->mb_h_ > 1) {
+    const int max_useful = (enc->mb_w_ + 1) >> 1;  // rows lag by 2 mbs
+    int num_jobs = GetNumThreads(enc);
+    if (num_jobs > enc->mb_h_) num_jobs = enc->mb_h_;
+    if (num_jobs > max_useful) num_jobs = max_useful;
+    if (num_jobs > WAVEFRONT_MAX_JOBS) num_jobs = WAVEFRONT_MAX_JOBS;
+    return (num_jobs > 1) ? num_jobs : 0;
+  }
+#else
+  (void)enc;
+#endif
+  return 0;
+}
+
+// Blocks until row 'y' has decimated at least 'count' macroblocks.
+static void WavefrontWaitRow(Wavefront* const wf, int y, int count) {
+#ifdef WEBP_USE_THREAD
+  if (y < 0 || wf->num_jobs == 0) return;
+  pthread_mutex_lock(&wf->mutex);
+  while (wf->done[y] < count) pthread_cond_wait(&wf->cond, &wf->mutex);
+  pthread_mutex_unlock(&wf->mutex);
+#else
+  (void)wf;
+  (void)y;
+  (void)count;
+#endif
+}
+
+// Blocks until the ring slot of row 'y' has been released by the token loop.
+static void WavefrontWaitSlot(Wavefront* const wf, int y) {
+#ifdef WEBP_USE_THREAD
+  if (wf->num_jobs == 0) return;
+  pthread_mutex_lock(&wf->mutex);
+  while (wf->consumed + wf->num_rows <= y) {
+    pthread_cond_wait(&wf->cond, &wf->mutex);
+  }
+  pthread_mutex_unlock(&wf->mutex);
+#else
+  (void)wf;
+  (void)y;
+#endif
+}
+
+static void WavefrontSignal(Wavefront* const wf, int* const counter,
+                            int value) {
+#ifdef WEBP_USE_THREAD
+  if (wf->num_jobs > 0) {
+    pthread_mutex_lock(&wf->mutex);
+    *counter = value;
+    pthread_cond_broadcast(&wf->cond);
+    pthread_mutex_unlock(&wf->mutex);
+    return;
+  }
+#endif
+  (void)wf;
+  *counter = value;
+}
+
+// Copies the macroblock row 'y' of 'pic' to 'dst', 384 bytes per macroblock:
+// the 16x16 luma samples then 8 rows of 8 U and 8 V samples, all with a
+// stride of 16. Samples past the picture edges replicate the last column / row,
+// as VP8IteratorImport() does.
+static void ImportRow(const WebPPicture* const pic, int mb_w, int y,
+                      uint8_t* dst) {
+  const int h = MinSize(pic->height - y * 16, 16);
+  const int uv_h = (h + 1) >> 1;
+  int x, i;
+  for (x = 0; x < mb_w; ++x, dst += 384) {
+    const int w = MinSize(pic->width - x * 16, 16);
+    const int uv_w = (w + 1) >> 1;
+    const uint8_t* const ysrc = pic->y + (y * pic->y_stride + x) * 16;
+    const uint8_t* const usrc = pic->u + (y * pic->uv_stride + x) * 8;
+    const uint8_t* const vsrc = pic->v + (y * pic->uv_stride + x) * 8;
+    for (i = 0; i < h; ++i) {
+      uint8_t* const row = dst + i * 16;
+      memcpy(row, ysrc + i * pic->y_stride, w);
+      if (w < 16) memset(row + w, row[w - 1], 16 - w);
+    }
+    for (i = h; i < 16; ++i) {
+      memcpy(dst + i * 16, dst + i * 16 - 16, 16);
+    }
+    for (i = 0; i < uv_h; ++i) {
+      uint8_t* const urow = dst + 256 + i * 16;
+      uint8_t* const vrow = dst + 264 + i * 16;
+      memcpy(urow, usrc + i * pic->uv_stride, uv_w);
+      memcpy(vrow, vsrc + i * pic->uv_stride, uv_w);
+      if (uv_w < 8) {
+        memset(urow + uv_w, urow[uv_w - 1], 8 - uv_w);
+        memset(vrow + uv_w, vrow[uv_w - 1], 8 - uv_w);
+      }
+    }
+    for (i = uv_h; i < 8; ++i) {
+      memcpy(dst + 256 + i * 16, dst + 256 + i * 16 - 16, 16);
+    }
+  }
+}
+
+// Same as StoreSSE() for the reconstruction left in 'data_it'.
+static void WavefrontStoreSSE(const DATA* const data_it,
+                              WavefrontAcc* const acc) {
+  const uint8_t* const yout =
+      (data_it->mbtype == 1) ? data_it->Yout16 : data_it->Yout4;
+  int i;
+  for (i = 0; i < 16 * 16; ++i) {
+    const int diff = data_it->Yin[i] - yout[i];
+    acc->sse[0] += diff * diff;
+  }
+  for (i = 0; i < 8 * 16; ++i) {   // u in columns 0..7, v in 8..15
+    const int diff = data_it->UVin[i] - data_it->UVout[i];
+    acc->sse[1 + ((i & 15) >> 3)] += diff * diff;
+  }
+  acc->sse_count += 16 * 16;
+}
+
+// With wf->stats, 'acc' accumulates the stage times and the squared errors.
+static void WavefrontDecimateRow(Wavefront* const wf, DATA* const data_it,
+                                 int y, WavefrontAcc* const acc) {
+  const int mb_w = wf->mb_w;
+  const int slot = (y % wf->num_rows) * mb_w;
+  uint8_t* const mb_in = wf->mem_in + slot * 384;
+  const int do_timing = (wf->stats != NULL);
+  double start = 0.;
+  int x;
+
+  WavefrontWaitSlot(wf, y);
+  // the slot is free: rows sharing it have been decimated and recorded
+  ImportRow(wf->pic, mb_w, y, mb_in);
+  memset(data_it->left_y, 129, 16);
+  memset(data_it->left_u, 129, 8);
+  memset(data_it->left_v, 129, 8);
+  memset(data_it->left_derr, 0, sizeof(data_it->left_derr));
+  memset(data_it->left_nz, 0, sizeof(data_it->left_nz));
+  memset(data_it->left_modes_i4, 0, sizeof(data_it->left_modes_i4));
+  data_it->y = y;
+  for (x = 0; x < mb_w; ++x) {
+    // the top-right neighbour must be complete
+    WavefrontWaitRow(wf, y - 1, (x + 2 < mb_w) ? x + 2 : mb_w);
+    VP8SegmentInfo* dqm;
+    uint8_t mb_top_nz[4], mb_left_nz[4];   // luma contexts, for the trellis
+    memcpy(data_it, mb_in + x * 384, 384);
+    data_it->x = x;
+    data_it->segment = wf->mb_info[y * mb_w + x].segment_;
+    dqm = &data_it->dqm[data_it->segment];
+    VP8IteratorLoadTop_snap(data_it);
+    memcpy(mb_top_nz, data_it->top_nz, sizeof(mb_top_nz));
+    memcpy(mb_left_nz, data_it->left_nz, sizeof(mb_left_nz));
+
+    if (do_timing) start = WallTime();
+    VP8Decimate_snap(data_it->Yin, data_it->Yout16, data_it->Yout4,
+      dqm, data_it->UVin, data_it->UVout, &data_it->is_skipped,
+      data_it->left_y, data_it->top_y, data_it->top_left_y, &data_it->mbtype,
+      data_it->left_u, data_it->top_u, data_it->top_left_u, data_it->left_v,
+      data_it->top_v, data_it->top_left_v, x, y, &wf->info[slot + x],
+      data_it->top_derr, data_it->left_derr, data_it->top_nz,
+      data_it->left_nz, data_it->top_modes_i4, data_it->left_modes_i4,
+      wf->costs);
+    if (do_timing) acc->times[0] += WallTime() - start;
+    if (wf->do_trellis) {
+      if (do_timing) start = WallTime();
+      VP8Trellis_snap(data_it->Yin, data_it->Yout16, data_it->Yout4, dqm,
+        &data_it->is_skipped, data_it->left_y, data_it->top_y,
+        data_it->top_left_y, data_it->mbtype, x, y, &wf->info[slot + x],
+        mb_top_nz, mb_left_nz, data_it->top_nz, data_it->left_nz, wf->costs);
+      if (do_timing) acc->times[2] += WallTime() - start;
+    }
+    if (wf->do_filter_stats) {
+      if (do_timing) start = WallTime();
+      VP8StoreFilterStats_snap(dqm, data_it->lf_stats[data_it->segment],
+        data_it->Yin, data_it->Yout16, data_it->Yout4, data_it->UVin,
+        data_it->UVout, data_it->mbtype, data_it->is_skipped);
+      if (do_timing) acc->times[1] += WallTime() - start;
+    }
+    if (do_timing) WavefrontStoreSSE(data_it, acc);
+
+    wf->mbtype[slot + x] = data_it->mbtype;
+    wf->is_skipped[slot + x] = data_it->is_skipped;
+    VP8IteratorStoreBoundary_snap(data_it);
+    WavefrontSignal(wf, &wf->done[y], x + 1);
+  }
+}
+
+#ifdef WEBP_USE_THREAD
+static int WavefrontJobHook(void* arg1, void* arg2) {
+  Wavefront* const wf = (Wavefront*)arg1;
+  WavefrontJob* const job = (WavefrontJob*)arg2;
+  int y;
+  for (y = job->first_row; y < wf->mb_h; y += wf->num_jobs) {
+    WavefrontDecimateRow(wf, &job->data_it, y, &job->acc);
+  }
+  return 1;
+}
+#endif
+
+static void WavefrontClear(Wavefront* const wf) {
+  WebPSafeFree(wf->costs);
+  WebPSafeFree(wf->info);
+  WebPSafeFree(wf->mbtype);
+  WebPSafeFree(wf->done);
+  WebPSafeFree(wf->mem_in);
+  WebPSafeFree(wf->jobs);
+  memset(wf, 0, sizeof(*wf));
+}
+
+static int WavefrontInit(Wavefront* const wf, VP8Encoder* const enc,
+                         DATA* const lines) {
+  const int mb_w = enc->mb_w_;
+  memset(wf, 0, sizeof(*wf));
+  wf->pic = enc->pic_;
+  wf->stats = enc->pic_->stats;
+  wf->mb_info = enc->mb_info_;
+  wf->lines = lines;
+  wf->do_filter_stats = (enc->lf_stats_ != NULL);
+  wf->do_trellis = (enc->rd_opt_level_ >= RD_OPT_TRELLIS);
+  wf->mb_w = mb_w;
+  wf->mb_h = enc->mb_h_;
+  wf->num_jobs = WavefrontNumJobs(enc);
+  // a running job may be up to 'num_jobs' rows ahead of the token loop
+  wf->num_rows = (wf->num_jobs > 0) ? wf->num_jobs + 2 : 1;
+  wf->info = (VP8ModeScore*)WebPSafeMalloc(wf->num_rows * mb_w,
+                                           sizeof(*wf->info));
+  wf->mbtype = (uint8_t*)WebPSafeMalloc(2 * wf->num_rows * mb_w,
+                                        sizeof(*wf->mbtype));
+  wf->done = (int*)WebPSafeCalloc(wf->mb_h, sizeof(*wf->done));
+  wf->costs = (VP8CostLUT*)WebPSafeMalloc(1ULL, sizeof(*wf->costs));
+  wf->mem_in = (uint8_t*)WebPSafeMalloc(384ULL * wf->num_rows * mb_w,
+                                        sizeof(*wf->mem_in));
+  if (wf->info == NULL || wf->mbtype == NULL || wf->done == NULL ||
+      wf->costs == NULL || wf->mem_in == NULL) {
+    WavefrontClear(wf);
+    return 0;
+  }
+  VP8SetCostLUT(&enc->proba_, wf->costs);
+  wf->is_skipped = wf->mbtype + wf->num_rows * mb_w;
+
+#ifdef WEBP_USE_THREAD
+  if (wf->num_jobs > 0) {
+    const WebPWorkerInterface* const worker_interface =
+        WebPGetWorkerInterface();
+    int n, ok = 1;
+    wf->jobs = (WavefrontJob*)WebPSafeMalloc(wf->num_jobs, sizeof(*wf->jobs));
+    if (wf->jobs == NULL) {
+      wf->num_jobs = 0;
+      wf->num_rows = 1;
+      return 1;
+    }
+    pthread_mutex_init(&wf->mutex, NULL);
+    pthread_cond_init(&wf->cond, NULL);
+    for (n = 0; n < wf->num_jobs; ++n) {
+      WavefrontJob* const job = &wf->jobs[n];
+      worker_interface->Init(&job->worker);
+      job->worker.hook = WavefrontJobHook;
+      job->worker.data1 = wf;
+      job->worker.data2 = job;
+      job->first_row = n;
+      memset(&job->acc, 0, sizeof(job->acc));
+      memcpy(job->data_it.dqm, lines->dqm, sizeof(job->data_it.dqm));
+      memset(job->data_it.lf_stats, 0, sizeof(job->data_it.lf_stats));
+      job->data_it.mb_w = wf->mb_w;
+      job->data_it.mb_h = wf->mb_h;
+      job->data_it.mem_top_y = lines->mem_top_y;   // shared line memories
+      job->data_it.mem_top_u = lines->mem_top_u;
+      job->data_it.mem_top_v = lines->mem_top_v;
+      job->data_it.top_derr = lines->top_derr;
+      job->data_it.mem_top_nz = lines->mem_top_nz;
+      job->data_it.mem_top_modes_i4 = lines->mem_top_modes_i4;
+      ok &= worker_interface->Reset(&job->worker);
+    }
+    if (!ok) {   // fall back to inline decimation
+      for (n = 0; n < wf->num_jobs; ++n) {
+        worker_interface->End(&wf->jobs[n].worker);
+      }
+      pthread_mutex_destroy(&wf->mutex);
+      pthread_cond_destroy(&wf->cond);
+      WebPSafeFree(wf->jobs);
+      wf->jobs = NULL;
+      wf->num_jobs = 0;
+      wf->num_rows = 1;
+      return 1;
+    }
+    for (n = 0; n < wf->num_jobs; ++n) {
+      worker_interface->Launch(&wf->jobs[n].worker);
+    }
+  }
+#endif
+  return 1;
+}
+
+// Waits for the workers and folds their per-job state back into 'lines' and
+// the stats. If not NULL, 'acc' receives the stats summed over all the rows.
+static void WavefrontEnd(Wavefront* const wf, WavefrontAcc* const acc) {
+#ifdef WEBP_USE_THREAD
+  if (wf->num_jobs > 0) {
+    const WebPWorkerInterface* const worker_interface =
+        WebPGetWorkerInterface();
+    DATA* const lines = wf->lines;
+    int n, s, i;
+    // release all the ring slots, in case the token loop bailed out early
+    WavefrontSignal(wf, &wf->consumed, wf->mb_h);
+    for (n = 0; n < wf->num_jobs; ++n) {
+      WavefrontJob* const job = &wf->jobs[n];
+      worker_interface->Sync(&job->worker);
+      worker_interface->End(&job->worker);
+      wf->acc.times[0] += job->acc.times[0];
+      wf->acc.times[1] += job->acc.times[1];
+      wf->acc.times[2] += job->acc.times[2];
+      for (i = 0; i < 3; ++i) wf->acc.sse[i] += job->acc.sse[i];
+      wf->acc.sse_count += job->acc.sse_count;
+      for (s = 0; s < NUM_MB_SEGMENTS; ++s) {
+        if (job->data_it.dqm[s].max_edge_ > lines->dqm[s].max_edge_) {
+          lines->dqm[s].max_edge_ = job->data_it.dqm[s].max_edge_;
+        }
+        if (!wf->do_filter_stats) continue;
+        for (i = 0; i < MAX_LF_LEVELS; ++i) {
+          lines->lf_stats[s][i] += job->data_it.lf_stats[s][i];
+        }
+      }
+    }
+    pthread_mutex_destroy(&wf->mutex);
+    pthread_cond_destroy(&wf->cond);
+  }
+#endif
+  if (wf->stats != NULL) {
+    wf->stats->stage_wall[WEBP_STAGE_DECIMATE] += wf->acc.times[0];
+    wf->stats->stage_wall[WEBP_STAGE_FILTER_STATS] += wf->acc.times[1];
+    wf->stats->stage_wall[WEBP_STAGE_TRELLIS] += wf->acc.times[2];
+  }
+  if (acc != NULL) *acc = wf->acc;
+  WavefrontClear(wf);
+}
+
+// Number of tokens recorded per macroblock, by base_quant_ / 8. Picked on
+// the high side of the test images.
+static const uint16_t kAverageTokensPerMB[16] = {
+  520, 160, 90, 70, 64, 60, 56, 54, 52, 50, 48, 46, 45, 44, 43, 42
+};
+
+// Sizes the token arena from the quantizer found by the analysis, so that
+// the pages of a pass come from a single allocation.
+static void ReserveTokenPages(VP8Encoder* const enc) {
+  const int num_mbs = enc->mb_w_ * enc->mb_h_;
+  // lower quality means smaller output -> we modulate a little the page
+  // size based on quality. This is just a crude 1rst-order prediction.
+  const float scale = 1.f + enc->config_->quality * 5.f / 100.f;  // in [1,6]
+  const int page_size = (int)(num_mbs * 4 * scale) / enc->num_parts_;
+  const int idx = (enc->base_quant_ >> 3) > 15 ? 15 : (enc->base_quant_ >> 3);
+  const uint64_t num_tokens =
+      (uint64_t)num_mbs * kAverageTokensPerMB[idx] / enc->num_parts_;
+  VP8TokenArena* const arena = enc->token_arena_;
+  int p;
+  VP8TokenArenaReserve(arena, page_size, enc->num_parts_, num_tokens);
+  for (p = 0; p < MAX_NUM_PARTITIONS; ++p) {
+    VP8TBufferInit(&enc->tokens_[p], arena->page_size_);
+    enc->tokens_[p].arena_ = arena;
+  }
+}
+
 #define MIN_COUNT 96  // minimum number of macroblocks before updating stats
 #define DEBUG_SEARCH 0    // useful to track search convergence
 
@@ -16232,16 +17390,20 @@ int VP8EncTokenLoop(VP8Encoder* const enc) {
   VP8EncProba* const proba = &enc->proba_;
   const VP8RDLevel rd_opt = enc->rd_opt_level_;
   const uint64_t pixel_count = enc->mb_w_ * enc->mb_h_ * 384;
+  WebPAuxStats* const aux_stats = enc->pic_->stats;
   PassStats stats;
+  StageTimer timer;
+  int x, y, i, j;
   int ok;
 
+  StageTimerStart(&timer);
   InitPassStats(enc, &stats);
   ok = PreLoopInitialize(enc);
   if (!ok) return 0;
+  ReserveTokenPages(enc);
 
   if (max_count < MIN_COUNT) max_count = MIN_COUNT;
 
-  assert(enc->num_parts_ == 1);
   assert(enc->use_tokens_);
   assert(proba->use_skip_proba_ == 0);
   assert(rd_opt >= RD_OPT_BASIC);   // otherwise, token-buffer won't be useful
@@ -16256,134 +17418,129 @@ int VP8EncTokenLoop(VP8Encoder* const enc) {
     SetLoopParams(enc, stats.q);
     ResetTokenStats(enc);
     VP8InitFilter(&it);
-    VP8TBufferClear(&enc->tokens_);
+    for (i = 0; i < enc->num_parts_; ++i) VP8TBufferClear(&enc->tokens_[i]);
 
 
     DATA data_it;
-	uint8_t * mem_in;
-	int x, y, i, j;
-	const WebPPicture* const pic = enc->pic_;
-	
-	mem_in = (uint8_t*)WebPSafeMalloc(384 * enc->mb_w_ * enc->mb_h_, sizeof(*mem_in));
-
-	for(y = 0; y < enc->mb_h_; y++){
-		for(x = 0; x < enc->mb_w_; x++){
-			const int w = MinSize(pic->width - x * 16, 16);
-			const int h = MinSize(pic->height - y * 16, 16);
-			const int uv_w = (w + 1) >> 1;
-			const int uv_h = (h + 1) >> 1;
-			for(i = 0; i < h; i++){
-				memcpy(mem_in + (y * enc->mb_w_ + x) * 384 + i * 16, pic->y + (y * pic->y_stride  + x) * 16 + i * pic->y_stride, w);
-				if(w < 16){
-					memset(mem_in + (y * enc->mb_w_ + x) * 384 + i * 16 + w, (mem_in + (y * enc->mb_w_ + x) * 384 + i * 16)[w - 1], 16 - w);
-				}
-			}
-			for (i = h; i < 16; ++i) {
-				memcpy(mem_in + (y * enc->mb_w_ + x) * 384 + i * 16, mem_in + (y * enc->mb_w_ + x) * 384 + i * 16 - 16, 16);
-			}
-			for(i = 0; i < uv_h; i++){
-				memcpy(mem_in + 256 + (y * enc->mb_w_ + x) * 384 + i * 16, pic->u + (y * pic->uv_stride + x) * 8 + i * pic->uv_stride, uv_w);
-				memcpy(mem_in + 264 + (y * enc->mb_w_ + x) * 384 + i * 16, pic->v + (y * pic->uv_stride + x) * 8 + i * pic->uv_stride, uv_w);
-				if(uv_w < 8){
-					memset(mem_in + 256 + (y * enc->mb_w_ + x) * 384 + i * 16 + uv_w, (mem_in + 256 + (y * enc->mb_w_ + x) * 384 + i * 16)[uv_w - 1], 8 - uv_w);
-					memset(mem_in + 264 + (y * enc->mb_w_ + x) * 384 + i * 16 + uv_w, (mem_in + 264 + (y * enc->mb_w_ + x) * 384 + i * 16)[uv_w - 1], 8 - uv_w);
-				}
-			}
-			for (i = uv_h; i < 8; ++i) {
-				memcpy(mem_in + 256 + (y * enc->mb_w_ + x) * 384 + i * 16, mem_in + 256 + (y * enc->mb_w_ + x) * 384 + i * 16 - 16, 16);
-			}
-		}
-	}
 
-	memset(data_it.top_y, 127, 20);
-	memset(data_it.top_u, 127, 8);
-	memset(data_it.top_v, 127, 8);
-	memset(data_it.left_y, 129, 16);
-	memset(data_it.left_u, 129, 8);
-	memset(data_it.left_v, 129, 8);
-	memcpy(&data_it.dqm, &enc->dqm_[0], sizeof(data_it.dqm));
-	//memset(data_it.top_derr, 0, sizeof(data_it.top_derr));
-	memset(data_it.left_derr, 0, sizeof(data_it.left_derr));
+	memcpy(data_it.dqm, enc->dqm_, sizeof(data_it.dqm));
+	memset(data_it.lf_stats, 0, sizeof(data_it.lf_stats));
 	data_it.mb_w = enc->mb_w_;
 	data_it.mb_h = enc->mb_h_;
-	data_it.count_down = data_it.mb_w * data_it.mb_h;
-	data_it.top_left_y = 127;
-	data_it.top_left_u = 127;
-	data_it.top_left_v = 127;
-	data_it.x = 0;
-	data_it.y = 0;
+	if (!VP8IteratorAllocLines_snap(&data_it, enc->mb_w_)) {
+	  return WebPEncodingSetError(enc->pic_, VP8_ENC_ERROR_OUT_OF_MEMORY);
+	}
 
-	FILE* testFile = fopen("result", "w");
+	Wavefront wf;
+	WavefrontAcc acc;
+	if (!WavefrontInit(&wf, enc, &data_it)) {
+	  VP8IteratorFreeLines_snap(&data_it);
+	  return WebPEncodingSetError(enc->pic_, VP8_ENC_ERROR_OUT_OF_MEMORY);
+	}
 
-    do {
-      VP8ModeScore info;
-	  
-	  memcpy(&data_it, mem_in + (data_it.y * data_it.mb_w + data_it.x) * 384, 384);
-	  
-	  VP8Decimate_snap(data_it.Yin, data_it.Yout16, data_it.Yout4, &data_it.dqm, 
-	  	data_it.UVin, data_it.UVout, &data_it.is_skipped, data_it.left_y, 
-	  	data_it.top_y, data_it.top_left_y, &data_it.mbtype, data_it.left_u, 
-	  	data_it.top_u, data_it.top_left_u, data_it.left_v, data_it.top_v, 
-	  	data_it.top_left_v, data_it.x, data_it.y, &info, data_it.top_derr, data_it.left_derr);
-
-	  fwrite(&info, 828, 1, testFile);
-
-	  
-	  uint8_t* preds = it.preds_;
-
-	  if(data_it.mbtype == 1){
-		it.mb_->type_ = 1;
-		for(j = 0; j < 4; ++j){
-		  for(i = 0; i < 4; ++i){
-			preds[i] = info.mode_i16;
-		  }
-		  preds += enc->preds_w_;
-		}
-	  }
-	  else{
-		it.mb_->type_ = 0;
-		for(j = 0; j < 4; ++j){
-		  for(i = 0; i < 4; ++i){
-			preds[i] = info.modes_i4[j*4+i];
-		  }
-		  preds += enc->preds_w_;
-		}
-	  }
-	  it.mb_->uv_mode_ = info.mode_uv;
-	  it.mb_->skip_ = data_it.is_skipped;
-	  
-      ok = RecordTokens(&it, &info, &enc->tokens_);
-
-      StoreSideInfo(&it);
-
-	  if((data_it.x + 1) == data_it.mb_w){
-	  	++it.y_;
-		//it.bw_ = &enc->parts_[it.y_ & (enc->num_parts_ - 1)];
-		it.preds_ = enc->preds_ + it.y_ * 4 * enc->preds_w_;
-		it.nz_ = enc->nz_;
-		it.mb_ = enc->mb_info_ + it.y_ * enc->mb_w_;
-		it.left_nz_[8] = 0;
-	  }
-	  else{
-		it.nz_ = it.nz_ + 1;
-		it.mb_ += 1;
-		it.preds_ += 4;
-	  }
-	  
-      if (!ok) {
-        WebPEncodingSetError(enc->pic_, VP8_ENC_ERROR_OUT_OF_MEMORY);
-        break;
-      }
-	  
-      distortion += info.D;
+	DecisionTrace trace;
+	memset(&trace, 0, sizeof(trace));
+	if (enc->config_->trace_file != NULL &&
+	    !TraceInit(&trace, enc->config_->trace_file, enc)) {
+	  WavefrontEnd(&wf, NULL);
+	  VP8IteratorFreeLines_snap(&data_it);
+	  return WebPEncodingSetError(enc->pic_, VP8_ENC_ERROR_BAD_WRITE);
+	}
 
-      VP8IteratorSaveBoundary_snap(&data_it);
+	for (y = 0; ok && y < enc->mb_h_; ++y) {
+	  const int slot = (y % wf.num_rows) * enc->mb_w_;
+	  // rows are dealt round-robin to the partitions, as in VP8IteratorSetRow()
+	  VP8TBuffer* const tokens = &enc->tokens_[y & (enc->num_parts_ - 1)];
+	  if (wf.num_jobs == 0) WavefrontDecimateRow(&wf, &data_it, y, &wf.acc);
+
+	  for (x = 0; x < enc->mb_w_; ++x) {
+	    const VP8ModeScore* const info = &wf.info[slot + x];
+	    WavefrontWaitRow(&wf, y, x + 1);
+
+	    if (trace.file != NULL &&
+	        !TraceAdd(&trace, info, wf.mbtype[slot + x],
+	                  wf.is_skipped[slot + x])) {
+	      ok = WebPEncodingSetError(enc->pic_, VP8_ENC_ERROR_BAD_WRITE);
+	      break;
+	    }
+
+	    uint8_t* preds = it.preds_;
+
+	    if(wf.mbtype[slot + x] == 1){
+	  	it.mb_->type_ = 1;
+	  	for(j = 0; j < 4; ++j){
+	  	  for(i = 0; i < 4; ++i){
+	  		preds[i] = info->mode_i16;
+	  	  }
+	  	  preds += enc->preds_w_;
+	  	}
+	    }
+	    else{
+	  	it.mb_->type_ = 0;
+	  	for(j = 0; j < 4; ++j){
+	  	  for(i = 0; i < 4; ++i){
+	  		preds[i] = info->modes_i4[j*4+i];
+	  	  }
+	  	  preds += enc->preds_w_;
+	  	}
+	    }
+	    it.mb_->uv_mode_ = info->mode_uv;
+	    it.mb_->skip_ = wf.is_skipped[slot + x];
+
+	    if (aux_stats != NULL) {
+	      const double start = WallTime();
+	      ok = RecordTokens(&it, info, tokens);
+	      aux_stats->stage_wall[WEBP_STAGE_RECORD_TOKENS] += WallTime() - start;
+	    } else {
+	      ok = RecordTokens(&it, info, tokens);
+	    }
+
+	    StoreSideInfo(&it);
+
+	    if((x + 1) == enc->mb_w_){
+	    	++it.y_;
+	  	//it.bw_ = &enc->parts_[it.y_ & (enc->num_parts_ - 1)];
+	  	it.preds_ = enc->preds_ + it.y_ * 4 * enc->preds_w_;
+	  	it.nz_ = enc->nz_;
+	  	it.mb_ = enc->mb_info_ + it.y_ * enc->mb_w_;
+	  	it.left_nz_[8] = 0;
+	    }
+	    else{
+	  	it.nz_ = it.nz_ + 1;
+	  	it.mb_ += 1;
+	  	it.preds_ += 4;
+	    }
+
+	    if (!ok) {
+	      WebPEncodingSetError(enc->pic_, VP8_ENC_ERROR_OUT_OF_MEMORY);
+	      break;
+	    }
+
+	    distortion += info->D;
+	  }
+	  WavefrontSignal(&wf, &wf.consumed, y + 1);   // release the ring slot
+	}
 
-    } while (ok && VP8IteratorNext_snap(&data_it));
+	if (!TraceEnd(&trace) && ok) {
+	  ok = WebPEncodingSetError(enc->pic_, VP8_ENC_ERROR_BAD_WRITE);
+	}
 
-	fclose(testFile);
+	WavefrontEnd(&wf, &acc);
+	VP8IteratorFreeLines_snap(&data_it);
 
-	enc->dqm_[0].max_edge_ = data_it.dqm.max_edge_;
+	if (enc->pic_->stats != NULL) {
+	  for (i = 0; i < 3; ++i) enc->sse_[i] += acc.sse[i];
+	  enc->sse_count_ += acc.sse_count;
+	}
+	for (i = 0; i < NUM_MB_SEGMENTS; ++i) {
+	  enc->dqm_[i].max_edge_ = data_it.dqm[i].max_edge_;
+	  if (enc->lf_stats_ != NULL) {
+	    for (j = 0; j < MAX_LF_LEVELS; ++j) {
+	      (*enc->lf_stats_)[i][j] +=
+	          (double)data_it.lf_stats[i][j] / (1 << VP8_SSIM_FIX);
+	    }
+	  }
+	}
 
     // compute and store PSNR
       stats.value = GetPSNR(distortion, pixel_count);
@@ -16394,10 +17551,13 @@ int VP8EncTokenLoop(VP8Encoder* const enc) {
            stats.last_q, stats.q, stats.dq);
 #endif
 
+  StageTimerStop(&timer, enc->pic_, WEBP_STAGE_TOKEN_LOOP);
   if (ok) {
+    StageTimerStart(&timer);
     FinalizeTokenProbas(&enc->proba_);
-    ok = VP8EmitTokens(&enc->tokens_, enc->parts_ + 0,
-                       (const uint8_t*)proba->coeffs_, 1);
+    ok = WebPParallelFor(enc->num_parts_, GetNumThreads(enc),
+                         EmitPartitionTokens, enc);
+    StageTimerStop(&timer, enc->pic_, WEBP_STAGE_EMIT_TOKENS);
   }
 
   return PostLoopFinalize(&it, ok);
@@ -17038,6 +18198,10 @@ static void StoreStats(VP8Encoder* const enc) {
     for (i = 0; i < 3; ++i) {
       stats->block_count[i] = enc->block_count_[i];
     }
+    {
+      struct rusage usage;
+      if (!getrusage(RUSAGE_SELF, &usage)) stats->peak_memory = usage.ru_maxrss;
+    }
   }
 #else  // defined(WEBP_DISABLE_STATS)
   WebPReportProgress(enc->pic_, 100, &enc->percent_);  // done!
@@ -17060,17 +18224,43 @@ int VP8EncDeleteAlpha(VP8Encoder* const enc) {
   return ok;
 }
 
-static int DeleteVP8Encoder(VP8Encoder* enc) {
+// 'reuse' must be the one given to InitVP8Encoder(). It keeps the memory.
+static int DeleteVP8Encoder(VP8Encoder* enc, WebPEncoder* const reuse) {
   int ok = 1;
   if (enc != NULL) {
+    int p;
     ok = VP8EncDeleteAlpha(enc);
-    VP8TBufferClear(&enc->tokens_);
-    WebPSafeFree(enc);
+    for (p = 0; p < MAX_NUM_PARTITIONS; ++p) VP8TBufferClear(&enc->tokens_[p]);
+    if (reuse == NULL) {
+      VP8TokenArenaClear(&enc->own_token_arena_);
+      WebPSafeFree(enc);
+    }
   }
   return ok;
 }
 
-int WebPEncode(const WebPConfig* config, WebPPicture* pic) {
+WebPEncoder* WebPEncoderNew(void) {
+  return (WebPEncoder*)WebPSafeCalloc(1ULL, sizeof(WebPEncoder));
+}
+
+// Releases the memory kept by 'encoder', which stays usable.
+void WebPEncoderReset(WebPEncoder* const encoder) {
+  if (encoder != NULL) {
+    WebPSafeFree(encoder->mem);
+    VP8TokenArenaClear(&encoder->tokens);
+    memset(encoder, 0, sizeof(*encoder));
+  }
+}
+
+void WebPEncoderDelete(WebPEncoder* const encoder) {
+  WebPEncoderReset(encoder);
+  WebPSafeFree(encoder);
+}
+
+// Same as WebPEncode(), but 'encoder' keeps its memory for the next call
+// instead of releasing it. It must not be used by two calls at once.
+int WebPEncoderEncode(WebPEncoder* const encoder, const WebPConfig* config,
+                      WebPPicture* pic) {
   int ok = 0;
   if (pic == NULL) return 0;
 
@@ -17088,21 +18278,26 @@ int WebPEncode(const WebPConfig* config, WebPPicture* pic) {
     return WebPEncodingSetError(pic, VP8_ENC_ERROR_BAD_DIMENSION);
   }
 
-  if (pic->stats != NULL) memset(pic->stats, 0, sizeof(*pic->stats));
+  if (pic->stats != NULL) {
+    memset(pic->stats, 0, sizeof(*pic->stats));
+    pic->stats->stage_wall[WEBP_STAGE_IMPORT] = pic->import_wall_;
+    pic->stats->stage_cpu[WEBP_STAGE_IMPORT] = pic->import_cpu_;
+  }
+  pic->import_wall_ = pic->import_cpu_ = 0.;   // not reported twice
 
     VP8Encoder* enc = NULL;
+    StageTimer timer;
 
     if (!config->exact) {
       WebPCleanupTransparentArea(pic);
     }
 
-//	struct timespec time_start={0, 0},time_end={0, 0};
-//	clock_gettime(CLOCK_REALTIME, &time_start);
-
-    enc = InitVP8Encoder(config, pic);
+    enc = InitVP8Encoder(config, pic, encoder);
     if (enc == NULL) return 0;  // pic->error is already set.
     // Note: each of the tasks below account for 20% in the progress report.
+    StageTimerStart(&timer);
     ok = VP8EncAnalyze(enc);
+    StageTimerStop(&timer, pic, WEBP_STAGE_ANALYZE);
 
     // Analysis is done, proceed to actual coding.
     ok = ok && VP8EncStartAlpha(enc);   // possibly done in parallel
@@ -17113,22 +18308,255 @@ int WebPEncode(const WebPConfig* config, WebPPicture* pic) {
     }
     ok = ok && VP8EncFinishAlpha(enc);
 
+    StageTimerStart(&timer);
     ok = ok && VP8EncWrite(enc);
+    StageTimerStop(&timer, pic, WEBP_STAGE_WRITE);
     StoreStats(enc);
     if (!ok) {
       VP8EncFreeBitWriters(enc);
     }
-    ok &= DeleteVP8Encoder(enc);  // must always be called, even if !ok
-
-//	clock_gettime(CLOCK_REALTIME, &time_end);
-//	fprintf(stdout, "%lluns\n", (long long)((double)((time_end.tv_sec-time_start.tv_sec)*1000000000+(time_end.tv_nsec-time_start.tv_nsec))));
+    // must always be called, even if !ok
+    ok &= DeleteVP8Encoder(enc, encoder);
 
   return ok;
 }
 
+int WebPEncode(const WebPConfig* config, WebPPicture* pic) {
+  return WebPEncoderEncode(NULL, config, pic);
+}
+
+//------------------------------------------------------------------------------
+// Batch mode
+//
+// -batch encodes the pictures of a list in one process, so the tables, the
+// thread pool and the allocator are set up once for all of them. Each line of
+// the list holds an input and an output file name. Up to -jobs pictures are
+// encoded at once, as iterations of WebPParallelFor(), all with the same
+// config. Each one borrows a WebPEncoder, so same-sized pictures reuse the
+// encoder memory of the previous ones.
+
+typedef struct {
+  const char* in_file;
+  const char* out_file;
+  int ok;
+  size_t in_size;        // input file size
+  size_t out_size;       // coded size
+} BatchPicture;
+
+typedef struct {
+  const WebPConfig* config;
+  int width, height;     // -s, for raw YUV inputs
+  int keep_alpha;
+  BatchPicture* pictures;
+  int num_pictures;
+  WebPEncoder** encoders;  // the idle ones
+  int num_encoders;
+#ifdef WEBP_USE_THREAD
+  pthread_mutex_t mutex;   // guards 'encoders'
+#endif
+} Batch;
+
+// Returns NULL if none is idle: the picture then gets a one-time encoder.
+static WebPEncoder* BatchGetEncoder(Batch* const batch) {
+  WebPEncoder* encoder = NULL;
+#ifdef WEBP_USE_THREAD
+  pthread_mutex_lock(&batch->mutex);
+#endif
+  if (batch->num_encoders > 0) {
+    encoder = batch->encoders[--batch->num_encoders];
+  }
+#ifdef WEBP_USE_THREAD
+  pthread_mutex_unlock(&batch->mutex);
+#endif
+  return encoder;
+}
+
+static void BatchPutEncoder(Batch* const batch, WebPEncoder* const encoder) {
+  if (encoder == NULL) return;
+#ifdef WEBP_USE_THREAD
+  pthread_mutex_lock(&batch->mutex);
+#endif
+  batch->encoders[batch->num_encoders++] = encoder;
+#ifdef WEBP_USE_THREAD
+  pthread_mutex_unlock(&batch->mutex);
+#endif
+}
+
+static size_t GetFileSize(const char* const file_name) {
+  FILE* const in = fopen(file_name, "rb");
+  long size = 0;
+  if (in != NULL) {
+    if (!fseek(in, 0, SEEK_END)) size = ftell(in);
+    fclose(in);
+  }
+  return (size > 0) ? (size_t)size : 0;
+}
+
+static int EncodeBatchPicture(void* data, int index) {
+  Batch* const batch = (Batch*)data;
+  BatchPicture* const bp = &batch->pictures[index];
+  WebPPicture picture;
+  WebPAuxStats stats;
+  FILE* out = NULL;
+  int ok = WebPPictureInit(&picture);
+
+  picture.width = batch->width;
+  picture.height = batch->height;
+  ok = ok && ReadPicture(bp->in_file, &picture, batch->keep_alpha, NULL);
+  if (ok) {
+    out = fopen(bp->out_file, "wb");
+    if (out == NULL) {
+      fprintf(stderr, "Error! Cannot open output file '%s'\n", bp->out_file);
+      ok = 0;
+    }
+  }
+  if (ok) {
+    picture.writer = MyWriter;
+    picture.custom_ptr = (void*)out;
+    picture.stats = &stats;
+    picture.user_data = (void*)bp->in_file;
+    {
+      WebPEncoder* const encoder = BatchGetEncoder(batch);
+      ok = WebPEncoderEncode(encoder, batch->config, &picture);
+      BatchPutEncoder(batch, encoder);
+    }
+    if (!ok) {
+      fprintf(stderr, "Error! Cannot encode '%s': %s\n",
+              bp->in_file, kErrorMessages[picture.error_code]);
+    }
+  }
+  if (out != NULL && fclose(out)) ok = 0;
+  if (ok) {
+    bp->in_size = GetFileSize(bp->in_file);
+    bp->out_size = (size_t)stats.coded_size;
+    if (verbose) PrintStageTimes(&stats, bp->in_file);
+  }
+  bp->ok = ok;
+  WebPPictureFree(&picture);
+  return 1;   // a failed picture doesn't stop the others
+}
+
+// Splits the 0-terminated 'list' in place into input/output pairs. Returns
+// false if a line doesn't hold exactly two names.
+static int ParseBatchList(char* list, const char* const list_file,
+                          Batch* const batch) {
+  int line_num = 0;
+  while (*list != '\0') {
+    char* const end = list + strcspn(list, "\n");
+    const int last = (*end == '\0');
+    char* names[3];
+    int num_names = 0;
+    char* p = list;
+    *end = '\0';
+    ++line_num;
+    while (num_names < 3) {
+      p += strspn(p, " \t\r");
+      if (*p == '\0') break;
+      names[num_names++] = p;
+      p += strcspn(p, " \t\r");
+      if (*p != '\0') *p++ = '\0';
+    }
+    if (num_names == 2) {
+      BatchPicture* const bp = &batch->pictures[batch->num_pictures++];
+      bp->in_file = names[0];
+      bp->out_file = names[1];
+    } else if (num_names != 0) {
+      fprintf(stderr, "Error! Line %d of '%s' isn't an 'input output' pair\n",
+              line_num, list_file);
+      return 0;
+    }
+    if (last) break;
+    list = end + 1;
+  }
+  return 1;
+}
+
+// Encodes the pictures listed in 'list_file' ('-' for stdin) and prints the
+// throughput. Returns false if any of them failed.
+static int EncodeBatch(const char* const list_file, int num_jobs,
+                       const WebPConfig* const config, int width, int height,
+                       int keep_alpha) {
+  const uint8_t* list = NULL;
+  size_t list_size = 0, i;
+  Batch batch;
+  Stopwatch stop_watch;
+  double elapsed;
+  size_t in_size = 0, out_size = 0;
+  int num_ok = 0;
+  int max_pictures = 1;
+  int n;
+
+  if (!ImgIoUtilReadFile(list_file, &list, &list_size)) return 0;
+  for (i = 0; i < list_size; ++i) max_pictures += (list[i] == '\n');
+  memset(&batch, 0, sizeof(batch));
+  batch.config = config;
+  batch.width = width;
+  batch.height = height;
+  batch.keep_alpha = keep_alpha;
+  batch.pictures =
+      (BatchPicture*)WebPSafeCalloc(max_pictures, sizeof(*batch.pictures));
+  if (batch.pictures == NULL ||
+      !ParseBatchList((char*)list, list_file, &batch)) {
+    WebPSafeFree(batch.pictures);
+    free((void*)list);
+    return 0;
+  }
+#ifdef WEBP_USE_THREAD
+  if (pthread_mutex_init(&batch.mutex, NULL)) {
+    WebPSafeFree(batch.pictures);
+    free((void*)list);
+    return 0;
+  }
+  if (num_jobs <= 0) num_jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  if (num_jobs < 1) num_jobs = 1;
+  // at most 'num_jobs' pictures are in flight, so as many encoders will do
+  batch.encoders =
+      (WebPEncoder**)WebPSafeCalloc(num_jobs, sizeof(*batch.encoders));
+  for (n = 0; batch.encoders != NULL && n < num_jobs; ++n) {
+    WebPEncoder* const encoder = WebPEncoderNew();
+    if (encoder == NULL) break;
+    batch.encoders[batch.num_encoders++] = encoder;
+  }
+
+  StopwatchReset(&stop_watch);
+  WebPParallelFor(batch.num_pictures, num_jobs, EncodeBatchPicture, &batch);
+  elapsed = StopwatchReadAndReset(&stop_watch);
+
+  for (n = 0; n < batch.num_encoders; ++n) {
+    WebPEncoderDelete(batch.encoders[n]);
+  }
+  WebPSafeFree(batch.encoders);
+#ifdef WEBP_USE_THREAD
+  pthread_mutex_destroy(&batch.mutex);
+#endif
+
+  for (n = 0; n < batch.num_pictures; ++n) {
+    const BatchPicture* const bp = &batch.pictures[n];
+    if (bp->ok) {
+      ++num_ok;
+      in_size += bp->in_size;
+      out_size += bp->out_size;
+    } else {
+      fprintf(stderr, "Failed: %s\n", bp->in_file);
+    }
+  }
+  if (elapsed <= 0.) elapsed = 1e-6;
+  fprintf(stderr, "Encoded %d/%d pictures in %.3fs (%d jobs): "
+          "%.1f images/s, %.2f MB/s in, %.2f MB/s out\n",
+          num_ok, batch.num_pictures, elapsed, num_jobs, num_ok / elapsed,
+          in_size / elapsed / 1e6, out_size / elapsed / 1e6);
+  n = (num_ok == batch.num_pictures);
+  WebPSafeFree(batch.pictures);
+  free((void*)list);
+  return n;
+}
+
 int main(int argc, const char *argv[]) {
   int return_value = -1;
   const char *in_file = NULL, *out_file = NULL;
+  const char* batch_file = NULL;
+  int num_jobs = 0;
   FILE *out = NULL;
   int c;
   int short_output = 0;
@@ -17139,6 +18567,7 @@ int main(int argc, const char *argv[]) {
   WebPAuxStats stats;
   WebPMemoryWriter memory_writer;
   Stopwatch stop_watch;
+  int max_dsp = VP8_SNAP_DSP_NUM - 1;
 
   WebPMemoryWriterInit(&memory_writer);
   if (!WebPPictureInit(&picture) ||
@@ -17162,6 +18591,10 @@ int main(int argc, const char *argv[]) {
       return 0;
     } else if (!strcmp(argv[c], "-o") && c < argc - 1) {
       out_file = argv[++c];
+    } else if (!strcmp(argv[c], "-batch") && c < argc - 1) {
+      batch_file = argv[++c];
+    } else if (!strcmp(argv[c], "-jobs") && c < argc - 1) {
+      num_jobs = ExUtilGetInt(argv[++c], 0, &parse_error);
     } else if (!strcmp(argv[c], "-s") && c < argc - 2) {
       picture.width = ExUtilGetInt(argv[++c], 0, &parse_error);
       picture.height = ExUtilGetInt(argv[++c], 0, &parse_error);
@@ -17174,13 +18607,35 @@ int main(int argc, const char *argv[]) {
       }
     } else if (!strcmp(argv[c], "-q") && c < argc - 1) {
       config.quality = ExUtilGetFloat(argv[++c], &parse_error);
+    } else if (!strcmp(argv[c], "-m") && c < argc - 1) {
+      config.method = ExUtilGetInt(argv[++c], 0, &parse_error);
+    } else if (!strcmp(argv[c], "-segments") && c < argc - 1) {
+      config.segments = ExUtilGetInt(argv[++c], 0, &parse_error);
+    } else if (!strcmp(argv[c], "-partitions") && c < argc - 1) {
+      config.partitions = ExUtilGetInt(argv[++c], 0, &parse_error);
+    } else if (!strcmp(argv[c], "-af")) {
+      config.autofilter = 1;
     } else if (!strcmp(argv[c], "-version")) {
       const int version = WebPGetEncoderVersion();
       printf("%d.%d.%d\n",
              (version >> 16) & 0xff, (version >> 8) & 0xff, version & 0xff);
       return 0;
+    } else if (!strcmp(argv[c], "-trace") && c < argc - 1) {
+      config.trace_file = argv[++c];
+    } else if (!strcmp(argv[c], "-noasm")) {
+      max_dsp = VP8_SNAP_DSP_C;
+    } else if (!strcmp(argv[c], "-selftest")) {
+      const int ok = VP8DspSelfTest_snap();
+      printf("SIMD kernels: %s\n", ok ? "OK" : "MISMATCH");
+      return ok ? 0 : -1;
     } else if (!strcmp(argv[c], "-v")) {
       verbose = 1;
+    } else if (!strcmp(argv[c], "-mt")) {
+      config.thread_level = 1;
+    } else if (!strcmp(argv[c], "-threads") && c < argc - 1) {
+      config.thread_level = 1;
+      config.thread_count = ExUtilGetInt(argv[++c], 0, &parse_error);
+      WebPSetThreadPoolSize(config.thread_count);
     } else if (!strcmp(argv[c], "--")) {
       if (c < argc - 1) in_file = argv[++c];
       break;
@@ -17198,7 +18653,7 @@ int main(int argc, const char *argv[]) {
     }
   }
 
-  if (in_file == NULL) {
+  if (in_file == NULL && batch_file == NULL) {
     fprintf(stderr, "No input file specified!\n");
     HelpShort();
     goto Error;
@@ -17212,6 +18667,28 @@ int main(int argc, const char *argv[]) {
     goto Error;
   }
 
+  {
+    static const char* const kDspNames[VP8_SNAP_DSP_NUM] = {
+      "C", "SSE2", "SSE4.1", "AVX2"
+    };
+    const int dsp = VP8DspInit_snap(max_dsp);
+    if (verbose) {
+      fprintf(stderr, "Transform kernels: %s\n", kDspNames[dsp]);
+    }
+  }
+
+  if (batch_file != NULL) {
+    if (config.trace_file != NULL) {
+      fprintf(stderr, "Error! -trace can't be used with -batch.\n");
+      goto Error;
+    }
+    if (EncodeBatch(batch_file, num_jobs, &config, picture.width,
+                    picture.height, keep_alpha)) {
+      return_value = 0;
+    }
+    goto Error;
+  }
+
   // Read the input.
   if (verbose) {
     StopwatchReset(&stop_watch);
@@ -17260,6 +18737,7 @@ int main(int argc, const char *argv[]) {
   if (verbose) {
     const double encode_time = StopwatchReadAndReset(&stop_watch);
     fprintf(stderr, "Time to encode picture: %.3fs\n", encode_time);
+    PrintStageTimes(&stats, in_file);
   }
 
   // Write info